@@ -26,21 +26,21 @@ struct ARPPacket {
 
 class ArpMap {
 public:
-    static void checkArp(const toolkit::Buffer::Ptr &buf,
+    static void checkArp(const PacketPtr &buf,
                          const sockaddr_storage &pktRecvPeer, int addr_len, uint8_t ttl) {
         static toolkit::ThreadPool arpCheckTh = toolkit::ThreadPool(1, toolkit::ThreadPool::PRIORITY_NORMAL);
-        arpCheckTh.async([buf]() {
-            if (buf->size() < 14 + sizeof(ARPPacket)) {
-                return;
-            }
-            auto type = htons(*(uint16_t *) ((uint8_t *) buf->data() + 12));
-            // 过滤非arp
-            if (type != 0x0806) {
-                return;
-            }
-            ARPPacket arpPacket{};
-            memcpy(&arpPacket, buf->data() + 14, sizeof(ARPPacket));
-
+        // 在收包线程中过滤，只把ARP内容拷贝到后台线程，不持有报文
+        if (buf->size() < 14 + sizeof(ARPPacket)) {
+            return;
+        }
+        auto type = htons(*(uint16_t *) ((uint8_t *) buf->data() + 12));
+        // 过滤非arp
+        if (type != 0x0806) {
+            return;
+        }
+        ARPPacket arpPacket{};
+        memcpy(&arpPacket, buf->data() + 14, sizeof(ARPPacket));
+        arpCheckTh.async([arpPacket]() {
             // 检查请求类型
             auto opcode = ntohs(arpPacket.operation);
             if (opcode != 0x0001 && opcode != 0x0002) {
@@ -0,0 +1,148 @@
+﻿/**
+ * @file BoundedQueue.h
+ * @brief 有界队列
+ * @details 数据面各处理阶段之间的缓冲队列，队列满时按策略丢包并计数；
+ * 可分为多个优先级通道，出队时按严格优先级或加权轮询选择通道
+ */
+
+#ifndef TALUSVSWITCH_BOUNDEDQUEUE_H
+#define TALUSVSWITCH_BOUNDEDQUEUE_H
+
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "Statistics.h"
+
+/**
+ * @class BoundedQueue
+ * @brief 线程安全的有界队列
+ * @tparam T 元素类型
+ * @details 每个队列在统计中注册"<name>.drops"计数器和"<name>.depth"状态项，
+ * 多通道时深度按通道输出。通道0优先级最高，每个通道独立限长
+ */
+template <typename T>
+class BoundedQueue {
+public:
+    /**
+     * @brief 队列满时的丢包策略
+     */
+    enum Policy {
+        TailDrop,   ///< 丢弃新到的元素
+        HeadDrop    ///< 丢弃最旧的元素，优先保证新数据的时效
+    };
+
+    /**
+     * @brief 构造有界队列
+     * @param name 队列名称，用于统计
+     * @param capacity 每个通道的最大元素个数
+     * @param policy 丢包策略
+     * @param weights 各通道的权重(每轮出队个数)，为空时单通道；全部为0时按严格优先级出队
+     */
+    BoundedQueue(const std::string &name, size_t capacity, Policy policy, std::vector<int> weights = {})
+        : _capacity(capacity ? capacity : 1), _policy(policy), _drops(Statistics::Instance().counter(name + ".drops")),
+          _weights(weights.empty() ? std::vector<int>{0} : std::move(weights)), _lanes(_weights.size()), _credit(_weights[0]) {
+        Statistics::Instance().addGauge(name + ".depth", [this]() { return depth(); });
+    }
+
+    /**
+     * @brief 入队
+     * @param item 元素
+     * @param lane 通道
+     * @return 入队前队列是否为空，调用方据此决定是否调度消费
+     */
+    bool push(T item, size_t lane = 0) {
+        std::lock_guard<std::mutex> lck(_mtx);
+        bool was_empty = !_size;
+        auto &queue = _lanes[std::min(lane, _lanes.size() - 1)];
+        if (queue.size() >= _capacity) {
+            ++_drops;
+            if (_policy == TailDrop) {
+                return false;
+            }
+            queue.pop_front();
+            --_size;
+        }
+        queue.emplace_back(std::move(item));
+        ++_size;
+        return was_empty;
+    }
+
+    /**
+     * @brief 出队
+     * @param item 取出的元素
+     * @return 队列为空时返回false
+     */
+    bool pop(T &item) {
+        std::lock_guard<std::mutex> lck(_mtx);
+        if (!_size) {
+            return false;
+        }
+        auto &queue = _lanes[nextLane()];
+        item = std::move(queue.front());
+        queue.pop_front();
+        --_size;
+        return true;
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> lck(_mtx);
+        return _size;
+    }
+
+    size_t capacity() const { return _capacity; }
+
+    /**
+     * @brief 解析丢包策略配置
+     * @param policy "head"为HeadDrop，其余为TailDrop
+     */
+    static Policy parsePolicy(const std::string &policy) {
+        return policy == "head" ? HeadDrop : TailDrop;
+    }
+
+private:
+    /**
+     * @brief 选择出队的通道，调用时队列非空
+     */
+    size_t nextLane() {
+        if (!_weights[0]) {
+            // 严格优先级
+            size_t lane = 0;
+            while (_lanes[lane].empty()) {
+                ++lane;
+            }
+            return lane;
+        }
+        // 加权轮询，当前通道额度用完或为空时轮到下一个通道
+        while (_lanes[_current].empty() || _credit <= 0) {
+            _current = (_current + 1) % _lanes.size();
+            _credit = _weights[_current];
+        }
+        --_credit;
+        return _current;
+    }
+
+    std::string depth() const {
+        std::lock_guard<std::mutex> lck(_mtx);
+        if (_lanes.size() == 1) {
+            return std::to_string(_size);
+        }
+        std::string ret;
+        for (auto &queue : _lanes) {
+            ret += (ret.empty() ? "" : "/") + std::to_string(queue.size());
+        }
+        return ret;
+    }
+
+    size_t _capacity;
+    Policy _policy;
+    Statistics::Counter &_drops;
+    std::vector<int> _weights;
+    mutable std::mutex _mtx;
+    std::vector<std::deque<T>> _lanes;
+    size_t _size = 0;
+    size_t _current = 0;    ///< 加权轮询的当前通道
+    int _credit;            ///< 当前通道本轮剩余额度
+};
+
+#endif //TALUSVSWITCH_BOUNDEDQUEUE_H
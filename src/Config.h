@@ -24,6 +24,37 @@ namespace Config {
     extern std::string coreIp;       ///< 远端IP地址
     extern int mask;                  ///< 子网掩码
     extern bool enableP2p;            ///< 是否启用P2P功能
+    extern std::string ioEngine;      ///< 收发引擎(epoll/io_uring)
+    extern int busyPollUs;            ///< 网卡读空后忙轮询的最大窗口(微秒)，0为关闭
+    extern int statsInterval;         ///< 统计输出间隔(秒)，0为关闭
+    extern int queueLen;              ///< 发送路径各阶段队列长度
+    extern std::string queueDrop;     ///< 队列满时的丢包策略(tail/head)
+    extern int arenaSize;             ///< 报文内存池大小(MB)，0为不启用
+    extern int fragSize;              ///< 隧道分片的数据报上限(字节)，0为不分片
+    extern bool pmtud;                ///< 是否按节点探测路径MTU，开启后分片上限取探测值
+    extern int pmtuMax;               ///< 路径MTU探测的上限(UDP载荷字节数)
+    extern bool mssClamp;             ///< 是否按路径数据报上限钳制TCP MSS
+    extern std::string psk;           ///< 隧道加密的预共享密钥，为空不加密
+    extern std::string cipher;        ///< 隧道加密算法(auto/aes-256-gcm/chacha20-poly1305)
+    extern std::string fec;           ///< 前向纠错方式(off/xor/rs)
+    extern int fecBlock;              ///< 前向纠错每组数据报个数
+    extern std::string uplinks;       ///< 多路径绑定的本地地址列表(ip[@权重],...)，为空不启用
+    extern std::string multipath;     ///< 多路径调度策略(hash/weighted/latency)
+    extern int paceRate;              ///< 每个节点的发送速率上限(kbit/s)，0为不整形
+    extern int paceBurst;             ///< 发送整形的突发上限(KB)
+    extern bool paceAuto;             ///< 是否基于往返时延自动降低发送速率
+    extern std::string prio;          ///< 发送优先级通道的调度方式(strict/weighted/off)
+    extern bool dscp;                 ///< 是否把内层DSCP复制到外层
+    extern bool ecn;                  ///< 是否按RFC 6040传递ECN
+    extern int probeInterval;         ///< 节点路径测量的探测间隔(毫秒)，0为不探测
+    extern bool pathSelect;           ///< 是否按测量结果在直连与经核心节点转发的路径间选择
+    extern int peerSocks;             ///< 流量大的节点使用已连接socket的个数上限，0为不启用
+    extern bool relay;                ///< 是否启用经中间边缘节点的时延感知中继
+    extern bool seq;                  ///< 是否给发出的数据报加序号，供对端统计丢包、乱序与重复
+    extern std::string cores;         ///< 额外的核心节点地址，格式为 地址:端口,...，与-remote_addr一起按MAC分担
+    extern std::string federation;    ///< 联邦核心节点地址，格式为 地址:端口,...，仅核心节点使用
+    extern bool failover;             ///< 是否按ICMP错误与保活丢失快速判定直连节点失效并回退到核心节点
+    extern bool resolve;              ///< 是否在MAC表未命中时向核心节点按需解析，暂存应答前的帧并缓存否定结果
 };
 
 #endif //TALUSVSWITCH_CONFIG_H
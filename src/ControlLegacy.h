@@ -0,0 +1,383 @@
+﻿/**
+ * @file ControlLegacy.h
+ * @brief 旧版文本控制命令与二进制消息的互转
+ * @details 旧版命令为MAC头后的"TVS_命令,参数,..."，列表项以'-'连接字段。
+ * 收到的文本命令先转为二进制消息再交给同一个处理函数；对端不支持二进制协议时，
+ * 发出的二进制消息转为文本命令。只有这里解析与拼接文本命令
+ */
+
+#ifndef TALUSVSWITCH_CONTROLLEGACY_H
+#define TALUSVSWITCH_CONTROLLEGACY_H
+
+#include <functional>
+#include <iomanip>
+#include <string>
+#include <unordered_map>
+#include <Network/Buffer.h>
+#include <Network/sockutil.h>
+#include <Util/util.h>
+#include "ControlProto.h"
+#include "HolePunch.h"
+#include "MacMap.h"
+
+// 文本命令字
+#define TVS_CMD_QUERY_PEERS TVS_CMD_PREFIX"QueryPeers"              ///< 查询对端列表命令
+#define TVS_CMD_QUERY_PEERS_RESPONSE TVS_CMD_PREFIX"ReQueryPeers"   ///< 查询对端列表响应
+#define TVS_CMD_QUERY_PEER_INFO TVS_CMD_PREFIX"QueryPeerInfo"       ///< 查询对端信息命令
+#define TVS_CMD_QUERY_PEER_INFO_RESPONSE TVS_CMD_PREFIX"ReQueryPeerInfo" ///< 查询对端信息响应
+#define TVS_CMD_CANDIDATES TVS_CMD_PREFIX"Candidates"              ///< 上报本地地址
+#define TVS_CMD_PUNCH_REQUEST TVS_CMD_PREFIX"PunchRequest"         ///< 请求协调打洞
+#define TVS_CMD_PUNCH TVS_CMD_PREFIX"Punch"                        ///< 下发对端候选
+#define TVS_CMD_RTT_REPORT TVS_CMD_PREFIX"RttReport"               ///< 上报路径得分
+#define TVS_CMD_ROUTE TVS_CMD_PREFIX"Route"                        ///< 下发中继
+#define TVS_CMD_FED_DIGEST TVS_CMD_PREFIX"FedDigest"               ///< 联邦目录摘要
+#define TVS_CMD_FED_ENTRIES TVS_CMD_PREFIX"FedEntries"             ///< 联邦目录项
+
+namespace ControlLegacy {
+    using Parts = std::vector<std::string>;
+    using Decoder = std::function<void(const Parts &parts, ControlProto::Writer &out)>;
+    using Encoder = std::function<void(ControlProto::Reader body, std::string &out)>;
+
+    inline std::string addrStr(const sockaddr_storage &addr) {
+        return toolkit::SockUtil::inet_ntoa(reinterpret_cast<const sockaddr *>(&addr)) + "-"
+            + std::to_string(toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&addr)));
+    }
+
+    /**
+     * @brief 解析"地址-端口"，端口非法时返回false
+     */
+    inline bool parseAddr(const std::string &ip, const std::string &port, sockaddr_storage &addr) {
+        auto n = atoi(port.c_str());
+        if (n < 0 || n > 0xffff) {
+            return false;
+        }
+        addr = toolkit::SockUtil::make_sockaddr(ip.c_str(), n);
+        return true;
+    }
+
+    inline char candidateType(int type) {
+        return type == HolePunch::Host ? 'h' : (type == HolePunch::Reflexive ? 's' : 'p');
+    }
+
+    /**
+     * @brief 文本命令字与消息类型的对应
+     */
+    inline const std::unordered_map<std::string, ControlProto::Msg> &names() {
+        static const std::unordered_map<std::string, ControlProto::Msg> names = {
+            {TVS_CMD_QUERY_PEERS, ControlProto::QueryPeers},
+            {TVS_CMD_QUERY_PEERS_RESPONSE, ControlProto::PeerList},
+            {TVS_CMD_QUERY_PEER_INFO, ControlProto::QueryPeerInfo},
+            {TVS_CMD_QUERY_PEER_INFO_RESPONSE, ControlProto::PeerInfo},
+            {TVS_CMD_CANDIDATES, ControlProto::Candidates},
+            {TVS_CMD_PUNCH_REQUEST, ControlProto::PunchRequest},
+            {TVS_CMD_PUNCH, ControlProto::Punch},
+            {TVS_CMD_RTT_REPORT, ControlProto::RttReport},
+            {TVS_CMD_ROUTE, ControlProto::Route},
+            {TVS_CMD_FED_DIGEST, ControlProto::FedDigest},
+            {TVS_CMD_FED_ENTRIES, ControlProto::FedEntries},
+        };
+        return names;
+    }
+
+    /**
+     * @brief 各消息的文本参数解析，parts[0]为命令字
+     */
+    inline const std::unordered_map<uint8_t, Decoder> &decoders() {
+        using namespace ControlProto;
+        static const std::unordered_map<uint8_t, Decoder> decoders = {
+            {PeerList, [](const Parts &parts, Writer &out) {
+                // mac-ip-port,...
+                for (size_t i = 1; i < parts.size(); ++i) {
+                    auto fields = toolkit::split(parts[i], "-");
+                    sockaddr_storage addr;
+                    if (fields.size() == 3 && parseAddr(fields[1], fields[2], addr)) {
+                        out.begin(Peer).mac(Mac, MacMap::macToUint64(fields[0])).addr(Addr, addr).end();
+                    }
+                }
+            }},
+            {PeerInfo, [](const Parts &parts, Writer &out) {
+                // ip,mac
+                if (parts.size() >= 3) {
+                    out.str(Ip, parts[1]).mac(Mac, MacMap::macToUint64(parts[2]));
+                }
+            }},
+            {Candidates, [](const Parts &parts, Writer &out) {
+                // port,ip,...
+                if (parts.size() < 2) {
+                    return;
+                }
+                auto port = atoi(parts[1].c_str());
+                if (port <= 0 || port > 0xffff) {
+                    return;
+                }
+                out.u16(Port, port);
+                for (size_t i = 2; i < parts.size(); ++i) {
+                    out.addr(Addr, toolkit::SockUtil::make_sockaddr(parts[i].c_str(), port));
+                }
+            }},
+            {PunchRequest, [](const Parts &parts, Writer &out) {
+                // mac
+                if (parts.size() >= 2) {
+                    out.mac(Mac, MacMap::macToUint64(parts[1]));
+                }
+            }},
+            {Punch, [](const Parts &parts, Writer &out) {
+                // mac,类型-地址-端口,...
+                if (parts.size() < 2) {
+                    return;
+                }
+                out.mac(Mac, MacMap::macToUint64(parts[1]));
+                for (size_t i = 2; i < parts.size(); ++i) {
+                    sockaddr_storage addr;
+                    HolePunch::Type type;
+                    if (HolePunch::parseCandidate(parts[i], addr, type)) {
+                        out.begin(Candidate).putUint(type, 1).putAddr(addr).end();
+                    }
+                }
+            }},
+            {RttReport, [](const Parts &parts, Writer &out) {
+                // mac-得分,...
+                for (size_t i = 1; i < parts.size(); ++i) {
+                    auto fields = toolkit::split(parts[i], "-");
+                    if (fields.size() == 2) {
+                        out.begin(Score).putMac(MacMap::macToUint64(fields[0])).putUint((uint32_t)(atof(fields[1].c_str()) * 100 + 0.5), 4).end();
+                    }
+                }
+            }},
+            {Route, [](const Parts &parts, Writer &out) {
+                // mac-中继mac(0为撤销),...
+                for (size_t i = 1; i < parts.size(); ++i) {
+                    auto fields = toolkit::split(parts[i], "-");
+                    if (fields.size() == 2) {
+                        out.begin(RouteVia).putMac(MacMap::macToUint64(fields[0]))
+                            .putMac(fields[1] == "0" ? 0 : MacMap::macToUint64(fields[1])).end();
+                    }
+                }
+            }},
+            {FedDigest, [](const Parts &parts, Writer &out) {
+                // 是否回送,归属-最大版本,...
+                if (parts.size() < 2) {
+                    return;
+                }
+                out.u8(Reply, parts[1] == "1");
+                for (size_t i = 2; i < parts.size(); ++i) {
+                    auto fields = toolkit::split(parts[i], "-");
+                    if (fields.size() == 2) {
+                        out.begin(Owner).putMac(MacMap::macToUint64(fields[0])).putUint(std::stoull(fields[1]), 8).end();
+                    }
+                }
+            }},
+            {FedEntries, [](const Parts &parts, Writer &out) {
+                // 归属,前一批末尾版本,本批末尾版本,mac-版本-地址-端口-是否删除,...
+                if (parts.size() < 4) {
+                    return;
+                }
+                out.mac(Mac, MacMap::macToUint64(parts[1])).u64(After, std::stoull(parts[2])).u64(Upto, std::stoull(parts[3]));
+                for (size_t i = 4; i < parts.size(); ++i) {
+                    auto fields = toolkit::split(parts[i], "-");
+                    sockaddr_storage addr;
+                    if (fields.size() == 5 && parseAddr(fields[2], fields[3], addr)) {
+                        out.begin(Entry).mac(Mac, MacMap::macToUint64(fields[0])).u64(Version, std::stoull(fields[1]))
+                            .addr(Addr, addr).u8(Dead, fields[4] == "1").end();
+                    }
+                }
+            }},
+        };
+        return decoders;
+    }
+
+    /**
+     * @brief 各消息的文本参数拼接，追加在命令字之后
+     */
+    inline const std::unordered_map<uint8_t, Encoder> &encoders() {
+        using namespace ControlProto;
+        static const std::unordered_map<uint8_t, Encoder> encoders = {
+            {QueryPeers, [](Reader, std::string &out) {
+                out += TVS_CMD_QUERY_PEERS",";
+            }},
+            {PeerList, [](Reader body, std::string &out) {
+                out += TVS_CMD_QUERY_PEERS_RESPONSE",";
+                while (body.next()) {
+                    if (body.tag() != Peer) {
+                        continue;
+                    }
+                    uint64_t mac = 0;
+                    sockaddr_storage addr{};
+                    auto peer = body.nested();
+                    while (peer.next()) {
+                        if (peer.tag() == Mac) {
+                            mac = peer.mac();
+                        } else if (peer.tag() == Addr) {
+                            peer.addr(addr);
+                        }
+                    }
+                    if (!addr.ss_family) {
+                        // 增量中的删除，旧版本节点只认全量
+                        continue;
+                    }
+                    out += MacMap::uint64ToMacStr(mac) + "-" + addrStr(addr) + ",";
+                }
+            }},
+            {QueryPeerInfo, [](Reader, std::string &out) {
+                out += TVS_CMD_QUERY_PEER_INFO",";
+            }},
+            {PeerInfo, [](Reader body, std::string &out) {
+                std::string ip, mac;
+                while (body.next()) {
+                    if (body.tag() == Ip) {
+                        ip = body.value();
+                    } else if (body.tag() == Mac) {
+                        mac = MacMap::uint64ToMacStr(body.mac());
+                    }
+                }
+                out += TVS_CMD_QUERY_PEER_INFO_RESPONSE"," + ip + "," + mac;
+            }},
+            {Candidates, [](Reader body, std::string &out) {
+                out += TVS_CMD_CANDIDATES",";
+                std::string ips;
+                uint16_t port = 0;
+                while (body.next()) {
+                    sockaddr_storage addr;
+                    if (body.tag() == Port) {
+                        port = body.u16();
+                    } else if (body.tag() == Addr && body.addr(addr)) {
+                        ips += "," + toolkit::SockUtil::inet_ntoa(reinterpret_cast<const sockaddr *>(&addr));
+                    }
+                }
+                out += std::to_string(port) + ips;
+            }},
+            {PunchRequest, [](Reader body, std::string &out) {
+                out += TVS_CMD_PUNCH_REQUEST",";
+                while (body.next()) {
+                    if (body.tag() == Mac) {
+                        out += MacMap::uint64ToMacStr(body.mac());
+                    }
+                }
+            }},
+            {Punch, [](Reader body, std::string &out) {
+                out += TVS_CMD_PUNCH",";
+                std::string candidates;
+                while (body.next()) {
+                    sockaddr_storage addr;
+                    if (body.tag() == Mac) {
+                        out += MacMap::uint64ToMacStr(body.mac());
+                    } else if (body.tag() == Candidate && body.addr(addr, 1)) {
+                        candidates += std::string(",") + candidateType(body.u8()) + "-" + addrStr(addr);
+                    }
+                }
+                out += candidates;
+            }},
+            {RttReport, [](Reader body, std::string &out) {
+                out += TVS_CMD_RTT_REPORT;
+                while (body.next()) {
+                    if (body.tag() == Score) {
+                        out += StrPrinter << "," << MacMap::uint64ToMacStr(body.mac()) << "-" << std::fixed
+                                          << std::setprecision(2) << body.u32(6) / 100.0;
+                    }
+                }
+            }},
+            {Route, [](Reader body, std::string &out) {
+                out += TVS_CMD_ROUTE;
+                while (body.next()) {
+                    if (body.tag() == RouteVia) {
+                        auto via = body.mac(6);
+                        out += "," + MacMap::uint64ToMacStr(body.mac()) + "-" + (via ? MacMap::uint64ToMacStr(via) : "0");
+                    }
+                }
+            }},
+            {FedDigest, [](Reader body, std::string &out) {
+                out += TVS_CMD_FED_DIGEST",";
+                std::string owners;
+                bool reply = false;
+                while (body.next()) {
+                    if (body.tag() == Reply) {
+                        reply = body.u8();
+                    } else if (body.tag() == Owner) {
+                        owners += "," + MacMap::uint64ToMacStr(body.mac()) + "-" + std::to_string(body.u64(6));
+                    }
+                }
+                out += (reply ? "1" : "0") + owners;
+            }},
+            {FedEntries, [](Reader body, std::string &out) {
+                out += TVS_CMD_FED_ENTRIES",";
+                uint64_t owner = 0, after = 0, upto = 0;
+                std::string entries;
+                while (body.next()) {
+                    switch (body.tag()) {
+                        case Mac: owner = body.mac(); break;
+                        case After: after = body.u64(); break;
+                        case Upto: upto = body.u64(); break;
+                        case Entry: {
+                            uint64_t mac = 0, version = 0;
+                            sockaddr_storage addr{};
+                            bool dead = false;
+                            auto entry = body.nested();
+                            while (entry.next()) {
+                                switch (entry.tag()) {
+                                    case Mac: mac = entry.mac(); break;
+                                    case Version: version = entry.u64(); break;
+                                    case Addr: entry.addr(addr); break;
+                                    case Dead: dead = entry.u8(); break;
+                                    default: break;
+                                }
+                            }
+                            entries += "," + MacMap::uint64ToMacStr(mac) + "-" + std::to_string(version) + "-" + addrStr(addr)
+                                + "-" + (dead ? "1" : "0");
+                            break;
+                        }
+                        default: break;
+                    }
+                }
+                out += MacMap::uint64ToMacStr(owner) + "," + std::to_string(after) + "," + std::to_string(upto) + entries;
+            }},
+        };
+        return encoders;
+    }
+
+    /**
+     * @brief 文本命令转为二进制消息
+     * @return 不认识的命令或参数格式错误时返回nullptr
+     */
+    inline toolkit::Buffer::Ptr decode(const toolkit::Buffer::Ptr &buf) {
+        auto parts = toolkit::split(std::string(buf->data() + ControlProto::kMacHeaderSize, buf->size() - ControlProto::kMacHeaderSize), ",");
+        if (parts.empty()) {
+            return nullptr;
+        }
+        auto it = names().find(parts.front());
+        if (it == names().end()) {
+            return nullptr;
+        }
+        uint64_t dst = *(uint64_t *)buf->data() << 16;
+        uint64_t src = *(uint64_t *)(buf->data() + 6) << 16;
+        ControlProto::Writer out(it->second, dst, src);
+        auto decoder = decoders().find(it->second);
+        if (decoder != decoders().end()) {
+            try {
+                decoder->second(parts, out);
+            } catch (std::exception &ex) {
+                WarnL << "invalid command " << parts.front() << ": " << ex.what();
+                return nullptr;
+            }
+        }
+        return out.buffer();
+    }
+
+    /**
+     * @brief 二进制消息转为文本命令
+     * @return 没有文本形式的消息(如Hello)返回nullptr
+     */
+    inline toolkit::Buffer::Ptr encode(const toolkit::Buffer::Ptr &buf) {
+        auto it = encoders().find(ControlProto::msg(buf->data()));
+        if (it == encoders().end()) {
+            return nullptr;
+        }
+        auto out = std::make_shared<toolkit::BufferLikeString>();
+        std::string text;
+        it->second(ControlProto::Reader::body(buf->data(), buf->size()), text);
+        out->append(buf->data(), ControlProto::kMacHeaderSize);
+        out->append(text);
+        return out;
+    }
+}
+
+#endif //TALUSVSWITCH_CONTROLLEGACY_H
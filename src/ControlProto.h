@@ -0,0 +1,351 @@
+﻿/**
+ * @file ControlProto.h
+ * @brief 二进制控制协议
+ * @details 控制命令与数据帧一样以12字节MAC头开始(目标MAC、来源MAC)，其后为：
+ * | 字节 | 含义 |
+ * | 12-14 | 标记"TVS" |
+ * | 15 | 协议版本，小于0x20，与文本命令"TVS_"的第4个字节区分 |
+ * | 16 | 消息类型 |
+ * | 17- | TLV序列：类型(1字节)、长度(2字节，网络序)、值 |
+ * - 整数为网络序，MAC为6字节，地址为 地址族(4/6) + IPv4/IPv6地址 + 端口(2字节)
+ * - 列表为重复的TLV，复合值为定长字段的拼接或嵌套的TLV序列
+ * - 不认识的TLV跳过，新增字段不影响旧版本；版本不同的消息整体忽略
+ * - 解析不拷贝，值以string_view指向原报文
+ * 双方通过Hello交换能力后才使用二进制消息，之前以及对端为旧版本时收发文本命令(见ControlLegacy.h)
+ */
+
+#ifndef TALUSVSWITCH_CONTROLPROTO_H
+#define TALUSVSWITCH_CONTROLPROTO_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <vector>
+#include <Network/Buffer.h>
+#include "Utils.h"
+
+/// 文本命令前缀，旧版协议
+#define TVS_CMD_PREFIX "TVS_"
+
+namespace ControlProto {
+    constexpr size_t kMacHeaderSize = 12;                   ///< MAC头长度
+    constexpr size_t kHeaderSize = kMacHeaderSize + 5;      ///< MAC头、标记、版本与消息类型
+    constexpr uint8_t kVersion = 1;                         ///< 协议版本
+    constexpr size_t kPageBytes = 1000;                     ///< 列表类消息超过该长度即分包
+
+    /**
+     * @brief 消息类型
+     */
+    enum Msg : uint8_t {
+        Hello = 1,          ///< 能力交换
+        QueryPeers = 2,     ///< 查询对端列表
+        PeerList = 3,       ///< 对端列表(一页)
+        QueryPeerInfo = 4,  ///< 查询节点信息
+        PeerInfo = 5,       ///< 节点信息
+        Candidates = 6,     ///< 上报本地地址
+        PunchRequest = 7,   ///< 请求协调打洞
+        Punch = 8,          ///< 下发对端候选
+        RttReport = 9,      ///< 上报路径得分
+        Route = 10,         ///< 下发中继
+        FedDigest = 11,     ///< 联邦目录摘要
+        FedEntries = 12,    ///< 联邦目录项
+        MapRequest = 13,    ///< 解析MAC
+        MapReply = 14,      ///< 解析结果，不存在时以Dead代替Addr
+        ScoreRequest = 15,  ///< 查询核心节点到各节点的路径得分
+        ScoreReply = 16,    ///< 核心节点到各节点的路径得分，尚无测量结果的节点不带
+    };
+
+    /**
+     * @brief TLV类型
+     */
+    enum Tag : uint8_t {
+        Caps = 1,           ///< 能力位图，4字节
+        Reply = 2,          ///< 是否为应答，1字节
+        Mac = 3,            ///< MAC
+        Addr = 4,           ///< 地址
+        Ip = 5,             ///< 虚拟网卡IP，字符串
+        Port = 6,           ///< 端口，2字节
+        Cursor = 7,         ///< 分页起点，此前最后一个MAC，8字节
+        Next = 8,           ///< 下一页的起点，没有时为最后一页，8字节
+        Peer = 9,           ///< 对端，嵌套Mac与Addr，已删除的对端以Dead代替Addr
+        Candidate = 10,     ///< 打洞候选，类型(1字节) + 地址
+        Score = 11,         ///< 路径得分，MAC + 得分×100(4字节)
+        RouteVia = 12,      ///< 中继，目标MAC + 中继MAC(全0为撤销)
+        Owner = 13,         ///< 联邦归属，MAC + 版本(8字节)
+        After = 14,         ///< 前一批的末尾版本，8字节
+        Upto = 15,          ///< 本批的末尾版本，8字节
+        Entry = 16,         ///< 联邦目录项，嵌套Mac、Version、Addr与Dead
+        Dead = 17,          ///< 是否为墓碑，1字节
+        Version = 18,       ///< 版本，8字节
+        Epoch = 19,         ///< 对端目录的纪元，8字节
+    };
+
+    /**
+     * @brief 能力位
+     */
+    enum Cap : uint32_t {
+        CapBinary = 1,      ///< 二进制控制协议第1版
+    };
+
+    constexpr uint32_t kCaps = CapBinary;   ///< 本节点支持的能力
+
+    /**
+     * @brief 是否为文本命令
+     */
+    inline bool isText(const char *frame, size_t size) {
+        return size >= kMacHeaderSize + strlen(TVS_CMD_PREFIX)
+            && strncmp(frame + kMacHeaderSize, TVS_CMD_PREFIX, strlen(TVS_CMD_PREFIX)) == 0;
+    }
+
+    /**
+     * @brief 是否为二进制消息，不检查版本
+     */
+    inline bool isBinary(const char *frame, size_t size) {
+        return size >= kHeaderSize && memcmp(frame + kMacHeaderSize, "TVS", 3) == 0
+            && (uint8_t)frame[kMacHeaderSize + 3] < 0x20;
+    }
+
+    /**
+     * @brief 是否为控制命令，文本或二进制
+     */
+    inline bool isControl(const char *frame, size_t size) {
+        return isText(frame, size) || isBinary(frame, size);
+    }
+
+    inline uint8_t version(const char *frame) {
+        return (uint8_t)frame[kMacHeaderSize + 3];
+    }
+
+    inline Msg msg(const char *frame) {
+        return (Msg)(uint8_t)frame[kMacHeaderSize + 4];
+    }
+
+    inline uint64_t getUint(const char *p, size_t n) {
+        uint64_t v = 0;
+        for (size_t i = 0; i < n; ++i) {
+            v = v << 8 | (uint8_t)p[i];
+        }
+        return v;
+    }
+
+    inline void putUint(char *p, uint64_t v, size_t n) {
+        for (size_t i = n; i > 0; --i) {
+            p[i - 1] = (char)v;
+            v >>= 8;
+        }
+    }
+
+    /**
+     * @brief 地址编码后的长度
+     */
+    inline size_t addrSize(const sockaddr_storage &addr) {
+        return addr.ss_family == AF_INET6 ? 19 : 7;
+    }
+
+    /**
+     * @class Reader
+     * @brief TLV序列的只读游标
+     * @details 值指向原报文，报文在Reader使用期间必须有效；长度越界时停止并标记为格式错误
+     */
+    class Reader {
+    public:
+        Reader(const char *data, size_t size) : _p(data), _end(data + size) {}
+
+        /**
+         * @brief 消息的TLV序列，data须已通过isBinary检查
+         */
+        static Reader body(const char *frame, size_t size) {
+            return Reader(frame + kHeaderSize, size - kHeaderSize);
+        }
+
+        /**
+         * @brief 移到下一个TLV
+         * @return 已到末尾或格式错误时返回false
+         */
+        bool next() {
+            if (_p == _end) {
+                return false;
+            }
+            if (_end - _p < 3) {
+                _bad = true;
+                _p = _end;
+                return false;
+            }
+            auto len = (size_t)getUint(_p + 1, 2);
+            if ((size_t)(_end - _p - 3) < len) {
+                _bad = true;
+                _p = _end;
+                return false;
+            }
+            _tag = (Tag)(uint8_t)_p[0];
+            _value = std::string_view(_p + 3, len);
+            _p += 3 + len;
+            return true;
+        }
+
+        bool ok() const { return !_bad; }
+        Tag tag() const { return _tag; }
+        std::string_view value() const { return _value; }
+
+        /**
+         * @brief 从偏移off处读取n字节的整数，越界时返回0
+         */
+        uint64_t uint(size_t off, size_t n) const {
+            return off + n <= _value.size() ? getUint(_value.data() + off, n) : 0;
+        }
+        uint8_t u8(size_t off = 0) const { return (uint8_t)uint(off, 1); }
+        uint16_t u16(size_t off = 0) const { return (uint16_t)uint(off, 2); }
+        uint32_t u32(size_t off = 0) const { return (uint32_t)uint(off, 4); }
+        uint64_t u64(size_t off = 0) const { return uint(off, 8); }
+
+        /**
+         * @brief 从偏移off处读取MAC，越界时返回0
+         */
+        uint64_t mac(size_t off = 0) const {
+            return off + 6 <= _value.size() ? toMac(_value.data() + off) : 0;
+        }
+
+        /**
+         * @brief 从偏移off处读取地址
+         * @return 越界或地址族不认识时返回false
+         */
+        bool addr(sockaddr_storage &out, size_t off = 0) const {
+            if (off >= _value.size()) {
+                return false;
+            }
+            auto p = _value.data() + off;
+            auto left = _value.size() - off;
+            memset(&out, 0, sizeof(out));
+            if (p[0] == 4 && left >= 7) {
+                auto &in = reinterpret_cast<sockaddr_in &>(out);
+                in.sin_family = AF_INET;
+                memcpy(&in.sin_addr, p + 1, 4);
+                in.sin_port = htons((uint16_t)getUint(p + 5, 2));
+                return true;
+            }
+            if (p[0] == 6 && left >= 19) {
+                auto &in6 = reinterpret_cast<sockaddr_in6 &>(out);
+                in6.sin6_family = AF_INET6;
+                memcpy(&in6.sin6_addr, p + 1, 16);
+                in6.sin6_port = htons((uint16_t)getUint(p + 17, 2));
+                return true;
+            }
+            return false;
+        }
+
+        /**
+         * @brief 值作为嵌套的TLV序列
+         */
+        Reader nested() const {
+            return Reader(_value.data(), _value.size());
+        }
+
+    private:
+        /**
+         * @brief 6字节MAC转为MacMap使用的表示(内存中与MAC头相同的排列)
+         */
+        static uint64_t toMac(const char *p) {
+            uint64_t mac = 0;
+            memcpy(reinterpret_cast<char *>(&mac) + 2, p, 6);
+            return mac;
+        }
+
+        const char *_p;
+        const char *_end;
+        Tag _tag{};
+        std::string_view _value;
+        bool _bad = false;
+    };
+
+    /**
+     * @class Writer
+     * @brief 消息构造器
+     * @details begin/end之间以put*追加定长字段或嵌套的TLV，长度在end时回填
+     */
+    class Writer {
+    public:
+        using Ptr = std::shared_ptr<toolkit::BufferLikeString>;
+
+        /**
+         * @param msg 消息类型
+         * @param dst 目标MAC，为0时由收到的节点处理
+         * @param src 来源MAC
+         */
+        Writer(Msg msg, uint64_t dst, uint64_t src) : _buf(std::make_shared<toolkit::BufferLikeString>()) {
+            _buf->reserve(256);
+            _buf->append(reinterpret_cast<char *>(&dst) + 2, 6);
+            _buf->append(reinterpret_cast<char *>(&src) + 2, 6);
+            char head[5] = {'T', 'V', 'S', (char)kVersion, (char)msg};
+            _buf->append(head, sizeof(head));
+        }
+
+        Writer &begin(Tag tag) {
+            char head[3] = {(char)tag, 0, 0};
+            _buf->append(head, sizeof(head));
+            _open.push_back(_buf->size());
+            return *this;
+        }
+
+        Writer &end() {
+            auto start = _open.back();
+            _open.pop_back();
+            ControlProto::putUint(_buf->data() + start - 2, _buf->size() - start, 2);
+            return *this;
+        }
+
+        Writer &putUint(uint64_t v, size_t n) {
+            char tmp[8];
+            ControlProto::putUint(tmp, v, n);
+            _buf->append(tmp, n);
+            return *this;
+        }
+
+        Writer &putMac(uint64_t mac) {
+            _buf->append(reinterpret_cast<char *>(&mac) + 2, 6);
+            return *this;
+        }
+
+        Writer &putAddr(const sockaddr_storage &addr) {
+            if (addr.ss_family == AF_INET6) {
+                auto &in6 = reinterpret_cast<const sockaddr_in6 &>(addr);
+                putUint(6, 1);
+                _buf->append(reinterpret_cast<const char *>(&in6.sin6_addr), 16);
+                return putUint(ntohs(in6.sin6_port), 2);
+            }
+            auto &in = reinterpret_cast<const sockaddr_in &>(addr);
+            putUint(4, 1);
+            _buf->append(reinterpret_cast<const char *>(&in.sin_addr), 4);
+            return putUint(ntohs(in.sin_port), 2);
+        }
+
+        Writer &putStr(std::string_view str) {
+            _buf->append(str.data(), str.size());
+            return *this;
+        }
+
+        Writer &u8(Tag tag, uint8_t v) { return begin(tag).putUint(v, 1).end(); }
+        Writer &u16(Tag tag, uint16_t v) { return begin(tag).putUint(v, 2).end(); }
+        Writer &u32(Tag tag, uint32_t v) { return begin(tag).putUint(v, 4).end(); }
+        Writer &u64(Tag tag, uint64_t v) { return begin(tag).putUint(v, 8).end(); }
+        Writer &mac(Tag tag, uint64_t mac) { return begin(tag).putMac(mac).end(); }
+        Writer &addr(Tag tag, const sockaddr_storage &addr) { return begin(tag).putAddr(addr).end(); }
+        Writer &str(Tag tag, std::string_view str) { return begin(tag).putStr(str).end(); }
+
+        size_t size() const { return _buf->size(); }
+
+        /**
+         * @brief 是否还没有TLV
+         */
+        bool empty() const { return _buf->size() == kHeaderSize; }
+
+        const Ptr &buffer() const { return _buf; }
+
+    private:
+        Ptr _buf;
+        std::vector<size_t> _open;      ///< 未结束的TLV值的起始偏移
+    };
+}
+
+#endif //TALUSVSWITCH_CONTROLPROTO_H
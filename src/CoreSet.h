@@ -0,0 +1,310 @@
+﻿/**
+ * @file CoreSet.h
+ * @brief 多核心节点的负载分担与故障切换
+ * @details 边缘节点可配置多个核心节点，-remote_addr为第一个，-cores追加其余：
+ * - 未知单播按目标MAC的最高随机权重哈希(HRW)分配到存活的核心节点，核心节点增减时只有归属它的MAC改变归属
+ * - MAC表的广播项指向广播MAC哈希到的主核心节点，广播与查询只经主核心节点；其余控制命令按目标MAC哈希分配
+ * - 保活、本地地址与路径得分发给全部核心节点，每个核心节点都直接知道所有边缘节点及其状态，
+ *   切换后不需要重新收敛
+ * - 每200毫秒向每个核心节点发送探测，连续3个未应答即判定失效，经它转发的节点按哈希改走其他核心节点，
+ *   应答恢复后重新参与分配
+ * 只有一个核心节点时不探测，行为与原来相同
+ */
+
+#ifndef TALUSVSWITCH_CORESET_H
+#define TALUSVSWITCH_CORESET_H
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <vector>
+#include <Network/sockutil.h>
+#include <Poller/EventPoller.h>
+#include <Util/logger.h>
+#include <Util/util.h>
+#include "Config.h"
+#include "LinkProbe.h"
+#include "MacMap.h"
+#include "Statistics.h"
+#include "Utils.h"
+
+/**
+ * @class CoreSet
+ * @brief 核心节点集合单例
+ * @details 核心节点列表在启动前设置，之后只读；存活状态为位图，选择核心节点不加锁，可在任意线程执行
+ */
+class CoreSet {
+public:
+    using KeepSender = std::function<void(const sockaddr_storage &addr)>;
+
+    static constexpr size_t kMaxCores = 32;             ///< 核心节点个数上限
+    static constexpr uint64_t kProbeMs = 200;           ///< 探测间隔
+    static constexpr int kMissProbes = 3;               ///< 连续未应答多少个探测视为失效
+    static constexpr uint64_t kKeepaliveMs = 5000;      ///< 保活间隔，与LinkKeeper一致
+
+    /**
+     * @brief 获取CoreSet单例
+     */
+    static CoreSet &Instance() {
+        static CoreSet cores;
+        return cores;
+    }
+
+    /**
+     * @brief 设置核心节点列表，第一个为-remote_addr指定的核心节点
+     */
+    void init(const std::vector<sockaddr_storage> &cores) {
+        _cores.clear();
+        for (auto &addr : cores) {
+            if (_cores.size() < kMaxCores && !isCore(addr)) {
+                Core core;
+                core.addr = addr;
+                core.seed = mix(PeerKey::Hash()(PeerKey(addr)));
+                _cores.emplace_back(core);
+            }
+        }
+        _alive = _cores.size() >= 32 ? ~0u : (1u << _cores.size()) - 1;
+    }
+
+    /**
+     * @brief 开始探测各核心节点
+     * @param poller 传输层poller
+     * @param keep 向核心节点发送保活
+     */
+    void start(const toolkit::EventPoller::Ptr &poller, KeepSender keep) {
+        if (_cores.size() < 2) {
+            return;
+        }
+        _keep = std::move(keep);
+        auto now = toolkit::getCurrentMillisecond();
+        for (auto &core : _cores) {
+            core.lastOk = now;
+        }
+        poller->doDelayTask(kProbeMs, [this]() {
+            tick();
+            return kProbeMs;
+        });
+        Statistics::Instance().addGauge("cores", [this]() { return report(); });
+        InfoL << "Sharing load across " << _cores.size() << " core peers";
+    }
+
+    /**
+     * @brief 是否为核心节点地址
+     */
+    bool isCore(const sockaddr_storage &addr) const {
+        for (auto &core : _cores) {
+            if (compareSockAddr(core.addr, addr)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * @brief 是否为核心节点的MAC
+     */
+    bool isCoreMac(uint64_t mac) {
+        if (!mac) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lck(_mtx);
+        for (auto &core : _cores) {
+            if (core.mac == mac) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * @brief 记录核心节点的MAC，由查询核心节点信息的应答得到
+     */
+    void setCoreMac(const sockaddr_storage &addr, uint64_t mac) {
+        std::lock_guard<std::mutex> lck(_mtx);
+        for (auto &core : _cores) {
+            if (compareSockAddr(core.addr, addr)) {
+                core.mac = mac;
+            }
+        }
+    }
+
+    /**
+     * @brief 核心节点的MAC，尚未得到时为0
+     */
+    uint64_t coreMac(const sockaddr_storage &addr) {
+        std::lock_guard<std::mutex> lck(_mtx);
+        for (auto &core : _cores) {
+            if (compareSockAddr(core.addr, addr)) {
+                return core.mac;
+            }
+        }
+        return 0;
+    }
+
+    /**
+     * @brief 按MAC选择存活的核心节点
+     * @details 全部失效时仍在全部核心节点中选择；没有核心节点(本节点即核心节点)时返回Config::corePeer
+     */
+    sockaddr_storage pick(uint64_t mac) const {
+        if (_cores.size() < 2) {
+            return _cores.empty() ? Config::corePeer : _cores.front().addr;
+        }
+        auto alive = _alive.load(std::memory_order_relaxed);
+        if (!alive) {
+            alive = ~0u;
+        }
+        const Core *best = nullptr;
+        uint64_t bestWeight = 0;
+        for (size_t i = 0; i < _cores.size(); ++i) {
+            if (!(alive >> i & 1)) {
+                continue;
+            }
+            auto weight = mix(mac ^ _cores[i].seed);
+            if (!best || weight > bestWeight) {
+                best = &_cores[i];
+                bestWeight = weight;
+            }
+        }
+        return best->addr;
+    }
+
+    /**
+     * @brief 主核心节点，负责广播与查询
+     */
+    sockaddr_storage primary() const {
+        return pick(MAC_BROADCAST);
+    }
+
+    /**
+     * @brief 存活的核心节点，用于需要各核心节点一致的上报
+     */
+    std::vector<sockaddr_storage> alive() const {
+        std::vector<sockaddr_storage> ret;
+        auto alive = _alive.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < _cores.size(); ++i) {
+            if (alive >> i & 1) {
+                ret.emplace_back(_cores[i].addr);
+            }
+        }
+        return ret;
+    }
+
+    /**
+     * @brief 全部核心节点
+     */
+    std::vector<sockaddr_storage> all() const {
+        std::vector<sockaddr_storage> ret;
+        for (auto &core : _cores) {
+            ret.emplace_back(core.addr);
+        }
+        return ret;
+    }
+
+private:
+    struct Core {
+        sockaddr_storage addr{};
+        uint64_t seed = 0;          ///< 哈希种子，由地址得到，各边缘节点一致
+        uint64_t mac = 0;
+        int probes = 0;             ///< 从未应答时已发送的探测个数
+        uint64_t lastOk = 0;        ///< 最近一次确认存活的时间(毫秒)
+    };
+
+    CoreSet() = default;
+
+    /**
+     * @brief splitmix64的混合函数
+     */
+    static uint64_t mix(uint64_t x) {
+        x += 0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    static std::string name(const sockaddr_storage &addr) {
+        return toolkit::SockUtil::inet_ntoa(reinterpret_cast<const sockaddr *>(&addr)) + ":"
+            + std::to_string(toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&addr)));
+    }
+
+    /**
+     * @brief 判定各核心节点的存活并发出下一轮探测
+     */
+    void tick() {
+        static auto &failovers = Statistics::Instance().counter("core.failovers");
+        static auto &recoveries = Statistics::Instance().counter("core.recoveries");
+        auto now = toolkit::getCurrentMillisecond();
+        auto before = _alive.load();
+        auto oldPrimary = primary();
+        uint32_t alive = 0;
+        for (size_t i = 0; i < _cores.size(); ++i) {
+            auto &core = _cores[i];
+            auto missed = LinkProbe::Instance().missed(core.addr);
+            bool up;
+            if (missed < 0) {
+                up = core.probes < kMissProbes;
+            } else {
+                up = missed < kMissProbes;
+                core.probes = 0;
+            }
+            if (missed == 0) {
+                core.lastOk = now;
+            }
+            alive |= (uint32_t)up << i;
+            if (missed < 0) {
+                ++core.probes;
+            }
+            LinkProbe::Instance().probe(core.addr);
+        }
+        if (now - _lastKeep >= kKeepaliveMs) {
+            _lastKeep = now;
+            for (auto &core : _cores) {
+                _keep(core.addr);
+            }
+        }
+        if (alive == before) {
+            return;
+        }
+        _alive = alive;
+        for (size_t i = 0; i < _cores.size(); ++i) {
+            auto &core = _cores[i];
+            bool was = before >> i & 1, is = alive >> i & 1;
+            if (was && !is) {
+                // 经失效核心节点转发的节点按哈希改走其他核心节点
+                auto moved = MacMap::failover(core.addr, [this](uint64_t mac) { return pick(mac); }, Config::sendTtl - 1);
+                _lastFailoverMs = now - core.lastOk;
+                ++failovers;
+                WarnL << "Core " << name(core.addr) << " down after " << _lastFailoverMs << "ms, " << moved.size() << " peers moved";
+            } else if (!was && is) {
+                ++recoveries;
+                InfoL << "Core " << name(core.addr) << " up";
+            }
+        }
+        auto newPrimary = primary();
+        if (!compareSockAddr(oldPrimary, newPrimary)) {
+            MacMap::setMacPeer(MAC_BROADCAST, newPrimary, Config::sendTtl);
+        }
+    }
+
+    std::string report() {
+        std::ostringstream oss;
+        auto alive = _alive.load();
+        auto primaryAddr = primary();
+        for (size_t i = 0; i < _cores.size(); ++i) {
+            auto &addr = _cores[i].addr;
+            oss << (oss.tellp() ? "," : "") << name(addr) << "=" << (alive >> i & 1 ? "up" : "down")
+                << (compareSockAddr(addr, primaryAddr) ? "/primary" : "");
+        }
+        oss << ",failover=" << _lastFailoverMs << "ms";
+        return oss.str();
+    }
+
+    std::vector<Core> _cores;
+    std::atomic<uint32_t> _alive{0};    ///< 第i位为第i个核心节点是否存活
+    KeepSender _keep;
+    uint64_t _lastKeep = 0;
+    std::atomic<uint64_t> _lastFailoverMs{0};   ///< 最近一次从失效前最后确认存活到完成切换的耗时
+    std::mutex _mtx;                    ///< 保护核心节点的MAC
+};
+
+#endif //TALUSVSWITCH_CORESET_H
@@ -0,0 +1,562 @@
+﻿/**
+ * @file Crypto.h
+ * @brief 隧道数据报的AEAD加密
+ * @details 使用OpenSSL的AES-256-GCM(由OpenSSL自动选用AES-NI/VAES)，CPU不支持AES指令时使用ChaCha20-Poly1305：
+ * - 密钥由预共享密钥经HKDF-SHA256按会话派生，会话内序号单调递增作为nonce；
+ *   会话编号高位为创建时间(毫秒)，最低位标记是否为进程启动时的会话，进程启动时及之后定期轮换会话
+ * - 接收方按会话维护滑动窗口，拒绝重放及窗口外的旧报文
+ * - 不在会话表中的会话，创建时间早于本进程启动(减去允许的时钟偏差)或不晚于已淘汰的最新会话时拒绝，
+ *   接收方重启或淘汰会话后不会为旧会话重建窗口；拒绝时向来源回送一个保活，
+ *   发送方看到对端新启动的会话时随即轮换，对端据此尽快恢复
+ * - 同一来源派生新会话密钥或回送保活有最小间隔，未认证的报文不能频繁占用传输层poller
+ * - 编码阶段按批加密，复用线程内的加密上下文，每包只重设nonce
+ * - 发送方的算法编号随报文携带，接收方按会话选用对应算法，两端可各自按CPU选择
+ * - 新会话的首个报文认证通过后才加入会话表，会话表满时只淘汰空闲会话，不因未认证的报文淘汰活跃会话
+ * 要求节点间的时钟偏差小于kClockSkewMs
+ * 加密报文格式：扩展报文公共头(类型Sealed) + 算法(1字节) + 会话(8字节) + 序号(8字节) + 密文 + 认证标签(16字节)，
+ * 公共头、算法、会话和序号作为附加认证数据
+ */
+
+#ifndef TALUSVSWITCH_CRYPTO_H
+#define TALUSVSWITCH_CRYPTO_H
+
+#if defined(ENABLE_OPENSSL) && __has_include(<openssl/evp.h>)
+#define HAS_TUNNEL_CRYPTO 1
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <Util/logger.h>
+#include <Util/util.h>
+#include "Packet.h"
+#include "Statistics.h"
+#include "TunnelProto.h"
+#include "Utils.h"
+
+#if defined(HAS_TUNNEL_CRYPTO)
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#if defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#endif
+#endif
+
+/**
+ * @class Crypto
+ * @brief 隧道加密单例
+ * @details 加密可在任意线程执行；解密只在传输层poller中执行
+ */
+class Crypto {
+public:
+    static constexpr size_t kCipherSize = 1;
+    static constexpr size_t kSessionSize = 8;
+    static constexpr size_t kSeqSize = 8;
+    static constexpr size_t kTagSize = 16;
+    static constexpr size_t kHeaderSize = TunnelProto::kHeaderSize + kCipherSize + kSessionSize + kSeqSize;  ///< 明文头长度
+    static constexpr size_t kOverhead = kHeaderSize + kTagSize;                                 ///< 加密后增加的长度
+    static constexpr size_t kReplayWindow = 1024;        ///< 重放窗口(包数)
+    static constexpr size_t kMaxSessions = 4096;         ///< 接收方最多保存的会话数，每个节点同时约有3个
+    static constexpr uint64_t kSessionIdleMs = 600 * 1000; ///< 接收方会话空闲超时
+    static constexpr uint64_t kRotateMs = kSessionIdleMs / 2;  ///< 发送方定期轮换会话的间隔
+    static constexpr uint64_t kRotateMinMs = 1000;       ///< 因对端重启而轮换的最小间隔
+    static constexpr uint64_t kClockSkewMs = 60 * 1000;  ///< 允许的节点间时钟偏差
+    static constexpr uint64_t kDeriveMs = 1000;          ///< 同一来源两次派生新会话密钥或回送保活的最小间隔
+    static constexpr uint64_t kFreshBit = 1;             ///< 会话编号中标记进程启动时会话的位
+    static constexpr size_t kSessionOffset = TunnelProto::kHeaderSize + kCipherSize;  ///< 会话在报文中的位置
+    static constexpr size_t kSeqOffset = kSessionOffset + kSessionSize;                ///< 序号在报文中的位置
+
+    /**
+     * @brief 报文携带的算法编号
+     */
+    enum CipherId : uint8_t {
+        Aes256Gcm = 1,
+        Chacha20Poly1305 = 2,
+    };
+
+    /**
+     * @brief 获取Crypto单例
+     */
+    static Crypto &Instance() {
+        static Crypto crypto;
+        return crypto;
+    }
+
+    /**
+     * @brief 启用加密
+     * @param psk 预共享密钥
+     * @param cipher 算法(auto/aes-256-gcm/chacha20-poly1305)
+     * @return 不支持加密或参数错误时返回false
+     */
+    bool start(const std::string &psk, const std::string &cipher) {
+#if defined(HAS_TUNNEL_CRYPTO)
+        if (psk.empty()) {
+            return false;
+        }
+        _cipher = resolveCipher(cipher);
+        if (!_cipher) {
+            WarnL << "Unknown cipher: " << cipher;
+            return false;
+        }
+        _cipherId = cipherId(_cipher);
+        _psk = psk;
+        _started = wallClock();
+        if (!rotate(true)) {
+            WarnL << "Derive tunnel key failed";
+            return false;
+        }
+        _enabled = true;
+        InfoL << "Tunnel encryption: " << EVP_CIPHER_name(_cipher);
+        return true;
+#else
+        WarnL << "Tunnel encryption requires OpenSSL, not available in this build";
+        return false;
+#endif
+    }
+
+    bool enabled() const { return _enabled; }
+
+    /**
+     * @brief 设置拒绝旧会话时的回调，在传输层poller中执行
+     * @param cb 向来源回送一个报文，使其看到本端的新会话后轮换
+     */
+    void setOnStale(std::function<void(const sockaddr_storage &from)> cb) {
+        _on_stale = std::move(cb);
+    }
+
+    /**
+     * @brief 批量加密
+     * @param pkts 待加密的数据报，原地替换为加密后的报文，加密失败的置空
+     */
+    void sealBatch(std::vector<PacketPtr> &pkts) {
+#if defined(HAS_TUNNEL_CRYPTO)
+        thread_local Context ctx;
+        if (toolkit::getCurrentMillisecond() >= _rotateAt) {
+            std::lock_guard<std::mutex> lck(_txMtx);
+            if (toolkit::getCurrentMillisecond() >= _rotateAt) {
+                rotate(false);
+            }
+        }
+        auto tx = std::atomic_load(&_tx);
+        if (!tx || !ctx.init(_cipher, tx->key, true)) {
+            pkts.clear();
+            return;
+        }
+        for (auto &pkt : pkts) {
+            if (!pkt) {
+                continue;
+            }
+            auto sealed = Packet::create(pkt->size() + kOverhead, false);
+            auto p = sealed->data();
+            TunnelProto::writeHeader(p, TunnelProto::Sealed);
+            p[TunnelProto::kHeaderSize] = (char)_cipherId;
+            put64(p + kSessionOffset, tx->session);
+            put64(p + kSeqOffset, _seq++);
+            int len = 0, fin = 0;
+            auto out = reinterpret_cast<uint8_t *>(p + kHeaderSize);
+            if (!ctx.begin(p + kSeqOffset, true)
+                || EVP_EncryptUpdate(ctx.ctx, nullptr, &len, reinterpret_cast<uint8_t *>(p), kHeaderSize) != 1
+                || EVP_EncryptUpdate(ctx.ctx, out, &len, reinterpret_cast<const uint8_t *>(pkt->data()), pkt->size()) != 1
+                || EVP_EncryptFinal_ex(ctx.ctx, out + len, &fin) != 1
+                || EVP_CIPHER_CTX_ctrl(ctx.ctx, EVP_CTRL_AEAD_GET_TAG, kTagSize, out + len + fin) != 1) {
+                pkt.reset();
+                continue;
+            }
+            sealed->setSize(kHeaderSize + len + fin + kTagSize);
+            pkt = std::move(sealed);
+        }
+#endif
+    }
+
+    /**
+     * @brief 解密，在传输层poller中执行
+     * @param data 加密报文，原地解密
+     * @param size 报文长度
+     * @param plain 解密后的数据报位置
+     * @param plainSize 解密后的数据报长度
+     * @param from 来源地址，用于限制派生新会话密钥的频率
+     * @return 认证失败或重放时返回false
+     */
+    bool open(char *data, size_t size, char *&plain, size_t &plainSize, const sockaddr_storage &from) {
+#if defined(HAS_TUNNEL_CRYPTO)
+        static auto &failures = Statistics::Instance().counter("crypto.auth_failures");
+        static auto &replays = Statistics::Instance().counter("crypto.replays");
+        if (size <= kOverhead) {
+            ++failures;
+            return false;
+        }
+        auto cipher = cipherById((uint8_t)data[TunnelProto::kHeaderSize]);
+        auto session = get64(data + kSessionOffset);
+        auto seq = get64(data + kSeqOffset);
+        auto rx = cipher ? findSession(session, cipher, from) : nullptr;
+        if (!rx) {
+            ++failures;
+            return false;
+        }
+        if (!rx->window.check(seq)) {
+            ++replays;
+            return false;
+        }
+        int len = 0, fin = 0;
+        auto in = reinterpret_cast<uint8_t *>(data + kHeaderSize);
+        auto inLen = (int)(size - kOverhead);
+        if (!rx->ctx.begin(data + kSeqOffset, false)
+            || EVP_DecryptUpdate(rx->ctx.ctx, nullptr, &len, reinterpret_cast<uint8_t *>(data), kHeaderSize) != 1
+            || EVP_DecryptUpdate(rx->ctx.ctx, in, &len, in, inLen) != 1
+            || EVP_CIPHER_CTX_ctrl(rx->ctx.ctx, EVP_CTRL_AEAD_SET_TAG, kTagSize, in + inLen) != 1
+            || EVP_DecryptFinal_ex(rx->ctx.ctx, in + len, &fin) != 1) {
+            ++failures;
+            return false;
+        }
+        // 认证通过后才更新窗口及加入新会话，伪造的报文不能推动窗口或占用会话表
+        if (rx == _candidate.get()) {
+            if (!addSession(session)) {
+                ++failures;
+                return false;
+            }
+            // 对端新启动，本端的会话可能早于其启动而被拒绝，轮换为更新的会话
+            auto tx = std::atomic_load(&_tx);
+            if ((session & kFreshBit) && tx && (session >> 16) > (tx->session >> 16)) {
+                auto at = _rotated + kRotateMinMs;
+                if (at < _rotateAt) {
+                    _rotateAt = at;
+                }
+            }
+        }
+        rx->window.update(seq);
+        rx->used = toolkit::getCurrentMillisecond();
+        plain = data + kHeaderSize;
+        plainSize = len + fin;
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    /**
+     * @brief 测试单核加解密吞吐，结果输出到日志
+     * @param size 数据报长度
+     */
+    static void benchmark(size_t size) {
+#if defined(HAS_TUNNEL_CRYPTO)
+        for (auto name : {"aes-256-gcm", "chacha20-poly1305"}) {
+            Crypto crypto;
+            sockaddr_storage from{};
+            if (!crypto.start("benchmark", name)) {
+                continue;
+            }
+            std::vector<PacketPtr> batch;
+            uint64_t bytes = 0;
+            auto start = std::chrono::steady_clock::now();
+            std::chrono::duration<double> elapsed{};
+            while (elapsed.count() < 1.0) {
+                batch.clear();
+                for (int i = 0; i < 32; ++i) {
+                    auto pkt = Packet::create(size, false);
+                    pkt->setSize(size);
+                    batch.emplace_back(std::move(pkt));
+                }
+                crypto.sealBatch(batch);
+                for (auto &pkt : batch) {
+                    char *plain;
+                    size_t plainSize;
+                    if (pkt && crypto.open(pkt->data(), pkt->size(), plain, plainSize, from)) {
+                        bytes += plainSize;
+                    }
+                }
+                elapsed = std::chrono::steady_clock::now() - start;
+            }
+            InfoL << "Crypto benchmark " << name << " " << size << "B: seal+open "
+                  << std::fixed << std::setprecision(2) << bytes * 8 / elapsed.count() / 1e9 << " Gbps, "
+                  << (uint64_t)(bytes / size / elapsed.count()) << " pps per core";
+        }
+#else
+        WarnL << "Tunnel encryption requires OpenSSL, not available in this build";
+#endif
+    }
+
+private:
+    /**
+     * @brief 发送会话及其密钥
+     */
+    struct TxKey {
+        uint64_t session = 0;
+        uint8_t key[32] = {0};
+    };
+
+    Crypto() = default;
+
+    static void put64(char *p, uint64_t v) {
+        for (int i = 7; i >= 0; --i, v >>= 8) {
+            p[i] = (char)v;
+        }
+    }
+
+    static uint64_t get64(const char *p) {
+        uint64_t v = 0;
+        for (int i = 0; i < 8; ++i) {
+            v = v << 8 | (uint8_t)p[i];
+        }
+        return v;
+    }
+
+#if defined(HAS_TUNNEL_CRYPTO)
+    /**
+     * @brief 复用的加解密上下文，密钥只设置一次
+     */
+    struct Context {
+        EVP_CIPHER_CTX *ctx = nullptr;
+        const EVP_CIPHER *cipher = nullptr;
+        uint8_t key[32] = {0};
+
+        Context() = default;
+        Context(const Context &) = delete;
+        ~Context() {
+            if (ctx) {
+                EVP_CIPHER_CTX_free(ctx);
+            }
+        }
+
+        bool init(const EVP_CIPHER *c, const uint8_t *k, bool encrypt) {
+            if (ctx && cipher == c && memcmp(key, k, sizeof(key)) == 0) {
+                return true;
+            }
+            if (!ctx) {
+                ctx = EVP_CIPHER_CTX_new();
+            }
+            cipher = nullptr;
+            if (!ctx || EVP_CipherInit_ex(ctx, c, nullptr, k, nullptr, encrypt) != 1) {
+                return false;
+            }
+            cipher = c;
+            memcpy(key, k, sizeof(key));
+            return true;
+        }
+
+        /**
+         * @brief 开始处理一个报文，nonce为4个0字节加8字节序号
+         */
+        bool begin(const char *seq, bool encrypt) {
+            uint8_t iv[12] = {0};
+            memcpy(iv + 4, seq, kSeqSize);
+            return EVP_CipherInit_ex(ctx, nullptr, nullptr, nullptr, iv, encrypt) == 1;
+        }
+    };
+
+    /**
+     * @brief 滑动重放窗口
+     */
+    struct ReplayWindow {
+        uint64_t top = 0;                          ///< 已接受的最大序号+1
+        uint64_t bits[kReplayWindow / 64] = {0};   ///< 窗口内已接受的序号
+
+        bool check(uint64_t seq) const {
+            if (seq >= top) {
+                return true;
+            }
+            if (top - seq > kReplayWindow) {
+                return false;
+            }
+            return !(bits[(seq / 64) % (kReplayWindow / 64)] & (1ULL << (seq % 64)));
+        }
+
+        void update(uint64_t seq) {
+            if (seq >= top) {
+                // 窗口前移，清除新进入窗口的位
+                if (seq - top >= kReplayWindow) {
+                    memset(bits, 0, sizeof(bits));
+                } else {
+                    for (auto s = top; s <= seq; ++s) {
+                        bits[(s / 64) % (kReplayWindow / 64)] &= ~(1ULL << (s % 64));
+                    }
+                }
+                top = seq + 1;
+            }
+            bits[(seq / 64) % (kReplayWindow / 64)] |= 1ULL << (seq % 64);
+        }
+    };
+
+    /**
+     * @brief 接收方的会话状态
+     */
+    struct RxSession {
+        uint64_t id = 0;
+        const EVP_CIPHER *cipher = nullptr;
+        uint8_t key[32];
+        Context ctx;
+        ReplayWindow window;
+        uint64_t used = 0;
+    };
+
+    static const EVP_CIPHER *resolveCipher(const std::string &name) {
+        if (name == "aes-256-gcm") {
+            return EVP_aes_256_gcm();
+        }
+        if (name == "chacha20-poly1305") {
+            return EVP_chacha20_poly1305();
+        }
+        if (name != "auto" && !name.empty()) {
+            return nullptr;
+        }
+        return hasAesInstructions() ? EVP_aes_256_gcm() : EVP_chacha20_poly1305();
+    }
+
+    static CipherId cipherId(const EVP_CIPHER *cipher) {
+        return EVP_CIPHER_nid(cipher) == EVP_CIPHER_nid(EVP_aes_256_gcm()) ? Aes256Gcm : Chacha20Poly1305;
+    }
+
+    static const EVP_CIPHER *cipherById(uint8_t id) {
+        switch (id) {
+            case Aes256Gcm: return EVP_aes_256_gcm();
+            case Chacha20Poly1305: return EVP_chacha20_poly1305();
+            default: return nullptr;
+        }
+    }
+
+    static bool hasAesInstructions() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul");
+#elif defined(__aarch64__) && defined(__linux__)
+        return getauxval(AT_HWCAP) & HWCAP_AES;
+#else
+        return false;
+#endif
+    }
+
+    static uint64_t wallClock() {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    /**
+     * @brief 生成新的发送会话，启动时或持有_txMtx时调用
+     * @param fresh 是否为进程启动时的会话
+     */
+    bool rotate(bool fresh) {
+        auto now = toolkit::getCurrentMillisecond();
+        auto tx = std::make_shared<TxKey>();
+        tx->session = wallClock() << 16 | (std::random_device()() & 0xfffe) | (fresh ? kFreshBit : 0);
+        if (!deriveKey(tx->session, tx->key)) {
+            _rotateAt = now + kRotateMinMs;
+            return false;
+        }
+        std::atomic_store(&_tx, std::shared_ptr<const TxKey>(std::move(tx)));
+        _rotated = now;
+        _rotateAt = now + kRotateMs;
+        return true;
+    }
+
+    bool deriveKey(uint64_t session, uint8_t *key) {
+        char info[16] = "TVS-AEAD";
+        put64(info + 8, session);
+        auto pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
+        size_t len = 32;
+        bool ok = pctx && EVP_PKEY_derive_init(pctx) > 0
+            && EVP_PKEY_CTX_set_hkdf_md(pctx, EVP_sha256()) > 0
+            && EVP_PKEY_CTX_set1_hkdf_key(pctx, reinterpret_cast<const uint8_t *>(_psk.data()), _psk.size()) > 0
+            && EVP_PKEY_CTX_add1_hkdf_info(pctx, reinterpret_cast<const uint8_t *>(info), sizeof(info)) > 0
+            && EVP_PKEY_derive(pctx, key, &len) > 0;
+        EVP_PKEY_CTX_free(pctx);
+        return ok;
+    }
+
+    /**
+     * @brief 查找会话
+     * @details 新会话派生密钥到候选会话，首个报文认证通过后由addSession加入；
+     * 已有会话的算法与报文不符、新会话的创建时间不可信或同一来源派生过于频繁时返回空
+     */
+    RxSession *findSession(uint64_t session, const EVP_CIPHER *cipher, const sockaddr_storage &from) {
+        static auto &stale = Statistics::Instance().counter("crypto.stale_sessions");
+        static auto &limited = Statistics::Instance().counter("crypto.derive_limited");
+        auto it = _rx.find(session);
+        if (it != _rx.end()) {
+            return it->second->cipher == cipher ? it->second.get() : nullptr;
+        }
+        if (_candidate && _candidate->id == session && _candidate->cipher == cipher) {
+            return _candidate.get();
+        }
+        auto now = toolkit::getCurrentMillisecond();
+        if (_derived.size() >= kMaxSessions) {
+            for (auto i = _derived.begin(); i != _derived.end();) {
+                i = now - i->second >= kDeriveMs ? _derived.erase(i) : std::next(i);
+            }
+        }
+        auto last = _derived.find(PeerKey(from));
+        if ((last != _derived.end() && now - last->second < kDeriveMs) || _derived.size() >= kMaxSessions) {
+            ++limited;
+            return nullptr;
+        }
+        _derived[PeerKey(from)] = now;
+        // 不在会话表中的旧会话可能是重放，接收方没有其窗口
+        auto created = session >> 16;
+        if (created <= _floor || created + kClockSkewMs < _started) {
+            ++stale;
+            if (_on_stale) {
+                _on_stale(from);
+            }
+            return nullptr;
+        }
+        auto rx = std::make_unique<RxSession>();
+        if (!deriveKey(session, rx->key) || !rx->ctx.init(cipher, rx->key, false)) {
+            return nullptr;
+        }
+        rx->id = session;
+        rx->cipher = cipher;
+        _candidate = std::move(rx);
+        return _candidate.get();
+    }
+
+    /**
+     * @brief 认证通过的候选会话加入会话表
+     * @details 会话表满时只淘汰空闲会话，仍满时拒绝新会话；
+     * 淘汰的会话把创建时间记入下限，此后不晚于下限的会话不再接受
+     */
+    bool addSession(uint64_t session) {
+        static auto &rejects = Statistics::Instance().counter("crypto.session_rejects");
+        if (_rx.size() >= kMaxSessions) {
+            auto now = toolkit::getCurrentMillisecond();
+            for (auto i = _rx.begin(); i != _rx.end();) {
+                if (now - i->second->used > kSessionIdleMs) {
+                    _floor = std::max(_floor, i->first >> 16);
+                    i = _rx.erase(i);
+                } else {
+                    ++i;
+                }
+            }
+            if (_rx.size() >= kMaxSessions) {
+                ++rejects;
+                return false;
+            }
+        }
+        _rx.emplace(session, std::move(_candidate));
+        return true;
+    }
+
+    const EVP_CIPHER *_cipher = nullptr;
+    CipherId _cipherId = Aes256Gcm;
+    std::unordered_map<uint64_t, std::unique_ptr<RxSession>> _rx;
+    std::unique_ptr<RxSession> _candidate;     ///< 首个报文尚未认证的新会话
+    std::unordered_map<PeerKey, uint64_t, PeerKey::Hash> _derived;  ///< 各来源上次派生新会话密钥的时间
+    uint64_t _floor = 0;                       ///< 已淘汰会话的最新创建时间
+    std::function<void(const sockaddr_storage &from)> _on_stale;
+#endif
+
+    bool _enabled = false;
+    std::string _psk;
+    uint64_t _started = 0;                     ///< 本进程启动的时间(毫秒，系统时钟)
+    std::mutex _txMtx;
+    std::shared_ptr<const TxKey> _tx;          ///< 当前的发送会话，原子地替换
+    std::atomic<uint64_t> _rotated{0};         ///< 上次轮换的时间
+    std::atomic<uint64_t> _rotateAt{0};        ///< 下次轮换的时间
+    std::atomic<uint64_t> _seq{0};
+};
+
+#endif //TALUSVSWITCH_CRYPTO_H
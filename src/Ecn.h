@@ -0,0 +1,117 @@
+﻿/**
+ * @file Ecn.h
+ * @brief 内外层DSCP与ECN的传递
+ * @details 封装时把内层IP报文的DSCP复制到外层UDP数据报，使底层网络的QoS能区分隧道内的流量；
+ * ECN按RFC 6040常规模式处理：封装时外层复制内层的ECN，解封装时把外层的拥塞标记(CE)合并到内层，
+ * 使隧道两端的TCP能收到底层路由器的拥塞反馈
+ */
+
+#ifndef TALUSVSWITCH_ECN_H
+#define TALUSVSWITCH_ECN_H
+
+#include <cstddef>
+#include <cstdint>
+#ifndef _WIN32
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
+#include "Statistics.h"
+#include "TrafficClass.h"
+
+/**
+ * @class Ecn
+ * @brief DSCP与ECN的封装和解封装
+ */
+class Ecn {
+public:
+    static constexpr uint8_t kNotEct = 0;
+    static constexpr uint8_t kEct1 = 1;
+    static constexpr uint8_t kEct0 = 2;
+    static constexpr uint8_t kCe = 3;
+
+    /**
+     * @brief 封装时外层的TOS
+     * @param frame 内层以太网帧
+     * @param dscp 是否复制DSCP
+     * @param ecn 是否复制ECN
+     * @return 外层TOS，非IP报文为0
+     */
+    static int outerTos(const char *frame, size_t size, bool dscp, bool ecn) {
+        auto tos = TrafficClass::tos(frame, size);
+        if (tos < 0) {
+            return 0;
+        }
+        return (dscp ? tos & 0xfc : 0) | (ecn ? tos & 0x03 : 0);
+    }
+
+    /**
+     * @brief 解封装时按外层ECN更新内层，RFC 6040 4.2节
+     * @param frame 内层以太网帧
+     * @param outer 外层TOS
+     * @return 外层为CE而内层不支持ECN时返回false，报文应丢弃
+     */
+    static bool decap(char *frame, size_t size, uint8_t outer) {
+        static auto &marked = Statistics::Instance().counter("ecn.ce_marked");
+        static auto &drops = Statistics::Instance().counter("ecn.drops");
+        outer &= 0x03;
+        if (outer == kNotEct || outer == kEct0) {
+            return true;
+        }
+        uint16_t ethertype = 0;
+        auto l3 = TrafficClass::ipOffset(frame, size, ethertype);
+        if (!l3) {
+            return true;
+        }
+        auto ip = reinterpret_cast<uint8_t *>(frame + l3);
+        uint8_t inner = ethertype == 0x0800 ? ip[1] & 0x03 : (ip[1] >> 4) & 0x03;
+        uint8_t next = inner;
+        if (outer == kCe) {
+            if (inner == kNotEct) {
+                ++drops;
+                return false;
+            }
+            next = kCe;
+        } else if (inner == kEct0) {
+            next = kEct1;
+        }
+        if (next == inner) {
+            return true;
+        }
+        if (next == kCe) {
+            ++marked;
+        }
+        if (ethertype == 0x0800) {
+            uint16_t old = ip[0] << 8 | ip[1];
+            ip[1] = (ip[1] & 0xfc) | next;
+            uint16_t now = ip[0] << 8 | ip[1];
+            uint16_t sum = update(ip[10] << 8 | ip[11], old, now);
+            ip[10] = sum >> 8;
+            ip[11] = sum & 0xff;
+        } else {
+            // ECN位于Traffic Class的低两位，即第2字节的bit4-5，IPv6头无校验和
+            ip[1] = (ip[1] & 0xcf) | next << 4;
+        }
+        return true;
+    }
+
+    /**
+     * @brief 设置socket发出数据报的TOS，用于无法逐个数据报设置的发送路径
+     */
+    static void setSocketTos(int fd, int tos) {
+        setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+        setsockopt(fd, IPPROTO_IPV6, IPV6_TCLASS, &tos, sizeof(tos));
+    }
+
+private:
+    /**
+     * @brief 增量更新校验和 HC' = ~(~HC + ~m + m')
+     */
+    static uint16_t update(uint16_t sum, uint16_t old, uint16_t now) {
+        uint32_t s = (uint16_t)~sum + (uint16_t)~old + now;
+        s = (s & 0xffff) + (s >> 16);
+        s = (s & 0xffff) + (s >> 16);
+        return (uint16_t)~s;
+    }
+};
+
+#endif //TALUSVSWITCH_ECN_H
@@ -0,0 +1,296 @@
+﻿/**
+ * @file Failover.h
+ * @brief 直连节点失效的快速判定与回退
+ * @details 直连节点下线或路径中断后，MAC表要等20秒无流量才失效，期间发往该节点的流量全部丢失。
+ * 两种信号提前判定直连地址失效：
+ * - ICMP不可达：发往已下线节点的数据报约一个往返后即收到端口/主机/网络不可达。数据socket由toolkit管理，
+ *   开启IP_RECVERR后错误队列非空会触发EPOLLERR，toolkit随即关闭socket，因此改用原始ICMP/ICMPv6 socket，
+ *   从差错报文携带的原始IP与UDP头中取出本端口发出的数据报的目的地址，没有CAP_NET_RAW权限时只用保活判定
+ * - 保活丢失：开启路径测量且节点应答过探测时，连续多个探测未应答即失效；否则以超过三个保活周期没有流量为准
+ * 失效地址上的节点按MAC改走核心节点(ttl比直连小1，直连流量恢复后按ttl自动切回)，打洞随后按退避重新发起。
+ * 回退耗时按失效地址最后一次收到流量到完成回退计算，按判定原因统计
+ */
+
+#ifndef TALUSVSWITCH_FAILOVER_H
+#define TALUSVSWITCH_FAILOVER_H
+
+#include <cstring>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+#include <Network/sockutil.h>
+#include <Poller/EventPoller.h>
+#include <Util/logger.h>
+#include <Util/util.h>
+#if defined(__linux__)
+#include <netinet/icmp6.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/ip6.h>
+#include <netinet/udp.h>
+#endif
+#include "Config.h"
+#include "CoreSet.h"
+#include "LinkProbe.h"
+#include "MacMap.h"
+#include "Statistics.h"
+#include "Utils.h"
+
+/**
+ * @class Failover
+ * @brief 快速故障切换单例
+ * @details ICMP的接收与保活丢失的检查都在传输层poller中执行
+ */
+class Failover {
+public:
+    /**
+     * @brief 判定原因
+     */
+    enum Reason {
+        Icmp = 0,       ///< ICMP不可达
+        Keepalive,      ///< 保活或探测丢失
+        kReasons
+    };
+
+    static constexpr uint64_t kTickMs = 500;                ///< 保活丢失的检查间隔
+    static constexpr int kMissProbes = 3;                   ///< 连续未应答多少个探测视为失效
+    static constexpr uint64_t kKeepaliveMs = 5000;          ///< 保活间隔，与LinkKeeper一致
+    static constexpr int kMissKeepalives = 3;               ///< 没有探测时，超过多少个保活周期无流量视为失效
+
+    /**
+     * @brief 获取Failover单例
+     */
+    static Failover &Instance() {
+        static Failover failover;
+        return failover;
+    }
+
+    /**
+     * @brief 启动
+     * @param poller 传输层poller
+     * @param port 数据socket的本地端口，只关注从该端口发出的数据报引起的ICMP差错
+     */
+    void start(const toolkit::EventPoller::Ptr &poller, uint16_t port) {
+        _poller = poller;
+        _port = port;
+#if defined(__linux__)
+        _fd4 = openIcmp(AF_INET);
+        _fd6 = openIcmp(AF_INET6);
+#endif
+        _poller->doDelayTask(kTickMs, [this]() {
+            checkKeepalive();
+            return kTickMs;
+        });
+        Statistics::Instance().addGauge("failover", [this]() { return report(); });
+        InfoL << "Fast failover enabled, icmp " << (_fd4 >= 0 || _fd6 >= 0 ? "on" : "off");
+    }
+
+    /**
+     * @brief 直连地址失效，使用该地址的节点回退到核心节点
+     * @details 回退耗时取MAC表中该地址已沉寂的时间
+     */
+    void pathDown(const sockaddr_storage &addr, Reason reason) {
+        static auto &icmp = Statistics::Instance().counter("failover.icmp");
+        static auto &keepalive = Statistics::Instance().counter("failover.keepalive");
+        if (!toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&addr)) || CoreSet::Instance().isCore(addr)) {
+            // 核心节点本身没有可回退的路径
+            return;
+        }
+        auto peers = MacMap::failover(addr, [](uint64_t mac) { return CoreSet::Instance().pick(mac); }, Config::sendTtl - 1);
+        if (peers.empty()) {
+            return;
+        }
+        uint64_t ms = 0;
+        for (auto &item : peers) {
+            ms = std::max(ms, item.second);
+        }
+        ++(reason == Icmp ? icmp : keepalive);
+        {
+            std::lock_guard<std::mutex> lck(_mtx);
+            auto &stat = _stats[reason];
+            stat.last = ms;
+            stat.total += ms;
+            ++stat.count;
+        }
+        WarnL << "Path " << toolkit::SockUtil::inet_ntoa(reinterpret_cast<const sockaddr *>(&addr)) << ":"
+              << toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&addr)) << " down("
+              << (reason == Icmp ? "icmp" : "keepalive") << "), " << peers.size() << " peers fall back to core after "
+              << ms << "ms";
+    }
+
+private:
+    struct Stat {
+        uint64_t count = 0;
+        uint64_t total = 0;     ///< 回退耗时之和(毫秒)
+        uint64_t last = 0;      ///< 最近一次回退耗时(毫秒)
+    };
+
+    Failover() = default;
+
+#if defined(__linux__)
+    int openIcmp(int family) {
+        int fd = socket(family, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, family == AF_INET ? (int)IPPROTO_ICMP : (int)IPPROTO_ICMPV6);
+        if (fd < 0) {
+            WarnL << "open raw icmp" << (family == AF_INET ? "" : "v6") << " socket failed: " << strerror(errno);
+            return -1;
+        }
+        if (family == AF_INET6) {
+            icmp6_filter filter;
+            ICMP6_FILTER_SETBLOCKALL(&filter);
+            ICMP6_FILTER_SETPASS(ICMP6_DST_UNREACH, &filter);
+            setsockopt(fd, IPPROTO_ICMPV6, ICMP6_FILTER, &filter, sizeof(filter));
+        }
+        if (_poller->addEvent(fd, toolkit::EventPoller::Event_Read, [this, fd, family](int) { onIcmp(fd, family); }) < 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    void onIcmp(int fd, int family) {
+        char buf[1500];
+        while (true) {
+            auto n = recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0) {
+                return;
+            }
+            sockaddr_storage dst{};
+            if (family == AF_INET ? parseIcmp(buf, n, dst) : parseIcmp6(buf, n, dst)) {
+                pathDown(dst, Icmp);
+            }
+        }
+    }
+
+    /**
+     * @brief 从ICMP不可达中取出本端口发出的UDP数据报的目的地址
+     * @details 原始ICMP socket收到的报文含外层IP头
+     */
+    bool parseIcmp(const char *buf, size_t size, sockaddr_storage &dst) {
+        if (size < sizeof(ip)) {
+            return false;
+        }
+        auto outer = reinterpret_cast<const ip *>(buf);
+        size_t off = outer->ip_hl * 4;
+        if (size < off + ICMP_MINLEN + sizeof(ip)) {
+            return false;
+        }
+        auto icmp = reinterpret_cast<const struct icmp *>(buf + off);
+        if (icmp->icmp_type != ICMP_UNREACH) {
+            return false;
+        }
+        switch (icmp->icmp_code) {
+            case ICMP_UNREACH_NET:
+            case ICMP_UNREACH_HOST:
+            case ICMP_UNREACH_PORT:
+            case ICMP_UNREACH_NET_PROHIB:
+            case ICMP_UNREACH_HOST_PROHIB:
+            case ICMP_UNREACH_FILTER_PROHIB:
+                break;
+            default:
+                // 需要分片等由路径MTU探测处理
+                return false;
+        }
+        off += ICMP_MINLEN;
+        auto inner = reinterpret_cast<const ip *>(buf + off);
+        off += inner->ip_hl * 4;
+        if (inner->ip_p != IPPROTO_UDP || size < off + 4) {
+            return false;
+        }
+        auto udp = reinterpret_cast<const udphdr *>(buf + off);
+        if (ntohs(udp->uh_sport) != _port) {
+            return false;
+        }
+        auto &in = reinterpret_cast<sockaddr_in &>(dst);
+        in.sin_family = AF_INET;
+        in.sin_addr = inner->ip_dst;
+        in.sin_port = udp->uh_dport;
+        return true;
+    }
+
+    /**
+     * @brief 从ICMPv6不可达中取出本端口发出的UDP数据报的目的地址
+     * @details 原始ICMPv6 socket收到的报文不含外层IPv6头，原始报文带扩展头时忽略
+     */
+    bool parseIcmp6(const char *buf, size_t size, sockaddr_storage &dst) {
+        if (size < sizeof(icmp6_hdr) + sizeof(ip6_hdr) + 4) {
+            return false;
+        }
+        auto icmp = reinterpret_cast<const icmp6_hdr *>(buf);
+        if (icmp->icmp6_type != ICMP6_DST_UNREACH || icmp->icmp6_code == ICMP6_DST_UNREACH_BEYONDSCOPE) {
+            return false;
+        }
+        auto inner = reinterpret_cast<const ip6_hdr *>(buf + sizeof(icmp6_hdr));
+        if (inner->ip6_nxt != IPPROTO_UDP) {
+            return false;
+        }
+        auto udp = reinterpret_cast<const udphdr *>(buf + sizeof(icmp6_hdr) + sizeof(ip6_hdr));
+        if (ntohs(udp->uh_sport) != _port) {
+            return false;
+        }
+        auto &in6 = reinterpret_cast<sockaddr_in6 &>(dst);
+        in6.sin6_family = AF_INET6;
+        in6.sin6_addr = inner->ip6_dst;
+        in6.sin6_port = udp->uh_dport;
+        return true;
+    }
+#endif
+
+    /**
+     * @brief 检查各直连节点的保活与探测
+     * @details 从未应答过探测的节点(未开启探测或对端不支持)按保活判定；
+     * 按探测判定时还要求同样长的时间内没有流量，避免路径恢复后旧的未应答记录立即再次触发；
+     * 失效针对地址，同一地址上有多个MAC(如桥接在边缘节点后的主机)时按其中最近的流量判定
+     */
+    void checkKeepalive() {
+        std::unordered_map<PeerKey, std::pair<sockaddr_storage, uint64_t>, PeerKey::Hash> idle;
+        for (auto &peer : MacMap::ages()) {
+            if (peer.mac == MAC_BROADCAST || !toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&peer.sock))
+                || CoreSet::Instance().isCore(peer.sock)) {
+                continue;
+            }
+            auto it = idle.find(PeerKey(peer.sock));
+            if (it == idle.end()) {
+                idle.emplace(PeerKey(peer.sock), std::make_pair(peer.sock, peer.idle));
+            } else {
+                it->second.second = std::min(it->second.second, peer.idle);
+            }
+        }
+        for (auto &item : idle) {
+            auto &addr = item.second.first;
+            auto age = item.second.second;
+            bool dead;
+            auto missed = Config::probeInterval > 0 ? LinkProbe::Instance().missed(addr) : -1;
+            if (missed >= 0) {
+                dead = missed >= kMissProbes && age >= kMissProbes * (uint64_t)Config::probeInterval;
+            } else {
+                dead = age > kMissKeepalives * kKeepaliveMs;
+            }
+            if (dead) {
+                pathDown(addr, Keepalive);
+            }
+        }
+    }
+
+    std::string report() {
+        static const char *names[kReasons] = {"icmp", "keepalive"};
+        std::lock_guard<std::mutex> lck(_mtx);
+        std::ostringstream oss;
+        for (int i = 0; i < kReasons; ++i) {
+            auto &stat = _stats[i];
+            if (stat.count) {
+                oss << (oss.tellp() ? "," : "") << names[i] << "=" << stat.count << "/last:" << stat.last
+                    << "ms/avg:" << stat.total / stat.count << "ms";
+            }
+        }
+        return oss.str();
+    }
+
+    toolkit::EventPoller::Ptr _poller;
+    uint16_t _port = 0;
+    int _fd4 = -1;
+    int _fd6 = -1;
+    std::mutex _mtx;
+    Stat _stats[kReasons];
+};
+
+#endif //TALUSVSWITCH_FAILOVER_H
@@ -0,0 +1,730 @@
+﻿/**
+ * @file Fec.h
+ * @brief 前向纠错
+ * @details 为丢包严重的链路(4G、卫星)按节点提供分组级前向纠错：
+ * - 发送方把发往同一节点的每N个数据报划为一组，组满或超时后发送M个校验报文
+ * - 校验可选XOR(M最多为1)或GF(256)上的Reed-Solomon(柯西矩阵，任意M个丢失都可恢复)
+ * - 校验在发送数据报时逐个累加，发送方不缓存数据报
+ * - 接收方数据报到达即交付，不增加时延，同时保存副本，丢失的数据报在校验到达后恢复
+ * - 接收方定期向发送方报告丢包率，发送方据此调整M，无丢包时不发送校验
+ * 报文格式(均为扩展报文)：
+ * - 数据：公共头 + 组号(2字节) + 组内序号(1字节) + 原数据报
+ * - 校验：公共头 + 组号(2字节) + 校验序号(1字节) + 组内数据报个数(1字节) + 校验方式(1字节) + 校验数据
+ * - 报告：公共头 + 丢包率(千分比，2字节)
+ * 参与编码的数据单元为“长度(2字节) + 原数据报”，不足最长单元的部分补0
+ */
+
+#ifndef TALUSVSWITCH_FEC_H
+#define TALUSVSWITCH_FEC_H
+
+#include <cmath>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <Poller/EventPoller.h>
+#include <Util/logger.h>
+#include <Util/util.h>
+#include "Packet.h"
+#include "Statistics.h"
+#include "TunnelProto.h"
+#include "Utils.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/**
+ * @class Gf256
+ * @brief GF(2^8)运算，生成多项式0x11d
+ * @details 乘加运算在支持AVX2的CPU上使用半字节查表(pshufb)，否则使用乘法表
+ */
+class Gf256 {
+public:
+    static const Gf256 &Instance() {
+        static Gf256 gf;
+        return gf;
+    }
+
+    uint8_t mul(uint8_t a, uint8_t b) const { return _mul[a][b]; }
+
+    uint8_t inv(uint8_t a) const { return _exp[255 - _log[a]]; }
+
+    /**
+     * @brief dst ^= c * src
+     */
+    void mulAdd(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) const {
+        if (!c) {
+            return;
+        }
+        size_t i = 0;
+        if (c == 1) {
+            for (; i + 8 <= len; i += 8) {
+                uint64_t d, s;
+                memcpy(&d, dst + i, 8);
+                memcpy(&s, src + i, 8);
+                d ^= s;
+                memcpy(dst + i, &d, 8);
+            }
+            for (; i < len; ++i) {
+                dst[i] ^= src[i];
+            }
+            return;
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        if (_avx2) {
+            i = mulAddAvx2(dst, src, c, len);
+        }
+#endif
+        auto row = _mul[c];
+        for (; i < len; ++i) {
+            dst[i] ^= row[src[i]];
+        }
+    }
+
+    /**
+     * @brief 求逆矩阵(高斯-约旦消元)
+     * @param m n*n矩阵，按行存放，求解后被破坏
+     * @param out 逆矩阵
+     * @return 矩阵不可逆时返回false
+     */
+    bool invert(uint8_t *m, uint8_t *out, size_t n) const {
+        memset(out, 0, n * n);
+        for (size_t i = 0; i < n; ++i) {
+            out[i * n + i] = 1;
+        }
+        for (size_t col = 0; col < n; ++col) {
+            size_t pivot = col;
+            while (pivot < n && !m[pivot * n + col]) {
+                ++pivot;
+            }
+            if (pivot == n) {
+                return false;
+            }
+            if (pivot != col) {
+                for (size_t k = 0; k < n; ++k) {
+                    std::swap(m[pivot * n + k], m[col * n + k]);
+                    std::swap(out[pivot * n + k], out[col * n + k]);
+                }
+            }
+            auto scale = inv(m[col * n + col]);
+            for (size_t k = 0; k < n; ++k) {
+                m[col * n + k] = mul(m[col * n + k], scale);
+                out[col * n + k] = mul(out[col * n + k], scale);
+            }
+            for (size_t row = 0; row < n; ++row) {
+                auto factor = m[row * n + col];
+                if (row == col || !factor) {
+                    continue;
+                }
+                for (size_t k = 0; k < n; ++k) {
+                    m[row * n + k] ^= mul(factor, m[col * n + k]);
+                    out[row * n + k] ^= mul(factor, out[col * n + k]);
+                }
+            }
+        }
+        return true;
+    }
+
+private:
+    Gf256() {
+        unsigned x = 1;
+        for (int i = 0; i < 255; ++i) {
+            _exp[i] = _exp[i + 255] = (uint8_t)x;
+            _log[x] = (uint8_t)i;
+            x <<= 1;
+            if (x & 0x100) {
+                x ^= 0x11d;
+            }
+        }
+        for (int a = 0; a < 256; ++a) {
+            for (int b = 0; b < 256; ++b) {
+                _mul[a][b] = (a && b) ? _exp[_log[a] + _log[b]] : 0;
+            }
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        _avx2 = __builtin_cpu_supports("avx2");
+#endif
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    /**
+     * @return 已处理的字节数，剩余部分由调用方处理
+     */
+    __attribute__((target("avx2"))) size_t mulAddAvx2(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) const {
+        uint8_t lo[16], hi[16];
+        for (int i = 0; i < 16; ++i) {
+            lo[i] = _mul[c][i];
+            hi[i] = _mul[c][i << 4];
+        }
+        auto tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(lo)));
+        auto thi = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(hi)));
+        auto mask = _mm256_set1_epi8(0x0f);
+        size_t i = 0;
+        for (; i + 32 <= len; i += 32) {
+            auto s = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+            auto l = _mm256_shuffle_epi8(tlo, _mm256_and_si256(s, mask));
+            auto h = _mm256_shuffle_epi8(thi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask));
+            auto d = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dst + i));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_xor_si256(d, _mm256_xor_si256(l, h)));
+        }
+        return i;
+    }
+
+    bool _avx2 = false;
+#endif
+
+    uint8_t _exp[510];
+    uint8_t _log[256] = {0};
+    uint8_t _mul[256][256];
+};
+
+/**
+ * @class Fec
+ * @brief 前向纠错单例
+ * @details 编码只在编码poller中执行，解码只在传输层poller中执行，两侧状态各自独立不加锁
+ */
+class Fec {
+public:
+    /**
+     * @brief 校验方式
+     */
+    enum Mode : uint8_t {
+        Off = 0,
+        Xor = 1,           ///< 单个XOR校验
+        ReedSolomon = 2,   ///< 多个Reed-Solomon校验
+    };
+
+    static constexpr size_t kDataHeader = TunnelProto::kHeaderSize + 3;     ///< 数据报文头长度
+    static constexpr size_t kParityHeader = TunnelProto::kHeaderSize + 5;   ///< 校验报文头长度
+    static constexpr size_t kOverhead = kParityHeader + 2;                  ///< 相对原数据报的最大膨胀
+    static constexpr size_t kMaxBlock = 64;          ///< 每组最多数据报个数
+    static constexpr int kMaxParity = 8;             ///< 每组最多校验报文个数
+    static constexpr size_t kRxBlocks = 8;           ///< 接收方每个节点保留的组数
+    static constexpr uint64_t kTickMs = 10;          ///< 组超时检查间隔
+    static constexpr uint64_t kBlockTimeoutMs = 20;  ///< 组未满时最多等待的时间
+    static constexpr uint64_t kReportMs = 1000;      ///< 丢包率报告间隔
+    static constexpr uint64_t kIdleMs = 60 * 1000;   ///< 节点空闲超时
+
+    using Output = std::function<void(PacketPtr pkt, const sockaddr_storage &addr)>;
+    using Deliver = std::function<void(char *data, size_t size)>;
+
+    /**
+     * @brief 获取Fec单例
+     */
+    static Fec &Instance() {
+        static Fec fec;
+        return fec;
+    }
+
+    /**
+     * @brief 解析校验方式配置
+     */
+    static Mode parseMode(const std::string &mode) {
+        if (mode == "xor") {
+            return Xor;
+        }
+        if (mode == "rs") {
+            return ReedSolomon;
+        }
+        return Off;
+    }
+
+    /**
+     * @brief 启动
+     * @param mode 本端发送时的校验方式，Off时只解码不编码
+     * @param block 每组数据报个数
+     * @param encoder 编码poller
+     * @param decoder 传输层poller
+     * @param out 校验报文和丢包率报告的发送函数，直接进入发送队列
+     */
+    void start(Mode mode, size_t block, const toolkit::EventPoller::Ptr &encoder,
+               const toolkit::EventPoller::Ptr &decoder, Output out) {
+        _mode = mode;
+        _block = std::max<size_t>(2, std::min(block, kMaxBlock));
+        _encoder = encoder;
+        _out = std::move(out);
+        decoder->doDelayTask(kReportMs, [this]() {
+            report();
+            return kReportMs;
+        });
+        if (_mode == Off) {
+            return;
+        }
+        encoder->doDelayTask(kTickMs, [this]() {
+            tick();
+            return kTickMs;
+        });
+        InfoL << "FEC " << (_mode == Xor ? "xor" : "rs") << ", block " << _block;
+    }
+
+    bool enabled() const { return _mode != Off; }
+
+    /**
+     * @brief 是否为前向纠错报文
+     */
+    static bool isFec(const char *data, size_t size) {
+        if (!TunnelProto::isExtended(data, size)) {
+            return false;
+        }
+        auto type = TunnelProto::type(data);
+        return type == TunnelProto::FecData || type == TunnelProto::FecParity || type == TunnelProto::FecReport;
+    }
+
+    /**
+     * @brief 编码一个待发送的数据报，在编码poller中执行
+     * @param pkt 数据报
+     * @param addr 目标地址
+     * @param send 发送加上前向纠错头的数据报；组满时随后通过out发送校验报文，保证校验在组内数据之后
+     */
+    template <typename Send>
+    void encode(const PacketPtr &pkt, const sockaddr_storage &addr, Send &&send) {
+        auto &tx = _tx[PeerKey(addr)];
+        auto now = toolkit::getCurrentMillisecond();
+        if (!tx.used) {
+            tx.addr = addr;
+        }
+        tx.used = now;
+        if (!tx.count) {
+            tx.started = now;
+        }
+
+        auto wrapped = Packet::create(kDataHeader + pkt->size(), false);
+        auto p = wrapped->data();
+        TunnelProto::writeHeader(p, TunnelProto::FecData);
+        TunnelProto::put16(p + TunnelProto::kHeaderSize, tx.block);
+        p[TunnelProto::kHeaderSize + 2] = (char)tx.count;
+        memcpy(p + kDataHeader, pkt->data(), pkt->size());
+        wrapped->setSize(kDataHeader + pkt->size());
+
+        if (tx.parity) {
+            // 逐个累加校验，数据单元为长度 + 数据
+            auto symbol = 2 + pkt->size();
+            if (tx.symbol < symbol) {
+                for (int j = 0; j < tx.parity; ++j) {
+                    tx.buf[j].resize(symbol, 0);
+                }
+                tx.symbol = symbol;
+            }
+            uint8_t len[2] = {(uint8_t)(pkt->size() >> 8), (uint8_t)pkt->size()};
+            auto &gf = Gf256::Instance();
+            for (int j = 0; j < tx.parity; ++j) {
+                auto c = coefficient(_mode, j, tx.count);
+                gf.mulAdd(tx.buf[j].data(), len, c, 2);
+                gf.mulAdd(tx.buf[j].data() + 2, reinterpret_cast<const uint8_t *>(pkt->data()), c, pkt->size());
+            }
+        }
+        send(std::move(wrapped));
+        if (++tx.count == _block) {
+            finishBlock(tx);
+        }
+    }
+
+    /**
+     * @brief 收到前向纠错报文，在传输层poller中执行
+     * @param data 报文
+     * @param size 报文长度
+     * @param from 来源地址
+     * @param deliver 每个收到或恢复出的数据报回调一次，数据可被原地修改
+     */
+    void onReceive(char *data, size_t size, const sockaddr_storage &from, const Deliver &deliver) {
+        switch (TunnelProto::type(data)) {
+            case TunnelProto::FecData: onData(data, size, from, deliver); break;
+            case TunnelProto::FecParity: onParity(data, size, from, deliver); break;
+            case TunnelProto::FecReport: onReport(data, size, from); break;
+            default: break;
+        }
+    }
+
+    /**
+     * @brief 节点报告的丢包率，据此调整发往该节点的校验个数
+     */
+    void onLoss(const sockaddr_storage &from, double loss) {
+        if (!enabled()) {
+            return;
+        }
+        _encoder->async([this, from, loss]() {
+            auto it = _tx.find(PeerKey(from));
+            if (it != _tx.end()) {
+                auto &tx = it->second;
+                tx.loss = tx.loss < 0 ? loss : tx.loss * 0.7 + loss * 0.3;
+            }
+        }, false);
+    }
+
+private:
+    /**
+     * @brief 发送方的节点状态
+     */
+    struct TxState {
+        sockaddr_storage addr{};
+        uint16_t block = 0;          ///< 当前组号
+        size_t count = 0;            ///< 当前组已发送的数据报个数
+        int parity = 1;              ///< 当前组的校验报文个数
+        double loss = -1;            ///< 对端报告的丢包率(平滑后)，负数为尚未收到报告
+        size_t symbol = 0;           ///< 当前组最长数据单元
+        uint64_t started = 0;        ///< 当前组开始时间
+        uint64_t used = 0;
+        std::vector<uint8_t> buf[kMaxParity];
+    };
+
+    /**
+     * @brief 接收方的一组数据
+     */
+    struct RxBlock {
+        bool active = false;
+        uint16_t id = 0;
+        size_t count = 0;            ///< 组内数据报个数，收到校验前未知
+        Mode mode = Off;
+        uint64_t have = 0;           ///< 已收到或已恢复的数据报
+        size_t received = 0;         ///< 直接收到的数据报个数
+        size_t recovered = 0;        ///< 恢复出的数据报个数
+        size_t top = 0;              ///< 收到的最大组内序号+1
+        bool done = false;
+        PacketPtr data[kMaxBlock];   ///< 数据单元副本
+        PacketPtr parity[kMaxParity];
+    };
+
+    /**
+     * @brief 接收方的节点状态
+     */
+    struct RxState {
+        sockaddr_storage addr{};
+        RxBlock blocks[kRxBlocks];
+        uint64_t expected = 0;       ///< 报告周期内应收到的数据报个数
+        uint64_t lost = 0;           ///< 报告周期内恢复前丢失的数据报个数
+        uint64_t used = 0;
+        uint16_t newest = 0;         ///< 收到的最新组号
+        bool started = false;
+    };
+
+    Fec()
+        : _parityTx(Statistics::Instance().counter("fec.parity_tx")),
+          _recovered(Statistics::Instance().counter("fec.recovered")),
+          _unrecovered(Statistics::Instance().counter("fec.lost")),
+          _late(Statistics::Instance().counter("fec.late")) {
+        Statistics::Instance().addGauge("fec.loss", [this]() { return lossReport(); });
+    }
+
+    /**
+     * @brief 校验系数，XOR全为1，Reed-Solomon为柯西矩阵 1/(x_j + y_i)
+     */
+    static uint8_t coefficient(Mode mode, int j, size_t i) {
+        if (mode == Xor) {
+            return 1;
+        }
+        return Gf256::Instance().inv((uint8_t)((128 + j) ^ i));
+    }
+
+    /**
+     * @brief 按丢包率决定校验报文个数，覆盖均值加两倍标准差的丢包
+     */
+    int parityFor(double loss) const {
+        if (loss < 0) {
+            // 尚未收到报告，保守地发送一个校验
+            return 1;
+        }
+        if (loss < 0.001) {
+            return 0;
+        }
+        auto n = (double)_block;
+        auto m = (int)std::ceil(n * loss + 2 * std::sqrt(n * loss * (1 - loss)));
+        m = std::max(1, std::min(m, kMaxParity));
+        return _mode == Xor ? 1 : m;
+    }
+
+    void finishBlock(TxState &tx) {
+        for (int j = 0; j < tx.parity; ++j) {
+            auto pkt = Packet::create(kParityHeader + tx.symbol, false);
+            auto p = pkt->data();
+            TunnelProto::writeHeader(p, TunnelProto::FecParity);
+            TunnelProto::put16(p + TunnelProto::kHeaderSize, tx.block);
+            p[TunnelProto::kHeaderSize + 2] = (char)j;
+            p[TunnelProto::kHeaderSize + 3] = (char)tx.count;
+            p[TunnelProto::kHeaderSize + 4] = (char)_mode;
+            memcpy(p + kParityHeader, tx.buf[j].data(), tx.symbol);
+            pkt->setSize(kParityHeader + tx.symbol);
+            memset(tx.buf[j].data(), 0, tx.symbol);
+            ++_parityTx;
+            _out(std::move(pkt), tx.addr);
+        }
+        ++tx.block;
+        tx.count = 0;
+        tx.symbol = 0;
+        // 新的一组按最新的丢包率确定校验个数
+        tx.parity = parityFor(tx.loss);
+    }
+
+    void tick() {
+        auto now = toolkit::getCurrentMillisecond();
+        for (auto it = _tx.begin(); it != _tx.end();) {
+            auto &tx = it->second;
+            if (now - tx.used > kIdleMs) {
+                it = _tx.erase(it);
+                continue;
+            }
+            if (tx.count && now - tx.started >= kBlockTimeoutMs) {
+                // 流量不足以填满一组，提前结束，避免恢复等待过久
+                finishBlock(tx);
+            }
+            ++it;
+        }
+    }
+
+    RxState &rxState(const sockaddr_storage &from) {
+        auto &rx = _rx[PeerKey(from)];
+        rx.addr = from;
+        rx.used = toolkit::getCurrentMillisecond();
+        return rx;
+    }
+
+    /**
+     * @brief 定位组，占用旧组的槽位时先结算旧组
+     * @return 组已过期时返回nullptr
+     */
+    RxBlock *rxBlock(RxState &rx, uint16_t id) {
+        auto &blk = rx.blocks[id % kRxBlocks];
+        if (blk.active && blk.id == id) {
+            return &blk;
+        }
+        if (blk.active) {
+            if ((int16_t)(id - blk.id) < 0) {
+                return nullptr;
+            }
+            settle(rx, blk);
+        }
+        if (!rx.started) {
+            rx.started = true;
+            rx.newest = id;
+        } else if ((int16_t)(id - rx.newest) > 0) {
+            // 整组丢失的组至少丢失了一个数据报
+            uint16_t gap = id - rx.newest - 1;
+            rx.expected += gap;
+            rx.lost += gap;
+            _unrecovered += gap;
+            rx.newest = id;
+        }
+        blk = RxBlock();
+        blk.active = true;
+        blk.id = id;
+        return &blk;
+    }
+
+    /**
+     * @brief 结算一组的丢包
+     */
+    void settle(RxState &rx, RxBlock &blk) {
+        auto expected = blk.count ? blk.count : blk.top;
+        if (expected > blk.received) {
+            rx.lost += expected - blk.received;
+            if (expected > blk.received + blk.recovered) {
+                _unrecovered += expected - blk.received - blk.recovered;
+            }
+        }
+        rx.expected += expected;
+    }
+
+    void onData(char *data, size_t size, const sockaddr_storage &from, const Deliver &deliver) {
+        if (size <= kDataHeader) {
+            return;
+        }
+        auto id = TunnelProto::get16(data + TunnelProto::kHeaderSize);
+        size_t index = (uint8_t)data[TunnelProto::kHeaderSize + 2];
+        auto len = size - kDataHeader;
+        auto &rx = rxState(from);
+        auto blk = index < kMaxBlock ? rxBlock(rx, id) : nullptr;
+        if (blk) {
+            if (blk->have & (1ULL << index)) {
+                // 已经恢复过的数据报迟到
+                ++_late;
+                return;
+            }
+            blk->have |= 1ULL << index;
+            ++blk->received;
+            blk->top = std::max(blk->top, index + 1);
+            if (!blk->done) {
+                // 交付时数据会被原地修改，先保存副本
+                auto symbol = Packet::create(2 + len, false);
+                TunnelProto::put16(symbol->data(), (uint16_t)len);
+                memcpy(symbol->data() + 2, data + kDataHeader, len);
+                symbol->setSize(2 + len);
+                blk->data[index] = std::move(symbol);
+            }
+        }
+        deliver(data + kDataHeader, len);
+        if (blk) {
+            recover(*blk, deliver);
+        }
+    }
+
+    void onParity(char *data, size_t size, const sockaddr_storage &from, const Deliver &deliver) {
+        if (size <= kParityHeader) {
+            return;
+        }
+        auto id = TunnelProto::get16(data + TunnelProto::kHeaderSize);
+        int j = (uint8_t)data[TunnelProto::kHeaderSize + 2];
+        size_t count = (uint8_t)data[TunnelProto::kHeaderSize + 3];
+        auto mode = (Mode)(uint8_t)data[TunnelProto::kHeaderSize + 4];
+        if (j >= kMaxParity || !count || count > kMaxBlock || (mode != Xor && mode != ReedSolomon)) {
+            return;
+        }
+        auto &rx = rxState(from);
+        auto blk = rxBlock(rx, id);
+        if (!blk || blk->done || blk->parity[j]) {
+            return;
+        }
+        blk->count = count;
+        blk->mode = mode;
+        blk->parity[j] = Packet::create(data + kParityHeader, size - kParityHeader, false);
+        recover(*blk, deliver);
+    }
+
+    void onReport(const char *data, size_t size, const sockaddr_storage &from) {
+        if (size < TunnelProto::kHeaderSize + 2) {
+            return;
+        }
+        onLoss(from, TunnelProto::get16(data + TunnelProto::kHeaderSize) / 1000.0);
+    }
+
+    /**
+     * @brief 尝试恢复一组中丢失的数据报
+     */
+    void recover(RxBlock &blk, const Deliver &deliver) {
+        if (blk.done || !blk.count) {
+            return;
+        }
+        size_t lost[kMaxParity];
+        size_t missing = 0;
+        for (size_t i = 0; i < blk.count; ++i) {
+            if (!(blk.have & (1ULL << i))) {
+                if (missing == kMaxParity) {
+                    return;
+                }
+                lost[missing++] = i;
+            }
+        }
+        if (!missing) {
+            blk.done = true;
+            return;
+        }
+        int rows[kMaxParity];
+        size_t found = 0;
+        size_t symbol = 0;
+        for (int j = 0; j < kMaxParity && found < missing; ++j) {
+            if (blk.parity[j]) {
+                rows[found++] = j;
+                symbol = blk.parity[j]->size();
+            }
+        }
+        if (found < missing) {
+            return;
+        }
+
+        auto &gf = Gf256::Instance();
+        // 校正子：校验减去已收到数据的贡献
+        std::vector<std::vector<uint8_t>> syndrome(missing);
+        for (size_t r = 0; r < missing; ++r) {
+            auto &parity = blk.parity[rows[r]];
+            if (parity->size() != symbol) {
+                return;
+            }
+            syndrome[r].assign(parity->data(), parity->data() + symbol);
+            for (size_t i = 0; i < blk.count; ++i) {
+                auto &d = blk.data[i];
+                if (!d) {
+                    continue;
+                }
+                if (d->size() > symbol) {
+                    return;
+                }
+                gf.mulAdd(syndrome[r].data(), reinterpret_cast<const uint8_t *>(d->data()), coefficient(blk.mode, rows[r], i), d->size());
+            }
+        }
+        uint8_t matrix[kMaxParity * kMaxParity], inverse[kMaxParity * kMaxParity];
+        for (size_t r = 0; r < missing; ++r) {
+            for (size_t c = 0; c < missing; ++c) {
+                matrix[r * missing + c] = coefficient(blk.mode, rows[r], lost[c]);
+            }
+        }
+        if (!gf.invert(matrix, inverse, missing)) {
+            return;
+        }
+        blk.done = true;
+        for (size_t c = 0; c < missing; ++c) {
+            auto out = Packet::create(symbol, false);
+            memset(out->data(), 0, symbol);
+            for (size_t r = 0; r < missing; ++r) {
+                gf.mulAdd(reinterpret_cast<uint8_t *>(out->data()), syndrome[r].data(), inverse[c * missing + r], symbol);
+            }
+            size_t len = TunnelProto::get16(out->data());
+            blk.have |= 1ULL << lost[c];
+            if (len + 2 > symbol) {
+                continue;
+            }
+            ++blk.recovered;
+            ++_recovered;
+            deliver(out->data() + 2, len);
+        }
+        // 恢复完成后不再需要副本
+        for (auto &d : blk.data) {
+            d.reset();
+        }
+        for (auto &p : blk.parity) {
+            p.reset();
+        }
+    }
+
+    /**
+     * @brief 向各发送方报告丢包率，在传输层poller中执行
+     */
+    void report() {
+        auto now = toolkit::getCurrentMillisecond();
+        std::lock_guard<std::mutex> lck(_report_mtx);
+        _last_loss.clear();
+        for (auto it = _rx.begin(); it != _rx.end();) {
+            auto &rx = it->second;
+            if (now - rx.used > kIdleMs) {
+                it = _rx.erase(it);
+                continue;
+            }
+            if (rx.expected) {
+                auto permille = (uint16_t)std::min<uint64_t>(1000, rx.lost * 1000 / rx.expected);
+                auto pkt = Packet::create(TunnelProto::kHeaderSize + 2, false);
+                TunnelProto::writeHeader(pkt->data(), TunnelProto::FecReport);
+                TunnelProto::put16(pkt->data() + TunnelProto::kHeaderSize, permille);
+                pkt->setSize(TunnelProto::kHeaderSize + 2);
+                _out(std::move(pkt), rx.addr);
+                _last_loss.emplace_back(rx.addr, permille);
+                rx.expected = 0;
+                rx.lost = 0;
+            }
+            ++it;
+        }
+    }
+
+    std::string lossReport() {
+        std::lock_guard<std::mutex> lck(_report_mtx);
+        std::string ret;
+        for (auto &item : _last_loss) {
+            ret += (ret.empty() ? "" : ",")
+                + toolkit::SockUtil::inet_ntoa(reinterpret_cast<const sockaddr *>(&item.first)) + ":"
+                + std::to_string(toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&item.first)))
+                + "=" + std::to_string(item.second / 10.0).substr(0, 4) + "%";
+        }
+        return ret;
+    }
+
+    Mode _mode = Off;
+    size_t _block = 8;
+    toolkit::EventPoller::Ptr _encoder;
+    Output _out;
+    std::unordered_map<PeerKey, TxState, PeerKey::Hash> _tx;
+    std::unordered_map<PeerKey, RxState, PeerKey::Hash> _rx;
+    std::mutex _report_mtx;
+    std::vector<std::pair<sockaddr_storage, uint16_t>> _last_loss;
+    Statistics::Counter &_parityTx;
+    Statistics::Counter &_recovered;
+    Statistics::Counter &_unrecovered;
+    Statistics::Counter &_late;
+};
+
+#endif //TALUSVSWITCH_FEC_H
@@ -0,0 +1,413 @@
+﻿/**
+ * @file Federation.h
+ * @brief 核心节点联邦，以反熵gossip复制MAC到节点的绑定
+ * @details 多个核心节点各自接入一部分边缘节点，彼此复制MAC目录，不同区域的边缘节点连接就近的核心节点，
+ * 仍可到达整个网络：
+ * - 目录项为 MAC、所属核心节点、版本、边缘节点的公网地址、是否已删除；本核心节点MAC表中直接学到的边缘节点归本核心节点所有
+ * - 版本为所属核心节点的混合逻辑时钟(系统时钟毫秒时间戳，同一毫秒内递增)，收到的版本均并入本地时钟，
+ *   同一MAC的不同归属间按版本比较，认领时的版本大于本核心节点已见过的任何版本，边缘节点换接入核心节点时新归属胜出，
+ *   不受核心节点间时钟偏差影响
+ * - 删除以墓碑表示，只能删除同一归属的目录项，墓碑保留一段时间后清理；所属核心节点每分钟重新发布自己的目录项，
+ *   长时间未更新的目录项丢弃，所属核心节点重启或离开后不会残留
+ * - 每秒随机选一个联邦节点发送摘要(各归属已知的最大版本)，对方回送比摘要新的目录项，自身落后时也回送摘要(推拉结合)
+ * - 目录项按版本升序分批发送，每批带上前一批的末尾版本，接收方只在不出现缺口时接受，丢失的批次在下一轮补齐
+ * - 其他核心节点所有的MAC在MAC表中指向所属核心节点，流量经其转发；查询对端列表与协调打洞时使用目录中的公网地址
+ * - 广播从边缘节点收到时转发给全部联邦节点，从联邦节点收到的只转发给本地节点(全互联时的水平分割)
+ */
+
+#ifndef TALUSVSWITCH_FEDERATION_H
+#define TALUSVSWITCH_FEDERATION_H
+
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <Network/sockutil.h>
+#include <Poller/EventPoller.h>
+#include <Util/logger.h>
+#include <Util/util.h>
+#include "Config.h"
+#include "MacMap.h"
+#include "Statistics.h"
+#include "Utils.h"
+
+/**
+ * @class Federation
+ * @brief 联邦目录单例
+ * @details 扫描与gossip在定时任务所在poller中执行，收到的摘要与目录项在控制助手的poller中处理，目录由互斥锁保护
+ */
+class Federation {
+public:
+    /**
+     * @brief 目录项
+     */
+    struct Entry {
+        uint64_t mac = 0;
+        uint64_t owner = 0;         ///< 所属核心节点的MAC
+        uint64_t version = 0;
+        sockaddr_storage addr{};    ///< 边缘节点的公网地址
+        bool dead = false;          ///< 墓碑
+        uint64_t updated = 0;       ///< 本地更新时间(毫秒)
+    };
+    using Digest = std::vector<std::pair<uint64_t, uint64_t>>;     ///< 归属与最大版本
+    /**
+     * @brief 发送摘要
+     * @param reply 是否为落后时回送的摘要，回送的摘要不再引起回送，避免往复
+     */
+    using DigestSender = std::function<void(const sockaddr_storage &to, const Digest &digest, bool reply)>;
+    /**
+     * @brief 发送一批目录项
+     * @param after 前一批的末尾版本，接收方已知版本不低于它时才接受
+     * @param upto 本批之后接收方可认为已知的版本
+     */
+    using EntriesSender = std::function<void(const sockaddr_storage &to, uint64_t owner, uint64_t after, uint64_t upto,
+                                             const std::vector<Entry> &entries)>;
+
+    static constexpr uint64_t kTickMs = 1000;                   ///< 扫描MAC表与gossip的间隔
+    static constexpr size_t kBatch = 16;                        ///< 每批目录项个数
+    static constexpr uint64_t kClaimIdleMs = 6 * 1000;          ///< 本地学到的节点在该时间内有流量才从其他核心节点夺回
+    static constexpr uint64_t kClaimHoldMs = 10 * 1000;         ///< 其他核心节点的归属至少保持该时间，避免多归属时来回切换
+    static constexpr uint64_t kTombstoneMs = 10 * 60 * 1000;    ///< 墓碑保留时间
+    static constexpr uint64_t kRefreshMs = 60 * 1000;           ///< 本核心节点所有的目录项重新发布的间隔
+    static constexpr uint64_t kStaleMs = 3 * kRefreshMs;        ///< 其他核心节点的目录项超过该时间未更新即丢弃(所属核心节点已重启或离开)
+
+    /**
+     * @brief 获取Federation单例
+     */
+    static Federation &Instance() {
+        static Federation federation;
+        return federation;
+    }
+
+    /**
+     * @brief 启动
+     * @param poller 定时任务所在的poller
+     * @param peers 其他联邦核心节点的地址
+     * @param digest 发送摘要
+     * @param entries 发送目录项
+     */
+    void start(const toolkit::EventPoller::Ptr &poller, const std::vector<sockaddr_storage> &peers,
+               DigestSender digest, EntriesSender entries) {
+        _peers = peers;
+        _digest = std::move(digest);
+        _entries_out = std::move(entries);
+        poller->doDelayTask(kTickMs, [this]() {
+            scan();
+            install();
+            gossip();
+            return kTickMs;
+        });
+        Statistics::Instance().addGauge("federation", [this]() { return report(); });
+        InfoL << "Federation with " << _peers.size() << " core peers";
+    }
+
+    bool enabled() const { return !_peers.empty(); }
+
+    /**
+     * @brief 是否为联邦核心节点的地址
+     */
+    bool isPeer(const sockaddr_storage &addr) const {
+        for (auto &peer : _peers) {
+            if (compareSockAddr(peer, addr)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const std::vector<sockaddr_storage> &peers() const { return _peers; }
+
+    /**
+     * @brief 其他核心节点所有的边缘节点的公网地址
+     * @return 不在目录中或为本核心节点所有时返回false
+     */
+    bool edgeAddr(uint64_t mac, sockaddr_storage &addr) {
+        std::lock_guard<std::mutex> lck(_mtx);
+        auto it = _entries.find(mac);
+        if (it == _entries.end() || it->second.dead || it->second.owner == Config::macLocal) {
+            return false;
+        }
+        addr = it->second.addr;
+        return true;
+    }
+
+    /**
+     * @brief 收到联邦节点的摘要
+     * @details 回送对方缺少的目录项，对方有更新的版本时回送本地摘要
+     * @param reply 对方是否为回送的摘要
+     */
+    void onDigest(const sockaddr_storage &from, uint64_t fromMac, const Digest &remote, bool reply) {
+        std::vector<std::pair<uint64_t, std::vector<Entry>>> send;
+        std::vector<std::pair<uint64_t, uint64_t>> upto;
+        bool behind = false;
+        {
+            std::lock_guard<std::mutex> lck(_mtx);
+            learnOwner(fromMac, from);
+            for (auto &item : remote) {
+                observe(item.second);
+            }
+            std::unordered_map<uint64_t, uint64_t> known(remote.begin(), remote.end());
+            for (auto &item : _owners) {
+                auto it = known.find(item.first);
+                auto theirs = it == known.end() ? 0 : it->second;
+                if (item.second.version <= theirs) {
+                    continue;
+                }
+                std::vector<Entry> entries;
+                for (auto &entry : _entries) {
+                    if (entry.second.owner == item.first && entry.second.version > theirs) {
+                        entries.emplace_back(entry.second);
+                    }
+                }
+                std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.version < b.version; });
+                send.emplace_back(item.first, std::move(entries));
+                upto.emplace_back(theirs, item.second.version);
+            }
+            for (auto &item : remote) {
+                auto it = _owners.find(item.first);
+                if (item.first != Config::macLocal && (it == _owners.end() || it->second.version < item.second)) {
+                    behind = true;
+                }
+            }
+        }
+        for (size_t i = 0; i < send.size(); ++i) {
+            sendEntries(from, send[i].first, upto[i].first, upto[i].second, send[i].second);
+        }
+        if (behind && !reply) {
+            _digest(from, digest(), true);
+        }
+    }
+
+    /**
+     * @brief 收到联邦节点的一批目录项
+     */
+    void onEntries(const sockaddr_storage &from, uint64_t fromMac, uint64_t owner, uint64_t after, uint64_t upto,
+                   const std::vector<Entry> &entries) {
+        static auto &applied = Statistics::Instance().counter("fed.applied");
+        static auto &gaps = Statistics::Instance().counter("fed.gaps");
+        if (owner == Config::macLocal) {
+            return;
+        }
+        std::lock_guard<std::mutex> lck(_mtx);
+        learnOwner(fromMac, from);
+        observe(upto);
+        for (auto &entry : entries) {
+            observe(entry.version);
+        }
+        auto &state = _owners[owner];
+        if (after > state.version) {
+            // 前面的批次丢失，下一轮补齐
+            ++gaps;
+            return;
+        }
+        auto now = toolkit::getCurrentMillisecond();
+        for (auto &entry : entries) {
+            if (entry.owner != owner || entry.version <= state.version) {
+                continue;
+            }
+            auto it = _entries.find(entry.mac);
+            if (it != _entries.end()) {
+                auto &cur = it->second;
+                if (entry.dead && cur.owner != owner) {
+                    // 旧归属的墓碑，不影响新归属
+                    continue;
+                }
+                if (entry.version < cur.version || (entry.version == cur.version && entry.owner <= cur.owner)) {
+                    continue;
+                }
+            }
+            auto &cur = _entries[entry.mac];
+            cur = entry;
+            cur.updated = now;
+            ++applied;
+        }
+        state.version = std::max(state.version, upto);
+    }
+
+    /**
+     * @brief 本地摘要
+     */
+    Digest digest() {
+        std::lock_guard<std::mutex> lck(_mtx);
+        Digest ret;
+        for (auto &item : _owners) {
+            ret.emplace_back(item.first, item.second.version);
+        }
+        return ret;
+    }
+
+private:
+    struct Owner {
+        uint64_t version = 0;       ///< 已知的最大版本
+        sockaddr_storage addr{};    ///< 核心节点地址，从其直接发来的消息得到
+    };
+
+    Federation() = default;
+
+    void learnOwner(uint64_t mac, const sockaddr_storage &addr) {
+        if (mac && mac != Config::macLocal && isPeer(addr)) {
+            _owners[mac].addr = addr;
+        }
+    }
+
+    /**
+     * @brief 混合逻辑时钟，本地事件
+     */
+    uint64_t nextVersion() {
+        _clock = std::max(toolkit::getCurrentMillisecond(true), _clock + 1);
+        return _clock;
+    }
+
+    /**
+     * @brief 混合逻辑时钟，并入收到的版本
+     */
+    void observe(uint64_t version) {
+        _clock = std::max(_clock, version);
+    }
+
+    /**
+     * @brief 扫描MAC表，认领本地学到的节点，为已离开的节点写墓碑
+     */
+    void scan() {
+        static auto &claims = Statistics::Instance().counter("fed.claims");
+        auto ages = MacMap::ages();
+        auto self = Config::macLocal;
+        std::lock_guard<std::mutex> lck(_mtx);
+        auto now = toolkit::getCurrentMillisecond();
+        std::unordered_set<uint64_t> owned;
+        for (auto &peer : ages) {
+            if (!peer.mac || peer.mac == MAC_BROADCAST || peer.mac == self || isPeer(peer.sock) || peer.idle >= MAC_PEER_EXPIRE_MS
+                || !toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&peer.sock))) {
+                continue;
+            }
+            auto it = _entries.find(peer.mac);
+            bool claim;
+            if (it == _entries.end() || it->second.dead) {
+                claim = true;
+            } else if (it->second.owner == self) {
+                claim = !compareSockAddr(it->second.addr, peer.sock) || now - it->second.updated > kRefreshMs;
+            } else {
+                claim = peer.idle < kClaimIdleMs && now - it->second.updated > kClaimHoldMs;
+            }
+            if (it != _entries.end() && it->second.owner != self && !claim) {
+                continue;
+            }
+            owned.emplace(peer.mac);
+            if (claim) {
+                auto &entry = _entries[peer.mac];
+                entry.mac = peer.mac;
+                entry.owner = self;
+                entry.version = nextVersion();
+                entry.addr = peer.sock;
+                entry.dead = false;
+                entry.updated = now;
+                ++claims;
+            }
+        }
+        for (auto it = _entries.begin(); it != _entries.end();) {
+            auto &entry = it->second;
+            if ((entry.dead && now - entry.updated > kTombstoneMs) || (entry.owner != self && now - entry.updated > kStaleMs)) {
+                it = _entries.erase(it);
+                continue;
+            }
+            if (entry.owner == self && !entry.dead && !owned.count(entry.mac)) {
+                entry.dead = true;
+                entry.version = nextVersion();
+                entry.updated = now;
+            }
+            ++it;
+        }
+        _owners[self].version = _clock;
+    }
+
+    /**
+     * @brief 其他核心节点所有的MAC指向所属核心节点，本地直接学到的地址优先
+     */
+    void install() {
+        std::vector<std::pair<uint64_t, sockaddr_storage>> remote;
+        {
+            std::lock_guard<std::mutex> lck(_mtx);
+            for (auto &item : _entries) {
+                auto &entry = item.second;
+                if (entry.dead || entry.owner == Config::macLocal) {
+                    continue;
+                }
+                auto owner = _owners.find(entry.owner);
+                if (owner != _owners.end() && toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&owner->second.addr))) {
+                    remote.emplace_back(entry.mac, owner->second.addr);
+                }
+            }
+        }
+        for (auto &item : remote) {
+            bool got = false;
+            auto cur = MacMap::getMacPeer(item.first, got);
+            if (!got || isPeer(cur)) {
+                MacMap::setMacPeer(item.first, item.second, Config::sendTtl - 1);
+            }
+        }
+    }
+
+    /**
+     * @brief 向随机一个联邦节点发送摘要
+     */
+    void gossip() {
+        static auto &rounds = Statistics::Instance().counter("fed.rounds");
+        if (_peers.empty() || !_digest) {
+            return;
+        }
+        std::uniform_int_distribution<size_t> dist(0, _peers.size() - 1);
+        _digest(_peers[dist(_rng)], digest(), false);
+        ++rounds;
+    }
+
+    /**
+     * @brief 按版本升序分批发送一个归属的目录项
+     */
+    void sendEntries(const sockaddr_storage &to, uint64_t owner, uint64_t after, uint64_t upto, const std::vector<Entry> &entries) {
+        static auto &sent = Statistics::Instance().counter("fed.sent");
+        if (!_entries_out) {
+            return;
+        }
+        size_t i = 0;
+        do {
+            std::vector<Entry> batch(entries.begin() + i, entries.begin() + std::min(i + kBatch, entries.size()));
+            i += batch.size();
+            auto last = i < entries.size() ? batch.back().version : upto;
+            _entries_out(to, owner, after, last, batch);
+            sent += batch.size();
+            after = last;
+        } while (i < entries.size());
+    }
+
+    std::string report() {
+        std::lock_guard<std::mutex> lck(_mtx);
+        size_t local = 0, remote = 0, dead = 0;
+        for (auto &item : _entries) {
+            if (item.second.dead) {
+                ++dead;
+            } else if (item.second.owner == Config::macLocal) {
+                ++local;
+            } else {
+                ++remote;
+            }
+        }
+        std::ostringstream oss;
+        oss << "local=" << local << ",remote=" << remote << ",tombstones=" << dead << ",owners=" << _owners.size();
+        return oss.str();
+    }
+
+    std::vector<sockaddr_storage> _peers;
+    DigestSender _digest;
+    EntriesSender _entries_out;
+    std::mt19937 _rng{std::random_device{}()};
+    std::mutex _mtx;
+    uint64_t _clock = 0;
+    std::unordered_map<uint64_t, Entry> _entries;
+    std::unordered_map<uint64_t, Owner> _owners;
+};
+
+#endif //TALUSVSWITCH_FEDERATION_H
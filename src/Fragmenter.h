@@ -0,0 +1,229 @@
+﻿/**
+ * @file Fragmenter.h
+ * @brief 隧道分片与重组
+ * @details 编码后超过路径数据报上限的报文在隧道层切分，不再依赖IP分片(常被NAT丢弃，
+ * 且丢失任一IP分片整帧丢失)。分片格式：
+ * | 字节 | 含义 |
+ * | 0-3 | 扩展报文公共头，类型为Fragment |
+ * | 4-5 | 报文编号 |
+ * | 6 | 分片序号 |
+ * | 7 | 分片总数 |
+ * | 8-9 | 原数据报总长度 |
+ * | 10- | 分片数据，除最后一片外长度相同 |
+ */
+
+#ifndef TALUSVSWITCH_FRAGMENTER_H
+#define TALUSVSWITCH_FRAGMENTER_H
+
+#include <atomic>
+#include <Util/util.h>
+#include "Packet.h"
+#include "Statistics.h"
+#include "TunnelProto.h"
+#include "Utils.h"
+
+/**
+ * @class Fragmenter
+ * @brief 隧道分片器单例
+ * @details
+ * - 切分可在任意线程执行
+ * - 重组只在传输层poller中执行，重组表为固定槽位，不加锁
+ * - 重组表按槽位数和总字节数限制内存，超出时淘汰最旧的未完成报文，未完成报文超时丢弃
+ */
+class Fragmenter {
+public:
+    static constexpr size_t kHeaderSize = TunnelProto::kHeaderSize + 6;  ///< 分片头长度
+    static constexpr size_t kMaxFragments = 64;            ///< 单个报文最多分片数
+    static constexpr size_t kSlots = 64;                   ///< 重组表槽位数
+    static constexpr size_t kMaxBytes = 4 * 1024 * 1024;   ///< 重组表最多占用的字节数
+    static constexpr uint64_t kTimeoutMs = 1000;           ///< 未完成报文超时时间
+
+    /**
+     * @brief 获取Fragmenter单例
+     */
+    static Fragmenter &Instance() {
+        static Fragmenter fragmenter;
+        return fragmenter;
+    }
+
+    /**
+     * @brief 切分数据报
+     * @param datagram 编码后的数据报
+     * @param budget 单个分片的最大长度
+     * @param out 每个分片回调一次
+     * @return 分片数超出上限时返回false，数据报被丢弃
+     */
+    template <typename Output>
+    bool fragment(const Packet &datagram, size_t budget, Output &&out) {
+        auto total = datagram.size();
+        if (budget <= kHeaderSize || total > UINT16_MAX) {
+            ++_oversize;
+            return false;
+        }
+        auto count = (total + budget - kHeaderSize - 1) / (budget - kHeaderSize);
+        if (count > kMaxFragments) {
+            ++_oversize;
+            return false;
+        }
+        // 均分，避免最后一片过小
+        auto chunk = (total + count - 1) / count;
+        uint16_t id = _next_id++;
+        for (size_t i = 0; i < count; ++i) {
+            auto offset = i * chunk;
+            auto len = std::min(chunk, total - offset);
+            auto frag = Packet::create(kHeaderSize + len, false);
+            auto p = frag->data();
+            TunnelProto::writeHeader(p, TunnelProto::Fragment);
+            TunnelProto::put16(p + 4, id);
+            p[6] = (char)i;
+            p[7] = (char)count;
+            TunnelProto::put16(p + 8, (uint16_t)total);
+            memcpy(p + kHeaderSize, datagram.data() + offset, len);
+            frag->setSize(kHeaderSize + len);
+            out(std::move(frag));
+        }
+        ++_fragmented;
+        return true;
+    }
+
+    /**
+     * @brief 收到一个分片
+     * @param data 分片数据
+     * @param size 分片长度
+     * @param peer 来源地址
+     * @return 报文的所有分片到齐时返回重组后的数据报，否则返回空
+     */
+    PacketPtr reassemble(const char *data, size_t size, const sockaddr_storage &peer) {
+        if (size <= kHeaderSize) {
+            ++_malformed;
+            return {};
+        }
+        auto id = TunnelProto::get16(data + 4);
+        size_t index = (uint8_t)data[6];
+        size_t count = (uint8_t)data[7];
+        size_t total = TunnelProto::get16(data + 8);
+        if (!count || count > kMaxFragments || index >= count || total < count) {
+            ++_malformed;
+            return {};
+        }
+        auto chunk = (total + count - 1) / count;
+        auto offset = index * chunk;
+        if (offset >= total || size - kHeaderSize != std::min(chunk, total - offset)) {
+            ++_malformed;
+            return {};
+        }
+
+        PeerKey key(peer);
+        auto now = toolkit::getCurrentMillisecond();
+        Slot *slot = nullptr;
+        Slot *oldest = nullptr;
+        Slot *idle = nullptr;
+        for (auto &s : _slots) {
+            if (s.buf && now - s.stamp > kTimeoutMs) {
+                ++_timeouts;
+                release(s);
+            }
+            if (!s.buf) {
+                idle = idle ? idle : &s;
+                continue;
+            }
+            if (s.id == id && s.count == count && s.total == total && s.peer == key) {
+                slot = &s;
+                break;
+            }
+            if (!oldest || s.stamp < oldest->stamp) {
+                oldest = &s;
+            }
+        }
+
+        if (!slot) {
+            while (_bytes + total > kMaxBytes || !idle) {
+                // 超出内存上限或槽位用尽，淘汰最旧的未完成报文
+                if (!oldest) {
+                    ++_oversize;
+                    return {};
+                }
+                ++_evicted;
+                release(*oldest);
+                idle = idle ? idle : oldest;
+                oldest = findOldest();
+            }
+            slot = idle;
+            slot->peer = key;
+            slot->id = id;
+            slot->count = count;
+            slot->total = total;
+            slot->mask = 0;
+            slot->stamp = now;
+            slot->buf = Packet::create(total, false);
+            slot->buf->setSize(total);
+            _bytes += total;
+        }
+
+        auto bit = 1ULL << index;
+        if (slot->mask & bit) {
+            return {};
+        }
+        slot->mask |= bit;
+        memcpy(slot->buf->data() + offset, data + kHeaderSize, size - kHeaderSize);
+        if (slot->mask != (count == 64 ? ~0ULL : (1ULL << count) - 1)) {
+            return {};
+        }
+        auto ret = std::move(slot->buf);
+        release(*slot);
+        ++_reassembled;
+        return ret;
+    }
+
+private:
+    /**
+     * @brief 重组表槽位
+     */
+    struct Slot {
+        PeerKey peer;
+        uint16_t id = 0;
+        size_t count = 0;
+        size_t total = 0;
+        uint64_t mask = 0;    ///< 已收到的分片
+        uint64_t stamp = 0;   ///< 收到首个分片的时间
+        PacketPtr buf;
+    };
+
+    Fragmenter()
+        : _fragmented(Statistics::Instance().counter("frag.tx")),
+          _reassembled(Statistics::Instance().counter("frag.rx")),
+          _timeouts(Statistics::Instance().counter("frag.timeouts")),
+          _evicted(Statistics::Instance().counter("frag.evicted")),
+          _malformed(Statistics::Instance().counter("frag.malformed")),
+          _oversize(Statistics::Instance().counter("frag.oversize")) {
+        Statistics::Instance().addGauge("frag.pending", [this]() { return std::to_string(_bytes.load()); });
+    }
+
+    void release(Slot &slot) {
+        _bytes -= slot.total;
+        slot.buf.reset();
+        slot.total = 0;
+    }
+
+    Slot *findOldest() {
+        Slot *oldest = nullptr;
+        for (auto &s : _slots) {
+            if (s.buf && (!oldest || s.stamp < oldest->stamp)) {
+                oldest = &s;
+            }
+        }
+        return oldest;
+    }
+
+    std::atomic<uint16_t> _next_id{0};
+    std::atomic<size_t> _bytes{0};
+    Slot _slots[kSlots];
+    Statistics::Counter &_fragmented;
+    Statistics::Counter &_reassembled;
+    Statistics::Counter &_timeouts;
+    Statistics::Counter &_evicted;
+    Statistics::Counter &_malformed;
+    Statistics::Counter &_oversize;
+};
+
+#endif //TALUSVSWITCH_FRAGMENTER_H
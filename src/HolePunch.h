@@ -0,0 +1,436 @@
+﻿/**
+ * @file HolePunch.h
+ * @brief 节点间NAT打洞
+ * @details 参照ICE的候选与连通性检查，替代原来每秒一次、共十次向对端反射地址发送保活的方式：
+ * - 候选地址分三类：本地网卡地址(host)、核心节点看到的反射地址(srflx)、按端口递增规律预测的地址(predicted)，
+ *   优先级依次降低，host在同一局域网内可直接连通，predicted用于端口随目的地址变化的对称NAT
+ * - 边缘节点启动时把本地地址上报核心节点，需要打洞时向核心节点请求，核心节点同时把双方的候选下发给双方，
+ *   两端同时向对方发出检查，各自的NAT映射在对方的检查到达前已建立
+ * - 检查即保活报文，全局按固定节拍发送，每拍最多发送若干个，优先发送重试次数少、优先级高的候选
+ * - 收到会话中节点从非核心地址发来的保活即打通，立即回送一个保活(触发检查)，使对端也尽快打通
+ * - 经核心节点或中继节点转发的节点自动发起打洞，失败后按指数退避重试
+ * 打通耗时从发起请求(被动一方从收到核心节点的下发)计算，按节点报告
+ */
+
+#ifndef TALUSVSWITCH_HOLEPUNCH_H
+#define TALUSVSWITCH_HOLEPUNCH_H
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#ifndef _WIN32
+#include <ifaddrs.h>
+#include <net/if.h>
+#endif
+#include <Network/sockutil.h>
+#include <Poller/EventPoller.h>
+#include <Util/logger.h>
+#include <Util/util.h>
+#include "Config.h"
+#include "CoreSet.h"
+#include "MacMap.h"
+#include "Relay.h"
+#include "Statistics.h"
+#include "Utils.h"
+
+/**
+ * @class HolePunch
+ * @brief 打洞会话管理单例
+ * @details 检查的发送在传输层poller中执行，候选的下发与打通的判定可能在其他线程，由互斥锁保护
+ */
+class HolePunch {
+public:
+    using CheckSender = std::function<void(uint64_t mac, const sockaddr_storage &addr)>;
+    using Requester = std::function<void(uint64_t mac)>;
+    using DirectCB = std::function<void(uint64_t mac, const sockaddr_storage &addr)>;
+
+    static constexpr uint64_t kTickMs = 20;                 ///< 检查的发送节拍
+    static constexpr int kChecksPerTick = 4;                ///< 每拍最多发送的检查个数
+    static constexpr uint64_t kRetryMs = 500;               ///< 同一候选两次检查的间隔
+    static constexpr uint64_t kTimeoutMs = 10 * 1000;       ///< 会话超时
+    static constexpr uint64_t kScanMs = 1000;               ///< 检查经核心节点转发的节点的间隔
+    static constexpr uint64_t kBackoffMs = 15 * 1000;       ///< 失败后首次重试的等待
+    static constexpr uint64_t kBackoffMaxMs = 5 * 60 * 1000; ///< 失败后重试等待的上限
+    static constexpr uint64_t kHostsTtlMs = 3 * 60 * 1000;  ///< 本地地址的有效期，边缘节点每分钟重新上报
+    static constexpr int kPredictPorts = 3;                 ///< 反射端口之后预测的端口个数
+
+    /**
+     * @brief 候选类型，数值越大优先级越高
+     */
+    enum Type : int {
+        Predicted = 1,
+        Reflexive = 2,
+        Host = 3,
+    };
+
+    /**
+     * @brief 获取HolePunch单例
+     */
+    static HolePunch &Instance() {
+        static HolePunch punch;
+        return punch;
+    }
+
+    /**
+     * @brief 启动
+     * @param poller 传输层poller
+     * @param sender 发送一个检查(保活报文)
+     * @param requester 向核心节点请求协调打洞
+     * @param on_direct 打通后的回调
+     */
+    void start(const toolkit::EventPoller::Ptr &poller, CheckSender sender, Requester requester, DirectCB on_direct) {
+        _sender = std::move(sender);
+        _requester = std::move(requester);
+        _on_direct = std::move(on_direct);
+        poller->doDelayTask(kTickMs, [this]() {
+            tick();
+            return kTickMs;
+        });
+        poller->doDelayTask(kScanMs, [this]() {
+            scan();
+            return kScanMs;
+        });
+        Statistics::Instance().addGauge("punch", [this]() { return report(); });
+    }
+
+    /**
+     * @brief 向节点发起打洞
+     * @param reflexive 已知的对端反射地址，未知时端口为0
+     */
+    void request(uint64_t mac, const sockaddr_storage &reflexive) {
+        static auto &requests = Statistics::Instance().counter("punch.requests");
+        {
+            std::lock_guard<std::mutex> lck(_mtx);
+            if (_sessions.count(mac)) {
+                return;
+            }
+            auto &session = open(mac);
+            if (toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&reflexive))) {
+                addCheck(session, reflexive, Reflexive);
+            }
+        }
+        ++requests;
+        InfoL << "Punch " << MacMap::uint64ToMacStr(mac) << " requested";
+        if (_requester) {
+            _requester(mac);
+        }
+    }
+
+    /**
+     * @brief 加入核心节点下发的候选，没有会话时(被动一方)新建
+     */
+    void addCandidates(uint64_t mac, const std::vector<std::pair<sockaddr_storage, Type>> &candidates) {
+        std::lock_guard<std::mutex> lck(_mtx);
+        auto it = _sessions.find(mac);
+        auto &session = it == _sessions.end() ? open(mac) : it->second;
+        // 双方同时开始，重新计时
+        session.deadline = toolkit::getCurrentMillisecond() + kTimeoutMs;
+        for (auto &item : candidates) {
+            addCheck(session, item.first, item.second);
+        }
+    }
+
+    /**
+     * @brief 收到节点的保活报文
+     * @details 会话中的节点从非核心地址发来保活即为打通
+     */
+    void onKeepalive(uint64_t mac, const sockaddr_storage &from) {
+        static auto &succeeded = Statistics::Instance().counter("punch.succeeded");
+        if (!_active || CoreSet::Instance().isCore(from)) {
+            return;
+        }
+        uint64_t elapsed;
+        {
+            std::lock_guard<std::mutex> lck(_mtx);
+            auto it = _sessions.find(mac);
+            if (it == _sessions.end()) {
+                return;
+            }
+            elapsed = toolkit::getCurrentMillisecond() - it->second.started;
+            _sessions.erase(it);
+            _active = !_sessions.empty();
+            _backoff.erase(mac);
+            _direct[mac] = elapsed;
+        }
+        ++succeeded;
+        InfoL << "Punch " << MacMap::uint64ToMacStr(mac) << " direct via "
+              << toolkit::SockUtil::inet_ntoa(reinterpret_cast<const sockaddr *>(&from)) << ":"
+              << toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&from)) << " in " << elapsed << "ms";
+        // 触发检查，对端的会话可能还未收到本端的检查
+        if (_sender) {
+            _sender(mac, from);
+        }
+        if (_on_direct) {
+            _on_direct(mac, from);
+        }
+    }
+
+    /**
+     * @brief 核心节点记录边缘节点上报的本地地址
+     * @details 超过有效期未重新上报的节点已离开，顺带清除
+     */
+    void setHostCandidates(uint64_t mac, uint16_t port, std::vector<std::string> ips) {
+        auto now = toolkit::getCurrentMillisecond();
+        std::lock_guard<std::mutex> lck(_mtx);
+        if (now - _hostsSwept >= kHostsTtlMs) {
+            _hostsSwept = now;
+            for (auto it = _hosts.begin(); it != _hosts.end();) {
+                it = now - it->second.updated >= kHostsTtlMs ? _hosts.erase(it) : std::next(it);
+            }
+        }
+        auto &hosts = _hosts[mac];
+        hosts.port = port;
+        hosts.ips = std::move(ips);
+        hosts.updated = now;
+    }
+
+    /**
+     * @brief 核心节点为节点生成下发给对端的候选
+     * @param reflexive 核心节点看到的节点地址
+     */
+    std::vector<std::pair<sockaddr_storage, Type>> offer(uint64_t mac, const sockaddr_storage &reflexive) {
+        std::vector<std::pair<sockaddr_storage, Type>> ret;
+        auto ip = toolkit::SockUtil::inet_ntoa(reinterpret_cast<const sockaddr *>(&reflexive));
+        auto port = toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&reflexive));
+        std::lock_guard<std::mutex> lck(_mtx);
+        auto it = _hosts.find(mac);
+        if (it != _hosts.end() && toolkit::getCurrentMillisecond() - it->second.updated >= kHostsTtlMs) {
+            _hosts.erase(it);
+            it = _hosts.end();
+        }
+        if (it != _hosts.end()) {
+            for (auto &host : it->second.ips) {
+                if (host != ip) {
+                    ret.emplace_back(toolkit::SockUtil::make_sockaddr(host.c_str(), it->second.port), Host);
+                }
+            }
+        }
+        if (!port) {
+            return ret;
+        }
+        ret.emplace_back(reflexive, Reflexive);
+        // 端口经过转换时NAT可能按顺序分配端口，对端的检查到达的是新的映射
+        if (it != _hosts.end() && it->second.port != port) {
+            for (int i = 1; i <= kPredictPorts && port + i <= 0xffff; ++i) {
+                ret.emplace_back(toolkit::SockUtil::make_sockaddr(ip.c_str(), port + i), Predicted);
+            }
+        }
+        return ret;
+    }
+
+    /**
+     * @brief 解析文本命令中形如"类型-地址-端口"的候选，类型为h/s/p
+     */
+    static bool parseCandidate(const std::string &str, sockaddr_storage &addr, Type &type) {
+        auto parts = toolkit::split(str, "-");
+        if (parts.size() != 3 || parts[0].size() != 1) {
+            return false;
+        }
+        switch (parts[0][0]) {
+            case 'h': type = Host; break;
+            case 's': type = Reflexive; break;
+            case 'p': type = Predicted; break;
+            default: return false;
+        }
+        auto port = atoi(parts[2].c_str());
+        if (port <= 0 || port > 0xffff) {
+            return false;
+        }
+        addr = toolkit::SockUtil::make_sockaddr(parts[1].c_str(), port);
+        return true;
+    }
+
+    /**
+     * @brief 本机除回环与虚拟网卡外的IP地址
+     */
+    static std::vector<std::string> localAddresses() {
+        std::vector<std::string> ret;
+#ifndef _WIN32
+        ifaddrs *ifs = nullptr;
+        if (getifaddrs(&ifs) != 0) {
+            return ret;
+        }
+        for (auto ifa = ifs; ifa; ifa = ifa->ifa_next) {
+            if (!ifa->ifa_addr || !(ifa->ifa_flags & IFF_UP) || (ifa->ifa_flags & IFF_LOOPBACK)
+                || Config::interfaceName == ifa->ifa_name) {
+                continue;
+            }
+            if (ifa->ifa_addr->sa_family == AF_INET6) {
+                // 链路本地地址需要接口序号，对端无法使用
+                auto in6 = reinterpret_cast<sockaddr_in6 *>(ifa->ifa_addr);
+                if (IN6_IS_ADDR_LINKLOCAL(&in6->sin6_addr)) {
+                    continue;
+                }
+            } else if (ifa->ifa_addr->sa_family != AF_INET) {
+                continue;
+            }
+            ret.emplace_back(toolkit::SockUtil::inet_ntoa(ifa->ifa_addr));
+        }
+        freeifaddrs(ifs);
+#endif
+        return ret;
+    }
+
+private:
+    struct Check {
+        sockaddr_storage addr{};
+        Type type = Reflexive;
+        uint64_t nextAt = 0;        ///< 下次发送时间
+        int tries = 0;              ///< 已发送次数
+    };
+
+    struct Session {
+        uint64_t started = 0;       ///< 发起时间
+        uint64_t deadline = 0;      ///< 超时时间
+        std::vector<Check> checks;
+    };
+
+    struct Hosts {
+        uint16_t port = 0;
+        std::vector<std::string> ips;
+        uint64_t updated = 0;       ///< 最近一次上报的时间
+    };
+
+    struct Backoff {
+        uint64_t wait = 0;          ///< 本次等待时长
+        uint64_t until = 0;         ///< 等待结束时间
+    };
+
+    HolePunch() = default;
+
+    Session &open(uint64_t mac) {
+        auto &session = _sessions[mac];
+        session.started = toolkit::getCurrentMillisecond();
+        session.deadline = session.started + kTimeoutMs;
+        _active = true;
+        return session;
+    }
+
+    static void addCheck(Session &session, const sockaddr_storage &addr, Type type) {
+        for (auto &check : session.checks) {
+            if (compareSockAddr(check.addr, addr)) {
+                check.type = std::max(check.type, type);
+                return;
+            }
+        }
+        Check check;
+        check.addr = addr;
+        check.type = type;
+        session.checks.emplace_back(check);
+    }
+
+    void tick() {
+        static auto &checks = Statistics::Instance().counter("punch.checks");
+        static auto &failed = Statistics::Instance().counter("punch.failed");
+        if (!_active) {
+            return;
+        }
+        std::vector<std::pair<uint64_t, sockaddr_storage>> sends;
+        {
+            std::lock_guard<std::mutex> lck(_mtx);
+            auto now = toolkit::getCurrentMillisecond();
+            std::vector<std::pair<uint64_t, Check *>> due;
+            for (auto it = _sessions.begin(); it != _sessions.end();) {
+                if (now >= it->second.deadline) {
+                    ++failed;
+                    WarnL << "Punch " << MacMap::uint64ToMacStr(it->first) << " timeout";
+                    auto &backoff = _backoff[it->first];
+                    backoff.wait = std::min(backoff.wait ? backoff.wait * 2 : kBackoffMs, kBackoffMaxMs);
+                    backoff.until = now + backoff.wait;
+                    it = _sessions.erase(it);
+                    continue;
+                }
+                for (auto &check : it->second.checks) {
+                    if (check.nextAt <= now) {
+                        due.emplace_back(it->first, &check);
+                    }
+                }
+                ++it;
+            }
+            _active = !_sessions.empty();
+            // 重试次数少的优先，同次数时按候选优先级
+            std::sort(due.begin(), due.end(), [](const std::pair<uint64_t, Check *> &a, const std::pair<uint64_t, Check *> &b) {
+                if (a.second->tries != b.second->tries) {
+                    return a.second->tries < b.second->tries;
+                }
+                return a.second->type > b.second->type;
+            });
+            for (size_t i = 0; i < due.size() && i < (size_t)kChecksPerTick; ++i) {
+                auto check = due[i].second;
+                check->nextAt = now + kRetryMs;
+                ++check->tries;
+                sends.emplace_back(due[i].first, check->addr);
+            }
+        }
+        for (auto &item : sends) {
+            if (_sender) {
+                _sender(item.first, item.second);
+            }
+            ++checks;
+        }
+    }
+
+    /**
+     * @brief 对经核心节点或中继节点转发、且没有直连候选的节点发起打洞
+     */
+    void scan() {
+        if (!Config::enableP2p) {
+            return;
+        }
+        std::vector<uint64_t> relayed;
+        for (auto &item : MacMap::peers()) {
+            auto mac = item.first;
+            if (mac && mac != MAC_BROADCAST && mac != Config::macLocal && mac != Config::macCore && !CoreSet::Instance().isCoreMac(mac)
+                && (CoreSet::Instance().isCore(item.second) || Relay::Instance().routed(mac))) {
+                relayed.emplace_back(mac);
+            }
+        }
+        if (relayed.empty()) {
+            return;
+        }
+        // 路径选择保留的直连候选说明已打通
+        for (auto &item : MacMap::candidates()) {
+            relayed.erase(std::remove(relayed.begin(), relayed.end(), item.mac), relayed.end());
+        }
+        auto now = toolkit::getCurrentMillisecond();
+        sockaddr_storage unknown{};
+        for (auto mac : relayed) {
+            {
+                std::lock_guard<std::mutex> lck(_mtx);
+                auto it = _backoff.find(mac);
+                if (_sessions.count(mac) || (it != _backoff.end() && now < it->second.until)) {
+                    continue;
+                }
+            }
+            request(mac, unknown);
+        }
+    }
+
+    std::string report() {
+        std::lock_guard<std::mutex> lck(_mtx);
+        std::ostringstream oss;
+        oss << "active=" << _sessions.size();
+        for (auto &it : _direct) {
+            oss << "," << MacMap::uint64ToMacStr(it.first) << "=" << it.second << "ms";
+        }
+        return oss.str();
+    }
+
+    std::mutex _mtx;
+    std::atomic<bool> _active{false};
+    CheckSender _sender;
+    Requester _requester;
+    DirectCB _on_direct;
+    std::unordered_map<uint64_t, Session> _sessions;
+    std::unordered_map<uint64_t, Hosts> _hosts;          ///< 核心节点记录的各节点本地地址
+    uint64_t _hostsSwept = 0;                            ///< 上次清除过期本地地址的时间
+    std::unordered_map<uint64_t, Backoff> _backoff;
+    std::unordered_map<uint64_t, uint64_t> _direct;      ///< 各节点最近一次的打通耗时(毫秒)
+};
+
+#endif //TALUSVSWITCH_HOLEPUNCH_H
@@ -0,0 +1,335 @@
+﻿/**
+ * @file IoUring.h
+ * @brief io_uring 最小封装
+ * @details 直接通过系统调用封装io_uring的提交队列、完成队列以及provided buffer ring，
+ * 不依赖liburing，供UringEngine使用
+ */
+
+#ifndef TALUSVSWITCH_IOURING_H
+#define TALUSVSWITCH_IOURING_H
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define HAS_IO_URING 1
+#endif
+
+#if defined(HAS_IO_URING)
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/**
+ * @class IoUring
+ * @brief io_uring 实例
+ * @details 只允许在同一个线程中提交和收割，不做任何加锁
+ */
+class IoUring {
+public:
+    IoUring() = default;
+    ~IoUring() { release(); }
+    IoUring(const IoUring &) = delete;
+    IoUring &operator=(const IoUring &) = delete;
+
+    /**
+     * @brief 创建io_uring
+     * @param entries 提交队列深度
+     * @return 是否成功，内核不支持时返回false
+     */
+    bool init(unsigned entries) {
+        io_uring_params p{};
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = entries * 4;
+        _fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+        if (_fd < 0 && errno == EINVAL) {
+            // 老内核不支持CQSIZE
+            p = {};
+            _fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+        }
+        if (_fd < 0) {
+            return false;
+        }
+        _features = p.features;
+
+        _sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        _cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            _sq_ring_size = _cq_ring_size = std::max(_sq_ring_size, _cq_ring_size);
+        }
+        _sq_ring = mmap(nullptr, _sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+        if (_sq_ring == MAP_FAILED) {
+            _sq_ring = nullptr;
+            release();
+            return false;
+        }
+        if (single_mmap) {
+            _cq_ring = _sq_ring;
+        } else {
+            _cq_ring = mmap(nullptr, _cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_CQ_RING);
+            if (_cq_ring == MAP_FAILED) {
+                _cq_ring = nullptr;
+                release();
+                return false;
+            }
+        }
+        _sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+        auto sqes = mmap(nullptr, _sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+            release();
+            return false;
+        }
+        _sqes = reinterpret_cast<io_uring_sqe *>(sqes);
+
+        auto sq = reinterpret_cast<char *>(_sq_ring);
+        _sq_head = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+        _sq_tail = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+        _sq_flags = reinterpret_cast<unsigned *>(sq + p.sq_off.flags);
+        _sq_array = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+        _sq_mask = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+        _sq_entries = p.sq_entries;
+
+        auto cq = reinterpret_cast<char *>(_cq_ring);
+        _cq_head = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+        _cq_tail = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+        _cq_mask = *reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+        _cqes = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+
+        _sqe_tail = _sqe_submitted = *_sq_tail;
+        return true;
+    }
+
+    /**
+     * @brief 释放io_uring
+     */
+    void release() {
+        if (_sqes) {
+            munmap(_sqes, _sqes_size);
+            _sqes = nullptr;
+        }
+        if (_cq_ring && _cq_ring != _sq_ring) {
+            munmap(_cq_ring, _cq_ring_size);
+        }
+        _cq_ring = nullptr;
+        if (_sq_ring) {
+            munmap(_sq_ring, _sq_ring_size);
+            _sq_ring = nullptr;
+        }
+        if (_fd >= 0) {
+            close(_fd);
+            _fd = -1;
+        }
+    }
+
+    /**
+     * @brief 检查内核是否支持指定操作码
+     */
+    bool supportOp(uint8_t op) const {
+        char buf[sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op)]{};
+        auto probe = reinterpret_cast<io_uring_probe *>(buf);
+        if (syscall(__NR_io_uring_register, _fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+            return false;
+        }
+        return op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    /**
+     * @brief 获取一个空闲的SQE，队列已满时会先提交
+     * @return 已清零的SQE，失败返回nullptr
+     */
+    io_uring_sqe *getSqe() {
+        if (_sqe_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) >= _sq_entries) {
+            submit();
+            if (_sqe_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) >= _sq_entries) {
+                return nullptr;
+            }
+        }
+        auto index = _sqe_tail & _sq_mask;
+        auto sqe = &_sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        _sq_array[index] = index;
+        ++_sqe_tail;
+        return sqe;
+    }
+
+    /**
+     * @brief 未提交的SQE个数
+     */
+    unsigned pending() const { return _sqe_tail - _sqe_submitted; }
+
+    /**
+     * @brief 把已准备好的SQE批量提交给内核
+     * @return 提交的个数，失败返回负数
+     */
+    int submit() {
+        unsigned flags = 0;
+        if (__atomic_load_n(_sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW) {
+            // 让内核把溢出的完成事件刷回完成队列
+            flags |= IORING_ENTER_GETEVENTS;
+        }
+        auto to_submit = pending();
+        if (!to_submit && !flags) {
+            return 0;
+        }
+        __atomic_store_n(_sq_tail, _sqe_tail, __ATOMIC_RELEASE);
+        int ret;
+        do {
+            ret = (int) syscall(__NR_io_uring_enter, _fd, to_submit, 0, flags, nullptr, 0);
+        } while (ret < 0 && errno == EINTR);
+        if (ret > 0) {
+            _sqe_submitted += ret;
+        }
+        return ret;
+    }
+
+    /**
+     * @brief 收割完成队列
+     * @param func 完成事件回调，参数为const io_uring_cqe &
+     * @return 收割的完成事件个数
+     */
+    template <typename FUNC>
+    unsigned reap(FUNC &&func) {
+        unsigned count = 0;
+        unsigned head = *_cq_head;
+        while (true) {
+            auto tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+            if (head == tail) {
+                break;
+            }
+            for (; head != tail; ++head, ++count) {
+                func(_cqes[head & _cq_mask]);
+            }
+            __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+        }
+        return count;
+    }
+
+    /**
+     * @brief 注册provided buffer ring
+     */
+    bool registerBufRing(io_uring_buf_reg &reg) {
+        return syscall(__NR_io_uring_register, _fd, IORING_REGISTER_PBUF_RING, &reg, 1) == 0;
+    }
+
+    int fd() const { return _fd; }
+    unsigned features() const { return _features; }
+
+private:
+    int _fd = -1;
+    unsigned _features = 0;
+
+    void *_sq_ring = nullptr;
+    void *_cq_ring = nullptr;
+    size_t _sq_ring_size = 0;
+    size_t _cq_ring_size = 0;
+    size_t _sqes_size = 0;
+
+    io_uring_sqe *_sqes = nullptr;
+    unsigned *_sq_head = nullptr;
+    unsigned *_sq_tail = nullptr;
+    unsigned *_sq_flags = nullptr;
+    unsigned *_sq_array = nullptr;
+    unsigned _sq_mask = 0;
+    unsigned _sq_entries = 0;
+    unsigned _sqe_tail = 0;      ///< 本地已准备的SQE尾部
+    unsigned _sqe_submitted = 0; ///< 已提交给内核的SQE尾部
+
+    unsigned *_cq_head = nullptr;
+    unsigned *_cq_tail = nullptr;
+    unsigned _cq_mask = 0;
+    io_uring_cqe *_cqes = nullptr;
+};
+
+/**
+ * @class BufferRing
+ * @brief provided buffer ring
+ * @details 一组等长的缓冲区，由内核在收包时自行挑选，用完后归还
+ */
+class BufferRing {
+public:
+    BufferRing() = default;
+    ~BufferRing() {
+        if (_ring) {
+            munmap(_ring, _ring_size);
+        }
+        if (_own_bufs) {
+            delete[] _bufs;
+        }
+    }
+    BufferRing(const BufferRing &) = delete;
+    BufferRing &operator=(const BufferRing &) = delete;
+
+    /**
+     * @brief 创建并注册buffer ring
+     * @param ring 所属io_uring
+     * @param bgid 缓冲区组id
+     * @param count 缓冲区个数，必须为2的幂
+     * @param size 单个缓冲区大小
+     * @param mem_bufs 缓冲区内存，至少count*size字节，由调用方管理；为空时自行分配
+     */
+    bool init(IoUring &ring, uint16_t bgid, unsigned count, unsigned size, char *mem_bufs = nullptr) {
+        _ring_size = count * sizeof(io_uring_buf);
+        auto mem = mmap(nullptr, _ring_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (mem == MAP_FAILED) {
+            return false;
+        }
+        _ring = reinterpret_cast<io_uring_buf_ring *>(mem);
+        _mask = count - 1;
+        _size = size;
+        _bgid = bgid;
+        _own_bufs = !mem_bufs;
+        _bufs = mem_bufs ? mem_bufs : new char[(size_t) count * size];
+
+        io_uring_buf_reg reg{};
+        reg.ring_addr = reinterpret_cast<uint64_t>(_ring);
+        reg.ring_entries = count;
+        reg.bgid = bgid;
+        if (!ring.registerBufRing(reg)) {
+            return false;
+        }
+        for (unsigned i = 0; i < count; ++i) {
+            add(i);
+        }
+        commit();
+        return true;
+    }
+
+    /**
+     * @brief 归还缓冲区，需调用commit生效
+     */
+    void add(uint16_t bid) {
+        // C++下__DECLARE_FLEX_ARRAY中的空结构体占1字节，bufs成员会偏移，这里按内核布局直接寻址
+        auto &buf = reinterpret_cast<io_uring_buf *>(_ring)[_tail & _mask];
+        buf.addr = reinterpret_cast<uint64_t>(buffer(bid));
+        buf.len = _size;
+        buf.bid = bid;
+        ++_tail;
+    }
+
+    /**
+     * @brief 把归还的缓冲区发布给内核
+     */
+    void commit() { __atomic_store_n(&_ring->tail, _tail, __ATOMIC_RELEASE); }
+
+    char *buffer(uint16_t bid) const { return _bufs + (size_t) bid * _size; }
+    unsigned size() const { return _size; }
+    uint16_t bgid() const { return _bgid; }
+
+private:
+    io_uring_buf_ring *_ring = nullptr;
+    size_t _ring_size = 0;
+    char *_bufs = nullptr;
+    bool _own_bufs = false;
+    unsigned _mask = 0;
+    unsigned _size = 0;
+    uint16_t _bgid = 0;
+    uint16_t _tail = 0;
+};
+
+#endif // HAS_IO_URING
+
+#endif //TALUSVSWITCH_IOURING_H
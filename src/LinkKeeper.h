@@ -14,7 +14,13 @@
 #include "TapInterface.h"
 #endif
 #include "Transport.h"
+#include "LinkProbe.h"
+#include "Failover.h"
+#include "SeqMonitor.h"
 #include <Poller/EventPoller.h>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
 #include "Config.h"
 
 using namespace toolkit;
@@ -22,10 +28,20 @@ using namespace toolkit;
 /**
  * @class LinkKeeper
  * @brief 链路维护类
- * @details 通过定期发送心跳包来维护网络中各节点间的连接状态
+ * @details 通过定期发送心跳包来维护网络中各节点间的连接状态，
+ * 开启路径测量时另按探测间隔向各节点发送带序号和时间戳的探测；
+ * 开启路径选择时节点的直连与经核心节点转发两个候选地址都保持并探测，按测量结果选择，
+ * 经核心节点转发的路径得分为本节点到核心节点的测量值加上核心节点报告的核心节点到对端的得分
  */
 class LinkKeeper {
 public:
+    static constexpr double kSwitchRatio = 0.8;         ///< 候选路径得分低于当前的该比例才切换
+    static constexpr double kSwitchMinMs = 1;           ///< 且至少低1ms，避免局域网内的微小差异引起切换
+    static constexpr double kLossPenaltyMs = 200;       ///< 丢包率折算的时延惩罚(100%丢包时)
+    static constexpr uint64_t kSwitchHoldMs = 10 * 1000; ///< 同一节点两次切换的最小间隔
+    static constexpr uint64_t kCoreScoreMs = 5000;      ///< 向核心节点查询其到对端得分的间隔
+    static constexpr uint64_t kCoreScoreStaleMs = 4 * kCoreScoreMs; ///< 核心节点报告的得分超过该时间未更新即失效
+
     /**
      * @brief 启动链路维护服务
      * @details 每5秒向MAC表中的所有对端发送一次ARP广播，用于保持链路活跃
@@ -39,8 +55,144 @@ public:
                     sendKeepData(mac, addr, 0);
                 }
             });
+            // 未使用的候选路径同样保活，保持NAT映射
+            for (auto &item : MacMap::candidates()) {
+                sendKeepData(item.mac, item.alt, 0);
+            }
             return 5000;  // 返回下次执行的延迟时间(毫秒)
         });
+        // 拒绝对端早于本端启动的旧会话时回送保活，对端看到本端的新会话后轮换
+        Crypto::Instance().setOnStale([](const sockaddr_storage &addr) {
+            sendKeepData(MAC_BROADCAST, addr, 0);
+        });
+        // 多个核心节点时探测各核心节点，失效时切换
+        CoreSet::Instance().start(Transport::Instance().getPoller(), [](const sockaddr_storage &addr) {
+            sendKeepData(MAC_BROADCAST, addr, 0);
+        });
+        // 核心节点没有可回退的路径
+        if (Config::failover && toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&Config::corePeer))) {
+            Failover::Instance().start(Transport::Instance().getPoller(), Transport::Instance().localPort());
+        }
+        if (Config::probeInterval > 0) {
+            LinkProbe::Instance().start();
+            Transport::Instance().getPoller()->doDelayTask(Config::probeInterval, []() {
+                sendProbes();
+                if (Config::pathSelect) {
+                    selectPaths();
+                }
+                return Config::probeInterval;
+            });
+        }
+    }
+
+    /**
+     * @brief 向MAC表中的每个节点地址发送一个路径测量探测
+     * @details 同一地址上的多个MAC只探测一次
+     */
+    static void sendProbes() {
+        std::unordered_set<PeerKey, PeerKey::Hash> probed;
+        auto probe = [&probed](const sockaddr_storage &addr) {
+            if (toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&addr)) && probed.insert(PeerKey(addr)).second) {
+                LinkProbe::Instance().probe(addr);
+            }
+        };
+        for (auto &peer : MacMap::peers()) {
+            probe(peer.second);
+        }
+        for (auto &item : MacMap::candidates()) {
+            probe(item.alt);
+        }
+        LinkProbe::Instance().expire();
+    }
+
+    /**
+     * @brief 路径得分，越低越好
+     * @details 丢包率取探测与对端按序号统计的数据丢包率中较高的
+     * @return 尚无测量结果时返回负数
+     */
+    static double pathScore(const sockaddr_storage &addr, LinkProbe::Stats &stats) {
+        if (!LinkProbe::Instance().query(addr, stats)) {
+            return -1;
+        }
+        SeqMonitor::Stats delivery;
+        if (SeqMonitor::Instance().remote(addr, delivery)) {
+            stats.loss = std::max(stats.loss, delivery.loss);
+        }
+        return stats.rtt + stats.jitter + stats.loss * kLossPenaltyMs;
+    }
+
+    /**
+     * @brief 记录核心节点报告的核心节点到对端的得分
+     */
+    static void onCoreScore(uint64_t mac, double score) {
+        auto &scores = coreScores();
+        std::lock_guard<std::mutex> lck(scores.mtx);
+        scores.map[mac] = {score, toolkit::getCurrentMillisecond()};
+    }
+
+    /**
+     * @brief 候选路径得分，经核心节点转发的路径为两段之和
+     * @return 尚无测量结果或核心节点尚未报告到对端的得分时返回负数
+     */
+    static double candidateScore(uint64_t mac, const sockaddr_storage &addr, LinkProbe::Stats &stats) {
+        auto score = pathScore(addr, stats);
+        if (score < 0 || !CoreSet::Instance().isCore(addr)) {
+            return score;
+        }
+        auto &scores = coreScores();
+        std::lock_guard<std::mutex> lck(scores.mtx);
+        auto it = scores.map.find(mac);
+        return it == scores.map.end() ? -1 : score + it->second.first;
+    }
+
+    /**
+     * @brief 清除核心节点超时未更新的得分
+     */
+    static void expireCoreScores() {
+        auto &scores = coreScores();
+        auto now = toolkit::getCurrentMillisecond();
+        std::lock_guard<std::mutex> lck(scores.mtx);
+        for (auto it = scores.map.begin(); it != scores.map.end();) {
+            it = now - it->second.second > kCoreScoreStaleMs ? scores.map.erase(it) : std::next(it);
+        }
+    }
+
+    /**
+     * @brief 在节点的两个候选路径中选择时延与丢包更低的一个
+     * @details 候选路径得分明显更低且距上次切换足够久才切换
+     */
+    static void selectPaths() {
+        static auto &switches = Statistics::Instance().counter("path.switches");
+        static std::unordered_map<uint64_t, uint64_t> lastSwitch;
+        auto now = toolkit::getCurrentMillisecond();
+        expireCoreScores();
+        for (auto &item : MacMap::candidates()) {
+            LinkProbe::Stats cur, alt;
+            auto curScore = candidateScore(item.mac, item.active, cur);
+            auto altScore = candidateScore(item.mac, item.alt, alt);
+            if (curScore < 0 || altScore < 0) {
+                continue;
+            }
+            if (altScore > curScore * kSwitchRatio || altScore > curScore - kSwitchMinMs) {
+                continue;
+            }
+            auto &last = lastSwitch[item.mac];
+            if (last && now - last < kSwitchHoldMs) {
+                continue;
+            }
+            if (!MacMap::switchPeer(item.mac, item.alt)) {
+                continue;
+            }
+            last = now;
+            ++switches;
+            InfoL << "Peer " << MacMap::uint64ToMacStr(item.mac) << " switch path "
+                  << toolkit::SockUtil::inet_ntoa(reinterpret_cast<const sockaddr *>(&item.active)) << ":"
+                  << toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&item.active))
+                  << "(" << curScore << "ms/" << (int)(cur.loss * 100) << "%) -> "
+                  << toolkit::SockUtil::inet_ntoa(reinterpret_cast<const sockaddr *>(&item.alt)) << ":"
+                  << toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&item.alt))
+                  << "(" << altScore << "ms/" << (int)(alt.loss * 100) << "%)";
+        }
     }
 
     /**
@@ -70,6 +222,20 @@ public:
         // 发送保活数据包
         Transport::Instance().send(buf, addr, sizeof(sockaddr_storage), true, ttl);
     }
+
+private:
+    /**
+     * @brief 核心节点报告的到各对端的得分及其更新时间，处理控制消息时写入，路径选择时读取
+     */
+    struct CoreScores {
+        std::mutex mtx;
+        std::unordered_map<uint64_t, std::pair<double, uint64_t>> map;
+    };
+
+    static CoreScores &coreScores() {
+        static CoreScores scores;
+        return scores;
+    }
 };
 
 #endif //TALUSVSWITCH_LINKKEEPER_H
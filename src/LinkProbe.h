@@ -0,0 +1,279 @@
+﻿/**
+ * @file LinkProbe.h
+ * @brief 节点路径的往返时延、抖动与丢包测量
+ * @details 链路保持时向每个节点发送带序号和时间戳的探测，节点原样应答：
+ * - 往返时延按1/8平滑，抖动为相邻样本差值的1/16平滑(RFC 3550)
+ * - 丢包率取最近32个探测中未应答的比例，最新一个尚在途中，不计入
+ * - 探测不经过压缩与加密，直接进入发送队列的控制通道，收包时在解压前识别，不影响数据面
+ * 探测报文格式：扩展报文公共头 + 序号(4字节) + 发送时间(8字节，微秒)，应答只改类型
+ */
+
+#ifndef TALUSVSWITCH_LINKPROBE_H
+#define TALUSVSWITCH_LINKPROBE_H
+
+#include <bitset>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+#include <Network/sockutil.h>
+#include <Util/util.h>
+#include "Packet.h"
+#include "Statistics.h"
+#include "TunnelProto.h"
+#include "Utils.h"
+
+/**
+ * @class LinkProbe
+ * @brief 节点路径测量单例
+ * @details 探测的发送与应答都在传输层poller中执行
+ */
+class LinkProbe {
+public:
+    using Sender = std::function<void(PacketPtr pkt, const sockaddr_storage &addr)>;
+    using RttCB = std::function<void(const sockaddr_storage &addr, double rtt)>;
+
+    static constexpr size_t kProbeSize = TunnelProto::kHeaderSize + 12;
+    static constexpr int kWindow = 32;                  ///< 丢包率统计的探测个数
+    static constexpr uint64_t kIdleMs = 60 * 1000;      ///< 节点不再探测后的保留时间
+
+    /**
+     * @brief 一个节点路径的测量结果
+     */
+    struct Stats {
+        double rtt = -1;        ///< 平滑往返时延(毫秒)，-1为未知
+        double jitter = 0;      ///< 抖动(毫秒)
+        double loss = 0;        ///< 丢包率(0-1)
+    };
+
+    /**
+     * @brief 获取LinkProbe单例
+     */
+    static LinkProbe &Instance() {
+        static LinkProbe probe;
+        return probe;
+    }
+
+    /**
+     * @brief 设置探测与应答的发送方式
+     */
+    void setSender(Sender sender) {
+        _sender = std::move(sender);
+    }
+
+    /**
+     * @brief 设置往返时延样本回调，在传输层poller中执行
+     */
+    void setOnRtt(RttCB cb) {
+        _on_rtt = std::move(cb);
+    }
+
+    /**
+     * @brief 开启本端探测
+     */
+    void start() {
+        Statistics::Instance().addGauge("probe", [this]() { return report(); });
+    }
+
+    /**
+     * @brief 向节点发送一个探测
+     */
+    void probe(const sockaddr_storage &addr) {
+        static auto &probes = Statistics::Instance().counter("probe.sent");
+        if (!_sender) {
+            return;
+        }
+        uint32_t seq;
+        uint64_t now = nowUs();
+        {
+            std::lock_guard<std::mutex> lck(_mtx);
+            auto &peer = _peers[PeerKey(addr)];
+            if (!peer.sent) {
+                peer.addr = addr;
+            }
+            seq = ++peer.seq;
+            peer.answered <<= 1;
+            peer.sent = std::min(peer.sent + 1, kWindow);
+            peer.last = toolkit::getCurrentMillisecond();
+            // 最新一个尚在途中，不计入
+            if (peer.sent > 1) {
+                auto done = peer.sent - 1;
+                auto got = (peer.answered >> 1 & mask(done)).count();
+                peer.stats.loss = 1 - (double)got / done;
+            }
+        }
+        char data[kProbeSize];
+        TunnelProto::writeHeader(data, TunnelProto::LinkProbe);
+        put32(data + TunnelProto::kHeaderSize, seq);
+        put64(data + TunnelProto::kHeaderSize + 4, now);
+        _sender(Packet::create(data, sizeof(data), false), addr);
+        ++probes;
+    }
+
+    /**
+     * @brief 是否为探测或应答报文
+     */
+    static bool isProbe(const char *data, size_t size) {
+        return size == kProbeSize && TunnelProto::isExtended(data, size)
+            && (TunnelProto::type(data) == TunnelProto::LinkProbe || TunnelProto::type(data) == TunnelProto::LinkEcho);
+    }
+
+    /**
+     * @brief 处理探测及应答报文
+     * @details 未开启探测时也应答对端的探测
+     */
+    void onPacket(char *data, size_t size, const sockaddr_storage &from) {
+        if (TunnelProto::type(data) == TunnelProto::LinkProbe) {
+            if (_sender) {
+                TunnelProto::writeHeader(data, TunnelProto::LinkEcho);
+                _sender(Packet::create(data, size, false), from);
+            }
+            return;
+        }
+        auto seq = get32(data + TunnelProto::kHeaderSize);
+        auto sent = get64(data + TunnelProto::kHeaderSize + 4);
+        auto now = nowUs();
+        double rtt;
+        {
+            std::lock_guard<std::mutex> lck(_mtx);
+            auto it = _peers.find(PeerKey(from));
+            if (it == _peers.end() || sent > now) {
+                return;
+            }
+            auto &peer = it->second;
+            auto age = peer.seq - seq;
+            if (age >= (uint32_t)peer.sent || peer.answered[age]) {
+                // 过旧或重复的应答
+                return;
+            }
+            peer.answered[age] = true;
+            rtt = (now - sent) / 1000.0;
+            auto &stats = peer.stats;
+            if (stats.rtt < 0) {
+                stats.rtt = rtt;
+            } else {
+                stats.jitter += (std::fabs(rtt - peer.prev) - stats.jitter) / 16;
+                stats.rtt = stats.rtt * 0.875 + rtt * 0.125;
+            }
+            peer.prev = rtt;
+        }
+        if (_on_rtt) {
+            _on_rtt(from, rtt);
+        }
+    }
+
+    /**
+     * @brief 查询节点路径的测量结果
+     * @return 尚无往返时延样本时返回false
+     */
+    bool query(const sockaddr_storage &addr, Stats &out) {
+        std::lock_guard<std::mutex> lck(_mtx);
+        auto it = _peers.find(PeerKey(addr));
+        if (it == _peers.end() || it->second.stats.rtt < 0) {
+            return false;
+        }
+        out = it->second.stats;
+        return true;
+    }
+
+    /**
+     * @brief 最近连续未应答的探测个数，最新一个尚在途中，不计入
+     * @return 从未应答过的节点返回-1，对端可能不支持探测
+     */
+    int missed(const sockaddr_storage &addr) {
+        std::lock_guard<std::mutex> lck(_mtx);
+        auto it = _peers.find(PeerKey(addr));
+        if (it == _peers.end() || it->second.stats.rtt < 0) {
+            return -1;
+        }
+        auto &peer = it->second;
+        int n = 0;
+        while (n + 1 < peer.sent && !peer.answered[n + 1]) {
+            ++n;
+        }
+        return n;
+    }
+
+    /**
+     * @brief 清理不再探测的节点
+     */
+    void expire() {
+        std::lock_guard<std::mutex> lck(_mtx);
+        auto now = toolkit::getCurrentMillisecond();
+        for (auto it = _peers.begin(); it != _peers.end();) {
+            if (now - it->second.last > kIdleMs) {
+                it = _peers.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+private:
+    struct Peer {
+        sockaddr_storage addr{};
+        uint32_t seq = 0;               ///< 最近一次探测的序号
+        int sent = 0;                   ///< 窗口内已发送的探测个数
+        std::bitset<kWindow> answered;  ///< 第i位为序号seq-i的探测是否已应答
+        double prev = 0;                ///< 上一个往返时延样本(毫秒)
+        uint64_t last = 0;              ///< 最近一次探测的时间(毫秒)
+        Stats stats;
+    };
+
+    LinkProbe() = default;
+
+    /**
+     * @brief 单调时钟(微秒)，toolkit的时间戳由后台线程按毫秒级刷新，精度不足以测量局域网时延
+     */
+    static uint64_t nowUs() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static std::bitset<kWindow> mask(int n) {
+        return std::bitset<kWindow>((1ULL << n) - 1);
+    }
+
+    static void put32(char *p, uint32_t v) {
+        TunnelProto::put16(p, v >> 16);
+        TunnelProto::put16(p + 2, v);
+    }
+
+    static uint32_t get32(const char *p) {
+        return (uint32_t)TunnelProto::get16(p) << 16 | TunnelProto::get16(p + 2);
+    }
+
+    static void put64(char *p, uint64_t v) {
+        put32(p, v >> 32);
+        put32(p + 4, v);
+    }
+
+    static uint64_t get64(const char *p) {
+        return (uint64_t)get32(p) << 32 | get32(p + 4);
+    }
+
+    std::string report() {
+        std::lock_guard<std::mutex> lck(_mtx);
+        std::ostringstream oss;
+        for (auto &it : _peers) {
+            auto &stats = it.second.stats;
+            if (stats.rtt < 0) {
+                continue;
+            }
+            auto addr = reinterpret_cast<const sockaddr *>(&it.second.addr);
+            oss << (oss.tellp() ? "," : "") << toolkit::SockUtil::inet_ntoa(addr) << ":" << toolkit::SockUtil::inet_port(addr)
+                << "=" << std::fixed << std::setprecision(2) << stats.rtt << "ms/" << stats.jitter << "ms/"
+                << std::setprecision(0) << stats.loss * 100 << "%";
+        }
+        return oss.str();
+    }
+
+    std::mutex _mtx;
+    Sender _sender;
+    RttCB _on_rtt;
+    std::unordered_map<PeerKey, Peer, PeerKey::Hash> _peers;
+};
+
+#endif //TALUSVSWITCH_LINKPROBE_H
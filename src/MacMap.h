@@ -5,6 +5,7 @@
 #ifndef TUNNEL_MACMAP_H
 #define TUNNEL_MACMAP_H
 
+#include <atomic>
 #include <functional>
 #include <iomanip>
 #include <sstream>
@@ -22,6 +23,13 @@
 
 #define MAC_BROADCAST (uint64_t)(0xFFFFFFFFFFFFFFFF << 16)
 
+// 同一节点以新地址出现时，旧地址在该时间内仍有流量则保持不变(毫秒)，
+// 多路径的节点会交替从多个地址发来数据
+#define MAC_PEER_HOLD_MS 2000
+
+// 节点的地址超过该时间没有流量即视为失效(毫秒)
+#define MAC_PEER_EXPIRE_MS (20*1000)
+
 class MacMap{
 public:
     class MacPeer{
@@ -29,7 +37,22 @@ public:
         sockaddr_storage sock{};
         uint8_t ttl{};
         toolkit::Ticker ticker;
+        // 开启路径选择时保留的另一个候选地址(直连或经核心节点转发)，由测量结果决定使用哪个
+        sockaddr_storage alt{};
+        uint8_t altTtl{};
+        uint64_t altSeen{};     // 候选地址最近一次有流量的时间(毫秒)
+    };
+    // 有两个候选地址的节点
+    struct Candidates{
+        uint64_t mac;
+        sockaddr_storage active;
+        sockaddr_storage alt;
     };
+    // 是否保留候选地址，由路径选择开启
+    static bool &keepCandidates(){
+        static bool keep = false;
+        return keep;
+    }
     static uint64_t macToUint64(const std::string& macAddress) {
         uint64_t addr = 0;
         auto *a = reinterpret_cast<uint8_t *>(&addr);
@@ -59,17 +82,36 @@ public:
     static void addMacPeer(uint64_t mac,const sockaddr_storage& peer,uint8_t ttl){
         std::lock_guard<std::mutex> lck(macMutex());
         auto& peerInfo = macMap()[mac];
-        if(!compareSockAddr(peerInfo.sock,peer)){
-            if( peerInfo.ttl <= ttl ){
+        bool candidates = keepCandidates() && mac != MAC_BROADCAST;
+        if(candidates && compareSockAddr(peerInfo.alt,peer)){
+            // 已知的候选地址，由路径选择决定是否切换
+            peerInfo.altSeen = toolkit::getCurrentMillisecond();
+            peerInfo.altTtl = ttl;
+        }else if(!compareSockAddr(peerInfo.sock,peer)){
+            // ttl更大(更直接)的地址立即替换，相同ttl时等旧地址沉寂后再替换
+            bool known = toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&peerInfo.sock)) != 0;
+            bool hold = known && peerInfo.ttl == ttl && peerInfo.ticker.elapsedTime() < MAC_PEER_HOLD_MS;
+            if( peerInfo.ttl <= ttl && !hold ){
+                if(candidates && known){
+                    // 原地址保留为候选
+                    peerInfo.alt = peerInfo.sock;
+                    peerInfo.altTtl = peerInfo.ttl;
+                    peerInfo.altSeen = toolkit::getCurrentMillisecond() - peerInfo.ticker.elapsedTime();
+                }
                 peerInfo.sock = peer;
                 peerInfo.ticker.resetTime();
                 peerInfo.ttl = ttl;
+                ++generation();
 
                 InfoL<<"Peer:"<<MacMap::uint64ToMacStr(mac)
                       <<" - "
                       <<toolkit::SockUtil::inet_ntoa(reinterpret_cast<const sockaddr *>(&peer))
                       <<":"
                       <<toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&peer));
+            }else if(candidates){
+                peerInfo.alt = peer;
+                peerInfo.altSeen = toolkit::getCurrentMillisecond();
+                peerInfo.altTtl = ttl;
             }
         }else{
             peerInfo.ticker.resetTime();
@@ -82,6 +124,23 @@ public:
             });
         });
     }
+    // 直接设置节点地址，不受ttl与保持时间限制，用于打洞成功与中继路由
+    static void setMacPeer(uint64_t mac,const sockaddr_storage& peer,uint8_t ttl){
+        std::lock_guard<std::mutex> lck(macMutex());
+        auto& peerInfo = macMap()[mac];
+        bool changed = !compareSockAddr(peerInfo.sock,peer);
+        peerInfo.sock = peer;
+        peerInfo.ttl = ttl;
+        peerInfo.ticker.resetTime();
+        if(changed){
+            ++generation();
+            InfoL<<"Peer:"<<MacMap::uint64ToMacStr(mac)
+                  <<" - "
+                  <<toolkit::SockUtil::inet_ntoa(reinterpret_cast<const sockaddr *>(&peer))
+                  <<":"
+                  <<toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&peer));
+        }
+    }
     static sockaddr_storage getMacPeer(uint64_t mac,bool& got){
         std::lock_guard<std::mutex> lck(macMutex());
         if(macMap().find(mac) != macMap().end()){
@@ -107,6 +166,11 @@ public:
         static std::mutex mtx;
         return mtx;
     }
+    // 节点地址的变化次数，每次增删或切换地址时加一，用于低成本地发现MAC表的变化
+    static std::atomic<uint64_t> &generation(){
+        static std::atomic<uint64_t> gen{0};
+        return gen;
+    }
     static void forEach(const std::function<void(uint64_t mac,sockaddr_storage addr)>& cb){
         std::lock_guard<std::mutex> lck(macMutex());
         auto poller = toolkit::EventPollerPool::Instance().getPoller(true);
@@ -116,17 +180,106 @@ public:
             },false);
         }
     }
+    static std::vector<std::pair<uint64_t,sockaddr_storage>> peers(){
+        std::lock_guard<std::mutex> lck(macMutex());
+        std::vector<std::pair<uint64_t,sockaddr_storage>> ret;
+        ret.reserve(macMap().size());
+        for (auto & it : macMap()) {
+            ret.emplace_back(it.first,it.second.sock);
+        }
+        return ret;
+    }
+    // 两个候选地址都未失效的节点
+    static std::vector<Candidates> candidates(){
+        std::lock_guard<std::mutex> lck(macMutex());
+        std::vector<Candidates> ret;
+        for (auto & it : macMap()) {
+            auto &peer = it.second;
+            if(toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&peer.alt))
+               && toolkit::getCurrentMillisecond() - peer.altSeen < MAC_PEER_EXPIRE_MS && peer.ticker.elapsedTime() < MAC_PEER_EXPIRE_MS){
+                ret.push_back({it.first,peer.sock,peer.alt});
+            }
+        }
+        return ret;
+    }
+    // 把节点切换到候选地址，原地址成为候选
+    static bool switchPeer(uint64_t mac,const sockaddr_storage& to){
+        std::lock_guard<std::mutex> lck(macMutex());
+        auto it = macMap().find(mac);
+        if(it == macMap().end() || !compareSockAddr(it->second.alt,to)){
+            return false;
+        }
+        auto &peer = it->second;
+        auto seen = toolkit::getCurrentMillisecond() - peer.ticker.elapsedTime();
+        std::swap(peer.sock,peer.alt);
+        std::swap(peer.ttl,peer.altTtl);
+        peer.ticker.resetTime();
+        peer.altSeen = seen;
+        ++generation();
+        return true;
+    }
+    // 各节点的当前地址及其最近一次有流量距今的时间(毫秒)
+    struct PeerAge{
+        uint64_t mac;
+        sockaddr_storage sock;
+        uint64_t idle;
+    };
+    static std::vector<PeerAge> ages(){
+        std::lock_guard<std::mutex> lck(macMutex());
+        std::vector<PeerAge> ret;
+        ret.reserve(macMap().size());
+        for (auto & it : macMap()) {
+            ret.push_back({it.first,it.second.sock,it.second.ticker.elapsedTime()});
+        }
+        return ret;
+    }
+    // 地址失效，使用该地址的节点改走to为其选择的地址(核心节点)，失效地址也不再作为候选
+    // 返回受影响的节点及失效地址已沉寂的时间(毫秒)
+    static std::vector<std::pair<uint64_t,uint64_t>> failover(const sockaddr_storage& dead,
+                                                              const std::function<sockaddr_storage(uint64_t mac)>& to,uint8_t ttl){
+        std::lock_guard<std::mutex> lck(macMutex());
+        std::vector<std::pair<uint64_t,uint64_t>> ret;
+        for (auto & it : macMap()) {
+            auto &peer = it.second;
+            if(it.first == MAC_BROADCAST){
+                continue;
+            }
+            if(compareSockAddr(peer.alt,dead)){
+                peer.alt = {};
+                peer.altSeen = 0;
+            }
+            if(!compareSockAddr(peer.sock,dead)){
+                continue;
+            }
+            ret.emplace_back(it.first,peer.ticker.elapsedTime());
+            auto target = to(it.first);
+            peer.ttl = compareSockAddr(peer.alt,target) ? peer.altTtl : ttl;
+            peer.sock = target;
+            peer.alt = {};
+            peer.altSeen = 0;
+            peer.ticker.resetTime();
+            ++generation();
+            InfoL<<"Peer:"<<MacMap::uint64ToMacStr(it.first)
+                  <<" failover - "
+                  <<toolkit::SockUtil::inet_ntoa(reinterpret_cast<const sockaddr *>(&target))
+                  <<":"
+                  <<toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&target));
+        }
+        return ret;
+    }
     static void removePeer(uint64_t mac){
         std::lock_guard<std::mutex> lck(macMutex());
         InfoL<<"RemovePeer:"<<MacMap::uint64ToMacStr(mac);
-        macMap().erase(mac);
+        if(macMap().erase(mac)){
+            ++generation();
+        }
     }
     static void checkMac(){
         std::lock_guard<std::mutex> lck(macMutex());
         auto poller = toolkit::EventPollerPool::Instance().getPoller(false);
         for (auto & it : macMap()) {
             poller->async([mac = it.first,time = it.second.ticker.elapsedTime()]{
-                if( time > 20*1000 && mac != MAC_BROADCAST){
+                if( time > MAC_PEER_EXPIRE_MS && mac != MAC_BROADCAST){
                     removePeer(mac);
                 }
             },false);
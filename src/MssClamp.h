@@ -0,0 +1,144 @@
+﻿/**
+ * @file MssClamp.h
+ * @brief TCP MSS钳制
+ * @details 改写进出隧道的TCP SYN/SYN-ACK中的MSS选项，使TCP报文段编码后不超过路径数据报上限，
+ * 避免IP分片或隧道分片。校验和按RFC 1624增量更新
+ */
+
+#ifndef TALUSVSWITCH_MSSCLAMP_H
+#define TALUSVSWITCH_MSSCLAMP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include "Statistics.h"
+
+/**
+ * @class MssClamp
+ * @brief TCP MSS钳制
+ * @details 支持以太网帧(可带一层VLAN标签)中的IPv4(非分片)和IPv6(无扩展头)
+ */
+class MssClamp {
+public:
+    static constexpr size_t kTunnelOverhead = 16;   ///< 压缩后相对原帧的最大膨胀(zlib头尾与存储块头)
+
+    /**
+     * @brief 数据报上限对应的MSS
+     * @param budget 数据报上限
+     * @param l3 以太网头及IP头长度
+     */
+    static uint16_t mssFor(size_t budget, size_t l3) {
+        auto overhead = kTunnelOverhead + l3 + 20;
+        return budget > overhead + 536 ? (uint16_t)(budget - overhead) : 536;
+    }
+
+    /**
+     * @brief 钳制帧中的MSS选项
+     * @param frame 以太网帧，原地修改
+     * @param size 帧长度
+     * @param budget 到对端的数据报上限
+     * @return 是否修改了帧
+     */
+    static bool apply(char *frame, size_t size, size_t budget) {
+        auto p = reinterpret_cast<uint8_t *>(frame);
+        size_t l2 = 14;
+        if (size < l2) {
+            return false;
+        }
+        uint16_t type = p[12] << 8 | p[13];
+        if (type == 0x8100) {
+            if (size < l2 + 4) {
+                return false;
+            }
+            type = p[16] << 8 | p[17];
+            l2 += 4;
+        }
+
+        size_t tcp;
+        if (type == 0x0800) {
+            if (size < l2 + 20 || (p[l2] >> 4) != 4 || p[l2 + 9] != 6) {
+                return false;
+            }
+            // 只处理首个分片
+            if ((p[l2 + 6] & 0x1f) || p[l2 + 7]) {
+                return false;
+            }
+            tcp = l2 + (p[l2] & 0x0f) * 4;
+        } else if (type == 0x86dd) {
+            if (size < l2 + 40 || p[l2 + 6] != 6) {
+                return false;
+            }
+            tcp = l2 + 40;
+        } else {
+            return false;
+        }
+        if (size < tcp + 20 || !(p[tcp + 13] & 0x02)) {
+            // 不是SYN
+            return false;
+        }
+        size_t tcpLen = (p[tcp + 12] >> 4) * 4;
+        if (tcpLen < 20 || size < tcp + tcpLen) {
+            return false;
+        }
+
+        auto mss = mssFor(budget, type == 0x0800 ? l2 + 20 : l2 + 40);
+        for (size_t i = tcp + 20; i < tcp + tcpLen;) {
+            auto kind = p[i];
+            if (kind == 0) {
+                break;
+            }
+            if (kind == 1) {
+                ++i;
+                continue;
+            }
+            if (i + 1 >= tcp + tcpLen || p[i + 1] < 2 || i + p[i + 1] > tcp + tcpLen) {
+                return false;
+            }
+            if (kind == 2 && p[i + 1] == 4) {
+                uint16_t old = p[i + 2] << 8 | p[i + 3];
+                if (old <= mss) {
+                    return false;
+                }
+                // 按16位对齐的字更新校验和，选项可能不在偶数偏移上
+                auto start = tcp + ((i + 2 - tcp) & ~(size_t)1);
+                auto end = tcp + ((i + 4 - tcp + 1) & ~(size_t)1);
+                uint16_t before[3], after[3];
+                auto words = (end - start) / 2;
+                for (size_t w = 0; w < words; ++w) {
+                    before[w] = word(p, start + w * 2, tcp + tcpLen);
+                }
+                p[i + 2] = mss >> 8;
+                p[i + 3] = mss & 0xff;
+                uint16_t sum = p[tcp + 16] << 8 | p[tcp + 17];
+                for (size_t w = 0; w < words; ++w) {
+                    after[w] = word(p, start + w * 2, tcp + tcpLen);
+                    sum = update(sum, before[w], after[w]);
+                }
+                p[tcp + 16] = sum >> 8;
+                p[tcp + 17] = sum & 0xff;
+                static auto &clamped = Statistics::Instance().counter("mss.clamped");
+                ++clamped;
+                return true;
+            }
+            i += p[i + 1];
+        }
+        return false;
+    }
+
+private:
+    static uint16_t word(const uint8_t *p, size_t off, size_t end) {
+        return p[off] << 8 | (off + 1 < end ? p[off + 1] : 0);
+    }
+
+    /**
+     * @brief 增量更新校验和 HC' = ~(~HC + ~m + m')
+     */
+    static uint16_t update(uint16_t sum, uint16_t old, uint16_t now) {
+        uint32_t s = (uint16_t)~sum + (uint16_t)~old + now;
+        s = (s & 0xffff) + (s >> 16);
+        s = (s & 0xffff) + (s >> 16);
+        return (uint16_t)~s;
+    }
+};
+
+#endif //TALUSVSWITCH_MSSCLAMP_H
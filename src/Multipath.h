@@ -0,0 +1,442 @@
+﻿/**
+ * @file Multipath.h
+ * @brief 多路径底层链路绑定
+ * @details 本端有多个上行链路时，每个链路绑定一个本地地址并使用独立的UDP socket：
+ * - 按内层报文的流(五元组)选择链路，同一条流固定走同一链路，避免乱序
+ * - 调度策略：hash为按流均分，weighted为按权重分配，latency为全部走时延最低的链路
+ * - 每个链路按节点周期性发送探测，连续多次无应答判定为故障，该链路上的流迁移到其他链路，
+ *   应答恢复后重新启用
+ * - 所有链路都故障时回退到默认socket
+ * 探测报文格式：扩展报文公共头 + 链路序号(1字节) + 发送时间(8字节，微秒)，应答原样返回
+ */
+
+#ifndef TALUSVSWITCH_MULTIPATH_H
+#define TALUSVSWITCH_MULTIPATH_H
+
+#include <cmath>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+#include <Network/Socket.h>
+#include <Util/logger.h>
+#include <Util/util.h>
+#include "Ecn.h"
+#include "Statistics.h"
+#include "TunnelProto.h"
+#include "Utils.h"
+
+/**
+ * @class Multipath
+ * @brief 多路径调度单例
+ * @details 链路socket、探测与调度都在传输层poller中执行
+ */
+class Multipath {
+public:
+    static constexpr size_t kMaxUplinks = 8;            ///< 最多链路数
+    static constexpr uint64_t kProbeMs = 500;           ///< 探测间隔
+    static constexpr int kDownMisses = 3;               ///< 连续无应答多少次判定为故障
+    static constexpr uint64_t kIdleMs = 60 * 1000;      ///< 节点空闲超时，超时后不再探测
+    static constexpr double kSwitchRatio = 0.8;         ///< latency策略下新链路时延低于当前的该比例才切换
+    static constexpr size_t kProbeSize = TunnelProto::kHeaderSize + 9;
+
+    /**
+     * @brief 调度策略
+     */
+    enum Policy {
+        Hash,       ///< 按流均分
+        Weighted,   ///< 按权重分配
+        Latency,    ///< 时延最低
+    };
+
+    /**
+     * @brief 上行链路
+     */
+    struct Uplink {
+        std::string ip;             ///< 绑定的本地地址
+        int weight = 1;             ///< 权重
+        int family = AF_INET;       ///< socket地址族
+        int tos = -1;               ///< socket当前的TOS
+        toolkit::Socket::Ptr sock;
+    };
+
+    /**
+     * @brief 获取Multipath单例
+     */
+    static Multipath &Instance() {
+        static Multipath multipath;
+        return multipath;
+    }
+
+    static Policy parsePolicy(const std::string &policy) {
+        if (policy == "weighted") {
+            return Weighted;
+        }
+        if (policy == "latency") {
+            return Latency;
+        }
+        return Hash;
+    }
+
+    /**
+     * @brief 启动
+     * @param poller 传输层poller
+     * @param port 本地端口，与默认socket相同
+     * @param uplinks 本地地址列表，格式为ip[@权重],...
+     * @param policy 调度策略
+     */
+    void start(const toolkit::EventPoller::Ptr &poller, uint16_t port, const std::string &uplinks, Policy policy) {
+        for (auto &item : toolkit::split(uplinks, ",")) {
+            if (_uplinks.size() == kMaxUplinks) {
+                WarnL << "Too many uplinks, ignore " << item;
+                continue;
+            }
+            Uplink uplink;
+            auto pos = item.find('@');
+            uplink.ip = item.substr(0, pos);
+            if (pos != std::string::npos) {
+                uplink.weight = std::max(1, atoi(item.c_str() + pos + 1));
+            }
+            uplink.sock = toolkit::Socket::createSocket(poller, false);
+            if (!uplink.sock->bindUdpSock(port, uplink.ip, true)) {
+                WarnL << "Bind uplink " << uplink.ip << ":" << port << " failed";
+                continue;
+            }
+            sockaddr_storage local{};
+            socklen_t len = sizeof(local);
+            getsockname(uplink.sock->rawFD(), reinterpret_cast<sockaddr *>(&local), &len);
+            uplink.family = local.ss_family;
+            InfoL << "Uplink " << _uplinks.size() << ": " << uplink.ip << " weight " << uplink.weight;
+            _uplinks.emplace_back(std::move(uplink));
+        }
+        if (_uplinks.empty()) {
+            return;
+        }
+        _policy = policy;
+        poller->doDelayTask(kProbeMs, [this]() {
+            tick();
+            return kProbeMs;
+        });
+        Statistics::Instance().addGauge("multipath", [this]() { return report(); });
+    }
+
+    bool enabled() const { return !_uplinks.empty(); }
+
+    /**
+     * @brief 设置往返时延样本回调，在传输层poller中执行
+     */
+    void setOnRtt(std::function<void(const sockaddr_storage &addr, double rtt)> cb) {
+        _on_rtt = std::move(cb);
+    }
+
+    const std::vector<Uplink> &uplinks() const { return _uplinks; }
+
+    /**
+     * @brief 计算内层以太网帧的流哈希
+     * @details IP报文取地址、协议与TCP/UDP端口(分片只取地址与协议)，其他报文取MAC地址
+     */
+    static uint32_t flowHash(const char *frame, size_t size) {
+        auto p = reinterpret_cast<const uint8_t *>(frame);
+        if (size < 14) {
+            return 0;
+        }
+        size_t l3 = 14;
+        uint16_t type = p[12] << 8 | p[13];
+        if (type == 0x8100 && size >= 18) {
+            type = p[16] << 8 | p[17];
+            l3 = 18;
+        }
+        uint64_t h = 14695981039346656037ULL;
+        auto mix = [&h](const uint8_t *data, size_t len) {
+            for (size_t i = 0; i < len; ++i) {
+                h = (h ^ data[i]) * 1099511628211ULL;
+            }
+        };
+        uint8_t proto = 0;
+        size_t l4 = 0;
+        if (type == 0x0800 && size >= l3 + 20) {
+            auto ip = p + l3;
+            proto = ip[9];
+            mix(ip + 9, 1);
+            mix(ip + 12, 8);
+            bool fragment = ((ip[6] & 0x3f) | ip[7]) != 0;
+            l4 = fragment ? 0 : l3 + (ip[0] & 0x0f) * 4;
+        } else if (type == 0x86dd && size >= l3 + 40) {
+            auto ip = p + l3;
+            proto = ip[6];
+            mix(ip + 6, 1);
+            mix(ip + 8, 32);
+            l4 = l3 + 40;
+        } else {
+            mix(p, 12);
+            return (uint32_t)(h ^ h >> 32);
+        }
+        if ((proto == 6 || proto == 17) && l4 && size >= l4 + 4) {
+            mix(p + l4, 4);
+        }
+        return (uint32_t)(h ^ h >> 32);
+    }
+
+    /**
+     * @brief 为流选择链路
+     * @param peer 节点地址
+     * @param flow 流哈希
+     * @return 链路序号，所有链路都故障时返回-1，使用默认socket
+     */
+    int select(const sockaddr_storage &peer, uint32_t flow) {
+        std::lock_guard<std::mutex> lck(_mtx);
+        auto &state = peerState(peer);
+        if (_policy == Latency && state.preferred >= 0 && state.paths[state.preferred].up) {
+            return state.preferred;
+        }
+        int best = -1;
+        double bestScore = 0;
+        for (size_t i = 0; i < _uplinks.size(); ++i) {
+            if (!state.paths[i].up) {
+                continue;
+            }
+            // 最高随机权重哈希，链路增减时只迁移受影响的流
+            auto score = unitHash(flow, i);
+            if (_policy == Weighted) {
+                score = _uplinks[i].weight / -std::log(score);
+            }
+            if (best < 0 || score > bestScore) {
+                best = (int)i;
+                bestScore = score;
+            }
+        }
+        return best;
+    }
+
+    /**
+     * @brief 通过链路发送数据报，需随后调用flushAll
+     * @param tos 外层TOS，-1为不设置
+     */
+    void send(int path, toolkit::Buffer::Ptr buf, const sockaddr_storage &addr, int tos = -1) {
+        auto &uplink = _uplinks[path];
+        sockaddr_storage dst;
+        auto len = PeerKey(addr).toSockAddr(uplink.family, dst);
+        if (!len) {
+            return;
+        }
+        if (tos >= 0 && tos != uplink.tos) {
+            // 之前的数据报按原TOS发出后再切换
+            uplink.sock->flushAll();
+            Ecn::setSocketTos(uplink.sock->rawFD(), tos);
+            uplink.tos = tos;
+        }
+        uplink.sock->send(std::move(buf), reinterpret_cast<sockaddr *>(&dst), len, false);
+    }
+
+    void flushAll() {
+        for (auto &uplink : _uplinks) {
+            uplink.sock->flushAll();
+        }
+    }
+
+    /**
+     * @brief 是否有链路socket积压
+     */
+    bool busy(size_t limit) const {
+        for (auto &uplink : _uplinks) {
+            if (uplink.sock->isSocketBusy() || uplink.sock->getSendBufferCount() >= limit) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * @brief 是否为探测或应答报文
+     */
+    static bool isProbe(const char *data, size_t size) {
+        return size == kProbeSize && TunnelProto::isExtended(data, size)
+            && (TunnelProto::type(data) == TunnelProto::PathProbe || TunnelProto::type(data) == TunnelProto::PathEcho);
+    }
+
+    /**
+     * @brief 处理探测及应答报文
+     * @param fd 收到报文的socket，探测从原socket应答，保证应答走同一链路
+     * @details 未开启多路径时也应答对端的探测
+     */
+    void onProbe(char *data, size_t size, const sockaddr_storage &from, int fd) {
+        if (TunnelProto::type(data) == TunnelProto::PathProbe) {
+            TunnelProto::writeHeader(data, TunnelProto::PathEcho);
+            sockaddr_storage local{};
+            socklen_t len = sizeof(local);
+            getsockname(fd, reinterpret_cast<sockaddr *>(&local), &len);
+            sockaddr_storage dst;
+            len = PeerKey(from).toSockAddr(local.ss_family, dst);
+            ::sendto(fd, data, size, 0, reinterpret_cast<const sockaddr *>(&dst), len);
+            return;
+        }
+        static auto &ups = Statistics::Instance().counter("multipath.up");
+        size_t path = (uint8_t)data[TunnelProto::kHeaderSize];
+        uint64_t sent = 0;
+        for (int i = 0; i < 8; ++i) {
+            sent = sent << 8 | (uint8_t)data[TunnelProto::kHeaderSize + 1 + i];
+        }
+        std::lock_guard<std::mutex> lck(_mtx);
+        auto it = _peers.find(PeerKey(from));
+        if (path >= _uplinks.size() || it == _peers.end() || it->second.paths[path].sent != sent) {
+            return;
+        }
+        auto &state = it->second.paths[path];
+        auto rtt = (toolkit::getCurrentMicrosecond() - sent) / 1000.0;
+        state.rtt = state.rtt < 0 ? rtt : state.rtt * 0.875 + rtt * 0.125;
+        if (_on_rtt) {
+            _on_rtt(it->second.addr, rtt);
+        }
+        state.answered = true;
+        state.misses = 0;
+        if (!state.up) {
+            state.up = true;
+            ++ups;
+            InfoL << "Uplink " << _uplinks[path].ip << " to " << peerName(it->second.addr) << " up";
+        }
+    }
+
+private:
+    /**
+     * @brief 一个节点在一个链路上的状态
+     */
+    struct PathState {
+        bool up = true;         ///< 未探测前视为可用
+        bool answered = true;   ///< 最近一次探测是否已应答
+        int misses = 0;         ///< 连续无应答次数
+        double rtt = -1;        ///< 平滑往返时延(毫秒)，-1为未知
+        uint64_t sent = 0;      ///< 最近一次探测的发送时间(微秒)
+    };
+
+    struct PeerState {
+        sockaddr_storage addr{};
+        int preferred = -1;     ///< latency策略当前使用的链路
+        uint64_t used = 0;      ///< 最近一次调度时间
+        PathState paths[kMaxUplinks];
+    };
+
+    Multipath() = default;
+
+    PeerState &peerState(const sockaddr_storage &peer) {
+        auto &state = _peers[PeerKey(peer)];
+        if (!state.used) {
+            state.addr = peer;
+        }
+        state.used = toolkit::getCurrentMillisecond();
+        return state;
+    }
+
+    /**
+     * @brief 流与链路的哈希，映射到(0,1)
+     */
+    static double unitHash(uint32_t flow, size_t path) {
+        uint64_t x = ((uint64_t)flow << 8 | path) * 0x9E3779B97F4A7C15ULL;
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+        x ^= x >> 31;
+        return ((x >> 11) + 0.5) / 9007199254740992.0;
+    }
+
+    void tick() {
+        static auto &downs = Statistics::Instance().counter("multipath.down");
+        static auto &probes = Statistics::Instance().counter("multipath.probes");
+        std::lock_guard<std::mutex> lck(_mtx);
+        auto now = toolkit::getCurrentMillisecond();
+        for (auto it = _peers.begin(); it != _peers.end();) {
+            auto &peer = it->second;
+            if (now - peer.used > kIdleMs) {
+                it = _peers.erase(it);
+                continue;
+            }
+            for (size_t i = 0; i < _uplinks.size(); ++i) {
+                auto &state = peer.paths[i];
+                if (!state.answered && ++state.misses >= kDownMisses && state.up) {
+                    state.up = false;
+                    ++downs;
+                    WarnL << "Uplink " << _uplinks[i].ip << " to " << peerName(peer.addr) << " down";
+                }
+                state.sent = toolkit::getCurrentMicrosecond();
+                state.answered = false;
+                sendProbe(i, peer.addr, state.sent);
+                ++probes;
+            }
+            if (_policy == Latency) {
+                choose(peer);
+            }
+            ++it;
+        }
+    }
+
+    /**
+     * @brief latency策略下选择时延最低的链路，新链路明显更快时才切换，避免来回抖动
+     */
+    void choose(PeerState &peer) {
+        int best = -1;
+        for (size_t i = 0; i < _uplinks.size(); ++i) {
+            auto &state = peer.paths[i];
+            if (state.up && state.rtt >= 0 && (best < 0 || state.rtt < peer.paths[best].rtt)) {
+                best = (int)i;
+            }
+        }
+        auto cur = peer.preferred;
+        if (best < 0 || best == cur) {
+            return;
+        }
+        if (cur >= 0 && peer.paths[cur].up && peer.paths[best].rtt > peer.paths[cur].rtt * kSwitchRatio) {
+            return;
+        }
+        peer.preferred = best;
+        InfoL << "Peer " << peerName(peer.addr) << " switch to uplink " << _uplinks[best].ip
+              << ", rtt " << peer.paths[best].rtt << "ms";
+    }
+
+    void sendProbe(size_t path, const sockaddr_storage &addr, uint64_t sent) {
+        char probe[kProbeSize];
+        TunnelProto::writeHeader(probe, TunnelProto::PathProbe);
+        probe[TunnelProto::kHeaderSize] = (char)path;
+        for (int i = 0; i < 8; ++i) {
+            probe[TunnelProto::kHeaderSize + 1 + i] = (char)(sent >> (56 - 8 * i));
+        }
+        auto &uplink = _uplinks[path];
+        sockaddr_storage dst;
+        auto len = PeerKey(addr).toSockAddr(uplink.family, dst);
+        if (len) {
+            ::sendto(uplink.sock->rawFD(), probe, sizeof(probe), 0, reinterpret_cast<const sockaddr *>(&dst), len);
+        }
+    }
+
+    static std::string peerName(const sockaddr_storage &addr) {
+        return toolkit::SockUtil::inet_ntoa(reinterpret_cast<const sockaddr *>(&addr)) + ":"
+            + std::to_string(toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&addr)));
+    }
+
+    std::string report() {
+        std::lock_guard<std::mutex> lck(_mtx);
+        std::ostringstream oss;
+        for (auto &it : _peers) {
+            oss << (oss.tellp() ? "," : "") << peerName(it.second.addr) << "[";
+            for (size_t i = 0; i < _uplinks.size(); ++i) {
+                auto &state = it.second.paths[i];
+                oss << (i ? " " : "") << _uplinks[i].ip << "=";
+                if (!state.up) {
+                    oss << "down";
+                } else if (state.rtt < 0) {
+                    oss << "?";
+                } else {
+                    oss << std::fixed << std::setprecision(2) << state.rtt << "ms";
+                }
+            }
+            oss << "]";
+        }
+        return oss.str();
+    }
+
+    std::mutex _mtx;
+    std::vector<Uplink> _uplinks;
+    std::unordered_map<PeerKey, PeerState, PeerKey::Hash> _peers;
+    Policy _policy = Hash;
+    std::function<void(const sockaddr_storage &, double)> _on_rtt;
+};
+
+#endif //TALUSVSWITCH_MULTIPATH_H
@@ -0,0 +1,255 @@
+﻿/**
+ * @file Pacer.h
+ * @brief 按节点的发送整形
+ * @details 每个节点一个令牌桶，令牌不足的数据报进入节点队列，由poller定时器按速率放行，
+ * 把局域网主机的突发流量摊平，避免打满socket发送缓冲区和上游调制解调器的队列：
+ * - 速率与突发上限可配置，桶满时允许一次性发出突发上限的数据
+ * - 可选基于时延的速率估计：往返时延高于最小值加目标排队时延时降速，否则逐步恢复到配置速率，
+ *   对端报告的丢包率超过阈值时同样降速
+ * - 节点队列超过3/4容量时报告拥塞，由调用方暂停读取网卡，回落到1/4容量以下后解除；
+ *   队列满时调用方应暂停向该节点放入数据报，仍放入时丢弃
+ */
+
+#ifndef TALUSVSWITCH_PACER_H
+#define TALUSVSWITCH_PACER_H
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+#include <Network/sockutil.h>
+#include <Poller/EventPoller.h>
+#include <Util/util.h>
+#include "Statistics.h"
+#include "Utils.h"
+
+/**
+ * @class Pacer
+ * @brief 令牌桶整形器
+ * @tparam T 待发送的元素类型，需有pkt与addr成员
+ * @details 入队与放行都在所属poller中执行
+ */
+template <typename T>
+class Pacer {
+public:
+    using Output = std::function<void(T &&item)>;
+
+    static constexpr uint64_t kTickMs = 1;              ///< 放行定时器间隔
+    static constexpr uint64_t kIdleMs = 60 * 1000;      ///< 节点空闲超时
+    static constexpr double kTargetDelayMs = 25;        ///< 基于时延估计时允许的排队时延
+    static constexpr double kDecrease = 0.85;           ///< 排队时延超标时的降速比例
+    static constexpr double kIncrease = 0.05;           ///< 每个正常样本恢复配置速率的比例
+    static constexpr double kMinRatio = 0.1;            ///< 最低降到配置速率的比例
+    static constexpr double kLossThreshold = 0.02;      ///< 基于时延估计时触发降速的丢包率
+
+    /**
+     * @brief 构造整形器
+     * @param poller 所属poller
+     * @param rate 每个节点的速率(kbit/s)
+     * @param burst 突发上限(字节)
+     * @param capacity 每个节点队列的最大数据报个数
+     * @param adaptive 是否基于时延估计速率
+     * @param out 放行的数据报
+     * @param flush 一轮放行结束，调用方可合并发送并检查拥塞是否解除
+     */
+    Pacer(toolkit::EventPoller::Ptr poller, int rate, int burst, size_t capacity, bool adaptive, Output out, std::function<void()> flush)
+        : _poller(std::move(poller)), _rate(rate / 8.0), _burst(std::max(burst, 1)), _capacity(capacity ? capacity : 1),
+          _adaptive(adaptive), _out(std::move(out)), _flush(std::move(flush)),
+          _delayed(Statistics::Instance().counter("pace.delayed")), _drops(Statistics::Instance().counter("pace.drops")) {
+        Statistics::Instance().addGauge("pace", [this]() { return report(); });
+        _poller->doDelayTask(kIdleMs, [this]() {
+            expire();
+            return kIdleMs;
+        });
+    }
+
+    /**
+     * @brief 发送一个数据报，令牌足够且节点无积压时立即放行
+     * @param urgent 高优先级报文不排队，直接放行并扣除令牌
+     */
+    void push(T item, bool urgent = false) {
+        std::lock_guard<std::mutex> lck(_mtx);
+        auto now = toolkit::getCurrentMillisecond();
+        auto &bucket = bucketOf(item.addr, now);
+        refill(bucket, now);
+        if (urgent || (bucket.queue.empty() && bucket.tokens > 0)) {
+            bucket.tokens -= item.pkt->size();
+            _out(std::move(item));
+            return;
+        }
+        if (bucket.queue.size() >= _capacity) {
+            ++_drops;
+            return;
+        }
+        ++_delayed;
+        bucket.queue.emplace_back(std::move(item), now);
+        if (!bucket.congested && bucket.queue.size() >= _capacity * 3 / 4) {
+            bucket.congested = true;
+            ++_congested;
+        }
+        if (!_scheduled) {
+            _scheduled = true;
+            _poller->doDelayTask(kTickMs, [this]() { return tick(); });
+        }
+    }
+
+    /**
+     * @brief 节点队列是否已满，满时push会丢弃非高优先级的数据报
+     */
+    bool full(const sockaddr_storage &addr) {
+        std::lock_guard<std::mutex> lck(_mtx);
+        auto it = _buckets.find(PeerKey(addr));
+        return it != _buckets.end() && it->second.queue.size() >= _capacity;
+    }
+
+    /**
+     * @brief 是否有节点队列拥塞，可在任意线程调用
+     */
+    bool congested() const {
+        return _congested > 0;
+    }
+
+    /**
+     * @brief 往返时延样本，基于时延估计速率
+     * @param addr 节点地址
+     * @param rtt 往返时延(毫秒)
+     */
+    void onRtt(const sockaddr_storage &addr, double rtt) {
+        if (!_adaptive) {
+            return;
+        }
+        std::lock_guard<std::mutex> lck(_mtx);
+        auto it = _buckets.find(PeerKey(addr));
+        if (it == _buckets.end()) {
+            return;
+        }
+        auto &bucket = it->second;
+        // 最小时延缓慢上浮，适应路径变化
+        bucket.minRtt = bucket.minRtt < 0 ? rtt : std::min(rtt, bucket.minRtt * 1.01);
+        if (rtt > bucket.minRtt + kTargetDelayMs) {
+            bucket.rate = std::max(bucket.rate * kDecrease, _rate * kMinRatio);
+        } else {
+            bucket.rate = std::min(bucket.rate + _rate * kIncrease, _rate);
+        }
+    }
+
+    /**
+     * @brief 对端报告的丢包率，基于时延估计时超过阈值即降速，恢复由时延样本完成
+     * @param addr 节点地址
+     * @param loss 丢包率(0-1)
+     */
+    void onLoss(const sockaddr_storage &addr, double loss) {
+        if (!_adaptive || loss < kLossThreshold) {
+            return;
+        }
+        std::lock_guard<std::mutex> lck(_mtx);
+        auto it = _buckets.find(PeerKey(addr));
+        if (it != _buckets.end()) {
+            it->second.rate = std::max(it->second.rate * kDecrease, _rate * kMinRatio);
+        }
+    }
+
+private:
+    struct Bucket {
+        sockaddr_storage addr{};
+        double rate = 0;            ///< 当前速率(字节/毫秒)
+        double tokens = 0;
+        double delay = 0;           ///< 平滑的整形时延(毫秒)
+        double minRtt = -1;         ///< 最小往返时延(毫秒)
+        uint64_t last = 0;          ///< 最近一次补充令牌的时间
+        bool congested = false;     ///< 队列超过高水位且尚未回落到低水位
+        std::deque<std::pair<T, uint64_t>> queue;
+    };
+
+    Bucket &bucketOf(const sockaddr_storage &addr, uint64_t now) {
+        auto &bucket = _buckets[PeerKey(addr)];
+        if (!bucket.last) {
+            bucket.addr = addr;
+            bucket.rate = _rate;
+            bucket.tokens = _burst;
+            bucket.last = now;
+        }
+        return bucket;
+    }
+
+    void refill(Bucket &bucket, uint64_t now) {
+        bucket.tokens = std::min<double>(bucket.tokens + bucket.rate * (now - bucket.last), _burst);
+        bucket.last = now;
+    }
+
+    uint64_t tick() {
+        std::lock_guard<std::mutex> lck(_mtx);
+        auto now = toolkit::getCurrentMillisecond();
+        bool pending = false;
+        bool sent = false;
+        for (auto &it : _buckets) {
+            auto &bucket = it.second;
+            if (bucket.queue.empty()) {
+                continue;
+            }
+            refill(bucket, now);
+            while (!bucket.queue.empty() && bucket.tokens > 0) {
+                auto &front = bucket.queue.front();
+                bucket.tokens -= front.first.pkt->size();
+                bucket.delay = bucket.delay * 0.875 + (now - front.second) * 0.125;
+                _out(std::move(front.first));
+                bucket.queue.pop_front();
+                sent = true;
+            }
+            if (bucket.congested && bucket.queue.size() <= _capacity / 4) {
+                bucket.congested = false;
+                --_congested;
+            }
+            pending = pending || !bucket.queue.empty();
+        }
+        if (sent && _flush) {
+            _flush();
+        }
+        _scheduled = pending;
+        return pending ? kTickMs : 0;
+    }
+
+    void expire() {
+        std::lock_guard<std::mutex> lck(_mtx);
+        auto now = toolkit::getCurrentMillisecond();
+        for (auto it = _buckets.begin(); it != _buckets.end();) {
+            if (it->second.queue.empty() && now - it->second.last > kIdleMs) {
+                it = _buckets.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    std::string report() {
+        std::lock_guard<std::mutex> lck(_mtx);
+        std::ostringstream oss;
+        for (auto &it : _buckets) {
+            auto &bucket = it.second;
+            auto addr = reinterpret_cast<const sockaddr *>(&bucket.addr);
+            oss << (oss.tellp() ? "," : "") << toolkit::SockUtil::inet_ntoa(addr) << ":" << toolkit::SockUtil::inet_port(addr)
+                << "=" << (int)(bucket.rate * 8) << "kbps/" << bucket.queue.size() << "/"
+                << std::fixed << std::setprecision(1) << bucket.delay << "ms";
+        }
+        return oss.str();
+    }
+
+    std::mutex _mtx;
+    toolkit::EventPoller::Ptr _poller;
+    double _rate;                   ///< 配置的速率(字节/毫秒)
+    int _burst;
+    size_t _capacity;
+    bool _adaptive;
+    bool _scheduled = false;
+    std::atomic<size_t> _congested{0};  ///< 拥塞的节点队列个数
+    Output _out;
+    std::function<void()> _flush;
+    Statistics::Counter &_delayed;
+    Statistics::Counter &_drops;
+    std::unordered_map<PeerKey, Bucket, PeerKey::Hash> _buckets;
+};
+
+#endif //TALUSVSWITCH_PACER_H
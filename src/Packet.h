@@ -0,0 +1,213 @@
+﻿/**
+ * @file Packet.h
+ * @brief 数据面报文
+ * @details 侵入式引用计数的报文及其句柄，替代热路径上的toolkit::Buffer::Ptr：
+ * - 报文头与数据位于同一块内存，优先取自报文内存池的slab
+ * - 句柄只能移动，共享需显式调用share()
+ * - 只在单一线程内共享的报文可使用非原子引用计数
+ * - 只在toolkit socket边界转换为toolkit::Buffer::Ptr
+ */
+
+#ifndef TALUSVSWITCH_PACKET_H
+#define TALUSVSWITCH_PACKET_H
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <Network/Buffer.h>
+#include "PacketArena.h"
+
+class PacketPtr;
+
+/**
+ * @class Packet
+ * @brief 报文
+ * @details 只能通过create创建，生命周期由PacketPtr管理
+ */
+class Packet {
+public:
+    /**
+     * @brief 创建报文
+     * @param capacity 容量
+     * @param atomic 引用计数是否为原子操作；报文只会被移动，或只在创建线程内共享时可传false
+     */
+    static PacketPtr create(size_t capacity, bool atomic = true);
+
+    /**
+     * @brief 创建报文并拷贝数据
+     */
+    static PacketPtr create(const char *data, size_t size, bool atomic = true);
+
+    /**
+     * @brief 能放入内存池单个slab的最大容量
+     */
+    static size_t slabCapacity() { return PacketArena::Instance().slabSize() - kHeaderSize; }
+
+    char *data() { return reinterpret_cast<char *>(this) + kHeaderSize; }
+    const char *data() const { return reinterpret_cast<const char *>(this) + kHeaderSize; }
+    size_t size() const { return _size; }
+    size_t capacity() const { return _capacity; }
+
+    void setSize(size_t size) {
+        if (size > _capacity) {
+            throw std::invalid_argument("Packet::setSize out of range");
+        }
+        _size = size;
+    }
+
+private:
+    friend class PacketPtr;
+
+    /// 报文头大小，数据按缓存行对齐
+    static constexpr size_t kHeaderSize = PacketArena::kAlign;
+
+    Packet(size_t capacity, bool atomic, bool slab) : _capacity(capacity), _atomic(atomic), _slab(slab) {}
+
+    void addRef() {
+        if (_atomic) {
+            __atomic_add_fetch(&_ref, 1, __ATOMIC_RELAXED);
+        } else {
+            ++_ref;
+        }
+    }
+
+    void release() {
+        auto ref = _atomic ? __atomic_sub_fetch(&_ref, 1, __ATOMIC_ACQ_REL) : --_ref;
+        if (ref) {
+            return;
+        }
+        auto slab = _slab;
+        auto mem = reinterpret_cast<char *>(this);
+        this->~Packet();
+        if (slab) {
+            PacketArena::Instance().freeSlab(mem);
+        } else {
+            ::operator delete(mem);
+        }
+    }
+
+    uint32_t _ref = 1;
+    size_t _size = 0;
+    size_t _capacity;
+    bool _atomic;
+    bool _slab;
+};
+
+static_assert(sizeof(Packet) <= PacketArena::kAlign, "Packet header must fit in one cache line");
+
+/**
+ * @class PacketPtr
+ * @brief 报文句柄
+ * @details 只能移动，不能拷贝；需要多个持有者时显式调用share()
+ */
+class PacketPtr {
+public:
+    PacketPtr() = default;
+    PacketPtr(std::nullptr_t) {}
+    PacketPtr(PacketPtr &&that) noexcept : _pkt(that._pkt) { that._pkt = nullptr; }
+    PacketPtr &operator=(PacketPtr &&that) noexcept {
+        if (this != &that) {
+            reset();
+            _pkt = that._pkt;
+            that._pkt = nullptr;
+        }
+        return *this;
+    }
+    PacketPtr(const PacketPtr &) = delete;
+    PacketPtr &operator=(const PacketPtr &) = delete;
+    ~PacketPtr() { reset(); }
+
+    /**
+     * @brief 增加一个持有者
+     */
+    PacketPtr share() const {
+        if (_pkt) {
+            _pkt->addRef();
+        }
+        return PacketPtr(_pkt);
+    }
+
+    /**
+     * @brief 放弃所有权并返回裸指针，用于穿过要求可拷贝的回调，之后必须用adopt接管
+     */
+    Packet *detach() {
+        auto pkt = _pkt;
+        _pkt = nullptr;
+        return pkt;
+    }
+
+    /**
+     * @brief 接管detach返回的裸指针
+     */
+    static PacketPtr adopt(Packet *pkt) { return PacketPtr(pkt); }
+
+    void reset() {
+        if (_pkt) {
+            _pkt->release();
+            _pkt = nullptr;
+        }
+    }
+
+    /**
+     * @brief 转换为toolkit::Buffer::Ptr，仅在交给toolkit socket时使用
+     * @details 转换后句柄为空
+     */
+    toolkit::Buffer::Ptr toBuffer() &&;
+
+    Packet *operator->() const { return _pkt; }
+    Packet &operator*() const { return *_pkt; }
+    Packet *get() const { return _pkt; }
+    explicit operator bool() const { return _pkt; }
+
+private:
+    friend class Packet;
+    explicit PacketPtr(Packet *pkt) : _pkt(pkt) {}
+
+    Packet *_pkt = nullptr;
+};
+
+/**
+ * @class PacketBuffer
+ * @brief 持有报文的toolkit::Buffer，仅用于socket边界
+ */
+class PacketBuffer : public toolkit::Buffer {
+public:
+    explicit PacketBuffer(PacketPtr pkt) : _pkt(std::move(pkt)) {}
+    char *data() const override { return _pkt->data(); }
+    size_t size() const override { return _pkt->size(); }
+    size_t getCapacity() const override { return _pkt->capacity(); }
+
+private:
+    PacketPtr _pkt;
+};
+
+inline PacketPtr Packet::create(size_t capacity, bool atomic) {
+    auto &arena = PacketArena::Instance();
+    char *mem = nullptr;
+    bool slab = false;
+    if (capacity + kHeaderSize <= arena.slabSize()) {
+        mem = arena.allocSlab();
+    }
+    if (mem) {
+        slab = true;
+        capacity = arena.slabSize() - kHeaderSize;
+    } else {
+        mem = static_cast<char *>(::operator new(kHeaderSize + capacity));
+    }
+    return PacketPtr(new (mem) Packet(capacity, atomic, slab));
+}
+
+inline PacketPtr Packet::create(const char *data, size_t size, bool atomic) {
+    auto pkt = create(size, atomic);
+    memcpy(pkt->data(), data, size);
+    pkt->setSize(size);
+    return pkt;
+}
+
+inline toolkit::Buffer::Ptr PacketPtr::toBuffer() && {
+    return std::make_shared<PacketBuffer>(std::move(*this));
+}
+
+#endif //TALUSVSWITCH_PACKET_H
@@ -0,0 +1,238 @@
+﻿/**
+ * @file PacketArena.h
+ * @brief 报文内存池
+ * @details 从一块连续的大页内存中切分报文缓冲区和编解码上下文，减少TLB缺失：
+ * - 优先使用MAP_HUGETLB预留的大页
+ * - 失败时使用普通匿名映射并通过MADV_HUGEPAGE申请透明大页
+ * - 内存池用尽或未启用时回退到普通堆内存
+ */
+
+#ifndef TALUSVSWITCH_PACKETARENA_H
+#define TALUSVSWITCH_PACKETARENA_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <Util/logger.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+#include "Statistics.h"
+
+/**
+ * @class PacketArena
+ * @brief 报文内存池单例
+ * @details
+ * - 报文缓冲区为固定大小的slab，释放后进入空闲链表复用；每个线程缓存少量空闲slab，
+ *   只有与全局空闲链表成批交换时才加锁，收发路径上逐个报文的申请与释放不加锁
+ * - 编解码上下文等长期存在的内存按需从池中顺序切分，不回收
+ */
+class PacketArena {
+public:
+    static constexpr size_t kHugePageSize = 2 * 1024 * 1024;   ///< 大页大小
+    static constexpr size_t kAlign = 64;                        ///< 分配对齐，避免伪共享
+    static constexpr size_t kCacheBatch = 32;                   ///< 线程缓存与全局空闲链表之间一次交换的slab个数
+    static constexpr size_t kCacheSlabs = 2 * kCacheBatch;      ///< 线程缓存的空闲slab上限
+
+    /**
+     * @brief 获取PacketArena单例
+     */
+    static PacketArena &Instance() {
+        // 不析构，线程退出时释放的编解码上下文可能晚于静态对象析构
+        static auto arena = new PacketArena();
+        return *arena;
+    }
+
+    /**
+     * @brief 创建内存池
+     * @param size 内存池大小(字节)，为0时不启用
+     * @param slab_size 单个报文缓冲区大小
+     */
+    void init(size_t size, size_t slab_size) {
+        _slab_size = alignUp(slab_size, kAlign);
+        if (!size) {
+            return;
+        }
+#ifndef _WIN32
+        size = alignUp(size, kHugePageSize);
+        auto mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (mem != MAP_FAILED) {
+            _mode = "hugetlb";
+        } else {
+            // 未预留大页，改用透明大页
+            mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (mem == MAP_FAILED) {
+                WarnL << "Packet arena mmap failed: " << strerror(errno);
+                return;
+            }
+            _mode = madvise(mem, size, MADV_HUGEPAGE) == 0 ? "thp" : "normal";
+        }
+        _base = reinterpret_cast<char *>(mem);
+        _size = size;
+        InfoL << "Packet arena " << (size >> 20) << "MB, " << _mode << ", slab " << _slab_size;
+        Statistics::Instance().addGauge("arena", [this]() { return usage(); });
+#endif
+    }
+
+    /**
+     * @brief 内存池是否已启用
+     */
+    bool enabled() const { return _base; }
+
+    /**
+     * @brief 单个报文缓冲区大小
+     */
+    size_t slabSize() const { return _slab_size; }
+
+    /**
+     * @brief 申请一个报文缓冲区
+     * @return 内存池未启用或已用尽时返回nullptr
+     */
+    char *allocSlab() {
+        if (!_base) {
+            return nullptr;
+        }
+        auto &slabs = cache().slabs;
+        if (slabs.empty()) {
+            refill(slabs);
+            if (slabs.empty()) {
+                return nullptr;
+            }
+        }
+        auto slab = slabs.back();
+        slabs.pop_back();
+        return slab;
+    }
+
+    /**
+     * @brief 归还报文缓冲区
+     * @details 放入当前线程的缓存，超过上限时把一批归还全局空闲链表
+     */
+    void freeSlab(char *slab) {
+        if (!_base) {
+            return;
+        }
+        auto &slabs = cache().slabs;
+        slabs.push_back(slab);
+        if (slabs.size() > kCacheSlabs) {
+            release(slabs, kCacheBatch);
+        }
+    }
+
+    /**
+     * @brief 申请长期存在的内存，不回收
+     * @return 内存池未启用或已用尽时返回nullptr
+     */
+    void *allocRegion(size_t size) {
+        std::lock_guard<std::mutex> lck(_mtx);
+        return carve(alignUp(size, kAlign));
+    }
+
+    /**
+     * @brief 地址是否属于内存池
+     */
+    bool contains(const void *ptr) const {
+        auto p = reinterpret_cast<const char *>(ptr);
+        return _base && p >= _base && p < _base + _size;
+    }
+
+    /**
+     * @brief 内存池使用情况
+     * @details 使用中的slab含各线程缓存的空闲slab
+     */
+    std::string usage() {
+        std::lock_guard<std::mutex> lck(_mtx);
+        return std::to_string(_used >> 10) + "/" + std::to_string(_size >> 10) + "KB(" + _mode + ",slabs:"
+            + std::to_string(_slabs_carved - _free.size()) + "/" + std::to_string(_slabs_carved) + ")";
+    }
+
+    /**
+     * @brief 供zlib使用的内存分配函数，编解码上下文放入内存池
+     */
+    static void *zalloc(void *, unsigned items, unsigned size) {
+        auto mem = Instance().allocRegion((size_t) items * size);
+        return mem ? mem : calloc(items, size);
+    }
+
+    /**
+     * @brief 供zlib使用的内存释放函数
+     */
+    static void zfree(void *, void *ptr) {
+        if (!Instance().contains(ptr)) {
+            free(ptr);
+        }
+    }
+
+private:
+    /**
+     * @brief 线程的空闲slab缓存，线程退出时归还全局空闲链表
+     */
+    struct ThreadCache {
+        std::vector<char *> slabs;
+        ~ThreadCache() { Instance().release(slabs, slabs.size()); }
+    };
+
+    PacketArena() = default;
+
+    static ThreadCache &cache() {
+        static thread_local ThreadCache cache;
+        return cache;
+    }
+
+    /**
+     * @brief 从全局空闲链表取一批slab，不足时从内存池切分
+     */
+    void refill(std::vector<char *> &slabs) {
+        std::lock_guard<std::mutex> lck(_mtx);
+        while (slabs.size() < kCacheBatch && !_free.empty()) {
+            slabs.push_back(_free.back());
+            _free.pop_back();
+        }
+        while (slabs.size() < kCacheBatch) {
+            auto slab = carve(_slab_size);
+            if (!slab) {
+                break;
+            }
+            slabs.push_back(slab);
+            ++_slabs_carved;
+        }
+    }
+
+    /**
+     * @brief 把缓存末尾的count个slab归还全局空闲链表
+     */
+    void release(std::vector<char *> &slabs, size_t count) {
+        if (!count) {
+            return;
+        }
+        std::lock_guard<std::mutex> lck(_mtx);
+        _free.insert(_free.end(), slabs.end() - count, slabs.end());
+        slabs.resize(slabs.size() - count);
+    }
+
+    static size_t alignUp(size_t size, size_t align) { return (size + align - 1) / align * align; }
+
+    char *carve(size_t size) {
+        if (!_base || _used + size > _size) {
+            return nullptr;
+        }
+        auto ptr = _base + _used;
+        _used += size;
+        return ptr;
+    }
+
+    std::mutex _mtx;
+    char *_base = nullptr;
+    size_t _size = 0;
+    size_t _used = 0;
+    size_t _slab_size = 2048;
+    size_t _slabs_carved = 0;
+    std::string _mode = "off";
+    std::vector<char *> _free;
+};
+
+#endif //TALUSVSWITCH_PACKETARENA_H
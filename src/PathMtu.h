@@ -0,0 +1,298 @@
+﻿/**
+ * @file PathMtu.h
+ * @brief 分组层路径MTU探测(PLPMTUD)
+ * @details 参照RFC 8899，按节点探测不经IP分片可达的最大UDP数据报：
+ * - socket设置IP_PMTUDISC_PROBE，所有数据报禁止IP分片，且不受ICMP影响
+ * - 从基准值开始，用填充到目标长度的探测报文二分搜索上限，对端应答即确认
+ * - 同一长度连续多次无应答视为不可达
+ * - 搜索完成后定期用当前值确认，确认失败回到基准值重新搜索(黑洞检测)，并定期尝试更大的值
+ * 探测报文格式：扩展报文公共头 + 序号(2字节) + 探测长度(2字节) + 填充，应答不含填充
+ */
+
+#ifndef TALUSVSWITCH_PATHMTU_H
+#define TALUSVSWITCH_PATHMTU_H
+
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+#include <Network/sockutil.h>
+#include <Poller/EventPoller.h>
+#include <Util/logger.h>
+#include <Util/util.h>
+#include "Statistics.h"
+#include "TunnelProto.h"
+#include "Utils.h"
+
+/**
+ * @class PathMtu
+ * @brief 路径MTU探测单例
+ * @details 探测在传输层poller中执行；查询可在任意线程执行
+ */
+class PathMtu {
+public:
+    static constexpr int kBase = 1200;                  ///< 基准值，所有路径都应支持
+    static constexpr int kGranularity = 16;             ///< 搜索精度
+    static constexpr int kMaxProbes = 3;                ///< 同一长度最多探测次数
+    static constexpr uint64_t kTickMs = 200;            ///< 探测调度间隔
+    static constexpr uint64_t kProbeTimeoutMs = 1000;   ///< 探测应答超时
+    static constexpr uint64_t kConfirmMs = 30 * 1000;   ///< 确认当前值的间隔
+    static constexpr uint64_t kRaiseMs = 600 * 1000;    ///< 尝试更大值的间隔
+    static constexpr uint64_t kIdleMs = 60 * 1000;      ///< 节点空闲超时，超时后不再探测
+
+    /**
+     * @brief 获取PathMtu单例
+     */
+    static PathMtu &Instance() {
+        static PathMtu pathMtu;
+        return pathMtu;
+    }
+
+    /**
+     * @brief 启动探测
+     * @param poller 传输层poller
+     * @param fd UDP socket
+     * @param max 搜索上限(UDP载荷字节数)
+     */
+    void start(const toolkit::EventPoller::Ptr &poller, int fd, int max) {
+        _fd = fd;
+        _max = std::max(max, kBase);
+        sockaddr_storage local{};
+        socklen_t len = sizeof(local);
+        getsockname(fd, reinterpret_cast<sockaddr *>(&local), &len);
+        _family = local.ss_family;
+#if defined(__linux__)
+        int probe = IP_PMTUDISC_PROBE;
+        setsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, &probe, sizeof(probe));
+        if (_family == AF_INET6) {
+            probe = IPV6_PMTUDISC_PROBE;
+            setsockopt(fd, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &probe, sizeof(probe));
+        }
+#endif
+        _enabled = true;
+        poller->doDelayTask(kTickMs, [this]() {
+            tick();
+            return kTickMs;
+        });
+        Statistics::Instance().addGauge("pmtu", [this]() { return report(); });
+        InfoL << "PLPMTUD enabled, search " << kBase << "-" << _max;
+    }
+
+    bool enabled() const { return _enabled; }
+
+    /**
+     * @brief 获取到节点的数据报上限
+     * @param addr 节点地址
+     * @return 已确认的最大UDP载荷字节数，未知节点从基准值开始探测
+     */
+    size_t size(const sockaddr_storage &addr) {
+        std::lock_guard<std::mutex> lck(_mtx);
+        auto &state = _peers[PeerKey(addr)];
+        if (!state.low) {
+            state.addr = addr;
+            state.low = kBase;
+            state.high = _max;
+            state.searching = true;
+        }
+        state.used = toolkit::getCurrentMillisecond();
+        return state.low;
+    }
+
+    /**
+     * @brief 处理探测及应答报文
+     * @details 在传输层poller中执行
+     */
+    void onPacket(const char *data, size_t size, const sockaddr_storage &from) {
+        if (size < TunnelProto::kHeaderSize + 4) {
+            return;
+        }
+        auto seq = TunnelProto::get16(data + TunnelProto::kHeaderSize);
+        auto probeSize = TunnelProto::get16(data + TunnelProto::kHeaderSize + 2);
+        if (TunnelProto::type(data) == TunnelProto::PmtuProbe) {
+            // 被截断的探测不应答
+            if (probeSize != size) {
+                return;
+            }
+            char ack[TunnelProto::kHeaderSize + 4];
+            TunnelProto::writeHeader(ack, TunnelProto::PmtuAck);
+            TunnelProto::put16(ack + TunnelProto::kHeaderSize, seq);
+            TunnelProto::put16(ack + TunnelProto::kHeaderSize + 2, probeSize);
+            sendTo(ack, sizeof(ack), from);
+            return;
+        }
+
+        std::lock_guard<std::mutex> lck(_mtx);
+        auto it = _peers.find(PeerKey(from));
+        if (it == _peers.end()) {
+            return;
+        }
+        auto &state = it->second;
+        if (!state.probing || seq != state.seq || probeSize != state.probing) {
+            return;
+        }
+        auto now = toolkit::getCurrentMillisecond();
+        if (state.searching) {
+            state.low = std::max(state.low, state.probing);
+        } else {
+            state.next = now + kConfirmMs;
+        }
+        state.probing = 0;
+        state.attempts = 0;
+    }
+
+private:
+    /**
+     * @brief 节点探测状态
+     */
+    struct State {
+        sockaddr_storage addr{};
+        int low = 0;            ///< 已确认的上限
+        int high = 0;           ///< 搜索的上界
+        int probing = 0;        ///< 正在探测的长度，0为空闲
+        int attempts = 0;       ///< 当前长度已探测次数
+        bool searching = false; ///< 是否在搜索，否则为定期确认
+        uint16_t seq = 0;
+        uint64_t sent = 0;      ///< 最近一次探测时间
+        uint64_t next = 0;      ///< 下次确认时间
+        uint64_t raise = 0;     ///< 下次尝试更大值的时间
+        uint64_t used = 0;      ///< 最近一次查询时间
+    };
+
+    PathMtu() = default;
+
+    void tick() {
+        std::vector<std::pair<sockaddr_storage, std::pair<uint16_t, int>>> probes;
+        {
+            std::lock_guard<std::mutex> lck(_mtx);
+            auto now = toolkit::getCurrentMillisecond();
+            for (auto it = _peers.begin(); it != _peers.end();) {
+                auto &state = it->second;
+                if (now - state.used > kIdleMs) {
+                    it = _peers.erase(it);
+                    continue;
+                }
+                if (step(state, now)) {
+                    probes.push_back({state.addr, {state.seq, state.probing}});
+                }
+                ++it;
+            }
+        }
+        for (auto &probe : probes) {
+            if (!sendProbe(probe.first, probe.second.first, probe.second.second)) {
+                // 超过本地网卡MTU，不必等待超时
+                std::lock_guard<std::mutex> lck(_mtx);
+                auto it = _peers.find(PeerKey(probe.first));
+                if (it != _peers.end() && it->second.seq == probe.second.first) {
+                    it->second.attempts = kMaxProbes - 1;
+                    it->second.sent = 0;
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief 推进一个节点的探测状态
+     * @return 是否需要发送探测
+     */
+    bool step(State &state, uint64_t now) {
+        if (state.probing) {
+            if (now - state.sent < kProbeTimeoutMs) {
+                return false;
+            }
+            if (++state.attempts < kMaxProbes) {
+                return launch(state, now);
+            }
+            // 同一长度多次无应答
+            auto failed = state.probing;
+            state.probing = 0;
+            state.attempts = 0;
+            if (state.searching) {
+                state.high = failed - 1;
+            } else {
+                WarnL << "Path MTU black hole detected, " << peerName(state.addr) << " " << state.low << " -> " << kBase;
+                state.low = kBase;
+                state.high = _max;
+                state.searching = true;
+            }
+            return false;
+        }
+
+        if (state.searching) {
+            if (state.high - state.low < kGranularity) {
+                InfoL << "Path MTU " << peerName(state.addr) << " = " << state.low;
+                state.searching = false;
+                state.next = now + kConfirmMs;
+                state.raise = now + kRaiseMs;
+                return false;
+            }
+            state.probing = (state.low + state.high + 1) / 2;
+            state.attempts = 0;
+            return launch(state, now);
+        }
+
+        if (now >= state.raise && state.low < _max) {
+            // 路径可能已变化，尝试更大的值
+            state.high = _max;
+            state.searching = true;
+            return false;
+        }
+        if (now >= state.next) {
+            state.probing = state.low;
+            state.attempts = 0;
+            return launch(state, now);
+        }
+        return false;
+    }
+
+    bool launch(State &state, uint64_t now) {
+        state.seq++;
+        state.sent = now;
+        return true;
+    }
+
+    /**
+     * @return 超过本地网卡MTU(EMSGSIZE)时返回false
+     */
+    bool sendProbe(const sockaddr_storage &addr, uint16_t seq, int size) {
+        static auto &probes = Statistics::Instance().counter("pmtu.probes");
+        std::string probe(size, '\0');
+        TunnelProto::writeHeader(&probe[0], TunnelProto::PmtuProbe);
+        TunnelProto::put16(&probe[TunnelProto::kHeaderSize], seq);
+        TunnelProto::put16(&probe[TunnelProto::kHeaderSize + 2], (uint16_t)size);
+        ++probes;
+        return sendTo(probe.data(), probe.size(), addr) >= 0 || errno != EMSGSIZE;
+    }
+
+    /**
+     * @brief 直接发送，探测报文不经过发送队列，避免超长探测失败时拖累同批次的数据
+     */
+    ssize_t sendTo(const char *data, size_t size, const sockaddr_storage &addr) {
+        // IPv6 socket发往IPv4地址时转换为IPv4映射地址
+        sockaddr_storage dst;
+        auto len = PeerKey(addr).toSockAddr(_family, dst);
+        return ::sendto(_fd, data, size, 0, reinterpret_cast<const sockaddr *>(&dst), len);
+    }
+
+    static std::string peerName(const sockaddr_storage &addr) {
+        return toolkit::SockUtil::inet_ntoa(reinterpret_cast<const sockaddr *>(&addr)) + ":"
+            + std::to_string(toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&addr)));
+    }
+
+    std::string report() {
+        std::lock_guard<std::mutex> lck(_mtx);
+        std::ostringstream oss;
+        for (auto &it : _peers) {
+            oss << (oss.tellp() ? "," : "") << peerName(it.second.addr) << "=" << it.second.low;
+        }
+        return oss.str();
+    }
+
+    std::mutex _mtx;
+    std::unordered_map<PeerKey, State, PeerKey::Hash> _peers;
+    int _fd = -1;
+    int _max = kBase;
+    int _family = AF_INET;
+    bool _enabled = false;
+};
+
+#endif //TALUSVSWITCH_PATHMTU_H
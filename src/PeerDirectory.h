@@ -0,0 +1,426 @@
+﻿/**
+ * @file PeerDirectory.h
+ * @brief 带版本的对端目录，按增量同步给边缘节点
+ * @details 边缘节点定期查询对端列表，核心节点每次都遍历整张MAC表回送全部节点，节点多时总开销随节点数平方增长。
+ * 改为带版本的目录：
+ * - 目录为 MAC 到公网地址的映射，MAC表变化(增删、切换地址)时计数加一，定时任务发现计数变化才比对，
+ *   每条变化使目录版本加一并记入有界的变更日志；联邦目录中的公网地址不经MAC表，另按较长间隔全量比对
+ * - 纪元为启动时取的随机数，核心节点重启后版本从头计数，纪元不同的版本不可比较
+ * - 查询携带已有目录的纪元与版本：纪元相同且版本仍在变更日志内时回送此后的变化(删除以Dead表示)，否则回送全量分页
+ * - 全量分页按MAC排序，在目录版本变化后首次查询时编码一次，之后各边缘节点的查询直接复用
+ * - 带版本查询的节点记为订阅者，目录变化时立即推送增量，超过一段时间未再查询即不再推送
+ * - 增量与推送带上起点版本，接收方已有版本不低于起点才应用，否则以已有版本重新查询补齐缺口
+ * - 不带版本的旧版本查询仍回送全量
+ */
+
+#ifndef TALUSVSWITCH_PEERDIRECTORY_H
+#define TALUSVSWITCH_PEERDIRECTORY_H
+
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <Network/sockutil.h>
+#include <Poller/EventPoller.h>
+#include <Util/logger.h>
+#include <Util/util.h>
+#include "Config.h"
+#include "ControlProto.h"
+#include "Federation.h"
+#include "MacMap.h"
+#include "Statistics.h"
+#include "Utils.h"
+
+/**
+ * @class PeerDirectory
+ * @brief 对端目录单例
+ * @details 作为被查询方维护目录、变更日志与订阅者；作为查询方记录所跟随目录的纪元与版本。
+ * 比对与推送在传输层poller中执行，查询在控制助手的poller中处理，由互斥锁保护
+ */
+class PeerDirectory {
+public:
+    /**
+     * @brief 收到的一条对端列表的版本信息
+     */
+    struct List {
+        bool versioned = false;     ///< 是否带纪元，旧版本核心节点不带
+        uint64_t epoch = 0;
+        bool delta = false;         ///< 是否为增量(带起点版本)
+        uint64_t after = 0;         ///< 增量的起点版本
+        uint64_t version = 0;       ///< 本条之后的目录版本
+        uint64_t next = 0;          ///< 全量的下一页游标
+    };
+    /**
+     * @brief 推送消息
+     */
+    using Pusher = std::function<void(const sockaddr_storage &to, const ControlProto::Writer &msg)>;
+
+    static constexpr uint64_t kTickMs = 200;                    ///< 检查MAC表变化的间隔
+    static constexpr uint64_t kRescanMs = 5000;                 ///< 没有变化时全量比对的间隔(联邦目录中的公网地址)
+    static constexpr size_t kLogSize = 4096;                    ///< 变更日志条数
+    static constexpr uint64_t kSubscribeMs = 3 * 60 * 1000;     ///< 订阅者超过该时间未查询即不再推送
+    static constexpr size_t kMaxSubscribers = 4096;             ///< 订阅者上限
+
+    /**
+     * @brief 获取PeerDirectory单例
+     */
+    static PeerDirectory &Instance() {
+        static PeerDirectory directory;
+        return directory;
+    }
+
+    /**
+     * @brief 启动
+     * @param poller 传输层poller
+     * @param push 推送增量
+     */
+    void start(const toolkit::EventPoller::Ptr &poller, Pusher push) {
+        _push = std::move(push);
+        scan(true);
+        poller->doDelayTask(kTickMs, [this]() {
+            scan(false);
+            return kTickMs;
+        });
+        Statistics::Instance().addGauge("directory", [this]() { return report(); });
+        InfoL << "Peer directory epoch " << _epoch;
+    }
+
+    /**
+     * @brief 回应带版本的查询
+     * @param from 查询方地址
+     * @param epoch 查询方已有目录的纪元
+     * @param since 查询方已有目录的版本，为0时查询全量
+     * @param cursor 全量分页的游标，不为0时总是回送全量中的一页
+     * @param subscribe 是否记为订阅者
+     * @return 要回送的消息，增量过大时分为多条
+     */
+    std::vector<ControlProto::Writer> query(const sockaddr_storage &from, uint64_t epoch, uint64_t since, uint64_t cursor,
+                                            bool subscribe) {
+        static auto &deltas = Statistics::Instance().counter("directory.delta");
+        static auto &pages = Statistics::Instance().counter("directory.page");
+        std::lock_guard<std::mutex> lck(_mtx);
+        if (subscribe) {
+            if (_subscribers.size() >= kMaxSubscribers) {
+                expire();
+            }
+            if (_subscribers.size() < kMaxSubscribers || _subscribers.count(PeerKey(from))) {
+                _subscribers[PeerKey(from)] = {from, toolkit::getCurrentMillisecond()};
+            }
+        }
+        if (!cursor && epoch == _epoch && since && since >= _floor && since <= _version) {
+            ++deltas;
+            return delta(since);
+        }
+        ++pages;
+        return {page(cursor)};
+    }
+
+    /**
+     * @brief 全量的全部分页，用于不会续查的旧版本节点
+     */
+    std::vector<ControlProto::Writer> snapshot() {
+        std::lock_guard<std::mutex> lck(_mtx);
+        build();
+        return _pages;
+    }
+
+    /**
+     * @brief 作为查询方，下一次查询携带的已有目录
+     */
+    void following(uint64_t &epoch, uint64_t &version) {
+        std::lock_guard<std::mutex> lck(_mtx);
+        epoch = _followEpoch;
+        version = _syncing ? 0 : _followVersion;
+    }
+
+    /**
+     * @brief 作为查询方收到一条对端列表
+     * @param list 列表的版本信息
+     * @param more 输出，是否需要继续查询
+     * @param cursor 输出，继续查询的游标，为0时按已有版本查询增量
+     * @return 是否应用其中的对端
+     */
+    bool onList(const List &list, bool &more, uint64_t &cursor) {
+        static auto &gaps = Statistics::Instance().counter("directory.gap");
+        more = false;
+        cursor = 0;
+        if (!list.versioned) {
+            // 旧版本核心节点，每次都是全量
+            more = list.next != 0;
+            cursor = list.next;
+            return true;
+        }
+        std::lock_guard<std::mutex> lck(_mtx);
+        if (list.delta) {
+            if (_syncing || list.version <= _followVersion) {
+                // 全量同步中或已应用过
+                return false;
+            }
+            if (list.epoch != _followEpoch || list.after > _followVersion) {
+                // 核心节点已重启或中间有丢失，按已有版本重新查询，纪元不同时核心节点回送全量
+                ++gaps;
+                more = true;
+                return false;
+            }
+            _followVersion = list.version;
+            return true;
+        }
+        // 全量分页可能取自不同的版本，以最低的版本为已有版本，结束后再查询一次增量补齐
+        if (!_syncing || list.epoch != _followEpoch) {
+            _syncing = true;
+            _followEpoch = list.epoch;
+            _syncLow = _syncHigh = list.version;
+        }
+        _syncLow = std::min(_syncLow, list.version);
+        _syncHigh = std::max(_syncHigh, list.version);
+        if (list.next) {
+            more = true;
+            cursor = list.next;
+            return true;
+        }
+        _syncing = false;
+        _followVersion = _syncLow;
+        more = _syncHigh > _syncLow;
+        return true;
+    }
+
+private:
+    struct Change {
+        uint64_t version = 0;
+        uint64_t mac = 0;
+        sockaddr_storage addr{};
+        bool dead = false;
+    };
+    struct Subscriber {
+        sockaddr_storage addr{};
+        uint64_t seen = 0;      ///< 最近一次查询的时间
+    };
+
+    PeerDirectory() {
+        std::mt19937_64 rng{std::random_device{}()};
+        while (!_epoch) {
+            _epoch = rng();
+        }
+    }
+
+    /**
+     * @brief 比对MAC表，记录变化并推送
+     * @param force 是否不论MAC表有无变化都比对
+     */
+    void scan(bool force) {
+        static auto &pushed = Statistics::Instance().counter("directory.push");
+        auto now = toolkit::getCurrentMillisecond();
+        auto gen = MacMap::generation().load();
+        if (!force && gen == _generation && now - _scanned < kRescanMs) {
+            return;
+        }
+        _generation = gen;
+        _scanned = now;
+
+        // 经联邦核心节点转发的节点给出其公网地址，其他核心节点自身不列出
+        std::unordered_map<uint64_t, sockaddr_storage> current;
+        for (auto &item : MacMap::peers()) {
+            if (!item.first || item.first == MAC_BROADCAST) {
+                continue;
+            }
+            auto addr = item.second;
+            if (Federation::Instance().isPeer(addr) && !Federation::Instance().edgeAddr(item.first, addr)) {
+                continue;
+            }
+            current.emplace(item.first, addr);
+        }
+
+        std::vector<ControlProto::Writer> msgs;
+        std::vector<sockaddr_storage> targets;
+        {
+            std::lock_guard<std::mutex> lck(_mtx);
+            auto before = _version;
+            for (auto &item : current) {
+                auto it = _entries.find(item.first);
+                if (it == _entries.end() || !compareSockAddr(it->second, item.second)) {
+                    _entries[item.first] = item.second;
+                    record(item.first, item.second, false);
+                }
+            }
+            for (auto it = _entries.begin(); it != _entries.end();) {
+                if (current.count(it->first)) {
+                    ++it;
+                    continue;
+                }
+                record(it->first, it->second, true);
+                it = _entries.erase(it);
+            }
+            if (_version == before) {
+                return;
+            }
+            expire();
+            if (!_subscribers.empty()) {
+                msgs = delta(before);
+                for (auto &item : _subscribers) {
+                    targets.emplace_back(item.second.addr);
+                }
+            }
+        }
+        for (auto &to : targets) {
+            for (auto &msg : msgs) {
+                _push(to, msg);
+                ++pushed;
+            }
+        }
+    }
+
+    void record(uint64_t mac, const sockaddr_storage &addr, bool dead) {
+        _log.push_back({++_version, mac, addr, dead});
+        if (_log.size() > kLogSize) {
+            _floor = _log.front().version;
+            _log.pop_front();
+        }
+    }
+
+    void expire() {
+        auto now = toolkit::getCurrentMillisecond();
+        for (auto it = _subscribers.begin(); it != _subscribers.end();) {
+            if (now - it->second.seen > kSubscribeMs) {
+                it = _subscribers.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    static ControlProto::Writer header(uint64_t epoch) {
+        ControlProto::Writer msg(ControlProto::PeerList, 0, Config::macLocal);
+        msg.u64(ControlProto::Epoch, epoch);
+        return msg;
+    }
+
+    static void putPeer(ControlProto::Writer &msg, uint64_t mac, const sockaddr_storage &addr, bool dead) {
+        msg.begin(ControlProto::Peer).mac(ControlProto::Mac, mac);
+        if (dead) {
+            msg.u8(ControlProto::Dead, 1);
+        } else {
+            msg.addr(ControlProto::Addr, addr);
+        }
+        msg.end();
+    }
+
+    /**
+     * @brief 编码某版本之后的变化
+     * @details 同一MAC只保留最后一次变化，按版本升序分批，每批带上前一批的末尾版本
+     */
+    std::vector<ControlProto::Writer> delta(uint64_t since) {
+        auto first = std::upper_bound(_log.begin(), _log.end(), since,
+                                      [](uint64_t v, const Change &change) { return v < change.version; });
+        std::vector<const Change *> changes;
+        std::unordered_set<uint64_t> seen;
+        for (auto it = _log.end(); it != first;) {
+            --it;
+            if (seen.emplace(it->mac).second) {
+                changes.emplace_back(&*it);
+            }
+        }
+        std::reverse(changes.begin(), changes.end());
+
+        std::vector<ControlProto::Writer> msgs;
+        auto msg = header(_epoch).u64(ControlProto::After, since);
+        for (size_t i = 0; i < changes.size(); ++i) {
+            putPeer(msg, changes[i]->mac, changes[i]->addr, changes[i]->dead);
+            if (msg.size() > ControlProto::kPageBytes && i + 1 < changes.size()) {
+                msg.u64(ControlProto::Version, changes[i]->version);
+                msgs.emplace_back(msg);
+                msg = header(_epoch).u64(ControlProto::After, changes[i]->version);
+            }
+        }
+        msg.u64(ControlProto::Version, _version);
+        msgs.emplace_back(msg);
+        return msgs;
+    }
+
+    /**
+     * @brief 全量中游标之后的一页
+     * @details 游标为缓存分页的边界时直接复用，否则(缓存已按新版本重建)从游标处另编一页
+     */
+    ControlProto::Writer page(uint64_t cursor) {
+        build();
+        auto it = std::find(_cursors.begin(), _cursors.end(), cursor);
+        if (it != _cursors.end()) {
+            return _pages[it - _cursors.begin()];
+        }
+        auto msg = header(_epoch).u64(ControlProto::Version, _version);
+        for (auto entry = _sorted.upper_bound(cursor); entry != _sorted.end(); ++entry) {
+            putPeer(msg, entry->first, entry->second, false);
+            if (msg.size() > ControlProto::kPageBytes && std::next(entry) != _sorted.end()) {
+                msg.u64(ControlProto::Next, entry->first);
+                break;
+            }
+        }
+        return msg;
+    }
+
+    /**
+     * @brief 目录版本变化后重建全量分页
+     */
+    void build() {
+        if (_built && _builtVersion == _version) {
+            return;
+        }
+        _built = true;
+        _builtVersion = _version;
+        _sorted = std::map<uint64_t, sockaddr_storage>(_entries.begin(), _entries.end());
+        _pages.clear();
+        _cursors.assign(1, 0);
+        auto msg = header(_epoch).u64(ControlProto::Version, _version);
+        for (auto entry = _sorted.begin(); entry != _sorted.end(); ++entry) {
+            putPeer(msg, entry->first, entry->second, false);
+            if (msg.size() > ControlProto::kPageBytes && std::next(entry) != _sorted.end()) {
+                msg.u64(ControlProto::Next, entry->first);
+                _pages.emplace_back(msg);
+                _cursors.emplace_back(entry->first);
+                msg = header(_epoch).u64(ControlProto::Version, _version);
+            }
+        }
+        _pages.emplace_back(msg);
+    }
+
+    std::string report() {
+        std::lock_guard<std::mutex> lck(_mtx);
+        std::ostringstream oss;
+        oss << "version=" << _version << ",peers=" << _entries.size() << ",log=" << _log.size()
+            << ",subscribers=" << _subscribers.size();
+        if (_followEpoch) {
+            oss << ",following=" << _followVersion;
+        }
+        return oss.str();
+    }
+
+    Pusher _push;
+    std::mutex _mtx;
+    uint64_t _epoch = 0;
+    uint64_t _version = 0;
+    uint64_t _floor = 0;                                        ///< 变更日志之前的版本，早于它的查询只能回送全量
+    uint64_t _generation = 0;                                   ///< 上次比对时MAC表的变化计数
+    uint64_t _scanned = 0;                                      ///< 上次比对的时间
+    std::unordered_map<uint64_t, sockaddr_storage> _entries;
+    std::deque<Change> _log;
+    std::unordered_map<PeerKey, Subscriber, PeerKey::Hash> _subscribers;
+    // 全量分页缓存
+    bool _built = false;
+    uint64_t _builtVersion = 0;
+    std::map<uint64_t, sockaddr_storage> _sorted;
+    std::vector<ControlProto::Writer> _pages;
+    std::vector<uint64_t> _cursors;                             ///< 各页的游标
+    // 作为查询方跟随的目录
+    uint64_t _followEpoch = 0;
+    uint64_t _followVersion = 0;
+    bool _syncing = false;
+    uint64_t _syncLow = 0;
+    uint64_t _syncHigh = 0;
+};
+
+#endif //TALUSVSWITCH_PEERDIRECTORY_H
@@ -0,0 +1,273 @@
+﻿/**
+ * @file PeerSockets.h
+ * @brief 热点节点的已连接UDP socket
+ * @details 默认socket未连接，每次sendto内核都要查路由；对流量最大的几个节点，
+ * 另建一个与默认socket同端口(SO_REUSEPORT)并connect到节点的socket：
+ * - 发送省去逐包的路由查找，节点不可达等ICMP错误只报告给该节点的socket
+ * - 内核优先把来自该节点的数据报投递给已连接的socket，收包回调与默认socket相同
+ * - 每秒按平滑的发送字节数排名，超过阈值的节点晋升，流量回落或出错的节点降级回默认socket，
+ *   缓存已满时新节点的流量须明显超过最冷的已连接节点才替换，避免来回抖动
+ */
+
+#ifndef TALUSVSWITCH_PEERSOCKETS_H
+#define TALUSVSWITCH_PEERSOCKETS_H
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+#include <Network/Socket.h>
+#include <Util/logger.h>
+#include <Util/util.h>
+#include "Ecn.h"
+#include "Statistics.h"
+#include "Utils.h"
+
+/**
+ * @class PeerSockets
+ * @brief 已连接socket缓存单例
+ * @details 发送、统计与晋升降级都在传输层poller中执行
+ */
+class PeerSockets {
+public:
+    using SocketCB = std::function<void(const toolkit::Socket::Ptr &sock)>;
+
+    static constexpr uint64_t kTickMs = 1000;               ///< 排名间隔
+    static constexpr double kPromoteBytes = 128 * 1024;     ///< 晋升所需的平滑发送量(字节/秒)
+    static constexpr double kDemoteBytes = kPromoteBytes / 4;   ///< 低于该发送量视为变冷
+    static constexpr int kColdTicks = 5;                    ///< 连续变冷多少次后降级
+    static constexpr double kReplaceRatio = 2;              ///< 缓存满时替换最冷节点所需的流量倍数
+    static constexpr uint64_t kIdleMs = 60 * 1000;          ///< 节点空闲超时
+
+    /**
+     * @brief 获取PeerSockets单例
+     */
+    static PeerSockets &Instance() {
+        static PeerSockets sockets;
+        return sockets;
+    }
+
+    /**
+     * @brief 启动
+     * @param poller 传输层poller
+     * @param port 本地端口，与默认socket相同
+     * @param local_ip 本地地址，与默认socket相同
+     * @param slots 最多已连接socket个数
+     * @param on_open 新建socket后的回调，调用方设置收包与可写回调
+     * @param on_close 关闭socket前的回调
+     */
+    void start(const toolkit::EventPoller::Ptr &poller, uint16_t port, const std::string &local_ip, size_t slots,
+               SocketCB on_open, SocketCB on_close) {
+        _poller = poller;
+        _port = port;
+        _local_ip = local_ip;
+        _slots = slots;
+        _on_open = std::move(on_open);
+        _on_close = std::move(on_close);
+        _poller->doDelayTask(kTickMs, [this]() {
+            tick();
+            return kTickMs;
+        });
+        Statistics::Instance().addGauge("peersock", [this]() { return report(); });
+        InfoL << "Connected sockets for up to " << slots << " peers";
+    }
+
+    bool enabled() const { return _slots > 0; }
+
+    /**
+     * @brief 统计发送量，节点已有连接时通过其socket发送，需随后调用flushAll
+     * @param tos 外层TOS，-1为不设置
+     * @return 节点没有已连接socket时返回false，由调用方经默认socket发送
+     */
+    bool send(toolkit::Buffer::Ptr &buf, const sockaddr_storage &addr, int tos) {
+        std::lock_guard<std::mutex> lck(_mtx);
+        auto &peer = _peers[PeerKey(addr)];
+        if (!peer.used) {
+            peer.addr = addr;
+        }
+        peer.used = toolkit::getCurrentMillisecond();
+        peer.bytes += buf->size();
+        if (!peer.sock) {
+            return false;
+        }
+        if (tos >= 0 && tos != peer.tos) {
+            // 之前的数据报按原TOS发出后再切换
+            peer.sock->flushAll();
+            Ecn::setSocketTos(peer.sock->rawFD(), tos);
+            peer.tos = tos;
+        }
+        peer.sock->send(std::move(buf), nullptr, 0, false);
+        return true;
+    }
+
+    void flushAll() {
+        std::lock_guard<std::mutex> lck(_mtx);
+        for (auto &it : _peers) {
+            if (it.second.sock) {
+                it.second.sock->flushAll();
+            }
+        }
+    }
+
+    /**
+     * @brief 是否有已连接socket积压
+     */
+    bool busy(size_t limit) {
+        std::lock_guard<std::mutex> lck(_mtx);
+        for (auto &it : _peers) {
+            auto &sock = it.second.sock;
+            if (sock && (sock->isSocketBusy() || sock->getSendBufferCount() >= limit)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    struct Peer {
+        sockaddr_storage addr{};
+        uint64_t used = 0;          ///< 最近一次发送时间
+        uint64_t bytes = 0;         ///< 本周期的发送字节数
+        double rate = 0;            ///< 平滑的发送量(字节/秒)
+        int cold = 0;               ///< 连续变冷次数
+        int tos = -1;               ///< socket当前的TOS
+        toolkit::Socket::Ptr sock;  ///< 已连接socket，未晋升时为空
+    };
+
+    PeerSockets() = default;
+
+    void tick() {
+        static auto &promotions = Statistics::Instance().counter("peersock.promotions");
+        static auto &demotions = Statistics::Instance().counter("peersock.demotions");
+        static auto &errors = Statistics::Instance().counter("peersock.errors");
+        std::lock_guard<std::mutex> lck(_mtx);
+        auto now = toolkit::getCurrentMillisecond();
+        std::vector<Peer *> hot;
+        size_t connected = 0;
+        for (auto it = _peers.begin(); it != _peers.end();) {
+            auto &peer = it->second;
+            peer.rate = peer.rate * 0.5 + peer.bytes * (500.0 / kTickMs);
+            peer.bytes = 0;
+            if (!peer.sock) {
+                if (now - peer.used > kIdleMs) {
+                    it = _peers.erase(it);
+                    continue;
+                }
+                if (peer.rate >= kPromoteBytes) {
+                    hot.emplace_back(&peer);
+                }
+                ++it;
+                continue;
+            }
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(peer.sock->rawFD(), SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err) {
+                // 节点不可达等错误，回到默认socket，流量仍高时下个周期重新晋升
+                ++errors;
+                WarnL << "Connected socket to " << peerName(peer.addr) << " failed: " << strerror(err);
+                demote(peer);
+                ++demotions;
+            } else if (peer.rate < kDemoteBytes && ++peer.cold >= kColdTicks) {
+                demote(peer);
+                ++demotions;
+            } else {
+                peer.cold = peer.rate < kDemoteBytes ? peer.cold : 0;
+                ++connected;
+            }
+            ++it;
+        }
+        std::sort(hot.begin(), hot.end(), [](Peer *a, Peer *b) { return a->rate > b->rate; });
+        for (auto peer : hot) {
+            if (connected >= _slots) {
+                auto coldest = coldestConnected();
+                if (!coldest || peer->rate < coldest->rate * kReplaceRatio) {
+                    break;
+                }
+                demote(*coldest);
+                ++demotions;
+                --connected;
+            }
+            if (promote(*peer)) {
+                ++promotions;
+                ++connected;
+            }
+        }
+    }
+
+    Peer *coldestConnected() {
+        Peer *coldest = nullptr;
+        for (auto &it : _peers) {
+            if (it.second.sock && (!coldest || it.second.rate < coldest->rate)) {
+                coldest = &it.second;
+            }
+        }
+        return coldest;
+    }
+
+    bool promote(Peer &peer) {
+        auto sock = toolkit::Socket::createSocket(_poller, false);
+        if (!sock->bindUdpSock(_port, _local_ip, true)) {
+            WarnL << "Bind connected socket " << _local_ip << ":" << _port << " failed";
+            return false;
+        }
+        sockaddr_storage local{};
+        socklen_t len = sizeof(local);
+        getsockname(sock->rawFD(), reinterpret_cast<sockaddr *>(&local), &len);
+        sockaddr_storage dst;
+        len = PeerKey(peer.addr).toSockAddr(local.ss_family, dst);
+        if (!len || !sock->bindPeerAddr(reinterpret_cast<sockaddr *>(&dst), len)) {
+            return false;
+        }
+        if (_on_open) {
+            _on_open(sock);
+        }
+        peer.sock = std::move(sock);
+        peer.tos = -1;
+        peer.cold = 0;
+        InfoL << "Peer " << peerName(peer.addr) << " promoted to connected socket, "
+              << (int)(peer.rate * 8 / 1000) << "kbps";
+        return true;
+    }
+
+    void demote(Peer &peer) {
+        // 已交给socket的数据报先发出
+        peer.sock->flushAll();
+        if (_on_close) {
+            _on_close(peer.sock);
+        }
+        InfoL << "Peer " << peerName(peer.addr) << " demoted from connected socket, "
+              << (int)(peer.rate * 8 / 1000) << "kbps";
+        peer.sock.reset();
+        peer.cold = 0;
+    }
+
+    static std::string peerName(const sockaddr_storage &addr) {
+        return toolkit::SockUtil::inet_ntoa(reinterpret_cast<const sockaddr *>(&addr)) + ":"
+            + std::to_string(toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&addr)));
+    }
+
+    std::string report() {
+        std::lock_guard<std::mutex> lck(_mtx);
+        std::ostringstream oss;
+        for (auto &it : _peers) {
+            if (it.second.sock) {
+                oss << (oss.tellp() ? "," : "") << peerName(it.second.addr) << "=" << (int)(it.second.rate * 8 / 1000) << "kbps";
+            }
+        }
+        return oss.str();
+    }
+
+    std::mutex _mtx;
+    toolkit::EventPoller::Ptr _poller;
+    uint16_t _port = 0;
+    std::string _local_ip;
+    size_t _slots = 0;
+    SocketCB _on_open;
+    SocketCB _on_close;
+    std::unordered_map<PeerKey, Peer, PeerKey::Hash> _peers;
+};
+
+#endif //TALUSVSWITCH_PEERSOCKETS_H
@@ -0,0 +1,376 @@
+﻿/**
+ * @file Relay.h
+ * @brief 经中间边缘节点的时延感知中继
+ * @details 两个边缘节点无法直连时流量经核心节点转发，核心节点离两者都远时绕路明显。
+ * - 边缘节点定期把到各直连节点(含核心节点)的路径得分上报核心节点，得分即路径测量的时延、抖动与丢包折算值
+ * - 核心节点把各节点的上报合成一张无向图，两节点间取两个方向中较差的得分，对每对无法直连的节点求最短路径，
+ *   首跳不是核心节点、且明显优于经核心节点转发时，把首跳作为中继下发给源节点
+ * - 已下发的中继在得分不劣于经核心节点转发时保持，换用其他中继同样需要明显更优，避免来回切换
+ * - 源节点把目标MAC指向中继节点的地址，中继节点按自己的MAC表继续转发，每转发一次TTL减一，跳数受TTL限制
+ * - 核心节点只下发变化，并定期全量刷新，源节点超时未刷新的中继自行撤销
+ * 上报格式：MAC-得分,...；下发格式：目标MAC-中继MAC,...，中继MAC为0表示撤销
+ */
+
+#ifndef TALUSVSWITCH_RELAY_H
+#define TALUSVSWITCH_RELAY_H
+
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <queue>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+#include <Network/sockutil.h>
+#include <Poller/EventPoller.h>
+#include <Util/logger.h>
+#include <Util/util.h>
+#include "Config.h"
+#include "CoreSet.h"
+#include "MacMap.h"
+#include "Statistics.h"
+#include "Utils.h"
+
+/**
+ * @class Relay
+ * @brief 中继路由单例
+ * @details 核心节点计算路由，边缘节点上报路径得分并应用下发的中继
+ */
+class Relay {
+public:
+    using Sample = std::pair<uint64_t, double>;         ///< 节点MAC与路径得分(毫秒)
+    using Route = std::pair<uint64_t, uint64_t>;        ///< 目标MAC与中继MAC
+    using Reporter = std::function<void()>;
+    using Pusher = std::function<void(uint64_t mac, const std::vector<Route> &routes)>;
+
+    static constexpr uint64_t kReportMs = 5000;             ///< 边缘节点上报间隔
+    static constexpr uint64_t kComputeMs = 5000;            ///< 核心节点计算间隔
+    static constexpr uint64_t kStaleMs = 4 * kReportMs;     ///< 上报的得分超过该时间未更新即失效
+    static constexpr uint64_t kRefreshMs = 30 * 1000;       ///< 核心节点全量刷新中继的间隔
+    static constexpr uint64_t kExpireMs = 3 * kRefreshMs;   ///< 边缘节点的中继超过该时间未刷新即撤销
+    static constexpr double kSwitchRatio = 0.8;             ///< 新路径得分低于当前的该比例才切换
+    static constexpr double kMinGainMs = 5;                 ///< 且至少低5ms
+
+    /**
+     * @brief 获取Relay单例
+     */
+    static Relay &Instance() {
+        static Relay relay;
+        return relay;
+    }
+
+    /**
+     * @brief 启动
+     * @param poller 定时任务所在的poller
+     * @param reporter 边缘节点上报路径得分
+     * @param pusher 核心节点向节点下发中继
+     */
+    void start(const toolkit::EventPoller::Ptr &poller, Reporter reporter, Pusher pusher) {
+        _reporter = std::move(reporter);
+        _pusher = std::move(pusher);
+        poller->doDelayTask(kReportMs, [this]() {
+            if (toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&Config::corePeer)) && _reporter) {
+                _reporter();
+            }
+            expire();
+            return kReportMs;
+        });
+        poller->doDelayTask(kComputeMs, [this]() {
+            compute();
+            return kComputeMs;
+        });
+        Statistics::Instance().addGauge("relay", [this]() { return report(); });
+    }
+
+    /**
+     * @brief 核心节点收到边缘节点的上报
+     * @details 上报可能分多个包，按节点逐个合并
+     */
+    void onReport(uint64_t mac, const std::vector<Sample> &samples) {
+        std::lock_guard<std::mutex> lck(_mtx);
+        auto now = toolkit::getCurrentMillisecond();
+        auto &row = _matrix[mac];
+        for (auto &sample : samples) {
+            if (sample.first != mac) {
+                row[sample.first] = {sample.second, now};
+            }
+        }
+    }
+
+    /**
+     * @brief 边缘节点应用核心节点下发的中继
+     * @param via 中继节点MAC，0为撤销
+     */
+    void apply(uint64_t dst, uint64_t via) {
+        static auto &applied = Statistics::Instance().counter("relay.applied");
+        static auto &withdrawn = Statistics::Instance().counter("relay.withdrawn");
+        if (dst == Config::macLocal || dst == MAC_BROADCAST) {
+            return;
+        }
+        std::lock_guard<std::mutex> lck(_mtx);
+        auto it = _routes.find(dst);
+        if (!via) {
+            if (it == _routes.end()) {
+                return;
+            }
+            bool got = false;
+            auto cur = MacMap::getMacPeer(dst, got);
+            if (got && compareSockAddr(cur, it->second.addr)) {
+                // 回到经核心节点转发，与核心节点转发来的流量ttl相同，直连地址出现时可替换
+                MacMap::setMacPeer(dst, CoreSet::Instance().pick(dst), Config::sendTtl - 1);
+            }
+            InfoL << "Relay " << MacMap::uint64ToMacStr(dst) << " withdrawn";
+            _routes.erase(it);
+            ++withdrawn;
+            return;
+        }
+        bool got = false;
+        auto addr = MacMap::getMacPeer(via, got);
+        if (!got || CoreSet::Instance().isCore(addr)) {
+            // 本节点与中继节点之间还没有直连
+            return;
+        }
+        bool changed = it == _routes.end() || it->second.via != via;
+        auto &route = _routes[dst];
+        route.via = via;
+        route.addr = addr;
+        route.refreshed = toolkit::getCurrentMillisecond();
+        // 刷新时同样重设，MAC表中的地址可能已被超时清理后重新学习
+        MacMap::setMacPeer(dst, addr, Config::sendTtl);
+        if (changed) {
+            ++applied;
+            InfoL << "Relay " << MacMap::uint64ToMacStr(dst) << " via " << MacMap::uint64ToMacStr(via);
+        }
+    }
+
+    /**
+     * @brief 目标节点是否经中继转发
+     */
+    bool routed(uint64_t mac) {
+        std::lock_guard<std::mutex> lck(_mtx);
+        return _routes.count(mac) != 0;
+    }
+
+    /**
+     * @brief 与目标节点已直连，放弃中继
+     */
+    void onDirect(uint64_t mac) {
+        std::lock_guard<std::mutex> lck(_mtx);
+        _routes.erase(mac);
+    }
+
+private:
+    struct Score {
+        double ms = 0;
+        uint64_t updated = 0;
+    };
+
+    struct LocalRoute {
+        uint64_t via = 0;
+        sockaddr_storage addr{};
+        uint64_t refreshed = 0;
+    };
+
+    using Graph = std::unordered_map<uint64_t, std::unordered_map<uint64_t, double>>;
+
+    Relay() = default;
+
+    static constexpr double kInf = std::numeric_limits<double>::infinity();
+
+    static double weight(const Graph &graph, uint64_t a, uint64_t b) {
+        auto it = graph.find(a);
+        if (it == graph.end()) {
+            return kInf;
+        }
+        auto w = it->second.find(b);
+        return w == it->second.end() ? kInf : w->second;
+    }
+
+    /**
+     * @brief 单源最短路径
+     */
+    static std::unordered_map<uint64_t, double> shortest(const Graph &graph, uint64_t src) {
+        std::unordered_map<uint64_t, double> dist;
+        using Item = std::pair<double, uint64_t>;
+        std::priority_queue<Item, std::vector<Item>, std::greater<Item>> queue;
+        dist[src] = 0;
+        queue.emplace(0, src);
+        while (!queue.empty()) {
+            auto top = queue.top();
+            queue.pop();
+            if (top.first > dist[top.second]) {
+                continue;
+            }
+            auto it = graph.find(top.second);
+            if (it == graph.end()) {
+                continue;
+            }
+            for (auto &edge : it->second) {
+                auto d = top.first + edge.second;
+                auto old = dist.find(edge.first);
+                if (old == dist.end() || d < old->second) {
+                    dist[edge.first] = d;
+                    queue.emplace(d, edge.first);
+                }
+            }
+        }
+        return dist;
+    }
+
+    /**
+     * @brief 核心节点计算并下发中继
+     */
+    void compute() {
+        static auto &changes = Statistics::Instance().counter("relay.changes");
+        std::unordered_map<uint64_t, std::vector<Route>> push;
+        {
+            std::lock_guard<std::mutex> lck(_mtx);
+            if (_matrix.empty()) {
+                return;
+            }
+            auto now = toolkit::getCurrentMillisecond();
+            // 去掉失效的得分，合成无向图，两个方向都有时取较差的
+            Graph graph;
+            for (auto it = _matrix.begin(); it != _matrix.end();) {
+                auto &row = it->second;
+                for (auto s = row.begin(); s != row.end();) {
+                    if (now - s->second.updated > kStaleMs) {
+                        s = row.erase(s);
+                        continue;
+                    }
+                    auto &ab = graph[it->first][s->first];
+                    auto &ba = graph[s->first][it->first];
+                    ab = ba = std::max(std::max(ab, ba), s->second.ms);
+                    ++s;
+                }
+                if (row.empty()) {
+                    it = _matrix.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            std::unordered_map<uint64_t, std::unordered_map<uint64_t, double>> dist;
+            for (auto &node : graph) {
+                dist[node.first] = shortest(graph, node.first);
+            }
+            auto core = Config::macLocal;
+            auto costVia = [&](uint64_t src, uint64_t hop, uint64_t dst) {
+                auto d = dist[hop].find(dst);
+                return d == dist[hop].end() ? kInf : weight(graph, src, hop) + d->second;
+            };
+            bool refresh = now - _refreshed >= kRefreshMs;
+            if (refresh) {
+                _refreshed = now;
+            }
+            for (auto &row : _matrix) {
+                auto src = row.first;
+                auto &routes = _pushed[src];
+                for (auto &node : graph) {
+                    auto dst = node.first;
+                    if (dst == src || dst == core) {
+                        continue;
+                    }
+                    uint64_t want = 0;
+                    double wantCost = kInf;
+                    double coreCost = weight(graph, src, core) + weight(graph, core, dst);
+                    if (weight(graph, src, dst) == kInf) {
+                        // 无法直连，从直连节点中选首跳
+                        for (auto &hop : graph[src]) {
+                            if (hop.first == core || hop.first == dst) {
+                                continue;
+                            }
+                            auto cost = costVia(src, hop.first, dst);
+                            if (cost < wantCost) {
+                                want = hop.first;
+                                wantCost = cost;
+                            }
+                        }
+                        if (want && !(wantCost < coreCost * kSwitchRatio && coreCost - wantCost >= kMinGainMs)) {
+                            want = 0;
+                        }
+                    }
+                    auto cur = routes.find(dst);
+                    if (cur != routes.end() && weight(graph, src, dst) == kInf) {
+                        auto curCost = costVia(src, cur->second, dst);
+                        bool better = want && want != cur->second && wantCost < curCost * kSwitchRatio
+                            && curCost - wantCost >= kMinGainMs;
+                        if (curCost <= coreCost && !better) {
+                            want = cur->second;
+                        }
+                    }
+                    if (cur == routes.end() ? want != 0 : cur->second != want) {
+                        ++changes;
+                        InfoL << "Relay " << MacMap::uint64ToMacStr(src) << " -> " << MacMap::uint64ToMacStr(dst)
+                              << (want ? " via " + MacMap::uint64ToMacStr(want) : std::string(" via core"));
+                        push[src].emplace_back(dst, want);
+                        if (want) {
+                            routes[dst] = want;
+                        } else {
+                            routes.erase(dst);
+                        }
+                    } else if (refresh && want) {
+                        push[src].emplace_back(dst, want);
+                    }
+                }
+            }
+            // 不再上报的节点无法下发，只清理记录
+            for (auto it = _pushed.begin(); it != _pushed.end();) {
+                if (_matrix.count(it->first)) {
+                    ++it;
+                } else {
+                    it = _pushed.erase(it);
+                }
+            }
+        }
+        for (auto &item : push) {
+            if (_pusher) {
+                _pusher(item.first, item.second);
+            }
+        }
+    }
+
+    /**
+     * @brief 边缘节点撤销超时未刷新的中继
+     */
+    void expire() {
+        std::vector<uint64_t> expired;
+        {
+            std::lock_guard<std::mutex> lck(_mtx);
+            auto now = toolkit::getCurrentMillisecond();
+            for (auto &it : _routes) {
+                if (now - it.second.refreshed > kExpireMs) {
+                    expired.emplace_back(it.first);
+                }
+            }
+        }
+        for (auto mac : expired) {
+            apply(mac, 0);
+        }
+    }
+
+    std::string report() {
+        std::lock_guard<std::mutex> lck(_mtx);
+        std::ostringstream oss;
+        for (auto &it : _routes) {
+            oss << (oss.tellp() ? "," : "") << MacMap::uint64ToMacStr(it.first) << ">" << MacMap::uint64ToMacStr(it.second.via);
+        }
+        size_t pushed = 0;
+        for (auto &it : _pushed) {
+            pushed += it.second.size();
+        }
+        if (pushed) {
+            oss << (oss.tellp() ? "," : "") << "pushed=" << pushed;
+        }
+        return oss.str();
+    }
+
+    std::mutex _mtx;
+    Reporter _reporter;
+    Pusher _pusher;
+    uint64_t _refreshed = 0;
+    std::unordered_map<uint64_t, std::unordered_map<uint64_t, Score>> _matrix;  ///< 核心节点：各节点上报的得分
+    std::unordered_map<uint64_t, std::unordered_map<uint64_t, uint64_t>> _pushed; ///< 核心节点：已下发的中继
+    std::unordered_map<uint64_t, LocalRoute> _routes;                           ///< 边缘节点：应用中的中继
+};
+
+#endif //TALUSVSWITCH_RELAY_H
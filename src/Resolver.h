@@ -0,0 +1,283 @@
+﻿/**
+ * @file Resolver.h
+ * @brief 未知单播的按需MAC解析
+ * @details 边缘节点MAC表未命中时，帧直接发往核心节点，核心节点也不认识目标MAC时静默丢弃，
+ * 发送方直到周期性的对端目录同步才能得知目标的地址。开启后改为向核心节点查询(类似LISP的map-request)：
+ * - 未命中时向目标MAC所分配的核心节点发送解析请求，应答前的前几帧暂存，超出的丢弃
+ * - 目标存在时MAC表中先指向核心节点(ttl比直连小1，直连成功后按ttl切换)，暂存的帧经核心节点发出，
+ *   应答带有公网地址时随即发起打洞
+ * - 目标不存在时丢弃暂存的帧，否定结果缓存一段时间，期间发往该MAC的帧直接丢弃
+ * - 应答超时(核心节点为旧版本或报文丢失)时按原方式把暂存的帧发往核心节点
+ * - 核心节点转发未命中时向来源回送否定应答(按MAC限速)，来源据此删除经核心节点的过期路由
+ * 组播MAC不解析，仍按原方式处理
+ */
+
+#ifndef TALUSVSWITCH_RESOLVER_H
+#define TALUSVSWITCH_RESOLVER_H
+
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+#include <Network/sockutil.h>
+#include <Poller/EventPoller.h>
+#include <Util/logger.h>
+#include <Util/util.h>
+#include "Config.h"
+#include "CoreSet.h"
+#include "MacMap.h"
+#include "Packet.h"
+#include "Statistics.h"
+#include "Utils.h"
+
+/**
+ * @class Resolver
+ * @brief 按需MAC解析单例
+ * @details 未命中在网卡读取的poller中处理，应答在控制助手的poller中处理，超时检查在传输层poller中执行，由互斥锁保护
+ */
+class Resolver {
+public:
+    /**
+     * @brief 发送解析请求
+     * @return 是否已发送，核心节点不支持时返回false
+     */
+    using Requester = std::function<bool(uint64_t mac)>;
+    /**
+     * @brief 把帧发往核心节点
+     */
+    using Sender = std::function<void(PacketPtr pkt, const sockaddr_storage &to)>;
+    /**
+     * @brief 解析到目标的公网地址
+     */
+    using Resolved = std::function<void(uint64_t mac, const sockaddr_storage &addr)>;
+
+    static constexpr uint64_t kTickMs = 100;                ///< 超时检查间隔
+    static constexpr uint64_t kTimeoutMs = 500;             ///< 应答超时，超时后按原方式发往核心节点
+    static constexpr uint64_t kNegativeMs = 5000;           ///< 否定结果的缓存时间
+    static constexpr size_t kQueueFrames = 8;               ///< 每个MAC暂存的帧数
+    static constexpr size_t kMaxPending = 1024;             ///< 同时解析的MAC个数上限
+    static constexpr size_t kMaxNegative = 4096;            ///< 否定结果的缓存个数上限
+    static constexpr uint64_t kNotifyMs = 1000;             ///< 核心节点对同一MAC的否定应答间隔
+
+    /**
+     * @brief 获取Resolver单例
+     */
+    static Resolver &Instance() {
+        static Resolver resolver;
+        return resolver;
+    }
+
+    /**
+     * @brief 启动，仅边缘节点使用
+     * @param poller 传输层poller
+     * @param request 发送解析请求
+     * @param send 把帧发往核心节点
+     * @param resolved 解析到公网地址时回调
+     */
+    void start(const toolkit::EventPoller::Ptr &poller, Requester request, Sender send, Resolved resolved) {
+        _request = std::move(request);
+        _send = std::move(send);
+        _resolved = std::move(resolved);
+        poller->doDelayTask(kTickMs, [this]() {
+            checkTimeout();
+            return kTickMs;
+        });
+        Statistics::Instance().addGauge("resolve", [this]() { return report(); });
+        _enabled = true;
+        InfoL << "On-demand MAC resolution enabled";
+    }
+
+    bool enabled() const { return _enabled; }
+
+    /**
+     * @brief MAC表未命中的单播帧
+     * @param mac 目标MAC
+     * @param pkt 帧，接管时移走
+     * @return 是否已接管(暂存或丢弃)，false时调用方按原方式发往核心节点
+     */
+    bool miss(uint64_t mac, PacketPtr &pkt) {
+        static auto &drops = Statistics::Instance().counter("resolve.drops");
+        static auto &requests = Statistics::Instance().counter("resolve.requests");
+        if (mac >> 16 & 1) {
+            // 组播
+            return false;
+        }
+        auto now = toolkit::getCurrentMillisecond();
+        {
+            std::lock_guard<std::mutex> lck(_mtx);
+            auto neg = _negative.find(mac);
+            if (neg != _negative.end()) {
+                if (now < neg->second) {
+                    ++drops;
+                    pkt.reset();
+                    return true;
+                }
+                _negative.erase(neg);
+            }
+            auto it = _pending.find(mac);
+            if (it != _pending.end()) {
+                if (it->second.frames.size() < kQueueFrames) {
+                    it->second.frames.emplace_back(std::move(pkt));
+                } else {
+                    ++drops;
+                    pkt.reset();
+                }
+                return true;
+            }
+            if (_pending.size() >= kMaxPending) {
+                return false;
+            }
+        }
+        // 请求只在网卡读取的poller中发出，不会重复
+        if (!_request(mac)) {
+            return false;
+        }
+        ++requests;
+        std::lock_guard<std::mutex> lck(_mtx);
+        auto &pending = _pending[mac];
+        pending.since = now;
+        pending.frames.emplace_back(std::move(pkt));
+        return true;
+    }
+
+    /**
+     * @brief 收到解析应答
+     * @param mac 目标MAC
+     * @param found 目标是否存在
+     * @param addr 目标的公网地址，只能经核心节点到达时端口为0
+     */
+    void onReply(uint64_t mac, bool found, const sockaddr_storage &addr) {
+        static auto &positive = Statistics::Instance().counter("resolve.found");
+        static auto &negative = Statistics::Instance().counter("resolve.negative");
+        std::vector<PacketPtr> frames;
+        bool pending = false;
+        {
+            std::lock_guard<std::mutex> lck(_mtx);
+            auto it = _pending.find(mac);
+            if (it != _pending.end()) {
+                pending = true;
+                frames = std::move(it->second.frames);
+                _pending.erase(it);
+            }
+            if (!found && _enabled) {
+                if (_negative.size() >= kMaxNegative) {
+                    expireNegative();
+                }
+                if (_negative.size() < kMaxNegative) {
+                    _negative[mac] = toolkit::getCurrentMillisecond() + kNegativeMs;
+                }
+            }
+        }
+
+        bool got = false;
+        auto current = MacMap::getMacPeer(mac, got);
+        auto core = CoreSet::Instance().pick(mac);
+        if (!found) {
+            // 经核心节点的路由已失效，直连路由由保活与故障切换处理
+            if (got && CoreSet::Instance().isCore(current)) {
+                MacMap::removePeer(mac);
+            }
+            if (pending || got) {
+                ++negative;
+                InfoL << "Resolve " << MacMap::uint64ToMacStr(mac) << " not found, drop " << frames.size() << " frames";
+            }
+            return;
+        }
+        if (!pending) {
+            return;
+        }
+        ++positive;
+        if (!got) {
+            MacMap::setMacPeer(mac, core, Config::sendTtl - 1);
+        } else {
+            core = current;
+        }
+        for (auto &frame : frames) {
+            _send(std::move(frame), core);
+        }
+        if (toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&addr))) {
+            _resolved(mac, addr);
+        }
+    }
+
+    /**
+     * @brief 核心节点转发未命中，是否向来源回送否定应答
+     * @details 同一来源的同一MAC每kNotifyMs最多一次
+     */
+    bool notify(uint64_t mac, const sockaddr_storage &from) {
+        auto now = toolkit::getCurrentMillisecond();
+        std::lock_guard<std::mutex> lck(_mtx);
+        if (_notified.size() >= kMaxNegative) {
+            for (auto it = _notified.begin(); it != _notified.end();) {
+                it = now - it->second >= kNotifyMs ? _notified.erase(it) : std::next(it);
+            }
+        }
+        auto &last = _notified[mac ^ PeerKey::Hash()(PeerKey(from))];
+        if (last && now - last < kNotifyMs) {
+            return false;
+        }
+        last = now;
+        return true;
+    }
+
+private:
+    struct Pending {
+        uint64_t since = 0;                 ///< 请求发出的时间
+        std::vector<PacketPtr> frames;      ///< 暂存的帧
+    };
+
+    Resolver() = default;
+
+    /**
+     * @brief 应答超时的解析按原方式把暂存的帧发往核心节点
+     */
+    void checkTimeout() {
+        static auto &timeouts = Statistics::Instance().counter("resolve.timeouts");
+        auto now = toolkit::getCurrentMillisecond();
+        std::vector<std::pair<uint64_t, std::vector<PacketPtr>>> expired;
+        {
+            std::lock_guard<std::mutex> lck(_mtx);
+            for (auto it = _pending.begin(); it != _pending.end();) {
+                if (now - it->second.since < kTimeoutMs) {
+                    ++it;
+                    continue;
+                }
+                expired.emplace_back(it->first, std::move(it->second.frames));
+                it = _pending.erase(it);
+            }
+        }
+        for (auto &item : expired) {
+            ++timeouts;
+            auto core = CoreSet::Instance().pick(item.first);
+            for (auto &frame : item.second) {
+                _send(std::move(frame), core);
+            }
+        }
+    }
+
+    void expireNegative() {
+        auto now = toolkit::getCurrentMillisecond();
+        for (auto it = _negative.begin(); it != _negative.end();) {
+            it = now >= it->second ? _negative.erase(it) : std::next(it);
+        }
+    }
+
+    std::string report() {
+        std::lock_guard<std::mutex> lck(_mtx);
+        std::ostringstream oss;
+        oss << "pending=" << _pending.size() << ",negative=" << _negative.size();
+        return oss.str();
+    }
+
+    bool _enabled = false;
+    Requester _request;
+    Sender _send;
+    Resolved _resolved;
+    std::mutex _mtx;
+    std::unordered_map<uint64_t, Pending> _pending;
+    std::unordered_map<uint64_t, uint64_t> _negative;      ///< 否定结果及其过期时间
+    std::unordered_map<uint64_t, uint64_t> _notified;      ///< 核心节点上次回送否定应答的时间，按MAC与来源
+};
+
+#endif //TALUSVSWITCH_RESOLVER_H
@@ -0,0 +1,331 @@
+﻿/**
+ * @file SeqMonitor.h
+ * @brief 基于序号的被动丢包、乱序与重复统计
+ * @details 发送方给发往每个节点的数据报加上连续的序号，接收方不需要额外的探测即可得到链路的投递质量：
+ * - 发送方为每个目标生成随机的发送方编号随报文携带，接收方按编号而不是来源地址区分序号空间，
+ *   多路径或按节点连接的socket从不同地址发出时仍计入同一序号空间，发送方重启后编号改变即重新开始
+ * - 接收方按发送方编号保存最近序号及其之前256个序号的到达位图，位图初始全部置位
+ * - 序号前跳时跳过的序号立即计为丢失，之后到达的计为乱序并撤销丢失，位图中已置位的计为重复
+ * - 早于位图窗口的序号视为乱序，序号前后跳变过大视为对端重启，重新开始
+ * - 接收方每秒把各项比率报告给发送方，发送方据此调整前向纠错的校验个数、整形速率与路径选择
+ * 序号加在最外层，在分片、加密与前向纠错之后，统计的是线路上的原始投递情况
+ * 报文格式(均为扩展报文)：
+ * - 数据：公共头 + 发送方编号(4字节) + 序号(4字节) + 原数据报
+ * - 报告：公共头 + 丢包率 + 乱序率 + 重复率(均为千分比，各2字节)
+ * 收到对端序号报文的一方必然支持该格式，报告只发给这样的节点
+ */
+
+#ifndef TALUSVSWITCH_SEQMONITOR_H
+#define TALUSVSWITCH_SEQMONITOR_H
+
+#include <algorithm>
+#include <bitset>
+#include <functional>
+#include <iomanip>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <unordered_map>
+#include <Network/sockutil.h>
+#include <Poller/EventPoller.h>
+#include <Util/util.h>
+#include "Packet.h"
+#include "Statistics.h"
+#include "TunnelProto.h"
+#include "Utils.h"
+
+/**
+ * @class SeqMonitor
+ * @brief 投递质量统计单例
+ * @details 加序号在编码poller中执行，收包统计与报告在传输层poller中执行
+ */
+class SeqMonitor {
+public:
+    using Output = std::function<void(PacketPtr pkt, const sockaddr_storage &addr)>;
+    using LossCB = std::function<void(const sockaddr_storage &addr, double loss)>;
+
+    static constexpr size_t kDataHeader = TunnelProto::kHeaderSize + 8;    ///< 数据报文头长度
+    static constexpr size_t kOverhead = kDataHeader;                       ///< 相对原数据报的膨胀
+    static constexpr size_t kReportSize = TunnelProto::kHeaderSize + 6;
+    static constexpr int kWindow = 256;                     ///< 到达位图的序号个数
+    static constexpr int64_t kResetGap = 1 << 16;           ///< 序号跳变超过该值视为对端重启
+    static constexpr uint64_t kReportMs = 1000;             ///< 报告间隔
+    static constexpr uint64_t kIdleMs = 60 * 1000;          ///< 节点空闲超时
+
+    /**
+     * @brief 一个节点的投递质量
+     */
+    struct Stats {
+        double loss = 0;        ///< 丢包率(0-1)
+        double reorder = 0;     ///< 乱序率(0-1)
+        double dup = 0;         ///< 重复率(0-1)
+    };
+
+    /**
+     * @brief 获取SeqMonitor单例
+     */
+    static SeqMonitor &Instance() {
+        static SeqMonitor monitor;
+        return monitor;
+    }
+
+    /**
+     * @brief 启动
+     * @param enabled 本端发送时是否加序号，关闭时仍统计和报告对端的序号报文
+     * @param poller 传输层poller
+     * @param out 报告的发送函数，直接进入发送队列
+     * @param on_loss 收到对端报告的丢包率
+     */
+    void start(bool enabled, const toolkit::EventPoller::Ptr &poller, Output out, LossCB on_loss) {
+        _enabled = enabled;
+        _out = std::move(out);
+        _on_loss = std::move(on_loss);
+        poller->doDelayTask(kReportMs, [this]() {
+            report();
+            return kReportMs;
+        });
+        Statistics::Instance().addGauge("seq", [this]() { return gauge(); });
+    }
+
+    bool enabled() const { return _enabled; }
+
+    /**
+     * @brief 加上序号，在编码poller中执行
+     */
+    PacketPtr wrap(const PacketPtr &pkt, const sockaddr_storage &addr) {
+        auto now = toolkit::getCurrentMillisecond();
+        if (now - _txSwept >= kIdleMs) {
+            _txSwept = now;
+            for (auto it = _tx.begin(); it != _tx.end();) {
+                it = now - it->second.used > kIdleMs ? _tx.erase(it) : std::next(it);
+            }
+        }
+        auto &tx = _tx[PeerKey(addr)];
+        if (!tx.sender) {
+            tx.sender = _rng() | 1;
+        }
+        tx.used = now;
+        auto seq = ++tx.seq;
+        auto wrapped = Packet::create(kDataHeader + pkt->size(), false);
+        auto p = wrapped->data();
+        TunnelProto::writeHeader(p, TunnelProto::Sequenced);
+        TunnelProto::put16(p + TunnelProto::kHeaderSize, tx.sender >> 16);
+        TunnelProto::put16(p + TunnelProto::kHeaderSize + 2, tx.sender);
+        TunnelProto::put16(p + TunnelProto::kHeaderSize + 4, seq >> 16);
+        TunnelProto::put16(p + TunnelProto::kHeaderSize + 6, seq);
+        memcpy(p + kDataHeader, pkt->data(), pkt->size());
+        wrapped->setSize(kDataHeader + pkt->size());
+        return wrapped;
+    }
+
+    static bool isSequenced(const char *data, size_t size) {
+        return size > kDataHeader && TunnelProto::isExtended(data, size) && TunnelProto::type(data) == TunnelProto::Sequenced;
+    }
+
+    static bool isReport(const char *data, size_t size) {
+        return size >= kReportSize && TunnelProto::isExtended(data, size) && TunnelProto::type(data) == TunnelProto::SeqReport;
+    }
+
+    /**
+     * @brief 统计并去掉序号
+     * @param data 输入为序号报文，输出为原数据报
+     * @param size 输入为序号报文长度，输出为原数据报长度
+     * @param from 来源地址，报告发往最近一次的来源
+     */
+    void onReceive(char *&data, size_t &size, const sockaddr_storage &from) {
+        uint32_t sender = (uint32_t)TunnelProto::get16(data + TunnelProto::kHeaderSize) << 16
+            | TunnelProto::get16(data + TunnelProto::kHeaderSize + 2);
+        uint32_t seq = (uint32_t)TunnelProto::get16(data + TunnelProto::kHeaderSize + 4) << 16
+            | TunnelProto::get16(data + TunnelProto::kHeaderSize + 6);
+        data += kDataHeader;
+        size -= kDataHeader;
+        std::lock_guard<std::mutex> lck(_mtx);
+        auto &rx = _rx[sender];
+        rx.addr = from;
+        rx.used = toolkit::getCurrentMillisecond();
+        int64_t diff = (int32_t)(seq - rx.highest);
+        if (!rx.started || diff > kResetGap || diff < -kResetGap) {
+            rx.started = true;
+            rx.highest = seq;
+            rx.arrived.set();
+            ++rx.received;
+            return;
+        }
+        if (diff > 0) {
+            // 跳过的序号先计为丢失
+            rx.lost += diff - 1;
+            rx.arrived = diff >= kWindow ? std::bitset<kWindow>() : rx.arrived << diff;
+            rx.arrived[0] = true;
+            rx.highest = seq;
+            ++rx.received;
+            return;
+        }
+        auto age = -diff;
+        if (age < kWindow && rx.arrived[age]) {
+            ++rx.dup;
+            return;
+        }
+        if (age < kWindow) {
+            rx.arrived[age] = true;
+        }
+        // 迟到的序号之前已计为丢失
+        --rx.lost;
+        ++rx.reordered;
+        ++rx.received;
+    }
+
+    /**
+     * @brief 处理对端的报告
+     */
+    void onReport(const char *data, const sockaddr_storage &from) {
+        auto p = data + TunnelProto::kHeaderSize;
+        Stats stats;
+        stats.loss = TunnelProto::get16(p) / 1000.0;
+        stats.reorder = TunnelProto::get16(p + 2) / 1000.0;
+        stats.dup = TunnelProto::get16(p + 4) / 1000.0;
+        {
+            std::lock_guard<std::mutex> lck(_mtx);
+            auto &remote = _remote[PeerKey(from)];
+            remote.addr = from;
+            remote.stats = stats;
+            remote.updated = toolkit::getCurrentMillisecond();
+        }
+        if (_on_loss) {
+            _on_loss(from, stats.loss);
+        }
+    }
+
+    /**
+     * @brief 对端报告的本端发往该节点的投递质量
+     * @return 没有近期的报告时返回false
+     */
+    bool remote(const sockaddr_storage &addr, Stats &out) {
+        std::lock_guard<std::mutex> lck(_mtx);
+        auto it = _remote.find(PeerKey(addr));
+        if (it == _remote.end() || toolkit::getCurrentMillisecond() - it->second.updated > 3 * kReportMs) {
+            return false;
+        }
+        out = it->second.stats;
+        return true;
+    }
+
+private:
+    struct TxState {
+        uint32_t sender = 0;                ///< 发送方编号，非0
+        uint32_t seq = 0;                   ///< 最近序号
+        uint64_t used = 0;
+    };
+
+    struct RxState {
+        sockaddr_storage addr{};            ///< 最近一次的来源地址
+        bool started = false;
+        uint32_t highest = 0;               ///< 收到的最大序号
+        std::bitset<kWindow> arrived;       ///< 第i位为序号highest-i是否已到达
+        uint64_t used = 0;
+        // 本周期的计数，丢失可能因迟到而为负
+        int64_t received = 0;
+        int64_t lost = 0;
+        int64_t reordered = 0;
+        int64_t dup = 0;
+        Stats stats;                        ///< 平滑后的比率
+    };
+
+    struct Remote {
+        sockaddr_storage addr{};
+        Stats stats;
+        uint64_t updated = 0;
+    };
+
+    SeqMonitor() = default;
+
+    static uint16_t permille(double v) {
+        return (uint16_t)std::min(1000.0, std::max(0.0, v * 1000));
+    }
+
+    /**
+     * @brief 计算本周期的比率并报告给各发送方
+     */
+    void report() {
+        std::vector<std::pair<sockaddr_storage, Stats>> reports;
+        {
+            std::lock_guard<std::mutex> lck(_mtx);
+            auto now = toolkit::getCurrentMillisecond();
+            for (auto it = _rx.begin(); it != _rx.end();) {
+                auto &rx = it->second;
+                if (now - rx.used > kIdleMs) {
+                    it = _rx.erase(it);
+                    continue;
+                }
+                ++it;
+                auto expected = rx.received + std::max<int64_t>(rx.lost, 0);
+                if (!expected) {
+                    continue;
+                }
+                Stats cur;
+                cur.loss = std::max<int64_t>(rx.lost, 0) / (double)expected;
+                cur.reorder = rx.reordered / (double)std::max<int64_t>(rx.received, 1);
+                cur.dup = rx.dup / (double)std::max<int64_t>(rx.received + rx.dup, 1);
+                rx.stats.loss = rx.stats.loss * 0.7 + cur.loss * 0.3;
+                rx.stats.reorder = rx.stats.reorder * 0.7 + cur.reorder * 0.3;
+                rx.stats.dup = rx.stats.dup * 0.7 + cur.dup * 0.3;
+                rx.received = rx.lost = rx.reordered = rx.dup = 0;
+                reports.emplace_back(rx.addr, rx.stats);
+            }
+            for (auto it = _remote.begin(); it != _remote.end();) {
+                if (now - it->second.updated > kIdleMs) {
+                    it = _remote.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+        for (auto &item : reports) {
+            auto pkt = Packet::create(kReportSize, false);
+            auto p = pkt->data();
+            TunnelProto::writeHeader(p, TunnelProto::SeqReport);
+            TunnelProto::put16(p + TunnelProto::kHeaderSize, permille(item.second.loss));
+            TunnelProto::put16(p + TunnelProto::kHeaderSize + 2, permille(item.second.reorder));
+            TunnelProto::put16(p + TunnelProto::kHeaderSize + 4, permille(item.second.dup));
+            pkt->setSize(kReportSize);
+            _out(std::move(pkt), item.first);
+        }
+    }
+
+    static std::string percent(const Stats &stats) {
+        std::ostringstream oss;
+        oss << std::fixed << std::setprecision(1) << stats.loss * 100 << "%/" << stats.reorder * 100 << "%/" << stats.dup * 100 << "%";
+        return oss.str();
+    }
+
+    /**
+     * @brief 收(本端统计)与发(对端报告)两个方向，各项依次为丢包/乱序/重复
+     */
+    std::string gauge() {
+        std::lock_guard<std::mutex> lck(_mtx);
+        std::ostringstream oss;
+        auto name = [](const sockaddr_storage &addr) {
+            return toolkit::SockUtil::inet_ntoa(reinterpret_cast<const sockaddr *>(&addr)) + ":"
+                + std::to_string(toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&addr)));
+        };
+        for (auto &it : _rx) {
+            oss << (oss.tellp() ? "," : "") << "rx@" << name(it.second.addr) << "=" << percent(it.second.stats);
+        }
+        for (auto &it : _remote) {
+            oss << (oss.tellp() ? "," : "") << "tx@" << name(it.second.addr) << "=" << percent(it.second.stats);
+        }
+        return oss.str();
+    }
+
+    bool _enabled = false;
+    Output _out;
+    LossCB _on_loss;
+    // 以下发送状态只在编码poller中访问
+    std::unordered_map<PeerKey, TxState, PeerKey::Hash> _tx;   ///< 发往各节点的编号与序号
+    uint64_t _txSwept = 0;                                      ///< 上次清除空闲发送状态的时间
+    std::mt19937 _rng{std::random_device{}()};
+    std::mutex _mtx;
+    std::unordered_map<uint32_t, RxState> _rx;                  ///< 按发送方编号的接收状态
+    std::unordered_map<PeerKey, Remote, PeerKey::Hash> _remote;
+};
+
+#endif //TALUSVSWITCH_SEQMONITOR_H
@@ -0,0 +1,147 @@
+﻿/**
+ * @file Statistics.h
+ * @brief 运行统计
+ * @details 各模块按名字注册计数器和状态项，由统计器定期输出到日志
+ */
+
+#ifndef TALUSVSWITCH_STATISTICS_H
+#define TALUSVSWITCH_STATISTICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+#include "Poller/EventPoller.h"
+#include "Util/logger.h"
+
+/**
+ * @class Statistics
+ * @brief 统计信息单例
+ * @details
+ * - 计数器只增不减，输出时附带上个周期内的每秒速率
+ * - 状态项由注册的回调在输出时计算
+ * - 每次输出附带进程在上个周期内的CPU占用
+ */
+class Statistics {
+public:
+    using Counter = std::atomic<uint64_t>;
+    using Gauge = std::function<std::string()>;
+
+    /**
+     * @brief 获取Statistics单例
+     */
+    static Statistics &Instance() {
+        static Statistics statistics;
+        return statistics;
+    }
+
+    /**
+     * @brief 获取计数器，不存在时创建
+     * @param name 计数器名称
+     * @return 计数器引用，整个进程生命周期内有效，调用方可缓存
+     */
+    Counter &counter(const std::string &name) {
+        std::lock_guard<std::mutex> lck(_mtx);
+        return _counters.try_emplace(name, 0).first->second.value;
+    }
+
+    /**
+     * @brief 注册状态项
+     * @param name 状态项名称
+     * @param gauge 输出时调用，返回状态值的文本
+     */
+    void addGauge(const std::string &name, Gauge gauge) {
+        std::lock_guard<std::mutex> lck(_mtx);
+        _gauges[name] = std::move(gauge);
+    }
+
+    /**
+     * @brief 启动周期输出
+     * @param poller 执行输出的轮询器
+     * @param interval 输出间隔(秒)，为0时不输出
+     */
+    void start(const toolkit::EventPoller::Ptr &poller, int interval) {
+        if (interval <= 0) {
+            return;
+        }
+        snapshot();
+        poller->doDelayTask(interval * 1000, [this, interval]() {
+            InfoL << "STATS " << report();
+            return interval * 1000;
+        });
+    }
+
+    /**
+     * @brief 生成一次统计报告，并以此刻作为下个周期的起点
+     */
+    std::string report() {
+        auto now = std::chrono::steady_clock::now();
+        auto cpu = cpuTime();
+        double seconds = std::chrono::duration<double>(now - _last_time).count();
+        std::stringstream ss;
+        ss << std::fixed << std::setprecision(1);
+        ss << "cpu=" << (seconds > 0 ? (cpu - _last_cpu) * 100 / seconds : 0) << "%";
+        std::lock_guard<std::mutex> lck(_mtx);
+        for (auto &pr : _counters) {
+            auto value = pr.second.value.load(std::memory_order_relaxed);
+            ss << " " << pr.first << "=" << value;
+            if (seconds > 0) {
+                ss << "(" << (value - pr.second.last) / seconds << "/s)";
+            }
+            pr.second.last = value;
+        }
+        for (auto &pr : _gauges) {
+            ss << " " << pr.first << "=" << pr.second();
+        }
+        _last_time = now;
+        _last_cpu = cpu;
+        return ss.str();
+    }
+
+private:
+    Statistics() = default;
+
+    struct Entry {
+        explicit Entry(uint64_t v) : value(v) {}
+        Counter value;
+        uint64_t last = 0;
+    };
+
+    void snapshot() {
+        std::lock_guard<std::mutex> lck(_mtx);
+        _last_time = std::chrono::steady_clock::now();
+        _last_cpu = cpuTime();
+        for (auto &pr : _counters) {
+            pr.second.last = pr.second.value.load(std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * @brief 进程累计CPU时间(秒)，包括用户态和内核态
+     */
+    static double cpuTime() {
+#ifndef _WIN32
+        rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+#else
+        return 0;
+#endif
+    }
+
+    std::mutex _mtx;
+    std::map<std::string, Entry> _counters;
+    std::map<std::string, Gauge> _gauges;
+    std::chrono::steady_clock::time_point _last_time = std::chrono::steady_clock::now();
+    double _last_cpu = 0;
+};
+
+#endif //TALUSVSWITCH_STATISTICS_H
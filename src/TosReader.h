@@ -0,0 +1,161 @@
+﻿/**
+ * @file TosReader.h
+ * @brief 带外层TOS的UDP收包
+ * @details toolkit的收包不读取辅助数据，开启ECN时epoll引擎改用本类收包：
+ * - socket开启IP_RECVTOS/IPV6_RECVTCLASS，每个数据报的TOS随控制消息返回
+ * - 复制一个fd注册到poller，原socket仍由toolkit持有并负责发送，只是不再由其收包
+ * - 每次可读时用recvmmsg批量收包
+ */
+
+#ifndef TALUSVSWITCH_TOSREADER_H
+#define TALUSVSWITCH_TOSREADER_H
+
+#include <cstring>
+#include <functional>
+#include <vector>
+#include <Network/Buffer.h>
+#include <Poller/EventPoller.h>
+#include <Util/logger.h>
+#ifndef _WIN32
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+
+/**
+ * @class TosReader
+ * @brief 读取外层TOS的UDP收包器
+ * @details 收包在所属poller中执行
+ */
+class TosReader {
+public:
+    using onReadCB = std::function<void(toolkit::Buffer::Ptr &buf, struct sockaddr *addr, int addr_len, int tos)>;
+
+    static constexpr size_t kBatch = 32;    ///< 每次recvmmsg最多收包个数
+
+    /**
+     * @brief 开启socket的TOS接收
+     * @param fd UDP socket
+     */
+    static void enableRecvTos(int fd) {
+        int on = 1;
+        setsockopt(fd, IPPROTO_IP, IP_RECVTOS, &on, sizeof(on));
+        setsockopt(fd, IPPROTO_IPV6, IPV6_RECVTCLASS, &on, sizeof(on));
+    }
+
+    /**
+     * @brief 从控制消息中取出TOS
+     * @return 没有时返回-1
+     */
+    static int parseTos(msghdr &msg) {
+        for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if ((cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_TOS)
+                || (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_TCLASS)) {
+                // IP_TOS为1字节，IPV6_TCLASS为int
+                return cmsg->cmsg_len >= CMSG_LEN(sizeof(int)) ? *reinterpret_cast<int *>(CMSG_DATA(cmsg)) & 0xff
+                                                                : *CMSG_DATA(cmsg);
+            }
+        }
+        return -1;
+    }
+
+    ~TosReader() {
+        if (_fd >= 0) {
+            _poller->delEvent(_fd, [fd = _fd](bool) { close(fd); });
+        }
+    }
+
+    /**
+     * @brief 开始收包
+     * @param poller socket所在的poller
+     * @param fd UDP socket，调用方应关闭其原有的收包
+     * @param size 最大数据报长度
+     * @return 失败时返回false
+     */
+    bool start(const toolkit::EventPoller::Ptr &poller, int fd, size_t size) {
+        _fd = dup(fd);
+        if (_fd < 0) {
+            WarnL << "dup udp socket failed: " << strerror(errno);
+            return false;
+        }
+        enableRecvTos(fd);
+        _poller = poller;
+        _size = size;
+        _data.resize(kBatch * size);
+        for (size_t i = 0; i < kBatch; ++i) {
+            _iov[i] = {&_data[i * size], size};
+        }
+        if (_poller->addEvent(_fd, toolkit::EventPoller::Event_Read, [this](int) { onRead(); }) < 0) {
+            WarnL << "add udp socket to poller failed";
+            close(_fd);
+            _fd = -1;
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief 设置收包回调
+     * @details buf仅在回调期间有效
+     */
+    void setOnRead(onReadCB cb) {
+        _poller->async([this, cb]() { _on_read = cb; });
+    }
+
+private:
+    /**
+     * @brief 仅在回调期间引用收包缓冲区的Buffer
+     */
+    class BufferRef : public toolkit::Buffer {
+    public:
+        BufferRef(char *data, size_t size) : _data(data), _size(size) {}
+        char *data() const override { return _data; }
+        size_t size() const override { return _size; }
+
+    private:
+        char *_data;
+        size_t _size;
+    };
+
+    void onRead() {
+        int count;
+        do {
+            for (size_t i = 0; i < kBatch; ++i) {
+                auto &msg = _msgs[i].msg_hdr;
+                msg.msg_name = &_addrs[i];
+                msg.msg_namelen = sizeof(sockaddr_storage);
+                msg.msg_iov = &_iov[i];
+                msg.msg_iovlen = 1;
+                msg.msg_control = _control[i];
+                msg.msg_controllen = sizeof(_control[i]);
+                msg.msg_flags = 0;
+            }
+            count = recvmmsg(_fd, _msgs, kBatch, MSG_DONTWAIT, nullptr);
+            for (int i = 0; i < count && _on_read; ++i) {
+                auto &msg = _msgs[i].msg_hdr;
+                if (msg.msg_flags & MSG_TRUNC) {
+                    continue;
+                }
+                BufferRef ref((char *)_iov[i].iov_base, _msgs[i].msg_len);
+                toolkit::Buffer::Ptr buf(std::shared_ptr<void>(), &ref);
+                _on_read(buf, reinterpret_cast<sockaddr *>(&_addrs[i]), msg.msg_namelen, parseTos(msg));
+            }
+        } while (count == (int)kBatch);
+    }
+
+    int _fd = -1;
+    size_t _size = 0;
+    toolkit::EventPoller::Ptr _poller;
+    std::vector<char> _data;
+    iovec _iov[kBatch];
+    mmsghdr _msgs[kBatch];
+    sockaddr_storage _addrs[kBatch];
+    alignas(cmsghdr) char _control[kBatch][CMSG_SPACE(sizeof(int)) * 2];
+    onReadCB _on_read;
+};
+
+#endif // __linux__
+
+#endif //TALUSVSWITCH_TOSREADER_H
@@ -0,0 +1,98 @@
+﻿/**
+ * @file TrafficClass.h
+ * @brief 内层报文的流量分类
+ * @details 按隧道头、内层以太网类型和DSCP把发送的报文分到不同优先级通道：
+ * - 控制：TVS命令、保活报文(只有MAC头)与ARP，丢失或延迟会导致节点老化
+ * - 交互：DSCP为CS4及以上(含EF、AF4x)的IP报文，通常是语音、视频与网络控制
+ * - 批量：其他报文
+ */
+
+#ifndef TALUSVSWITCH_TRAFFICCLASS_H
+#define TALUSVSWITCH_TRAFFICCLASS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "ControlProto.h"
+
+namespace TrafficClass {
+    /**
+     * @brief 优先级通道，数值越小优先级越高
+     */
+    enum Lane : uint8_t {
+        Control = 0,
+        Interactive = 1,
+        Bulk = 2,
+        kLanes = 3,
+    };
+
+    constexpr int kInteractiveDscp = 32;   ///< CS4
+
+    /**
+     * @brief 内层IP头的偏移
+     * @return 非IP报文返回0
+     */
+    inline size_t ipOffset(const char *frame, size_t size, uint16_t &ethertype) {
+        auto p = reinterpret_cast<const uint8_t *>(frame);
+        if (size < 14) {
+            return 0;
+        }
+        size_t l3 = 14;
+        ethertype = p[12] << 8 | p[13];
+        if (ethertype == 0x8100 && size >= 18) {
+            ethertype = p[16] << 8 | p[17];
+            l3 = 18;
+        }
+        if ((ethertype == 0x0800 && size >= l3 + 20) || (ethertype == 0x86dd && size >= l3 + 40)) {
+            return l3;
+        }
+        return 0;
+    }
+
+    /**
+     * @brief 内层IP报文的流量类别字节(IPv4 TOS / IPv6 Traffic Class)
+     * @return 非IP报文返回-1
+     */
+    inline int tos(const char *frame, size_t size) {
+        uint16_t ethertype = 0;
+        auto l3 = ipOffset(frame, size, ethertype);
+        if (!l3) {
+            return -1;
+        }
+        auto ip = reinterpret_cast<const uint8_t *>(frame + l3);
+        return ethertype == 0x0800 ? ip[1] : ((ip[0] & 0x0f) << 4 | ip[1] >> 4);
+    }
+
+    /**
+     * @brief 对要发送的内层以太网帧分类
+     */
+    inline Lane classify(const char *frame, size_t size) {
+        if (size <= 12 || ControlProto::isControl(frame, size)) {
+            return Control;
+        }
+        if (size >= 14 && (uint8_t)frame[12] == 0x08 && (uint8_t)frame[13] == 0x06) {
+            return Control;
+        }
+        auto t = tos(frame, size);
+        return t >= 0 && (t >> 2) >= kInteractiveDscp ? Interactive : Bulk;
+    }
+
+    /**
+     * @brief 解析队列调度配置
+     * @param mode strict为严格优先级，weighted为加权轮询，off为单通道
+     * @return 传给BoundedQueue的通道权重
+     */
+    inline std::vector<int> laneWeights(const std::string &mode) {
+        if (mode == "strict") {
+            return {0, 0, 0};
+        }
+        if (mode == "off") {
+            return {};
+        }
+        return {16, 4, 1};
+    }
+}
+
+#endif //TALUSVSWITCH_TRAFFICCLASS_H
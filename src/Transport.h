@@ -11,17 +11,44 @@
 #include "VSCtrlHelper.h"
 #include <Network/Socket.h>
 #include "ArpMap.h"
+#include "BoundedQueue.h"
+#include "UringEngine.h"
+#include "Fragmenter.h"
+#include "PathMtu.h"
+#include "Crypto.h"
+#include "Fec.h"
+#include "Multipath.h"
+#include "Pacer.h"
+#include "TrafficClass.h"
+#include "Ecn.h"
+#include "TosReader.h"
+#include "PeerSockets.h"
+#include "LinkProbe.h"
+#include "SeqMonitor.h"
 
 /**
  * @class Transport
  * @brief 网络传输管理类
  * @details 负责网络数据的发送和接收，包括：
  * - UDP Socket的创建和管理
+ * - 收发引擎的选择(epoll/io_uring)
+ * - 发送路径的有界队列与背压，控制与交互报文走高优先级通道
  * - 数据的压缩和解压缩
+ * - 超过路径数据报上限时的隧道分片与重组
+ * - 按批加密与解密
+ * - 按节点的前向纠错
+ * - 多个上行链路时按流调度
+ * - 内层DSCP/ECN复制到外层，收包时取外层TOS
+ * - 按节点的令牌桶发送整形
+ * - 流量大的节点使用已连接的socket发送
+ * - 节点路径测量报文的收发
  * - 命令数据的识别和处理
  */
 class Transport {
 public:
+    using onReadCB = std::function<void(const PacketPtr& pkt,
+        const sockaddr_storage& pktRecvPeer, int addr_len, uint8_t ttl, bool isTvsCmd, int tos)>;
+
     /**
      * @brief 获取Transport单例
      * @return Transport& 单例引用
@@ -36,11 +63,90 @@ public:
      * @param port 监听端口
      * @param local_ip 本地IP地址
      * @param enable_reuse 是否允许端口重用
-     * @details 创建并初始化UDP Socket，开始监听指定端口
+     * @details 创建并初始化UDP Socket，开始监听指定端口；
+     * 配置为io_uring且内核支持时由UringEngine接管收发，否则使用epoll
      */
     void start(uint16_t port, const std::string& local_ip = "::", bool enable_reuse = true) {
+        auto policy = BoundedQueue<Pending>::parsePolicy(Config::queueDrop);
+        auto weights = TrafficClass::laneWeights(Config::prio);
+        _encode_queue = std::make_unique<BoundedQueue<Pending>>("queue.encode", Config::queueLen, policy, weights);
+        _send_queue = std::make_unique<BoundedQueue<Pending>>("queue.send", Config::queueLen, policy, weights);
+        _encode_poller = toolkit::EventPollerPool::Instance().getPoller();
         _sock = toolkit::Socket::createSocket();
         _sock->bindUdpSock(port, local_ip, enable_reuse);
+        if (Config::pmtud) {
+            PathMtu::Instance().start(getPoller(), _sock->rawFD(), Config::pmtuMax);
+        }
+        // socket积压的数据发送完毕后继续发送队列中的数据
+        _sock->setOnFlush([this]() {
+            flushSendQueue();
+            return true;
+        });
+        if (Config::paceRate > 0) {
+            _pacer = std::make_unique<Pacer<Pending>>(getPoller(), Config::paceRate, Config::paceBurst << 10,
+                Config::queueLen, Config::paceAuto, [this](Pending &&item) { sendNow(std::move(item)); },
+                [this]() {
+                    flushSockets();
+                    checkDrained();
+                    if (_pace_holding) {
+                        // 放行回调中持有整形器的锁，异步继续发送队列
+                        getPoller()->async([this]() { flushSendQueue(); }, false);
+                    }
+                });
+            Multipath::Instance().setOnRtt([this](const sockaddr_storage &addr, double rtt) { _pacer->onRtt(addr, rtt); });
+            LinkProbe::Instance().setOnRtt([this](const sockaddr_storage &addr, double rtt) { _pacer->onRtt(addr, rtt); });
+        }
+        if (!Config::uplinks.empty()) {
+            Multipath::Instance().start(getPoller(), port, Config::uplinks, Multipath::parsePolicy(Config::multipath));
+            for (auto &uplink : Multipath::Instance().uplinks()) {
+                uplink.sock->setOnFlush([this]() {
+                    flushSendQueue();
+                    return true;
+                });
+                if (Config::ecn) {
+                    startTosReader(uplink.sock);
+                }
+            }
+        }
+        // 路径测量报文不压缩不加密，走控制通道
+        LinkProbe::Instance().setSender([this](PacketPtr pkt, const sockaddr_storage &addr) {
+            enqueueSend({std::move(pkt), addr, sizeof(addr), true, 0, 0, TrafficClass::Control, defaultTos()});
+        });
+        // 序号统计的报告直接进入发送队列，对端报告的丢包率用于调整校验个数与整形速率
+        SeqMonitor::Instance().start(Config::seq, getPoller(),
+            [this](PacketPtr pkt, const sockaddr_storage &addr) {
+                enqueueSend({std::move(pkt), addr, sizeof(addr), true, 0, 0, TrafficClass::Control, defaultTos()});
+            },
+            [this](const sockaddr_storage &addr, double loss) {
+                Fec::Instance().onLoss(addr, loss);
+                if (_pacer) {
+                    _pacer->onLoss(addr, loss);
+                }
+            });
+        // 校验报文与丢包率报告直接进入发送队列
+        Fec::Instance().start(Fec::parseMode(Config::fec), Config::fecBlock, _encode_poller, getPoller(),
+            [this](PacketPtr pkt, const sockaddr_storage &addr) {
+                enqueueSend({std::move(pkt), addr, sizeof(addr), true, 0, 0, TrafficClass::Bulk, defaultTos()});
+            });
+#if defined(HAS_IO_URING)
+        if (Config::ioEngine == "io_uring") {
+            if (UringEngine::Instance().start(getPoller(), _sock->rawFD(), maxDatagram(), Config::ecn)) {
+                // socket仍由toolkit持有，只是不再由epoll收包
+                _sock->enableRecv(false);
+                UringEngine::Instance().setOnSendDone([this]() { flushSendQueue(); });
+                InfoL << "IO engine: io_uring";
+                return;
+            }
+            WarnL << "io_uring not available, fallback to epoll";
+        }
+#endif
+        if (Config::ecn) {
+            startTosReader(_sock);
+        }
+        if (Config::peerSocks > 0) {
+            startPeerSockets(port, local_ip);
+        }
+        InfoL << "IO engine: epoll";
     }
 
     /**
@@ -52,33 +158,20 @@ public:
      * - 地址长度
      * - TTL值
      * - 是否为TVS命令
+     * - 外层TOS，未知时为-1
      */
-    void setOnRead(const std::function<void(const toolkit::Buffer::Ptr& buf,
-        const sockaddr_storage& pktRecvPeer, int addr_len, uint8_t ttl, bool isTvsCmd)>& cb) {
-        auto poller = getPoller();
-        _sock->setOnRead([cb, poller](toolkit::Buffer::Ptr& buf, struct sockaddr* addr, int addr_len) {
-            sockaddr_storage pktRecvPeer{};
-            if (addr) {
-                auto addrLen = addr_len ? addr_len : toolkit::SockUtil::get_sock_len(addr);
-                memcpy(&pktRecvPeer, addr, addrLen);
-            }
-            uint8_t ttl = buf->data()[0] ^ buf->data()[buf->size()-1];
-            auto dd = decompress(buf);
-            uint64_t dMac = *(uint64_t*)dd->data();
-            dMac = dMac << 16;
-            auto isTvsCmd = strncmp(dd->data() + 12, TVS_CMD_PREFIX, strlen(TVS_CMD_PREFIX)) == 0;
-            
-            if (cb && dMac) {
-                cb(dd, pktRecvPeer, addr_len, ttl, isTvsCmd);
-            }
-            
-            if (isTvsCmd) {
-                // 执行命令处理
-                toolkit::EventPollerPool::Instance().getPoller()->async([dd, pktRecvPeer, addr_len, ttl, dMac]() {
-                    VSCtrlHelper::Instance().handleCmd(dd, pktRecvPeer, addr_len, ttl);
-                }, false);
-            }
-        });
+    void setOnRead(const onReadCB& cb) {
+        _on_read = cb;
+        for (auto &uplink : Multipath::Instance().uplinks()) {
+            attachOnRead(uplink.sock, cb);
+        }
+#if defined(HAS_IO_URING)
+        if (UringEngine::Instance().active()) {
+            UringEngine::Instance().setOnRead(makeOnRead(cb, _sock->rawFD()));
+            return;
+        }
+#endif
+        attachOnRead(_sock, cb);
     }
 
     /**
@@ -88,23 +181,67 @@ public:
      * @param addr_len 地址长度
      * @param try_flush 是否尝试立即发送
      * @param ttl 生存时间
-     * @details 压缩数据并通过UDP发送
+     * @details 控制面使用，拷贝为报文后发送
      */
     void send(const toolkit::Buffer::Ptr& buf, const sockaddr_storage& addr, 
              socklen_t addr_len, bool try_flush, uint8_t ttl) {
-        auto poller = getPoller();
-        toolkit::EventPollerPool::Instance().getPoller()->async([poller, buf, ttl, addr, addr_len, try_flush]() {
-            auto cd = compress(buf);
-            if (cd->size() > Config::mtu) {
-                WarnL << "WTF! compressedData is bigger than mtu " << cd->size() << " -> " << buf->size();
-            }
-            cd->data()[0] = (char)(ttl ^ cd->data()[cd->size()-1]);
-            cd->data()[1] = cd->data()[cd->size()-2];
-            poller->async([=]() {
-                Instance()._sock->send(cd, reinterpret_cast<sockaddr*>(const_cast<sockaddr_storage*>(&addr)), 
-                                     addr_len, try_flush);
-            }, false);
-        }, false);
+        send(Packet::create(buf->data(), buf->size(), false), addr, addr_len, try_flush, ttl);
+    }
+
+    /**
+     * @brief 发送报文
+     * @param pkt 要发送的报文，所有权移交给传输层
+     * @param addr 目标地址
+     * @param addr_len 地址长度
+     * @param try_flush 是否尝试立即发送
+     * @param ttl 生存时间
+     * @details 报文先进入编码队列，压缩后进入发送队列，再交给socket发送；
+     * 队列满时按配置的策略丢包；目标地址无效时直接丢弃，避免拖累同批次的其他报文
+     */
+    void send(PacketPtr pkt, const sockaddr_storage& addr,
+             socklen_t addr_len, bool try_flush, uint8_t ttl) {
+        if (!toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&addr))) {
+            return;
+        }
+        uint32_t flow = Multipath::Instance().enabled() ? Multipath::flowHash(pkt->data(), pkt->size()) : 0;
+        auto lane = TrafficClass::classify(pkt->data(), pkt->size());
+        int16_t tos = Config::dscp || Config::ecn ? Ecn::outerTos(pkt->data(), pkt->size(), Config::dscp, Config::ecn) : -1;
+        if (_encode_queue->push({std::move(pkt), addr, addr_len, try_flush, ttl, flow, lane, tos}, lane)) {
+            // 队列由空变为非空时调度一次编码
+            _encode_poller->async([this]() { encodeQueue(); }, false);
+        }
+    }
+
+    /**
+     * @brief 发送路径是否拥塞
+     * @details 任一队列或整形的节点队列超过3/4容量即视为拥塞，调用方应暂停读取网卡，
+     * 队列回落到1/4容量以下时通过setOnDrained设置的回调通知恢复
+     */
+    bool congested() {
+        auto high = _encode_queue->capacity() * 3 / 4;
+        if (_encode_queue->size() >= high || _send_queue->size() >= high || (_pacer && _pacer->congested())) {
+            _paused = true;
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * @brief 设置拥塞解除回调
+     * @param cb 回调函数，可能在任意poller线程中执行
+     */
+    void setOnDrained(std::function<void()> cb) {
+        _on_drained = std::move(cb);
+    }
+
+    /**
+     * @brief 到节点的数据报上限
+     * @details 开启分片时为分片上限，否则为网卡MTU，与超长告警的阈值一致
+     */
+    static size_t pathBudget(const sockaddr_storage &addr) {
+        auto budget = datagramBudget(addr);
+        budget = budget ? budget : Config::mtu;
+        return Crypto::Instance().enabled() ? budget - Crypto::kOverhead : budget;
     }
 
     /**
@@ -115,8 +252,446 @@ public:
         return _sock->getPoller();
     }
 
+    /**
+     * @brief 获取本地端口
+     */
+    uint16_t localPort() {
+        return _sock->get_local_port();
+    }
+
 protected:
+    /**
+     * @brief 待发送的数据
+     */
+    struct Pending {
+        PacketPtr pkt;
+        sockaddr_storage addr;
+        socklen_t addr_len;
+        bool try_flush;
+        uint8_t ttl;
+        uint32_t flow = 0;  ///< 内层报文的流哈希，多路径调度使用
+        uint8_t lane = TrafficClass::Bulk;  ///< 优先级通道
+        int16_t tos = -1;   ///< 外层TOS，-1为不设置
+    };
+
+    using RawReadCB = std::function<void(toolkit::Buffer::Ptr &buf, struct sockaddr *addr, int addr_len, int tos)>;
+
+    /**
+     * @brief 复制DSCP或ECN时，不含内层IP的数据报使用的外层TOS
+     */
+    static int16_t defaultTos() {
+        return Config::dscp || Config::ecn ? 0 : -1;
+    }
+
+    /**
+     * @brief socket改由TosReader收包，以取得外层TOS
+     */
+    void startTosReader(const toolkit::Socket::Ptr &sock) {
+#if defined(__linux__)
+        auto reader = std::make_shared<TosReader>();
+        if (reader->start(sock->getPoller(), sock->rawFD(), maxDatagram())) {
+            sock->enableRecv(false);
+            _tos_readers[sock->rawFD()] = std::move(reader);
+        }
+#endif
+    }
+
+    /**
+     * @brief 启用已连接socket缓存
+     * @details 已连接socket由toolkit批量发送，io_uring引擎与多路径各自管理发送socket，不启用
+     */
+    void startPeerSockets(uint16_t port, const std::string &local_ip) {
+        if (Multipath::Instance().enabled()) {
+            WarnL << "Connected peer sockets are not used with multipath";
+            return;
+        }
+        PeerSockets::Instance().start(getPoller(), port, local_ip, Config::peerSocks,
+            [this](const toolkit::Socket::Ptr &sock) {
+                // 来自该节点的数据报改由此socket收取
+                sock->setOnFlush([this]() {
+                    flushSendQueue();
+                    return true;
+                });
+                if (Config::ecn) {
+                    startTosReader(sock);
+                }
+                attachOnRead(sock, _on_read);
+            },
+            [this](const toolkit::Socket::Ptr &sock) {
+#if defined(__linux__)
+                _tos_readers.erase(sock->rawFD());
+#endif
+            });
+    }
+
+    /**
+     * @brief 设置socket的收包回调
+     */
+    void attachOnRead(const toolkit::Socket::Ptr &sock, const onReadCB &cb) {
+        auto onRead = makeOnRead(cb, sock->rawFD());
+#if defined(__linux__)
+        auto it = _tos_readers.find(sock->rawFD());
+        if (it != _tos_readers.end()) {
+            it->second->setOnRead(std::move(onRead));
+            return;
+        }
+#endif
+        sock->setOnRead([onRead](toolkit::Buffer::Ptr &buf, struct sockaddr *addr, int addr_len) {
+            onRead(buf, addr, addr_len, -1);
+        });
+    }
+
+    /**
+     * @brief 生成socket的数据接收回调
+     * @param fd 收包的socket，多路径探测从原socket应答
+     */
+    static RawReadCB makeOnRead(const onReadCB &cb, int fd) {
+        return [cb, fd](toolkit::Buffer::Ptr& buf, struct sockaddr* addr, int addr_len, int tos) {
+            sockaddr_storage pktRecvPeer{};
+            if (addr) {
+                auto addrLen = addr_len ? addr_len : toolkit::SockUtil::get_sock_len(addr);
+                memcpy(&pktRecvPeer, addr, addrLen);
+            }
+            auto data = buf->data();
+            auto size = buf->size();
+            if (SeqMonitor::isSequenced(data, size)) {
+                // 序号在最外层，统计后去掉
+                SeqMonitor::Instance().onReceive(data, size, pktRecvPeer);
+            } else if (SeqMonitor::isReport(data, size)) {
+                SeqMonitor::Instance().onReport(data, pktRecvPeer);
+                return;
+            }
+            if (Multipath::isProbe(data, size)) {
+                Multipath::Instance().onProbe(data, size, pktRecvPeer, fd);
+                return;
+            }
+            if (LinkProbe::isProbe(data, size)) {
+                LinkProbe::Instance().onPacket(data, size, pktRecvPeer);
+                return;
+            }
+            if (Fec::isFec(data, size)) {
+                // 收到及恢复出的数据报逐个处理
+                Fec::Instance().onReceive(data, size, pktRecvPeer, [&](char *data, size_t size) {
+                    onDatagram(cb, data, size, pktRecvPeer, addr_len, tos);
+                });
+                return;
+            }
+            onDatagram(cb, data, size, pktRecvPeer, addr_len, tos);
+        };
+    }
+
+    /**
+     * @brief 接收的最大数据报长度
+     */
+    static size_t maxDatagram() {
+        return std::max(Config::mtu, Config::pmtud ? Config::pmtuMax : 0) + 64;
+    }
+
+    /**
+     * @brief 处理一个数据报，在传输层poller中执行
+     * @details 拆除扩展封装、解压后交给上层，TVS命令另交给控制助手
+     */
+    static void onDatagram(const onReadCB &cb, char *data, size_t size, const sockaddr_storage &pktRecvPeer, int addr_len, int tos) {
+        PacketPtr whole;
+        if (!unwrap(data, size, whole, pktRecvPeer)) {
+            return;
+        }
+        uint8_t ttl = data[0] ^ data[size-1];
+        auto dd = decompress(data, size);
+        if (!dd) {
+            return;
+        }
+        uint64_t dMac = *(uint64_t*)dd->data();
+        dMac = dMac << 16;
+        // 保活报文只有MAC头，不能读取其后的内存
+        auto isTvsCmd = ControlProto::isControl(dd->data(), dd->size());
+
+        if (cb && dMac) {
+            cb(dd, pktRecvPeer, addr_len, ttl, isTvsCmd, tos);
+        }
+
+        if (isTvsCmd) {
+            // 执行命令处理，命令为控制面的低频流量，拷贝一份交给控制助手，排在poller任务队列最前
+            auto cmd = std::make_shared<toolkit::BufferLikeString>();
+            cmd->assign(dd->data(), dd->size());
+            toolkit::EventPollerPool::Instance().getPoller()->async_first([cmd, pktRecvPeer, addr_len, ttl]() {
+                VSCtrlHelper::Instance().handleCmd(cmd, pktRecvPeer, addr_len, ttl);
+            }, false);
+        }
+    }
+
+    /**
+     * @brief 拆除扩展封装，得到常规数据报，在传输层poller中执行
+     * @param data 输入为收到的报文，输出为常规数据报
+     * @param size 输入为收到的报文长度，输出为常规数据报长度
+     * @param holder 分片重组后由其持有完整的报文
+     * @param from 来源地址
+     * @return 不含数据报(控制报文、未完成的分片、认证失败)时返回false
+     */
+    static bool unwrap(char *&data, size_t &size, PacketPtr &holder, const sockaddr_storage &from) {
+        static auto &plaintext = Statistics::Instance().counter("crypto.plaintext_drops");
+        if (TunnelProto::isExtended(data, size) && TunnelProto::type(data) != TunnelProto::Sealed) {
+            holder = onExtended(data, size, from);
+            if (!holder) {
+                return false;
+            }
+            data = holder->data();
+            size = holder->size();
+        }
+        bool sealed = TunnelProto::isExtended(data, size) && TunnelProto::type(data) == TunnelProto::Sealed;
+        if (!Crypto::Instance().enabled()) {
+            return !sealed;
+        }
+        if (!sealed) {
+            // 开启加密后不接受明文数据报
+            ++plaintext;
+            return false;
+        }
+        return Crypto::Instance().open(data, size, data, size, from);
+    }
+
+    /**
+     * @brief 处理扩展报文，在传输层poller中执行
+     * @return 分片重组完成时返回完整的数据报，其余情况返回空
+     */
+    static PacketPtr onExtended(const char *data, size_t size, const sockaddr_storage &from) {
+        switch (TunnelProto::type(data)) {
+            case TunnelProto::Fragment:
+                return Fragmenter::Instance().reassemble(data, size, from);
+            case TunnelProto::PmtuProbe:
+            case TunnelProto::PmtuAck:
+                PathMtu::Instance().onPacket(data, size, from);
+                return {};
+            default:
+                return {};
+        }
+    }
+
+    /**
+     * @brief 到节点的数据报上限
+     * @return 0为不分片
+     */
+    static size_t datagramBudget(const sockaddr_storage &addr) {
+        size_t budget = PathMtu::Instance().enabled() ? PathMtu::Instance().size(addr) : Config::fragSize;
+        if (budget && Fec::Instance().enabled()) {
+            // 为前向纠错头预留空间
+            budget -= Fec::kOverhead;
+        }
+        if (budget && SeqMonitor::Instance().enabled()) {
+            budget -= SeqMonitor::kOverhead;
+        }
+        return budget;
+    }
+
+    static constexpr size_t kEncodeBatch = 32;      ///< 每次调度最多编码的包数，避免长期占用poller
+    static constexpr size_t kSocketBufLimit = 256;  ///< 交给socket但尚未发出的最大包数
+
+    /**
+     * @brief 编码阶段，在编码poller中执行
+     */
+    void encodeQueue() {
+        thread_local std::vector<Pending> batch;
+        thread_local std::vector<PacketPtr> pkts;
+        Pending next;
+        size_t count = 0;
+        for (; count < kEncodeBatch && _encode_queue->pop(next); ++count) {
+            auto cd = compress(*next.pkt);
+            if (!cd) {
+                continue;
+            }
+            cd->data()[0] = (char)(next.ttl ^ cd->data()[cd->size()-1]);
+            cd->data()[1] = cd->data()[cd->size()-2];
+            next.pkt = std::move(cd);
+            batch.emplace_back(std::move(next));
+        }
+        if (Crypto::Instance().enabled() && !batch.empty()) {
+            // 整批加密，复用同一个加密上下文
+            pkts.clear();
+            for (auto &pending : batch) {
+                pkts.emplace_back(std::move(pending.pkt));
+            }
+            Crypto::Instance().sealBatch(pkts);
+            for (size_t i = 0; i < pkts.size(); ++i) {
+                batch[i].pkt = std::move(pkts[i]);
+            }
+        }
+        for (auto &item : batch) {
+            if (!item.pkt) {
+                continue;
+            }
+            auto &cd = item.pkt;
+            auto budget = datagramBudget(item.addr);
+            if (budget && cd->size() > budget) {
+                // 超过路径上限，在隧道层分片
+                Fragmenter::Instance().fragment(*cd, budget, [&](PacketPtr frag) {
+                    emit({std::move(frag), item.addr, item.addr_len, item.try_flush, item.ttl, item.flow, item.lane, item.tos});
+                });
+                continue;
+            }
+            if (!budget && cd->size() > (size_t)Config::mtu) {
+                WarnL << "WTF! compressedData is bigger than mtu " << cd->size();
+            }
+            emit(std::move(item));
+        }
+        batch.clear();
+        if (count == kEncodeBatch && _encode_queue->size()) {
+            // 还有数据，让出poller后继续
+            _encode_poller->async([this]() { encodeQueue(); }, false);
+        }
+        checkDrained();
+    }
+
+    /**
+     * @brief 编码完成的数据报加上前向纠错头后进入发送队列
+     */
+    void emit(Pending item) {
+        if (!Fec::Instance().enabled()) {
+            enqueueSend(sequence(std::move(item)));
+            return;
+        }
+        Fec::Instance().encode(item.pkt, item.addr, [&](PacketPtr wrapped) {
+            enqueueSend(sequence({std::move(wrapped), item.addr, item.addr_len, item.try_flush, item.ttl, item.flow, item.lane, item.tos}));
+        });
+    }
+
+    /**
+     * @brief 开启序号统计时在最外层加上发往该节点的序号
+     */
+    static Pending sequence(Pending item) {
+        if (SeqMonitor::Instance().enabled()) {
+            item.pkt = SeqMonitor::Instance().wrap(item.pkt, item.addr);
+        }
+        return item;
+    }
+
+    void enqueueSend(Pending item) {
+        auto lane = item.lane;
+        if (_send_queue->push(std::move(item), lane)) {
+            getPoller()->async([this]() { flushSendQueue(); }, false);
+        }
+    }
+
+    /**
+     * @brief 发送阶段，在传输层poller中执行
+     * @details socket或io_uring积压达到上限时停止，待其发送完毕后再继续；
+     * 目标节点的整形队列已满时暂存该数据报并停止出队，积压留在发送队列中由拥塞控制暂停读取网卡，
+     * 待整形放行后再继续
+     */
+    void flushSendQueue() {
+        Pending item;
+        bool sent = true;
+        while (sent) {
+            sent = false;
+            while (!socketBusy() && nextSend(item)) {
+                if (_pacer) {
+                    // 控制与交互报文不在整形队列中等待批量流量
+                    auto urgent = item.lane != TrafficClass::Bulk;
+                    if (!urgent && _pacer->full(item.addr)) {
+                        _pace_held = std::move(item);
+                        _pace_holding = true;
+                        break;
+                    }
+                    sent = true;
+                    _pacer->push(std::move(item), urgent);
+                    continue;
+                }
+                sent = true;
+                sendNow(std::move(item));
+            }
+            // 一批数据合并发送(sendmmsg)，未阻塞时继续下一批
+            if (sent) {
+                flushSockets();
+            }
+        }
+        checkDrained();
+    }
+
+    /**
+     * @brief 取出下一个待发送的数据报，优先取因整形队列满而暂存的
+     */
+    bool nextSend(Pending &item) {
+        if (_pace_holding) {
+            item = std::move(_pace_held);
+            _pace_holding = false;
+            return true;
+        }
+        return _send_queue->pop(item);
+    }
+
+    /**
+     * @brief 交给socket或io_uring，需随后调用flushSockets
+     */
+    void sendNow(Pending item) {
+        auto path = Multipath::Instance().enabled() ? Multipath::Instance().select(item.addr, item.flow) : -1;
+        if (path >= 0) {
+            Multipath::Instance().send(path, std::move(item.pkt).toBuffer(), item.addr, item.tos);
+            return;
+        }
+#if defined(HAS_IO_URING)
+        if (UringEngine::Instance().active()) {
+            UringEngine::Instance().send(std::move(item.pkt).toBuffer(), item.addr, item.addr_len, item.tos);
+            return;
+        }
+#endif
+        auto buf = std::move(item.pkt).toBuffer();
+        if (PeerSockets::Instance().enabled() && PeerSockets::Instance().send(buf, item.addr, item.tos)) {
+            return;
+        }
+        if (item.tos >= 0 && item.tos != _sock_tos) {
+            // toolkit批量发送不支持逐个数据报的控制消息，TOS变化时先发出积压的数据再切换
+            _sock->flushAll();
+            Ecn::setSocketTos(_sock->rawFD(), item.tos);
+            _sock_tos = item.tos;
+        }
+        _sock->send(std::move(buf), reinterpret_cast<sockaddr*>(&item.addr), item.addr_len, false);
+    }
+
+    void flushSockets() {
+        _sock->flushAll();
+        Multipath::Instance().flushAll();
+        if (PeerSockets::Instance().enabled()) {
+            PeerSockets::Instance().flushAll();
+        }
+    }
+
+    bool socketBusy() {
+#if defined(HAS_IO_URING)
+        if (UringEngine::Instance().active()) {
+            return UringEngine::Instance().sendInflight() >= kSocketBufLimit;
+        }
+#endif
+        return _sock->isSocketBusy() || _sock->getSendBufferCount() >= kSocketBufLimit
+            || Multipath::Instance().busy(kSocketBufLimit)
+            || (PeerSockets::Instance().enabled() && PeerSockets::Instance().busy(kSocketBufLimit));
+    }
+
+    void checkDrained() {
+        if (!_paused) {
+            return;
+        }
+        auto low = _encode_queue->capacity() / 4;
+        if (_encode_queue->size() > low || _send_queue->size() > low || (_pacer && _pacer->congested())) {
+            return;
+        }
+        if (_paused.exchange(false) && _on_drained) {
+            _on_drained();
+        }
+    }
+
     toolkit::Socket::Ptr _sock;  ///< UDP Socket指针
+    toolkit::EventPoller::Ptr _encode_poller;            ///< 编码阶段所在的poller
+    std::unique_ptr<BoundedQueue<Pending>> _encode_queue; ///< 待编码队列
+    std::unique_ptr<BoundedQueue<Pending>> _send_queue;   ///< 待发送队列
+    std::unique_ptr<Pacer<Pending>> _pacer;               ///< 发送整形，未开启时为空
+    Pending _pace_held;                                   ///< 因目标节点整形队列满而暂存的数据报
+    bool _pace_holding = false;                           ///< 是否有暂存的数据报
+    int _sock_tos = -1;                                   ///< 默认socket当前的TOS
+#if defined(__linux__)
+    std::unordered_map<int, std::shared_ptr<TosReader>> _tos_readers; ///< 按fd索引的收包器
+#endif
+    onReadCB _on_read;                                    ///< 收包回调，新建的已连接socket使用
+    std::atomic<bool> _paused{false};                     ///< 是否因拥塞通知过上游暂停
+    std::function<void()> _on_drained;                    ///< 拥塞解除回调
 };
 
 #endif //TALUSVSWITCH_TRANSPORT_H
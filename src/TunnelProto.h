@@ -0,0 +1,74 @@
+﻿/**
+ * @file TunnelProto.h
+ * @brief 隧道扩展报文格式
+ * @details 常规数据报是去掉zlib头的deflate数据，第3个字节是第一个deflate块头。
+ * 扩展报文把第3个字节置为0xFF(BTYPE=11为保留值，deflate不会产生)，以此与常规数据报区分：
+ * | 字节 | 含义 |
+ * | 0-1 | 保留，置0 |
+ * | 2 | 扩展标记0xFF |
+ * | 3 | 扩展类型 |
+ * | 4- | 按类型定义 |
+ * 扩展报文只在双方都开启对应功能时使用，默认配置下线上格式不变
+ */
+
+#ifndef TALUSVSWITCH_TUNNELPROTO_H
+#define TALUSVSWITCH_TUNNELPROTO_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace TunnelProto {
+    constexpr uint8_t kMarker = 0xFF;     ///< 扩展标记
+    constexpr size_t kHeaderSize = 4;     ///< 扩展报文公共头长度
+
+    /**
+     * @brief 扩展报文类型
+     */
+    enum Type : uint8_t {
+        Fragment = 1,    ///< 隧道分片
+        PmtuProbe = 2,   ///< 路径MTU探测
+        PmtuAck = 3,     ///< 路径MTU探测应答
+        Sealed = 4,      ///< 加密的数据报
+        FecData = 5,     ///< 前向纠错的数据
+        FecParity = 6,   ///< 前向纠错的校验
+        FecReport = 7,   ///< 前向纠错的丢包率报告
+        PathProbe = 8,   ///< 多路径健康探测
+        PathEcho = 9,    ///< 多路径健康探测应答
+        LinkProbe = 10,  ///< 节点路径测量探测
+        LinkEcho = 11,   ///< 节点路径测量应答
+        Sequenced = 12,  ///< 带序号的数据报
+        SeqReport = 13,  ///< 序号统计的投递质量报告
+    };
+
+    /**
+     * @brief 是否为扩展报文
+     */
+    inline bool isExtended(const char *data, size_t size) {
+        return size >= kHeaderSize && (uint8_t)data[2] == kMarker;
+    }
+
+    inline Type type(const char *data) {
+        return (Type)(uint8_t)data[3];
+    }
+
+    /**
+     * @brief 写入扩展报文公共头
+     */
+    inline void writeHeader(char *data, Type type) {
+        data[0] = 0;
+        data[1] = 0;
+        data[2] = (char)kMarker;
+        data[3] = (char)type;
+    }
+
+    inline void put16(char *p, uint16_t v) {
+        p[0] = (char)(v >> 8);
+        p[1] = (char)v;
+    }
+
+    inline uint16_t get16(const char *p) {
+        return (uint16_t)((uint8_t)p[0] << 8 | (uint8_t)p[1]);
+    }
+}
+
+#endif //TALUSVSWITCH_TUNNELPROTO_H
@@ -0,0 +1,472 @@
+﻿/**
+ * @file UringEngine.h
+ * @brief 基于io_uring的收发引擎
+ * @details 在Linux上替代epoll完成TAP与UDP的数据收发：
+ * - UDP使用multishot recvmsg配合provided buffer ring常驻收包
+ * - TAP的读写以SQE形式批量提交
+ * - UDP发送以SQE形式批量提交，可逐个数据报设置TOS
+ * 内核不支持时由调用方回退到epoll
+ */
+
+#ifndef TALUSVSWITCH_URINGENGINE_H
+#define TALUSVSWITCH_URINGENGINE_H
+
+#include "IoUring.h"
+
+#if defined(HAS_IO_URING)
+
+#include <algorithm>
+#include <functional>
+#include <Network/Buffer.h>
+#include <Network/sockutil.h>
+#include <Poller/EventPoller.h>
+#include <Util/logger.h>
+#include <Util/TimeTicker.h>
+#include "Packet.h"
+#include "Statistics.h"
+#include "TosReader.h"
+
+/**
+ * @class UringEngine
+ * @brief io_uring收发引擎
+ * @details 所有io_uring操作都在传输层的poller线程中执行，采用单例模式
+ */
+class UringEngine {
+public:
+    using onReadCB = std::function<void(toolkit::Buffer::Ptr &buf, struct sockaddr *addr, int addr_len, int tos)>;
+    using onTapReadCB = std::function<void(const char *data, size_t size)>;
+
+    static constexpr unsigned kRingEntries = 1024;    ///< 提交队列深度
+    static constexpr unsigned kRecvBufCount = 1024;   ///< UDP收包缓冲区个数
+    static constexpr unsigned kTapBufCount = 256;     ///< TAP读缓冲区个数
+    static constexpr unsigned kTapReadDepth = 8;      ///< 同时挂起的TAP读请求个数
+    static constexpr unsigned kSubmitBatch = 64;      ///< 积攒多少个SQE后立即提交
+    static constexpr unsigned kTapWriteDepth = 256;   ///< 同时挂起的TAP写请求上限，超出丢弃
+
+    /**
+     * @brief 获取UringEngine单例
+     */
+    static UringEngine &Instance() {
+        static UringEngine engine;
+        return engine;
+    }
+
+    /**
+     * @brief 启动引擎并接管UDP收发
+     * @param poller 传输层poller，所有io_uring操作都在该线程执行
+     * @param udp_fd 已绑定的UDP socket
+     * @param frame_size 最大帧长，用于确定缓冲区大小
+     * @param recv_tos 是否接收每个数据报的外层TOS
+     * @return 内核不支持时返回false
+     */
+    bool start(const toolkit::EventPoller::Ptr &poller, int udp_fd, size_t frame_size, bool recv_tos = false) {
+        if (!_ring.init(kRingEntries)) {
+            WarnL << "io_uring_setup failed: " << strerror(errno);
+            return false;
+        }
+        if (!_ring.supportOp(IORING_OP_RECVMSG) || !_ring.supportOp(IORING_OP_SENDMSG)
+            || !_ring.supportOp(IORING_OP_READ) || !_ring.supportOp(IORING_OP_WRITE)) {
+            WarnL << "io_uring opcode not supported";
+            _ring.release();
+            return false;
+        }
+        // 缓冲区需要容纳recvmsg头、地址和一个完整的报文
+        auto buf_size = std::max<size_t>(4096, frame_size * 2);
+        auto tap_buf_size = std::max<size_t>(2048, frame_size + 64);
+        // 缓冲区优先放入报文内存池
+        auto recv_mem = static_cast<char *>(PacketArena::Instance().allocRegion(kRecvBufCount * buf_size));
+        auto tap_mem = static_cast<char *>(PacketArena::Instance().allocRegion(kTapBufCount * tap_buf_size));
+        if (!_recv_bufs.init(_ring, kRecvGroup, kRecvBufCount, buf_size, recv_mem)
+            || !_tap_bufs.init(_ring, kTapGroup, kTapBufCount, tap_buf_size, tap_mem)) {
+            WarnL << "io_uring provided buffer ring not supported";
+            _ring.release();
+            return false;
+        }
+        // fd仍由toolkit socket与路径MTU探测直接收发，保持非阻塞；io_uring在EAGAIN时自行挂poll等待
+        _udp_fd = udp_fd;
+        _poller = poller;
+        _active = true;
+        _recv.msg.msg_namelen = sizeof(sockaddr_storage);
+        if (recv_tos) {
+            TosReader::enableRecvTos(udp_fd);
+            // multishot时控制消息由内核放在缓冲区中，这里只声明其长度
+            _recv.msg.msg_control = _recv.control;
+            _recv.msg.msg_controllen = sizeof(_recv.control);
+        }
+        _poller->async([this]() {
+            armRecv();
+            _ring.submit();
+        });
+        _poller->addEvent(_ring.fd(), toolkit::EventPoller::Event_Read, [this](int) { onPoll(); });
+        return true;
+    }
+
+    /**
+     * @brief 引擎是否已接管收发
+     */
+    bool active() const { return _active; }
+
+    /**
+     * @brief 设置UDP收包回调
+     * @details buf仅在回调期间有效，回调返回后缓冲区即归还给内核
+     */
+    void setOnRead(onReadCB cb) {
+        _poller->async([this, cb]() { _on_read = cb; });
+    }
+
+    /**
+     * @brief 开始读取TAP设备
+     * @param tap_fd TAP设备fd
+     * @param cb 每读到一帧回调一次，data仅在回调期间有效
+     */
+    void startTapRead(int tap_fd, onTapReadCB cb) {
+        _poller->async([this, tap_fd, cb]() {
+            _tap_fd = tap_fd;
+            _on_tap_read = cb;
+            for (unsigned i = 0; i < kTapReadDepth; ++i) {
+                armTapRead();
+            }
+            _ring.submit();
+        });
+    }
+
+    /**
+     * @brief 停止读取TAP设备，已挂起的请求完成后不再续挂
+     */
+    void stopTapRead() {
+        _poller->async([this]() { _on_tap_read = nullptr; });
+    }
+
+    /**
+     * @brief 暂停读取TAP设备，用于下游拥塞时的背压
+     * @details 已挂起的读请求完成后不再续挂，必须在poller线程中调用
+     */
+    void pauseTapRead() { _tap_paused = true; }
+
+    /**
+     * @brief 恢复读取TAP设备
+     */
+    void resumeTapRead() {
+        _poller->async([this]() {
+            _tap_paused = false;
+            if (!_on_tap_read) {
+                return;
+            }
+            for (auto i = _tap_armed; i < kTapReadDepth; ++i) {
+                armTapRead();
+            }
+            _ring.submit();
+        });
+    }
+
+    /**
+     * @brief 已提交但尚未完成的UDP发送个数
+     */
+    size_t sendInflight() const { return _send_inflight; }
+
+    /**
+     * @brief 设置UDP发送完成回调
+     * @details 每轮收割中有发送完成时回调一次，用于继续发送积压的数据
+     */
+    void setOnSendDone(std::function<void()> cb) { _on_send_done = std::move(cb); }
+
+    /**
+     * @brief 发送UDP数据
+     * @param buf 数据
+     * @param addr 目标地址
+     * @param addr_len 地址长度
+     * @param tos 外层TOS，-1为不设置
+     */
+    void send(const toolkit::Buffer::Ptr &buf, const sockaddr_storage &addr, socklen_t addr_len, int tos = -1) {
+        if (!_poller->isCurrentThread()) {
+            _poller->async([this, buf, addr, addr_len, tos]() { send(buf, addr, addr_len, tos); }, false);
+            return;
+        }
+        auto op = new Op(Op::Send);
+        op->buf = buf;
+        op->addr = addr;
+        op->iov = {buf->data(), buf->size()};
+        op->msg.msg_name = &op->addr;
+        op->msg.msg_namelen = addr_len;
+        op->msg.msg_iov = &op->iov;
+        op->msg.msg_iovlen = 1;
+        if (tos >= 0) {
+            // IPv4及IPv4映射地址用IP_TOS，原生IPv6地址用IPV6_TCLASS
+            auto in6 = reinterpret_cast<const sockaddr_in6 *>(&addr);
+            bool v6 = addr.ss_family == AF_INET6 && !IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr);
+            op->msg.msg_control = op->control;
+            op->msg.msg_controllen = CMSG_SPACE(sizeof(int));
+            auto cmsg = CMSG_FIRSTHDR(&op->msg);
+            cmsg->cmsg_level = v6 ? IPPROTO_IPV6 : IPPROTO_IP;
+            cmsg->cmsg_type = v6 ? IPV6_TCLASS : IP_TOS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cmsg), &tos, sizeof(int));
+        }
+        auto sqe = _ring.getSqe();
+        if (!sqe) {
+            delete op;
+            return;
+        }
+        ++_send_inflight;
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = _udp_fd;
+        sqe->addr = reinterpret_cast<uint64_t>(&op->msg);
+        sqe->len = 1;
+        sqe->user_data = reinterpret_cast<uint64_t>(op);
+        flushLater();
+    }
+
+    /**
+     * @brief 写入TAP设备
+     * @param tap_fd TAP设备fd
+     * @param buf 完整的以太网帧
+     */
+    void writeTap(int tap_fd, PacketPtr buf) {
+        if (!_poller->isCurrentThread()) {
+            // 任务要求可拷贝，以裸指针穿过
+            _poller->async([this, tap_fd, pkt = buf.detach()]() { writeTap(tap_fd, PacketPtr::adopt(pkt)); }, false);
+            return;
+        }
+        static auto &drops = Statistics::Instance().counter("tap.write_drops");
+        if (_tap_write_inflight >= kTapWriteDepth) {
+            ++drops;
+            return;
+        }
+        auto op = new Op(Op::TapWrite);
+        op->pkt = std::move(buf);
+        auto sqe = _ring.getSqe();
+        if (!sqe) {
+            delete op;
+            ++drops;
+            return;
+        }
+        ++_tap_write_inflight;
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = tap_fd;
+        sqe->addr = reinterpret_cast<uint64_t>(op->pkt->data());
+        sqe->len = op->pkt->size();
+        sqe->user_data = reinterpret_cast<uint64_t>(op);
+        flushLater();
+    }
+
+private:
+    /**
+     * @brief 一次io_uring操作的上下文，user_data即为其指针
+     */
+    struct Op {
+        enum Type { Recv, TapRead, Send, TapWrite };
+        explicit Op(Type t) : type(t) {}
+        Type type;
+        toolkit::Buffer::Ptr buf;
+        PacketPtr pkt;
+        sockaddr_storage addr{};
+        iovec iov{};
+        msghdr msg{};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int)) * 2]{};
+    };
+
+    /**
+     * @brief 仅在回调期间引用provided buffer的Buffer
+     */
+    class BufferRef : public toolkit::Buffer {
+    public:
+        BufferRef(char *data, size_t size) : _data(data), _size(size) {}
+        char *data() const override { return _data; }
+        size_t size() const override { return _size; }
+
+    private:
+        char *_data;
+        size_t _size;
+    };
+
+    static constexpr uint16_t kRecvGroup = 0;
+    static constexpr uint16_t kTapGroup = 1;
+
+    UringEngine() = default;
+
+    void flushLater() {
+        if (_ring.pending() >= kSubmitBatch) {
+            _ring.submit();
+            return;
+        }
+        if (_flush_scheduled) {
+            return;
+        }
+        // 同一轮事件循环中的发送合并为一次提交
+        _flush_scheduled = true;
+        _poller->async([this]() {
+            _flush_scheduled = false;
+            _ring.submit();
+        }, false);
+    }
+
+    void armRecv() {
+        auto sqe = _ring.getSqe();
+        if (!sqe) {
+            return;
+        }
+        sqe->opcode = IORING_OP_RECVMSG;
+        sqe->fd = _udp_fd;
+        sqe->addr = reinterpret_cast<uint64_t>(&_recv.msg);
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = kRecvGroup;
+        sqe->user_data = reinterpret_cast<uint64_t>(&_recv);
+        if (_recv_multishot) {
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+        } else {
+            // 单次recvmsg时，内核把数据直接写入选中的缓冲区
+            _recv.msg.msg_name = &_recv.addr;
+            _recv.msg.msg_namelen = sizeof(sockaddr_storage);
+            _recv.msg.msg_iov = &_recv.iov;
+            _recv.msg.msg_iovlen = 1;
+            _recv.iov = {nullptr, _recv_bufs.size()};
+        }
+    }
+
+    void armTapRead() {
+        auto sqe = _ring.getSqe();
+        if (!sqe) {
+            return;
+        }
+        ++_tap_armed;
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = _tap_fd;
+        sqe->len = _tap_bufs.size();
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = kTapGroup;
+        sqe->user_data = reinterpret_cast<uint64_t>(&_tap_read);
+    }
+
+    void onPoll() {
+        bool send_done = false;
+        _ring.reap([this, &send_done](const io_uring_cqe &cqe) {
+            auto op = reinterpret_cast<Op *>(cqe.user_data);
+            switch (op->type) {
+                case Op::Recv: onRecv(cqe); break;
+                case Op::TapRead: onTapRead(cqe); break;
+                default: {
+                    if (cqe.res < 0 && _err_ticker.elapsedTime() > 1000) {
+                        _err_ticker.resetTime();
+                        WarnL << (op->type == Op::Send ? "io_uring send failed: " : "io_uring tap write failed: ")
+                              << strerror(-cqe.res);
+                    }
+                    if (op->type == Op::Send) {
+                        --_send_inflight;
+                        send_done = true;
+                    } else {
+                        --_tap_write_inflight;
+                    }
+                    delete op;
+                    break;
+                }
+            }
+        });
+        _recv_bufs.commit();
+        _tap_bufs.commit();
+        if (send_done && _on_send_done) {
+            _on_send_done();
+        }
+        _ring.submit();
+    }
+
+    void onRecv(const io_uring_cqe &cqe) {
+        if (cqe.flags & IORING_CQE_F_BUFFER) {
+            uint16_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+            if (cqe.res > 0 && _on_read) {
+                auto base = _recv_bufs.buffer(bid);
+                char *payload = base;
+                size_t size = cqe.res;
+                auto addr = reinterpret_cast<sockaddr *>(&_recv.addr);
+                int addr_len = _recv.msg.msg_namelen;
+                int tos = -1;
+                if (_recv_multishot) {
+                    // 缓冲区布局: io_uring_recvmsg_out | name | control | payload
+                    auto out = reinterpret_cast<io_uring_recvmsg_out *>(base);
+                    addr = reinterpret_cast<sockaddr *>(base + sizeof(io_uring_recvmsg_out));
+                    addr_len = out->namelen;
+                    payload = base + sizeof(io_uring_recvmsg_out) + _recv.msg.msg_namelen + _recv.msg.msg_controllen;
+                    size = out->payloadlen;
+                    if (out->flags & MSG_TRUNC) {
+                        size = 0;
+                    }
+                    if (out->controllen) {
+                        msghdr control{};
+                        control.msg_control = base + sizeof(io_uring_recvmsg_out) + _recv.msg.msg_namelen;
+                        control.msg_controllen = out->controllen;
+                        tos = TosReader::parseTos(control);
+                    }
+                } else if (_recv.msg.msg_controllen) {
+                    tos = TosReader::parseTos(_recv.msg);
+                    _recv.msg.msg_controllen = sizeof(_recv.control);
+                }
+                if (size) {
+                    // 缓冲区只在回调期间有效，用不持有对象的别名指针避免每包分配
+                    BufferRef ref(payload, size);
+                    toolkit::Buffer::Ptr buf(std::shared_ptr<void>(), &ref);
+                    try {
+                        _on_read(buf, addr, addr_len, tos);
+                    } catch (std::exception &ex) {
+                        ErrorL << "Exception occurred when emit on_read: " << ex.what();
+                    }
+                }
+            }
+            _recv_bufs.add(bid);
+        }
+        if (cqe.flags & IORING_CQE_F_MORE) {
+            return;
+        }
+        if (cqe.res == -EINVAL && _recv_multishot) {
+            // 内核不支持multishot recvmsg，退化为单次recvmsg
+            WarnL << "io_uring multishot recvmsg not supported, use single shot";
+            _recv_multishot = false;
+        } else if (cqe.res < 0 && cqe.res != -ENOBUFS && _err_ticker.elapsedTime() > 1000) {
+            _err_ticker.resetTime();
+            WarnL << "io_uring recv failed: " << strerror(-cqe.res);
+        }
+        _recv_bufs.commit();
+        armRecv();
+    }
+
+    void onTapRead(const io_uring_cqe &cqe) {
+        --_tap_armed;
+        if (cqe.flags & IORING_CQE_F_BUFFER) {
+            uint16_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+            if (cqe.res > 0 && _on_tap_read) {
+                _on_tap_read(_tap_bufs.buffer(bid), cqe.res);
+            }
+            _tap_bufs.add(bid);
+        }
+        if (cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -EAGAIN && cqe.res != -EINTR) {
+            WarnL << "io_uring tap read failed: " << strerror(-cqe.res);
+        }
+        if (_on_tap_read && !_tap_paused) {
+            _tap_bufs.commit();
+            armTapRead();
+        }
+    }
+
+private:
+    IoUring _ring;
+    BufferRing _recv_bufs;
+    BufferRing _tap_bufs;
+    toolkit::EventPoller::Ptr _poller;
+    int _udp_fd = -1;
+    int _tap_fd = -1;
+    bool _active = false;
+    bool _recv_multishot = true;
+    bool _flush_scheduled = false;
+    bool _tap_paused = false;
+    unsigned _tap_armed = 0;
+    size_t _send_inflight = 0;
+    size_t _tap_write_inflight = 0;
+    std::function<void()> _on_send_done;
+    Op _recv{Op::Recv};
+    Op _tap_read{Op::TapRead};
+    onReadCB _on_read;
+    onTapReadCB _on_tap_read;
+    toolkit::Ticker _err_ticker;
+};
+
+#endif // HAS_IO_URING
+
+#endif //TALUSVSWITCH_URINGENGINE_H
@@ -15,6 +15,7 @@
 #include <Network/sockutil.h>
 
 #include <zlib.h>
+#include "Packet.h"
 
 #ifdef _WIN32
 #else
@@ -104,93 +105,124 @@ inline std::string getMacAddress() {
 }
 
 /**
- * @brief 压缩数据
- * @param data 要压缩的数据
- * @return toolkit::Buffer::Ptr 压缩后的数据
- * @details 使用zlib进行数据压缩
+ * @class ZlibContext
+ * @brief zlib压缩/解压上下文
+ * @details 每个线程各持有一个，逐包reset复用，避免每包初始化上下文的开销；
+ * 上下文内存从报文内存池申请
  */
-inline toolkit::Buffer::Ptr compress(const toolkit::Buffer::Ptr& data) {
-    z_stream defstream;
-    defstream.zalloc = Z_NULL;
-    defstream.zfree = Z_NULL;
-    defstream.opaque = Z_NULL;
+class ZlibContext {
+public:
+    explicit ZlibContext(bool deflater) : _deflater(deflater) {
+        _stream.zalloc = PacketArena::zalloc;
+        _stream.zfree = PacketArena::zfree;
+        _stream.opaque = Z_NULL;
+        _ok = (deflater ? deflateInit(&_stream, Z_BEST_COMPRESSION) : inflateInit(&_stream)) == Z_OK;
+    }
 
-    if (deflateInit(&defstream, Z_BEST_COMPRESSION) != Z_OK) {
-        return {};
+    ~ZlibContext() {
+        if (_ok) {
+            _deflater ? deflateEnd(&_stream) : inflateEnd(&_stream);
+        }
     }
 
-    auto compressedData = std::make_shared<toolkit::BufferLikeString>();
-    defstream.avail_in = data->size();
-    defstream.next_in = const_cast<Bytef*>(reinterpret_cast<const Bytef*>(data->data()));
+    /**
+     * @brief 重置上下文，准备处理下一个包
+     * @return 上下文不可用时返回nullptr
+     */
+    z_stream *reset() {
+        if (!_ok) {
+            return nullptr;
+        }
+        _ok = (_deflater ? deflateReset(&_stream) : inflateReset(&_stream)) == Z_OK;
+        return _ok ? &_stream : nullptr;
+    }
 
-    unsigned char outBuffer[2000];
-    do {
-        defstream.avail_out = sizeof(outBuffer);
-        defstream.next_out = outBuffer;
+private:
+    z_stream _stream{};
+    bool _deflater;
+    bool _ok = false;
+};
 
-        if (deflate(&defstream, Z_FINISH) == Z_STREAM_ERROR) {
-            deflateEnd(&defstream);
-            return {};
-        }
+/**
+ * @brief 压缩数据
+ * @param data 要压缩的数据
+ * @return PacketPtr 压缩后的数据，只会被移动，使用非原子引用计数
+ * @details 使用zlib进行数据压缩，输出缓冲区按压缩上限一次分配
+ */
+inline PacketPtr compress(const Packet& data) {
+    thread_local ZlibContext ctx(true);
+    auto defstream = ctx.reset();
+    if (!defstream) {
+        return {};
+    }
 
-        compressedData->append(reinterpret_cast<const char*>(outBuffer), 
-                             sizeof(outBuffer) - defstream.avail_out);
-    } while (defstream.avail_out == 0);
+    auto bound = deflateBound(defstream, data.size());
+    auto compressedData = Packet::create(bound, false);
+    defstream->avail_in = data.size();
+    defstream->next_in = const_cast<Bytef*>(reinterpret_cast<const Bytef*>(data.data()));
+    defstream->avail_out = bound;
+    defstream->next_out = reinterpret_cast<Bytef*>(compressedData->data());
 
-    if (deflateEnd(&defstream) != Z_OK) {
+    if (deflate(defstream, Z_FINISH) != Z_STREAM_END) {
         return {};
     }
+    compressedData->setSize(bound - defstream->avail_out);
     return compressedData;
 }
 
 /**
  * @brief 解压数据
- * @param compressedData 要解压的数据
- * @return toolkit::Buffer::Ptr 解压后的数据
- * @details 使用zlib进行数据解压缩
+ * @param data 要解压的数据，前两个字节会被还原为zlib头
+ * @param size 数据长度
+ * @return PacketPtr 解压后的数据，可能被广播共享，使用原子引用计数
+ * @details 使用zlib进行数据解压缩，先解压到一个报文缓冲区，超出时扩容
  */
-inline toolkit::Buffer::Ptr decompress(const toolkit::Buffer::Ptr& compressedData) {
-    if (compressedData->size()) {
-        compressedData->data()[0] = 0x78;
-        compressedData->data()[1] = 0xda;
+inline PacketPtr decompress(char *data, size_t size) {
+    if (size) {
+        data[0] = 0x78;
+        data[1] = 0xda;
     }
 
-    z_stream infstream;
-    infstream.zalloc = Z_NULL;
-    infstream.zfree = Z_NULL;
-    infstream.opaque = Z_NULL;
-    infstream.avail_in = 0;
-    infstream.next_in = Z_NULL;
-
-    if (inflateInit(&infstream) != Z_OK) {
+    thread_local ZlibContext ctx(false);
+    auto infstream = ctx.reset();
+    if (!infstream) {
         return {};
     }
 
-    auto decompressedData = std::make_shared<toolkit::BufferLikeString>();
-    infstream.avail_in = compressedData->size();
-    infstream.next_in = const_cast<Bytef*>(reinterpret_cast<const Bytef*>(compressedData->data()));
+    auto decompressedData = Packet::create(Packet::slabCapacity());
+    infstream->avail_in = size;
+    infstream->next_in = reinterpret_cast<Bytef*>(data);
+    infstream->avail_out = decompressedData->capacity();
+    infstream->next_out = reinterpret_cast<Bytef*>(decompressedData->data());
 
-    unsigned char outBuffer[2000];
-    do {
-        infstream.avail_out = sizeof(outBuffer);
-        infstream.next_out = outBuffer;
-
-        int ret = inflate(&infstream, 0);
+    while (true) {
+        int ret = inflate(infstream, 0);
         if (ret == Z_STREAM_ERROR || (ret < 0 && ret != Z_DATA_ERROR)) {
-            inflateEnd(&infstream);
             return {};
         }
-
-        decompressedData->append(reinterpret_cast<const char*>(outBuffer), 
-                               sizeof(outBuffer) - infstream.avail_out);
-    } while (infstream.avail_out == 0);
-
-    if (inflateEnd(&infstream) != Z_OK) {
-        return {};
+        auto size = decompressedData->capacity() - infstream->avail_out;
+        decompressedData->setSize(size);
+        if (infstream->avail_out || ret != Z_OK) {
+            break;
+        }
+        // 输出超出缓冲区，扩容后继续
+        auto bigger = Packet::create(decompressedData->capacity() * 2);
+        memcpy(bigger->data(), decompressedData->data(), size);
+        decompressedData = std::move(bigger);
+        infstream->avail_out = decompressedData->capacity() - size;
+        infstream->next_out = reinterpret_cast<Bytef*>(decompressedData->data() + size);
     }
     return decompressedData;
 }
 
+/**
+ * @brief 解压数据
+ * @param compressedData 要解压的数据
+ */
+inline PacketPtr decompress(const toolkit::Buffer::Ptr& compressedData) {
+    return decompress(compressedData->data(), compressedData->size());
+}
+
 /**
  * @brief 比较两个网络地址是否相同
  * @param addr1 第一个地址
@@ -258,6 +290,73 @@ inline bool compareSockAddr(const sockaddr_storage& addr1, const sockaddr_storag
     return false;
 }
 
+/**
+ * @struct PeerKey
+ * @brief 节点地址键
+ * @details IPv4地址统一转换为IPv4映射的IPv6地址，同一节点不论以何种形式出现都得到相同的键，
+ * 用于按节点保存状态的哈希表
+ */
+struct PeerKey {
+    uint8_t addr[16]{};
+    uint16_t port = 0;
+
+    PeerKey() = default;
+
+    explicit PeerKey(const sockaddr_storage& sa) {
+        if (sa.ss_family == AF_INET) {
+            const auto* in = reinterpret_cast<const sockaddr_in*>(&sa);
+            addr[10] = addr[11] = 0xff;
+            memcpy(addr + 12, &in->sin_addr, 4);
+            port = in->sin_port;
+        } else if (sa.ss_family == AF_INET6) {
+            const auto* in6 = reinterpret_cast<const sockaddr_in6*>(&sa);
+            memcpy(addr, &in6->sin6_addr, 16);
+            port = in6->sin6_port;
+        }
+    }
+
+    /**
+     * @brief 转换为指定地址族的socket地址
+     * @param family socket的地址族，IPv4 socket只能表示IPv4映射地址
+     * @param out 输出地址
+     * @return 地址长度，无法表示时返回0
+     */
+    socklen_t toSockAddr(int family, sockaddr_storage& out) const {
+        memset(&out, 0, sizeof(out));
+        if (family == AF_INET) {
+            static const uint8_t v4mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+            if (memcmp(addr, v4mapped, sizeof(v4mapped)) != 0) {
+                return 0;
+            }
+            auto* in = reinterpret_cast<sockaddr_in*>(&out);
+            in->sin_family = AF_INET;
+            in->sin_port = port;
+            memcpy(&in->sin_addr, addr + 12, 4);
+            return sizeof(sockaddr_in);
+        }
+        auto* in6 = reinterpret_cast<sockaddr_in6*>(&out);
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = port;
+        memcpy(&in6->sin6_addr, addr, sizeof(addr));
+        return sizeof(sockaddr_in6);
+    }
+
+    bool operator==(const PeerKey& that) const {
+        return port == that.port && memcmp(addr, that.addr, sizeof(addr)) == 0;
+    }
+
+    struct Hash {
+        size_t operator()(const PeerKey& key) const {
+            // FNV-1a
+            uint64_t h = 14695981039346656037ULL;
+            for (auto b : key.addr) {
+                h = (h ^ b) * 1099511628211ULL;
+            }
+            return (h ^ key.port) * 1099511628211ULL;
+        }
+    };
+};
+
 /**
  * @brief 启动守护进程
  * @details 在Unix系统上实现进程守护，Windows上此函数无效
@@ -15,13 +15,60 @@
 #include <algorithm>
 
 #include "LinkKeeper.h"
+#include "HolePunch.h"
+#include "Relay.h"
+#include "CoreSet.h"
+#include "Federation.h"
+#include "PeerDirectory.h"
+#include "Resolver.h"
+#include "ControlLegacy.h"
+#include "Statistics.h"
 #include "Config.h"
 
-// 命令字定义
-#define TVS_CMD_QUERY_PEERS TVS_CMD_PREFIX"QueryPeers"              ///< 查询对端列表命令
-#define TVS_CMD_QUERY_PEERS_RESPONSE TVS_CMD_PREFIX"ReQueryPeers"   ///< 查询对端列表响应
-#define TVS_CMD_QUERY_PEER_INFO TVS_CMD_PREFIX"QueryPeerInfo"       ///< 查询对端信息命令
-#define TVS_CMD_QUERY_PEER_INFO_RESPONSE TVS_CMD_PREFIX"ReQueryPeerInfo" ///< 查询对端信息响应
+/**
+ * @brief 创建发给对端控制助手的命令
+ * @param msg 消息类型
+ * @param dst 目标MAC，为0时由收到的节点处理，否则沿途转发到目标节点处理
+ */
+static ControlProto::Writer makeCmd(ControlProto::Msg msg, uint64_t dst = 0) {
+    return ControlProto::Writer(msg, dst, MacMap::macToUint64(TapInterface::Instance().hwaddr()));
+}
+
+/**
+ * @brief 命令的来源MAC
+ */
+static uint64_t cmdSourceMac(const toolkit::Buffer::Ptr &buf) {
+    uint64_t mac = *(uint64_t*)(buf->data() + 6);
+    return mac << 16;
+}
+
+/**
+ * @brief 命令的目标MAC
+ */
+static uint64_t cmdDestMac(const toolkit::Buffer::Ptr &buf) {
+    uint64_t mac = *(uint64_t*)buf->data();
+    return mac << 16;
+}
+
+/**
+ * @brief 命令的TLV序列
+ */
+static ControlProto::Reader cmdBody(const toolkit::Buffer::Ptr &buf) {
+    return ControlProto::Reader::body(buf->data(), buf->size());
+}
+
+/**
+ * @brief 发给全部存活的核心节点，使各核心节点的状态一致
+ */
+static void sendToCores(const ControlProto::Writer &cmd) {
+    auto cores = CoreSet::Instance().alive();
+    if (cores.empty()) {
+        cores.emplace_back(Config::corePeer);
+    }
+    for (const auto &addr : cores) {
+        VSCtrlHelper::Instance().sendCmd(cmd, addr);
+    }
+}
 
 /**
  * @brief 处理接收到的命令
@@ -29,132 +76,271 @@
  * @param peer 发送方地址
  * @param addr_len 地址长度
  * @param ttl 生存时间
+ * @details 文本命令先转为二进制消息，并向未交换过能力的发送方发送Hello
  */
 void VSCtrlHelper::handleCmd(const toolkit::Buffer::Ptr &buf, 
                            const sockaddr_storage& peer, 
                            int addr_len,
                            uint8_t ttl) {
-    auto parts = toolkit::split(buf->data() + 12, ",");
+    static auto &binary = Statistics::Instance().counter("ctrl.binary");
+    static auto &legacy = Statistics::Instance().counter("ctrl.legacy");
+    auto dst = cmdDestMac(buf);
+    if (dst && dst != Config::macLocal) {
+        // 发给其他节点的命令，本节点只转发
+        return;
+    }
+    auto msg = buf;
+    if (ControlProto::isBinary(buf->data(), buf->size())) {
+        if (ControlProto::version(buf->data()) != ControlProto::kVersion) {
+            return;
+        }
+        ++binary;
+        learnCaps(peer, ControlProto::CapBinary);
+    } else {
+        msg = ControlLegacy::decode(buf);
+        if (!msg) {
+            return;
+        }
+        ++legacy;
+        if (onLegacy(peer)) {
+            SendHello(peer, false);
+        }
+    }
     using request_handler = void (VSCtrlHelper::*)(const toolkit::Buffer::Ptr &buf, 
                                                   const sockaddr_storage& peer, 
                                                   int addr_len,
                                                   uint8_t ttl);
-    static std::unordered_map<std::string, request_handler> s_cmd_functions;
+    static std::unordered_map<uint8_t, request_handler> s_cmd_functions;
     static toolkit::onceToken token([]() {
-        s_cmd_functions.emplace(TVS_CMD_QUERY_PEERS, &VSCtrlHelper::OnQueryPeers);
-        s_cmd_functions.emplace(TVS_CMD_QUERY_PEERS_RESPONSE, &VSCtrlHelper::OnQueryPeersResponse);
-        s_cmd_functions.emplace(TVS_CMD_QUERY_PEER_INFO, &VSCtrlHelper::OnQueryPeerInfo);
-        s_cmd_functions.emplace(TVS_CMD_QUERY_PEER_INFO_RESPONSE, &VSCtrlHelper::OnQueryPeerInfoResponse);
+        s_cmd_functions.emplace(ControlProto::Hello, &VSCtrlHelper::OnHello);
+        s_cmd_functions.emplace(ControlProto::QueryPeers, &VSCtrlHelper::OnQueryPeers);
+        s_cmd_functions.emplace(ControlProto::PeerList, &VSCtrlHelper::OnQueryPeersResponse);
+        s_cmd_functions.emplace(ControlProto::QueryPeerInfo, &VSCtrlHelper::OnQueryPeerInfo);
+        s_cmd_functions.emplace(ControlProto::PeerInfo, &VSCtrlHelper::OnQueryPeerInfoResponse);
+        s_cmd_functions.emplace(ControlProto::Candidates, &VSCtrlHelper::OnCandidates);
+        s_cmd_functions.emplace(ControlProto::PunchRequest, &VSCtrlHelper::OnPunchRequest);
+        s_cmd_functions.emplace(ControlProto::Punch, &VSCtrlHelper::OnPunch);
+        s_cmd_functions.emplace(ControlProto::RttReport, &VSCtrlHelper::OnRttReport);
+        s_cmd_functions.emplace(ControlProto::Route, &VSCtrlHelper::OnRoute);
+        s_cmd_functions.emplace(ControlProto::FedDigest, &VSCtrlHelper::OnFedDigest);
+        s_cmd_functions.emplace(ControlProto::FedEntries, &VSCtrlHelper::OnFedEntries);
+        s_cmd_functions.emplace(ControlProto::MapRequest, &VSCtrlHelper::OnMapRequest);
+        s_cmd_functions.emplace(ControlProto::MapReply, &VSCtrlHelper::OnMapReply);
+        s_cmd_functions.emplace(ControlProto::ScoreRequest, &VSCtrlHelper::OnScoreRequest);
+        s_cmd_functions.emplace(ControlProto::ScoreReply, &VSCtrlHelper::OnScoreReply);
     });
 
-    auto it = s_cmd_functions.find(parts.front());
+    auto it = s_cmd_functions.find(ControlProto::msg(msg->data()));
     if (it == s_cmd_functions.end()) {
         return;
     }
-    (this->*(it->second))(buf, peer, addr_len, ttl);
+    (this->*(it->second))(msg, peer, addr_len, ttl);
+}
+
+/**
+ * @brief 发送命令，对端不支持二进制协议时转为文本命令
+ */
+void VSCtrlHelper::sendCmd(const ControlProto::Writer &cmd, const sockaddr_storage &addr, int addr_len, uint8_t ttl) {
+    toolkit::Buffer::Ptr buf = cmd.buffer();
+    if (!binary(addr)) {
+        buf = ControlLegacy::encode(buf);
+        if (!buf) {
+            return;
+        }
+    }
+    Transport::Instance().send(buf, addr, addr_len, true, ttl);
+}
+
+/**
+ * @brief 对端是否支持二进制协议
+ */
+bool VSCtrlHelper::binary(const sockaddr_storage &addr) {
+    std::lock_guard<std::mutex> lck(_caps_mtx);
+    auto it = _caps.find(PeerKey(addr));
+    return it != _caps.end() && (it->second.caps & ControlProto::CapBinary)
+        && toolkit::getCurrentMillisecond() - it->second.seen < kCapsMs;
+}
+
+/**
+ * @brief 记录对端的能力
+ */
+void VSCtrlHelper::learnCaps(const sockaddr_storage &addr, uint32_t caps) {
+    std::lock_guard<std::mutex> lck(_caps_mtx);
+    auto &entry = _caps[PeerKey(addr)];
+    entry.caps |= caps;
+    entry.seen = toolkit::getCurrentMillisecond();
+}
+
+/**
+ * @brief 收到对端的文本命令
+ * @details 对端启动时Hello与最初的文本命令同时发出，刚收到过其二进制消息时不处理；
+ * 否则对端可能已换为旧版本，清除其能力，之后发给它的命令转为文本，直到重新交换能力。
+ * Hello每kHelloMs最多发送一次，顺带清理过期的记录
+ * @return 是否需要向对端发送Hello
+ */
+bool VSCtrlHelper::onLegacy(const sockaddr_storage &addr) {
+    std::lock_guard<std::mutex> lck(_caps_mtx);
+    auto now = toolkit::getCurrentMillisecond();
+    if (_caps.size() > kMaxCaps) {
+        for (auto it = _caps.begin(); it != _caps.end();) {
+            if (now - it->second.seen >= kCapsMs && now - it->second.hello >= kCapsMs) {
+                it = _caps.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    auto &entry = _caps[PeerKey(addr)];
+    if (entry.caps && now - entry.seen < kLegacyGraceMs) {
+        return false;
+    }
+    entry.caps = 0;
+    if (entry.hello && now - entry.hello < kHelloMs) {
+        return false;
+    }
+    entry.hello = now;
+    return true;
+}
+
+/**
+ * @brief 发送Hello，告知本节点的能力
+ * @details 旧版本节点不认识二进制消息，直接丢弃
+ */
+void VSCtrlHelper::SendHello(const sockaddr_storage &to, bool reply) {
+    auto cmd = makeCmd(ControlProto::Hello);
+    cmd.u32(ControlProto::Caps, ControlProto::kCaps).u8(ControlProto::Reply, reply);
+    Transport::Instance().send(cmd.buffer(), to, sizeof(sockaddr_storage), true, Config::sendTtl);
+}
+
+/**
+ * @brief 处理Hello
+ * @details 记录对端能力，不是应答时回送Hello；
+ * 启动时的查询在能力交换前以文本发出，收到主核心节点的应答后重新以带版本的查询订阅对端目录
+ */
+void VSCtrlHelper::OnHello(const toolkit::Buffer::Ptr &buf,
+                         const sockaddr_storage &peer,
+                         int addr_len,
+                         uint8_t ttl) {
+    uint32_t caps = 0;
+    bool reply = false;
+    auto body = cmdBody(buf);
+    while (body.next()) {
+        if (body.tag() == ControlProto::Caps) {
+            caps = body.u32();
+        } else if (body.tag() == ControlProto::Reply) {
+            reply = body.u8();
+        }
+    }
+    learnCaps(peer, caps);
+    if (!reply) {
+        SendHello(peer, true);
+    } else if ((caps & ControlProto::CapBinary) && Config::enableP2p && compareSockAddr(peer, CoreSet::Instance().primary())) {
+        SendQueryPeers();
+    }
 }
 
 /**
  * @brief 处理查询对端列表请求
- * @details 返回本地MAC表中记录的所有对端信息
+ * @details 带版本的查询由对端目录回送增量或全量中的一页，并订阅后续变化；
+ * 不带版本的二进制查询按游标回送一页；旧版本节点不会续查，一次发送全部分页
  */
 void VSCtrlHelper::OnQueryPeers(const toolkit::Buffer::Ptr &buf, 
                                const sockaddr_storage& peer, 
                                int addr_len,
                                uint8_t ttl) {
-    // 拷贝表，防止加锁影响正常交换
-    auto macMap = MacMap::macMap();
-    std::shared_ptr<toolkit::BufferLikeString> resp = std::make_shared<toolkit::BufferLikeString>();
-    
-    for (const auto &item: macMap) {
-        if (!item.first || item.first == MAC_BROADCAST) {
-            continue;
+    uint64_t cursor = 0, epoch = 0, since = 0;
+    bool versioned = false;
+    auto body = cmdBody(buf);
+    while (body.next()) {
+        if (body.tag() == ControlProto::Cursor) {
+            cursor = body.u64();
+        } else if (body.tag() == ControlProto::Epoch) {
+            epoch = body.u64();
+        } else if (body.tag() == ControlProto::Version) {
+            since = body.u64();
+            versioned = true;
         }
-        
-        if (resp->empty()) {
-            // 填充目标MAC
-            uint64_t mac = 0;
-            char *pMac = reinterpret_cast<char*>(&mac) + 2;
-            resp->append(pMac, 6);
-            
-            // 填充来源MAC
-            auto macLocal = MacMap::macToUint64(TapInterface::Instance().hwaddr());
-            pMac = reinterpret_cast<char*>(&macLocal) + 2;
-            resp->append(pMac, 6);
-            
-            // 填充返回命令字
-            resp->append(TVS_CMD_QUERY_PEERS_RESPONSE",");
-        }
-
-        // 填充MAC-IP-端口信息
-        std::string peerStr = StrPrinter << MacMap::uint64ToMacStr(item.first) << "-"
-            << toolkit::SockUtil::inet_ntoa(reinterpret_cast<const sockaddr *>(&item.second.sock)) << "-"
-            << toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&item.second.sock)) << ",";
-        resp->append(peerStr);
+    }
 
-        // 分包发送，避免数据包过大
-        if (resp->size() > 1000) {
-            InfoL << "response mac map.";
-            Transport::Instance().send(resp, peer, addr_len, true, ttl);
-            resp = std::make_shared<toolkit::BufferLikeString>();
-        }
+    auto &directory = PeerDirectory::Instance();
+    auto resps = binary(peer) ? directory.query(peer, epoch, since, cursor, versioned) : directory.snapshot();
+    for (const auto &resp : resps) {
+        sendCmd(resp, peer, addr_len, ttl);
     }
-    Transport::Instance().send(resp, peer, addr_len, true, ttl);
 }
 
 /**
  * @brief 处理查询对端列表响应
- * @details 处理返回的对端信息，尝试建立P2P连接
+ * @details 按对端目录的版本决定是否应用，对经核心节点转发的节点发起打洞，未完或有缺口时继续查询
  */
 void VSCtrlHelper::OnQueryPeersResponse(const toolkit::Buffer::Ptr &buf, 
                                       const sockaddr_storage &peer, 
                                       int addr_len, 
                                       uint8_t ttl) {
-    auto parts = toolkit::split(buf->toString(), ",");
-    std::for_each(parts.begin() + 1, parts.end(), [&](const auto &item) {
-        auto parts = toolkit::split(item, "-");
-        if (parts.size() != 3) {
-            return;
+    PeerDirectory::List list;
+    auto body = cmdBody(buf);
+    while (body.next()) {
+        switch (body.tag()) {
+            case ControlProto::Epoch: list.versioned = true; list.epoch = body.u64(); break;
+            case ControlProto::After: list.delta = true; list.after = body.u64(); break;
+            case ControlProto::Version: list.version = body.u64(); break;
+            case ControlProto::Next: list.next = body.u64(); break;
+            default: break;
+        }
+    }
+    bool more = false;
+    uint64_t next = 0;
+    if (!PeerDirectory::Instance().onList(list, more, next)) {
+        if (more) {
+            SendQueryPeers(next);
         }
+        return;
+    }
 
-        auto mac = MacMap::macToUint64(parts[0]);
-        if (mac == MAC_BROADCAST) {
-            return;
+    body = cmdBody(buf);
+    while (body.next()) {
+        if (body.tag() != ControlProto::Peer) {
+            continue;
+        }
+        uint64_t mac = 0;
+        sockaddr_storage addr{};
+        auto item = body.nested();
+        while (item.next()) {
+            if (item.tag() == ControlProto::Mac) {
+                mac = item.mac();
+            } else if (item.tag() == ControlProto::Addr) {
+                item.addr(addr);
+            }
+        }
+        if (!mac || mac == MAC_BROADCAST || !addr.ss_family) {
+            // 已删除的对端由MAC表自行过期
+            continue;
         }
 
-        auto addr = parts[1];
-        auto port = atoi(parts[2].c_str());
-        auto peer = toolkit::SockUtil::make_sockaddr(addr.c_str(), port);
         bool gotPeer = false;
         auto macMapPeer = MacMap::getMacPeer(mac, gotPeer);
 
         // 检查是否需要建立P2P连接
-        if (Config::macLocal != mac && compareSockAddr(macMapPeer, Config::corePeer)) {
-            InfoL << "got mac peer " << parts[0] << " " 
-                 << toolkit::SockUtil::inet_ntoa(reinterpret_cast<const sockaddr *>(&peer)) << ":"
-                 << toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&peer)) << " current "
+        if (Config::macLocal != mac && CoreSet::Instance().isCore(macMapPeer)) {
+            InfoL << "got mac peer " << MacMap::uint64ToMacStr(mac) << " "
+                 << toolkit::SockUtil::inet_ntoa(reinterpret_cast<const sockaddr *>(&addr)) << ":"
+                 << toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&addr)) << " current "
                  << toolkit::SockUtil::inet_ntoa(reinterpret_cast<const sockaddr *>(&macMapPeer)) << ":"
                  << toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&macMapPeer));
 
-            // 尝试向远程返回地址表发送数据，打通P2P
-            std::shared_ptr<int> retry = std::make_shared<int>();
-            *retry = 10;
-            EventPollerPool::Instance().getPoller()->doDelayTask(1000, [=]() {
-                LinkKeeper::sendKeepData(mac, peer, 0);
-                if (*retry) {
-                    (*retry)--;
-                    return 1000;
-                }
-                return 0;
-            });
+            // 以反射地址为首个候选开始打洞，同时请求核心节点协调
+            HolePunch::Instance().request(mac, addr);
         } else {
-            WarnL << "ignore mac peer " << parts[0] << " "
-                 << toolkit::SockUtil::inet_ntoa(reinterpret_cast<const sockaddr *>(&peer)) << ":"
-                 << toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&peer)) << " current "
+            WarnL << "ignore mac peer " << MacMap::uint64ToMacStr(mac) << " "
+                 << toolkit::SockUtil::inet_ntoa(reinterpret_cast<const sockaddr *>(&addr)) << ":"
+                 << toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&addr)) << " current "
                  << toolkit::SockUtil::inet_ntoa(reinterpret_cast<const sockaddr *>(&macMapPeer)) << ":"
                  << toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&macMapPeer));
         }
-    });
+    }
+    if (more) {
+        SendQueryPeers(next);
+    }
 }
 
 /**
@@ -162,26 +348,19 @@ void VSCtrlHelper::OnQueryPeersResponse(const toolkit::Buffer::Ptr &buf,
  * @details 向核心节点查询其基本信息
  */
 void VSCtrlHelper::SendQueryPeerInfo() {
-    std::shared_ptr<toolkit::BufferLikeString> req = std::make_shared<toolkit::BufferLikeString>();
-    
-    // 填充目标MAC
-    uint64_t mac = 0;
-    char *pMac = reinterpret_cast<char*>(&mac) + 2;
-    req->append(pMac, 6);
-    
-    // 填充来源MAC
-    auto macLocal = MacMap::macToUint64(TapInterface::Instance().hwaddr());
-    pMac = reinterpret_cast<char*>(&macLocal) + 2;
-    req->append(pMac, 6);
-    
-    // 填充查询命令字
-    req->append(TVS_CMD_QUERY_PEER_INFO",");
+    auto req = makeCmd(ControlProto::QueryPeerInfo);
 
-    InfoL << "SendQueryPeerInfo to " 
-          << toolkit::SockUtil::inet_ntoa(reinterpret_cast<const sockaddr *>(&Config::corePeer)) << ":"
-          << toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&Config::corePeer));
-
-    Transport::Instance().send(req, Config::corePeer, sizeof(sockaddr_storage), true, Config::sendTtl);
+    // 每个核心节点都查询，得到各自的MAC
+    auto cores = CoreSet::Instance().all();
+    if (cores.empty()) {
+        cores.emplace_back(Config::corePeer);
+    }
+    for (const auto &core : cores) {
+        InfoL << "SendQueryPeerInfo to "
+              << toolkit::SockUtil::inet_ntoa(reinterpret_cast<const sockaddr *>(&core)) << ":"
+              << toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&core));
+        sendCmd(req, core);
+    }
 }
 
 /**
@@ -192,25 +371,9 @@ void VSCtrlHelper::OnQueryPeerInfo(const toolkit::Buffer::Ptr &buf,
                                  const sockaddr_storage &peer, 
                                  int addr_len,
                                  uint8_t ttl) {
-    std::shared_ptr<toolkit::BufferLikeString> resp = std::make_shared<toolkit::BufferLikeString>();
-    
-    // 填充目标MAC
-    uint64_t mac = 0;
-    char *pMac = reinterpret_cast<char*>(&mac) + 2;
-    resp->append(pMac, 6);
-    
-    // 填充来源MAC
-    auto macLocal = MacMap::macToUint64(TapInterface::Instance().hwaddr());
-    pMac = reinterpret_cast<char*>(&macLocal) + 2;
-    resp->append(pMac, 6);
-    
-    // 填充返回命令字和本机信息
-    resp->append(TVS_CMD_QUERY_PEER_INFO_RESPONSE",");
-    resp->append(Config::localIp);
-    resp->append(",");
-    resp->append(MacMap::uint64ToMacStr(MacMap::macToUint64(TapInterface::Instance().hwaddr())));
-
-    Transport::Instance().send(resp, peer, addr_len, true, Config::sendTtl);
+    auto resp = makeCmd(ControlProto::PeerInfo);
+    resp.str(ControlProto::Ip, Config::localIp).mac(ControlProto::Mac, MacMap::macToUint64(TapInterface::Instance().hwaddr()));
+    sendCmd(resp, peer, addr_len);
 }
 
 /**
@@ -221,12 +384,25 @@ void VSCtrlHelper::OnQueryPeerInfoResponse(const toolkit::Buffer::Ptr &buf,
                                         const sockaddr_storage &peer, 
                                         int addr_len,
                                         uint8_t ttl) {
-    auto parts = toolkit::split(buf->toString(), ",");
-    auto corePeerIp = parts[1];
-    auto corePeerMac = parts[2];
-    InfoL << "CorePeer " << corePeerIp << " " << corePeerMac;
-    Config::macCore = MacMap::macToUint64(corePeerMac);
-    Config::coreIp = corePeerIp;
+    std::string corePeerIp;
+    uint64_t corePeerMac = 0;
+    auto body = cmdBody(buf);
+    while (body.next()) {
+        if (body.tag() == ControlProto::Ip) {
+            corePeerIp = body.value();
+        } else if (body.tag() == ControlProto::Mac) {
+            corePeerMac = body.mac();
+        }
+    }
+    if (corePeerIp.empty() || !corePeerMac) {
+        return;
+    }
+    InfoL << "CorePeer " << corePeerIp << " " << MacMap::uint64ToMacStr(corePeerMac);
+    CoreSet::Instance().setCoreMac(peer, corePeerMac);
+    if (compareSockAddr(peer, Config::corePeer)) {
+        Config::macCore = corePeerMac;
+        Config::coreIp = corePeerIp;
+    }
 }
 
 /**
@@ -234,15 +410,94 @@ void VSCtrlHelper::OnQueryPeerInfoResponse(const toolkit::Buffer::Ptr &buf,
  * @details 启动P2P发现和信息更新定时任务
  */
 void VSCtrlHelper::Start() {
+    // 向核心节点告知能力，应答到达前的命令仍为文本
+    auto hellos = CoreSet::Instance().all();
+    if (hellos.empty()) {
+        hellos.emplace_back(Config::corePeer);
+    }
+    for (const auto &addr : hellos) {
+        VSCtrlHelper::Instance().SendHello(addr, false);
+    }
+
+    // 对端目录，作为上级节点时回送增量并推送变化
+    PeerDirectory::Instance().start(Transport::Instance().getPoller(), [](const sockaddr_storage &to, const ControlProto::Writer &msg) {
+        VSCtrlHelper::Instance().sendCmd(msg, to);
+    });
+
     // P2P 远端轮询
     if (Config::enableP2p) {
+        HolePunch::Instance().start(Transport::Instance().getPoller(), [](uint64_t mac, const sockaddr_storage &addr) {
+            LinkKeeper::sendKeepData(mac, addr, 0);
+        }, [](uint64_t mac) {
+            VSCtrlHelper::Instance().SendPunchRequest(mac);
+        }, [](uint64_t mac, const sockaddr_storage &addr) {
+            // 开启路径选择时直连地址已作为候选，由测量结果决定是否切换
+            Relay::Instance().onDirect(mac);
+            if (!Config::pathSelect) {
+                MacMap::setMacPeer(mac, addr, Config::sendTtl);
+            }
+        });
+        VSCtrlHelper::Instance().SendCandidates();
         VSCtrlHelper::Instance().SendQueryPeers();
         EventPollerPool::Instance().getPoller()->doDelayTask(60 * 1000, []() {
+            // 本地地址可能变化，随查询一起重新上报
+            VSCtrlHelper::Instance().SendCandidates();
             VSCtrlHelper::Instance().SendQueryPeers();
             return 60 * 1000;
         });
     }
 
+    // 未知单播按需解析，只在边缘节点上开启
+    if (Config::resolve && toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&Config::corePeer))) {
+        Resolver::Instance().start(Transport::Instance().getPoller(), [](uint64_t mac) {
+            return VSCtrlHelper::Instance().SendMapRequest(mac);
+        }, [](PacketPtr pkt, const sockaddr_storage &to) {
+            Transport::Instance().send(std::move(pkt), to, sizeof(sockaddr_storage), true, Config::sendTtl);
+        }, [](uint64_t mac, const sockaddr_storage &addr) {
+            if (Config::enableP2p) {
+                HolePunch::Instance().request(mac, addr);
+            }
+        });
+    }
+
+    // 经中间边缘节点的中继
+    if (Config::relay) {
+        Relay::Instance().start(Transport::Instance().getPoller(), []() {
+            VSCtrlHelper::Instance().SendRttReport();
+        }, [](uint64_t mac, const std::vector<Relay::Route> &routes) {
+            VSCtrlHelper::Instance().SendRoutes(mac, routes);
+        });
+    }
+
+    // 路径选择比较经核心节点转发的候选时需要核心节点到对端的得分
+    if (Config::pathSelect && Config::probeInterval > 0
+        && toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&Config::corePeer))) {
+        Transport::Instance().getPoller()->doDelayTask(LinkKeeper::kCoreScoreMs, []() {
+            VSCtrlHelper::Instance().SendScoreRequest();
+            return LinkKeeper::kCoreScoreMs;
+        });
+    }
+
+    // 核心节点联邦，只在核心节点上开启
+    if (!Config::federation.empty() && !toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&Config::corePeer))) {
+        std::vector<sockaddr_storage> peers;
+        for (auto &item : toolkit::split(Config::federation, ",")) {
+            auto pos = item.rfind(':');
+            if (!item.empty() && pos != std::string::npos) {
+                peers.emplace_back(toolkit::SockUtil::make_sockaddr(item.substr(0, pos).c_str(), atoi(item.substr(pos + 1).c_str())));
+            }
+        }
+        Federation::Instance().start(Transport::Instance().getPoller(), peers,
+            [](const sockaddr_storage &to, const Federation::Digest &digest, bool reply) {
+                VSCtrlHelper::Instance().SendFedDigest(to, digest, reply);
+            }, [](const sockaddr_storage &to, uint64_t owner, uint64_t after, uint64_t upto, const std::vector<Federation::Entry> &entries) {
+                VSCtrlHelper::Instance().SendFedEntries(to, owner, after, upto, entries);
+            });
+        for (const auto &addr : peers) {
+            VSCtrlHelper::Instance().SendHello(addr, false);
+        }
+    }
+
     // 定期刷新远程信息
     VSCtrlHelper::Instance().SendQueryPeerInfo();
     EventPollerPool::Instance().getPoller()->doDelayTask(30 * 1000, []() {
@@ -253,27 +508,501 @@ void VSCtrlHelper::Start() {
 
 /**
  * @brief 发送查询对端列表请求
- * @details 向核心节点查询所有已知的对端信息
+ * @details 向核心节点查询已知的对端信息，带上已有目录的纪元与版本以只取增量
  */
-void VSCtrlHelper::SendQueryPeers() {
-    std::shared_ptr<toolkit::BufferLikeString> req = std::make_shared<toolkit::BufferLikeString>();
-    
-    // 填充目标MAC
-    uint64_t mac = 0;
-    char *pMac = reinterpret_cast<char*>(&mac) + 2;
-    req->append(pMac, 6);
-    
-    // 填充来源MAC
-    auto macLocal = MacMap::macToUint64(TapInterface::Instance().hwaddr());
-    pMac = reinterpret_cast<char*>(&macLocal) + 2;
-    req->append(pMac, 6);
-    
-    // 填充查询命令字
-    req->append(TVS_CMD_QUERY_PEERS",");
+void VSCtrlHelper::SendQueryPeers(uint64_t cursor) {
+    uint64_t epoch = 0, version = 0;
+    PeerDirectory::Instance().following(epoch, version);
+    auto req = makeCmd(ControlProto::QueryPeers);
+    if (cursor) {
+        req.u64(ControlProto::Cursor, cursor);
+    }
+    req.u64(ControlProto::Epoch, epoch).u64(ControlProto::Version, version);
 
+    auto core = CoreSet::Instance().primary();
     InfoL << "send QueryPeers to " 
-          << toolkit::SockUtil::inet_ntoa(reinterpret_cast<const sockaddr *>(&Config::corePeer)) << ":"
-          << toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&Config::corePeer));
+          << toolkit::SockUtil::inet_ntoa(reinterpret_cast<const sockaddr *>(&core)) << ":"
+          << toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&core));
+
+    sendCmd(req, core);
+}
+
+/**
+ * @brief 上报本地地址
+ * @details 反射地址由核心节点从报文来源得到
+ */
+void VSCtrlHelper::SendCandidates() {
+    auto port = Transport::Instance().localPort();
+    auto req = makeCmd(ControlProto::Candidates);
+    req.u16(ControlProto::Port, port);
+    for (const auto &ip : HolePunch::localAddresses()) {
+        req.addr(ControlProto::Addr, toolkit::SockUtil::make_sockaddr(ip.c_str(), port));
+    }
+    sendToCores(req);
+}
+
+/**
+ * @brief 处理节点上报的本地地址
+ */
+void VSCtrlHelper::OnCandidates(const toolkit::Buffer::Ptr &buf,
+                              const sockaddr_storage &peer,
+                              int addr_len,
+                              uint8_t ttl) {
+    uint16_t port = 0;
+    std::vector<std::string> ips;
+    auto body = cmdBody(buf);
+    while (body.next()) {
+        sockaddr_storage addr;
+        if (body.tag() == ControlProto::Port) {
+            port = body.u16();
+        } else if (body.tag() == ControlProto::Addr && body.addr(addr)) {
+            ips.emplace_back(toolkit::SockUtil::inet_ntoa(reinterpret_cast<const sockaddr *>(&addr)));
+        }
+    }
+    if (!port) {
+        return;
+    }
+    HolePunch::Instance().setHostCandidates(cmdSourceMac(buf), port, std::move(ips));
+}
+
+/**
+ * @brief 请求核心节点协调打洞
+ */
+void VSCtrlHelper::SendPunchRequest(uint64_t mac) {
+    auto req = makeCmd(ControlProto::PunchRequest);
+    req.mac(ControlProto::Mac, mac);
+    sendCmd(req, CoreSet::Instance().pick(mac));
+}
+
+/**
+ * @brief 处理打洞请求
+ * @details 把双方的候选同时下发给双方，两端同时收到后同时开始检查
+ */
+void VSCtrlHelper::OnPunchRequest(const toolkit::Buffer::Ptr &buf,
+                                const sockaddr_storage &peer,
+                                int addr_len,
+                                uint8_t ttl) {
+    uint64_t to = 0;
+    auto body = cmdBody(buf);
+    while (body.next()) {
+        if (body.tag() == ControlProto::Mac) {
+            to = body.mac();
+        }
+    }
+    auto from = cmdSourceMac(buf);
+    bool got = false;
+    auto toPeer = MacMap::getMacPeer(to, got);
+    if (!got || to == MAC_BROADCAST || to == from) {
+        WarnL << "ignore punch request " << MacMap::uint64ToMacStr(from) << " -> " << MacMap::uint64ToMacStr(to);
+        return;
+    }
+    // 目标节点接入其他联邦核心节点时，反射地址取自目录，下发经其所属核心节点转发
+    auto reflexive = toPeer;
+    uint64_t via = 0;
+    if (Federation::Instance().isPeer(toPeer)) {
+        if (!Federation::Instance().edgeAddr(to, reflexive)) {
+            WarnL << "ignore punch request " << MacMap::uint64ToMacStr(from) << " -> " << MacMap::uint64ToMacStr(to)
+                  << ", not in directory";
+            return;
+        }
+        via = to;
+    }
+    auto notify = [this](uint64_t mac, const std::vector<std::pair<sockaddr_storage, HolePunch::Type>> &candidates,
+                         const sockaddr_storage &addr, uint64_t dst) {
+        auto resp = makeCmd(ControlProto::Punch, dst);
+        resp.mac(ControlProto::Mac, mac);
+        for (const auto &item : candidates) {
+            resp.begin(ControlProto::Candidate).putUint(item.second, 1).putAddr(item.first).end();
+        }
+        sendCmd(resp, addr);
+    };
+    notify(to, HolePunch::Instance().offer(to, reflexive), peer, 0);
+    notify(from, HolePunch::Instance().offer(from, peer), toPeer, via);
+}
+
+/**
+ * @brief 处理核心节点下发的对端候选
+ */
+void VSCtrlHelper::OnPunch(const toolkit::Buffer::Ptr &buf,
+                         const sockaddr_storage &peer,
+                         int addr_len,
+                         uint8_t ttl) {
+    if (!Config::enableP2p) {
+        return;
+    }
+    uint64_t mac = 0;
+    std::vector<std::pair<sockaddr_storage, HolePunch::Type>> candidates;
+    auto body = cmdBody(buf);
+    while (body.next()) {
+        sockaddr_storage addr;
+        if (body.tag() == ControlProto::Mac) {
+            mac = body.mac();
+        } else if (body.tag() == ControlProto::Candidate && body.addr(addr, 1)) {
+            auto type = body.u8();
+            if (type >= HolePunch::Predicted && type <= HolePunch::Host) {
+                candidates.emplace_back(addr, (HolePunch::Type)type);
+            }
+        }
+    }
+    if (!mac || mac == Config::macLocal || mac == MAC_BROADCAST) {
+        return;
+    }
+    InfoL << "Punch " << MacMap::uint64ToMacStr(mac) << " with " << candidates.size() << " candidates";
+    HolePunch::Instance().addCandidates(mac, candidates);
+}
+
+/**
+ * @brief 上报到各直连节点的路径得分
+ * @details 经核心节点或中继转发的节点不上报，核心节点以其MAC上报
+ */
+void VSCtrlHelper::SendRttReport() {
+    std::vector<Relay::Sample> samples;
+    LinkProbe::Stats stats;
+    for (const auto &item : MacMap::peers()) {
+        if (item.first == MAC_BROADCAST || item.first == Config::macLocal
+            || CoreSet::Instance().isCore(item.second) || Relay::Instance().routed(item.first)) {
+            continue;
+        }
+        auto score = LinkKeeper::pathScore(item.second, stats);
+        if (score >= 0) {
+            samples.emplace_back(item.first, score);
+        }
+    }
+    for (const auto &core : CoreSet::Instance().alive()) {
+        auto coreMac = CoreSet::Instance().coreMac(core);
+        auto coreScore = LinkKeeper::pathScore(core, stats);
+        if (coreMac && coreScore >= 0) {
+            samples.emplace_back(coreMac, coreScore);
+        }
+    }
+
+    auto req = makeCmd(ControlProto::RttReport);
+    for (const auto &item : samples) {
+        req.begin(ControlProto::Score).putMac(item.first).putUint((uint32_t)(item.second * 100 + 0.5), 4).end();
+        // 分包发送，避免数据包过大
+        if (req.size() > ControlProto::kPageBytes) {
+            sendToCores(req);
+            req = makeCmd(ControlProto::RttReport);
+        }
+    }
+    if (!req.empty()) {
+        sendToCores(req);
+    }
+}
 
-    Transport::Instance().send(req, Config::corePeer, sizeof(sockaddr_storage), true, Config::sendTtl);
+/**
+ * @brief 处理节点上报的路径得分
+ */
+void VSCtrlHelper::OnRttReport(const toolkit::Buffer::Ptr &buf,
+                             const sockaddr_storage &peer,
+                             int addr_len,
+                             uint8_t ttl) {
+    std::vector<Relay::Sample> samples;
+    auto body = cmdBody(buf);
+    while (body.next()) {
+        if (body.tag() == ControlProto::Score && body.value().size() >= 10) {
+            samples.emplace_back(body.mac(), body.u32(6) / 100.0);
+        }
+    }
+    Relay::Instance().onReport(cmdSourceMac(buf), samples);
+}
+
+/**
+ * @brief 向节点下发中继
+ */
+void VSCtrlHelper::SendRoutes(uint64_t mac, const std::vector<Relay::Route> &routes) {
+    bool got = false;
+    auto addr = MacMap::getMacPeer(mac, got);
+    if (!got) {
+        return;
+    }
+    auto resp = makeCmd(ControlProto::Route);
+    for (const auto &item : routes) {
+        resp.begin(ControlProto::RouteVia).putMac(item.first).putMac(item.second).end();
+        if (resp.size() > ControlProto::kPageBytes) {
+            sendCmd(resp, addr);
+            resp = makeCmd(ControlProto::Route);
+        }
+    }
+    if (!resp.empty()) {
+        sendCmd(resp, addr);
+    }
+}
+
+/**
+ * @brief 处理核心节点下发的中继
+ */
+void VSCtrlHelper::OnRoute(const toolkit::Buffer::Ptr &buf,
+                         const sockaddr_storage &peer,
+                         int addr_len,
+                         uint8_t ttl) {
+    if (!CoreSet::Instance().isCore(peer)) {
+        return;
+    }
+    auto body = cmdBody(buf);
+    while (body.next()) {
+        if (body.tag() == ControlProto::RouteVia && body.value().size() >= 12) {
+            Relay::Instance().apply(body.mac(), body.mac(6));
+        }
+    }
+}
+
+/**
+ * @brief 发送联邦目录摘要
+ */
+void VSCtrlHelper::SendFedDigest(const sockaddr_storage &to, const Federation::Digest &digest, bool reply) {
+    auto req = makeCmd(ControlProto::FedDigest);
+    req.u8(ControlProto::Reply, reply);
+    for (const auto &item : digest) {
+        req.begin(ControlProto::Owner).putMac(item.first).putUint(item.second, 8).end();
+    }
+    sendCmd(req, to);
+}
+
+/**
+ * @brief 处理联邦节点的目录摘要
+ */
+void VSCtrlHelper::OnFedDigest(const toolkit::Buffer::Ptr &buf,
+                             const sockaddr_storage &peer,
+                             int addr_len,
+                             uint8_t ttl) {
+    if (!Federation::Instance().isPeer(peer)) {
+        return;
+    }
+    Federation::Digest digest;
+    bool reply = false;
+    auto body = cmdBody(buf);
+    while (body.next()) {
+        if (body.tag() == ControlProto::Reply) {
+            reply = body.u8();
+        } else if (body.tag() == ControlProto::Owner && body.value().size() >= 14) {
+            digest.emplace_back(body.mac(), body.u64(6));
+        }
+    }
+    Federation::Instance().onDigest(peer, cmdSourceMac(buf), digest, reply);
+}
+
+/**
+ * @brief 发送一批联邦目录项
+ */
+void VSCtrlHelper::SendFedEntries(const sockaddr_storage &to, uint64_t owner, uint64_t after, uint64_t upto,
+                                  const std::vector<Federation::Entry> &entries) {
+    auto req = makeCmd(ControlProto::FedEntries);
+    req.mac(ControlProto::Mac, owner).u64(ControlProto::After, after).u64(ControlProto::Upto, upto);
+    for (const auto &entry : entries) {
+        req.begin(ControlProto::Entry).mac(ControlProto::Mac, entry.mac).u64(ControlProto::Version, entry.version)
+            .addr(ControlProto::Addr, entry.addr).u8(ControlProto::Dead, entry.dead).end();
+    }
+    sendCmd(req, to);
+}
+
+/**
+ * @brief 处理联邦节点的一批目录项
+ */
+void VSCtrlHelper::OnFedEntries(const toolkit::Buffer::Ptr &buf,
+                              const sockaddr_storage &peer,
+                              int addr_len,
+                              uint8_t ttl) {
+    if (!Federation::Instance().isPeer(peer)) {
+        return;
+    }
+    uint64_t owner = 0, after = 0, upto = 0;
+    std::vector<Federation::Entry> entries;
+    auto body = cmdBody(buf);
+    while (body.next()) {
+        switch (body.tag()) {
+            case ControlProto::Mac: owner = body.mac(); break;
+            case ControlProto::After: after = body.u64(); break;
+            case ControlProto::Upto: upto = body.u64(); break;
+            case ControlProto::Entry: {
+                Federation::Entry entry;
+                auto item = body.nested();
+                while (item.next()) {
+                    switch (item.tag()) {
+                        case ControlProto::Mac: entry.mac = item.mac(); break;
+                        case ControlProto::Version: entry.version = item.u64(); break;
+                        case ControlProto::Addr: item.addr(entry.addr); break;
+                        case ControlProto::Dead: entry.dead = item.u8(); break;
+                        default: break;
+                    }
+                }
+                if (entry.mac) {
+                    entries.emplace_back(entry);
+                }
+                break;
+            }
+            default: break;
+        }
+    }
+    // 格式错误的一批整体丢弃，下一轮重新同步
+    if (!owner || !body.ok()) {
+        return;
+    }
+    for (auto &entry : entries) {
+        entry.owner = owner;
+    }
+    Federation::Instance().onEntries(peer, cmdSourceMac(buf), owner, after, upto, entries);
+}
+
+/**
+ * @brief 向核心节点请求解析MAC
+ */
+bool VSCtrlHelper::SendMapRequest(uint64_t mac) {
+    auto core = CoreSet::Instance().pick(mac);
+    if (!binary(core)) {
+        return false;
+    }
+    auto req = makeCmd(ControlProto::MapRequest);
+    req.mac(ControlProto::Mac, mac);
+    sendCmd(req, core);
+    return true;
+}
+
+/**
+ * @brief 回送解析结果
+ */
+void VSCtrlHelper::SendMapReply(const sockaddr_storage &to, uint64_t mac, bool found, const sockaddr_storage &addr) {
+    auto resp = makeCmd(ControlProto::MapReply);
+    resp.mac(ControlProto::Mac, mac);
+    if (!found) {
+        resp.u8(ControlProto::Dead, 1);
+    } else if (toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&addr))) {
+        resp.addr(ControlProto::Addr, addr);
+    }
+    sendCmd(resp, to);
+}
+
+/**
+ * @brief 处理解析请求
+ * @details 本节点还有上级节点时，未命中的MAC可能由上级节点转发，不作否定回答
+ */
+void VSCtrlHelper::OnMapRequest(const toolkit::Buffer::Ptr &buf,
+                              const sockaddr_storage &peer,
+                              int addr_len,
+                              uint8_t ttl) {
+    uint64_t mac = 0;
+    auto body = cmdBody(buf);
+    while (body.next()) {
+        if (body.tag() == ControlProto::Mac) {
+            mac = body.mac();
+        }
+    }
+    if (!mac || mac == MAC_BROADCAST) {
+        return;
+    }
+    bool got = false;
+    auto addr = MacMap::getMacPeer(mac, got);
+    bool found = got || mac == Config::macLocal
+        || toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&Config::corePeer));
+    if (!got || compareSockAddr(addr, peer)
+        || (Federation::Instance().isPeer(addr) && !Federation::Instance().edgeAddr(mac, addr))) {
+        // 只能经本节点转发
+        addr = {};
+    }
+    SendMapReply(peer, mac, found, addr);
+}
+
+/**
+ * @brief 处理解析结果
+ */
+void VSCtrlHelper::OnMapReply(const toolkit::Buffer::Ptr &buf,
+                            const sockaddr_storage &peer,
+                            int addr_len,
+                            uint8_t ttl) {
+    uint64_t mac = 0;
+    bool dead = false;
+    sockaddr_storage addr{};
+    auto body = cmdBody(buf);
+    while (body.next()) {
+        if (body.tag() == ControlProto::Mac) {
+            mac = body.mac();
+        } else if (body.tag() == ControlProto::Dead) {
+            dead = body.u8();
+        } else if (body.tag() == ControlProto::Addr) {
+            body.addr(addr);
+        }
+    }
+    if (!mac || mac == MAC_BROADCAST || !CoreSet::Instance().isCore(peer)) {
+        return;
+    }
+    Resolver::Instance().onReply(mac, !dead, addr);
+}
+
+/**
+ * @brief 向核心节点查询其到经其转发的候选节点的路径得分
+ */
+void VSCtrlHelper::SendScoreRequest() {
+    // 按核心节点分组，多个核心节点时候选可能经不同的核心节点转发
+    std::unordered_map<PeerKey, std::pair<sockaddr_storage, std::vector<uint64_t>>, PeerKey::Hash> queries;
+    for (const auto &item : MacMap::candidates()) {
+        auto &core = CoreSet::Instance().isCore(item.active) ? item.active : item.alt;
+        if (!CoreSet::Instance().isCore(core)) {
+            continue;
+        }
+        auto &query = queries[PeerKey(core)];
+        query.first = core;
+        query.second.emplace_back(item.mac);
+    }
+    for (const auto &item : queries) {
+        auto &core = item.second.first;
+        if (!binary(core)) {
+            continue;
+        }
+        auto req = makeCmd(ControlProto::ScoreRequest);
+        for (auto mac : item.second.second) {
+            req.mac(ControlProto::Mac, mac);
+            if (req.size() > ControlProto::kPageBytes) {
+                sendCmd(req, core);
+                req = makeCmd(ControlProto::ScoreRequest);
+            }
+        }
+        if (!req.empty()) {
+            sendCmd(req, core);
+        }
+    }
+}
+
+/**
+ * @brief 处理路径得分查询
+ */
+void VSCtrlHelper::OnScoreRequest(const toolkit::Buffer::Ptr &buf,
+                                const sockaddr_storage &peer,
+                                int addr_len,
+                                uint8_t ttl) {
+    auto resp = makeCmd(ControlProto::ScoreReply);
+    LinkProbe::Stats stats;
+    auto body = cmdBody(buf);
+    while (body.next()) {
+        if (body.tag() != ControlProto::Mac) {
+            continue;
+        }
+        bool got = false;
+        auto mac = body.mac();
+        auto addr = MacMap::getMacPeer(mac, got);
+        auto score = got ? LinkKeeper::pathScore(addr, stats) : -1;
+        if (score >= 0) {
+            resp.begin(ControlProto::Score).putMac(mac).putUint((uint32_t)(score * 100 + 0.5), 4).end();
+        }
+    }
+    if (!resp.empty()) {
+        sendCmd(resp, peer);
+    }
+}
+
+/**
+ * @brief 处理核心节点回答的路径得分
+ */
+void VSCtrlHelper::OnScoreReply(const toolkit::Buffer::Ptr &buf,
+                              const sockaddr_storage &peer,
+                              int addr_len,
+                              uint8_t ttl) {
+    if (!CoreSet::Instance().isCore(peer)) {
+        return;
+    }
+    auto body = cmdBody(buf);
+    while (body.next()) {
+        if (body.tag() == ControlProto::Score && body.value().size() >= 10) {
+            LinkKeeper::onCoreScore(body.mac(), body.u32(6) / 100.0);
+        }
+    }
 }
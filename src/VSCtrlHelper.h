@@ -5,16 +5,21 @@
  * - 节点发现和P2P连接建立
  * - 对端信息查询和更新
  * - 命令处理和响应
+ * 命令为二进制TLV消息(见ControlProto.h)，与旧版本节点之间收发文本命令
  */
 
 #ifndef TALUSVSWITCH_P2PHELPER_H
 #define TALUSVSWITCH_P2PHELPER_H
 
+#include <mutex>
+#include <unordered_map>
 #include <Network/Buffer.h>
 #include <Network/Socket.h>
-
-/// TVS命令前缀，用于识别控制命令
-#define TVS_CMD_PREFIX "TVS_"
+#include "Config.h"
+#include "ControlProto.h"
+#include "Federation.h"
+#include "Relay.h"
+#include "Utils.h"
 
 /**
  * @class VSCtrlHelper
@@ -45,11 +50,43 @@ public:
                   int addr_len,
                   uint8_t ttl);
 
+    /**
+     * @brief 发送命令
+     * @param cmd 二进制消息
+     * @param addr 目标地址
+     * @param addr_len 地址长度
+     * @param ttl 生存时间
+     * @details 对端未通过Hello确认支持二进制协议时转为文本命令
+     */
+    void sendCmd(const ControlProto::Writer &cmd, const sockaddr_storage &addr,
+                 int addr_len = sizeof(sockaddr_storage), uint8_t ttl = Config::sendTtl);
+
+    /**
+     * @brief 发送Hello，告知本节点的能力
+     * @param to 对端地址
+     * @param reply 是否为应答，应答不再引起回送
+     */
+    void SendHello(const sockaddr_storage &to, bool reply);
+
+    /**
+     * @brief 处理Hello
+     * @param buf 消息数据
+     * @param peer 发送方地址
+     * @param addr_len 地址长度
+     * @param ttl 生存时间
+     * @details 记录对端能力，之后发给它的命令使用二进制消息
+     */
+    void OnHello(const toolkit::Buffer::Ptr &buf,
+                 const sockaddr_storage& peer,
+                 int addr_len,
+                 uint8_t ttl);
+
     /**
      * @brief 发送查询对端列表请求
-     * @details 向核心节点发送查询请求，获取所有已知的对端信息
+     * @param cursor 分页游标，0为第一页
+     * @details 向核心节点发送查询请求，获取已知的对端信息，应答未完时自动续查
      */
-    void SendQueryPeers();
+    void SendQueryPeers(uint64_t cursor = 0);
 
     /**
      * @brief 处理查询对端列表请求
@@ -109,13 +146,240 @@ public:
                                int addr_len,
                                uint8_t ttl);
 
+    /**
+     * @brief 向核心节点上报本机的本地地址与端口，作为打洞的host候选
+     */
+    void SendCandidates();
+
+    /**
+     * @brief 处理节点上报的本地地址
+     * @param buf 请求数据
+     * @param peer 发送方地址
+     * @param addr_len 地址长度
+     * @param ttl 生存时间
+     * @details 核心节点记录，协调打洞时下发给对端
+     */
+    void OnCandidates(const toolkit::Buffer::Ptr &buf,
+                      const sockaddr_storage& peer,
+                      int addr_len,
+                      uint8_t ttl);
+
+    /**
+     * @brief 请求核心节点协调与目标节点打洞
+     * @param mac 目标节点MAC
+     */
+    void SendPunchRequest(uint64_t mac);
+
+    /**
+     * @brief 处理打洞请求
+     * @param buf 请求数据
+     * @param peer 发送方地址
+     * @param addr_len 地址长度
+     * @param ttl 生存时间
+     * @details 核心节点把双方的候选同时下发给双方
+     */
+    void OnPunchRequest(const toolkit::Buffer::Ptr &buf,
+                        const sockaddr_storage& peer,
+                        int addr_len,
+                        uint8_t ttl);
+
+    /**
+     * @brief 处理核心节点下发的对端候选
+     * @param buf 下发数据
+     * @param peer 发送方地址
+     * @param addr_len 地址长度
+     * @param ttl 生存时间
+     * @details 加入打洞会话，开始向对端发送检查
+     */
+    void OnPunch(const toolkit::Buffer::Ptr &buf,
+                 const sockaddr_storage& peer,
+                 int addr_len,
+                 uint8_t ttl);
+
+    /**
+     * @brief 向核心节点上报到各直连节点的路径得分
+     */
+    void SendRttReport();
+
+    /**
+     * @brief 处理节点上报的路径得分
+     * @param buf 上报数据
+     * @param peer 发送方地址
+     * @param addr_len 地址长度
+     * @param ttl 生存时间
+     * @details 核心节点合入得分矩阵，定期计算中继
+     */
+    void OnRttReport(const toolkit::Buffer::Ptr &buf,
+                     const sockaddr_storage& peer,
+                     int addr_len,
+                     uint8_t ttl);
+
+    /**
+     * @brief 向节点下发中继
+     * @param mac 节点MAC
+     * @param routes 目标MAC与中继MAC，中继MAC为0表示撤销
+     */
+    void SendRoutes(uint64_t mac, const std::vector<Relay::Route> &routes);
+
+    /**
+     * @brief 处理核心节点下发的中继
+     * @param buf 下发数据
+     * @param peer 发送方地址
+     * @param addr_len 地址长度
+     * @param ttl 生存时间
+     * @details 把目标MAC指向中继节点的地址
+     */
+    void OnRoute(const toolkit::Buffer::Ptr &buf,
+                 const sockaddr_storage& peer,
+                 int addr_len,
+                 uint8_t ttl);
+
+    /**
+     * @brief 向联邦核心节点发送目录摘要
+     * @param to 联邦核心节点地址
+     * @param digest 各归属已知的最大版本
+     * @param reply 是否为落后时回送的摘要
+     */
+    void SendFedDigest(const sockaddr_storage &to, const Federation::Digest &digest, bool reply);
+
+    /**
+     * @brief 处理联邦核心节点的目录摘要
+     * @param buf 摘要数据
+     * @param peer 发送方地址
+     * @param addr_len 地址长度
+     * @param ttl 生存时间
+     * @details 回送对方缺少的目录项
+     */
+    void OnFedDigest(const toolkit::Buffer::Ptr &buf,
+                     const sockaddr_storage& peer,
+                     int addr_len,
+                     uint8_t ttl);
+
+    /**
+     * @brief 向联邦核心节点发送一批目录项
+     * @param to 联邦核心节点地址
+     * @param owner 目录项的归属
+     * @param after 前一批的末尾版本
+     * @param upto 本批的末尾版本
+     * @param entries 按版本升序的目录项
+     */
+    void SendFedEntries(const sockaddr_storage &to, uint64_t owner, uint64_t after, uint64_t upto,
+                        const std::vector<Federation::Entry> &entries);
+
+    /**
+     * @brief 处理联邦核心节点的目录项
+     * @param buf 目录项数据
+     * @param peer 发送方地址
+     * @param addr_len 地址长度
+     * @param ttl 生存时间
+     * @details 无缺口时合入目录
+     */
+    void OnFedEntries(const toolkit::Buffer::Ptr &buf,
+                      const sockaddr_storage& peer,
+                      int addr_len,
+                      uint8_t ttl);
+
+    /**
+     * @brief 向目标MAC所分配的核心节点请求解析
+     * @param mac 目标MAC
+     * @return 是否已发送，核心节点不支持二进制协议时不发送
+     */
+    bool SendMapRequest(uint64_t mac);
+
+    /**
+     * @brief 回送解析结果
+     * @param to 请求方地址
+     * @param mac 目标MAC
+     * @param found 目标是否存在
+     * @param addr 目标的公网地址，端口为0时不带
+     */
+    void SendMapReply(const sockaddr_storage &to, uint64_t mac, bool found, const sockaddr_storage &addr);
+
+    /**
+     * @brief 处理解析请求
+     * @param buf 请求数据
+     * @param peer 发送方地址
+     * @param addr_len 地址长度
+     * @param ttl 生存时间
+     * @details 按MAC表回答，经联邦核心节点转发的节点给出目录中的公网地址
+     */
+    void OnMapRequest(const toolkit::Buffer::Ptr &buf,
+                      const sockaddr_storage& peer,
+                      int addr_len,
+                      uint8_t ttl);
+
+    /**
+     * @brief 处理解析结果
+     * @param buf 结果数据
+     * @param peer 发送方地址
+     * @param addr_len 地址长度
+     * @param ttl 生存时间
+     */
+    void OnMapReply(const toolkit::Buffer::Ptr &buf,
+                    const sockaddr_storage& peer,
+                    int addr_len,
+                    uint8_t ttl);
+
+    /**
+     * @brief 向核心节点查询其到经其转发的候选节点的路径得分
+     * @details 路径选择据此给经核心节点转发的路径加上核心节点到对端一段
+     */
+    void SendScoreRequest();
+
+    /**
+     * @brief 处理路径得分查询
+     * @param buf 查询数据
+     * @param peer 发送方地址
+     * @param addr_len 地址长度
+     * @param ttl 生存时间
+     * @details 按本节点路径测量的结果回答
+     */
+    void OnScoreRequest(const toolkit::Buffer::Ptr &buf,
+                        const sockaddr_storage& peer,
+                        int addr_len,
+                        uint8_t ttl);
+
+    /**
+     * @brief 处理核心节点回答的路径得分
+     * @param buf 回答数据
+     * @param peer 发送方地址
+     * @param addr_len 地址长度
+     * @param ttl 生存时间
+     */
+    void OnScoreReply(const toolkit::Buffer::Ptr &buf,
+                      const sockaddr_storage& peer,
+                      int addr_len,
+                      uint8_t ttl);
+
     /**
      * @brief 启动控制服务
      * @details 启动P2P发现和信息更新定时任务：
-     * - 如果启用P2P，每60秒查询一次对端列表
+     * - 如果启用P2P，上报本地地址并开始打洞，每60秒查询一次对端列表
      * - 每30秒更新一次核心节点信息
      */
     void Start();
+
+private:
+    static constexpr uint64_t kCapsMs = 5 * 60 * 1000;     ///< 超过该时间未收到对端的二进制消息即视为能力未知
+    static constexpr uint64_t kHelloMs = 30 * 1000;         ///< 向同一对端发送Hello的最小间隔
+    static constexpr uint64_t kLegacyGraceMs = 2000;        ///< 收到二进制消息后该时间内的文本命令不视为对端换为旧版本
+    static constexpr size_t kMaxCaps = 4096;                ///< 能力记录超过该数量时清理过期的记录
+
+    /**
+     * @brief 对端的能力
+     */
+    struct PeerCaps {
+        uint32_t caps = 0;      ///< 能力位图
+        uint64_t seen = 0;      ///< 最近一次收到二进制消息的时间(毫秒)
+        uint64_t hello = 0;     ///< 最近一次发送Hello的时间(毫秒)
+    };
+
+    bool binary(const sockaddr_storage &addr);
+    void learnCaps(const sockaddr_storage &addr, uint32_t caps);
+    bool onLegacy(const sockaddr_storage &addr);
+
+    std::mutex _caps_mtx;
+    std::unordered_map<PeerKey, PeerCaps, PeerKey::Hash> _caps;
 };
 
 #endif //TALUSVSWITCH_P2PHELPER_H
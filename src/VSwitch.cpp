@@ -13,6 +13,15 @@
 #endif
 #include "Transport.h"
 #include "Utils.h"
+#include "Statistics.h"
+#include "MssClamp.h"
+#include "Ecn.h"
+#include "HolePunch.h"
+#include "CoreSet.h"
+#include "Federation.h"
+#include "Resolver.h"
+#include "Util/uv_errno.h"
+#include <chrono>
 #include <memory>
 #include "Config.h"
 
@@ -32,39 +41,101 @@ namespace Config{
     int mask = 24;                      ///< 子网掩码
     int mtu;                            ///< MTU大小
     bool enableP2p = true;              ///< P2P功能开关
+    std::string ioEngine = "epoll";     ///< 收发引擎
+    int busyPollUs = 0;                 ///< 网卡忙轮询窗口(微秒)
+    int statsInterval = 60;             ///< 统计输出间隔(秒)
+    int queueLen = 1024;                ///< 发送路径各阶段队列长度
+    std::string queueDrop = "tail";     ///< 队列满时的丢包策略
+    int arenaSize = 0;                  ///< 报文内存池大小(MB)
+    int fragSize = 0;                   ///< 隧道分片的数据报上限(字节)
+    bool pmtud = false;                 ///< 路径MTU探测开关
+    int pmtuMax = 1472;                 ///< 路径MTU探测上限(字节)
+    bool mssClamp = false;              ///< TCP MSS钳制开关
+    std::string psk;                    ///< 隧道加密的预共享密钥
+    std::string cipher = "auto";        ///< 隧道加密算法
+    std::string fec = "off";            ///< 前向纠错方式
+    int fecBlock = 8;                   ///< 前向纠错每组数据报个数
+    std::string uplinks;                ///< 多路径绑定的本地地址列表
+    std::string multipath = "hash";     ///< 多路径调度策略
+    int paceRate = 0;                   ///< 每个节点的发送速率上限(kbit/s)
+    int paceBurst = 64;                 ///< 发送整形的突发上限(KB)
+    bool paceAuto = false;              ///< 基于时延的速率估计开关
+    std::string prio = "weighted";      ///< 发送优先级通道的调度方式
+    bool dscp = false;                  ///< DSCP复制开关
+    bool ecn = false;                   ///< ECN传递开关
+    int probeInterval = 0;              ///< 节点路径测量的探测间隔(毫秒)
+    bool pathSelect = false;            ///< 路径选择开关
+    int peerSocks = 0;                  ///< 已连接socket个数上限
+    bool relay = false;                 ///< 中继开关
+    bool seq = false;                   ///< 数据报序号开关
+    bool failover = false;              ///< 快速故障切换开关
+    std::string cores;                  ///< 额外的核心节点列表
+    std::string federation;             ///< 联邦核心节点列表
+    bool resolve = false;               ///< 按需MAC解析开关
 };
 
 // 静态成员初始化
 volatile bool VSwitch::m_running = false;
 std::shared_ptr<toolkit::ThreadPool> VSwitch::m_thread;
+std::shared_ptr<std::vector<uint8_t>> VSwitch::m_buf;
+toolkit::EventPoller::Ptr VSwitch::m_poller;
 
 /**
  * @brief 启动虚拟交换机
  * @details 
  * 1. 初始化运行状态
  * 2. 设置网络事件处理
- * 3. 启动接口轮询线程
+ * 3. 把网卡注册到事件轮询器，可读时批量读取
  */
 void VSwitch::start() {
     m_running = true;
-    // 处理线程
-    auto poller = toolkit::EventPollerPool::Instance().getPoller();
     // 分发远程输入
     setupOnPeerInput(Config::corePeer,Config::macLocal);
+    // 发送路径拥塞解除后恢复读取网卡
+    Transport::Instance().setOnDrained([]() { resumeInterface(); });
     // 分发本地输入
-    std::shared_ptr<std::vector<uint8_t>> buf = std::make_shared<std::vector<uint8_t>>();
-    buf->resize(1024*1024);
+#if defined(HAS_IO_URING)
+    if (UringEngine::Instance().active()) {
+        // 由io_uring批量读取网卡
+        UringEngine::Instance().startTapRead(TapInterface::Instance().native_handle(), [](const char *frame, size_t size) {
+            onInterfaceFrame(frame, size);
+            if (Transport::Instance().congested()) {
+                static auto &backpressure = Statistics::Instance().counter("tap.backpressure");
+                ++backpressure;
+                UringEngine::Instance().pauseTapRead();
+            }
+        });
+        return;
+    }
+#endif
+    m_buf = std::make_shared<std::vector<uint8_t>>();
+    m_buf->resize(1024*1024);
+#ifdef _WIN32
     m_thread = std::make_shared<toolkit::ThreadPool>(1, toolkit::ThreadPool::Priority::PRIORITY_HIGHEST, true, true, "PollingInterface");
-    m_thread->async([=](){
+    m_thread->async([](){
         while(m_running){
-            pollInterface(buf);
+            pollInterface(m_buf);
         }
     },false);
+#else
+    // 网卡与UDP收发共用同一个轮询线程，可读时一次读空
+    TapInterface::Instance().nonblocking(true);
+    m_poller = Transport::Instance().getPoller();
+    auto ret = m_poller->addEvent(TapInterface::Instance().native_handle(), toolkit::EventPoller::Event_Read, [](int) {
+        drainInterface();
+    });
+    if (ret == -1) {
+        ErrorL << "Add interface to poller failed: " << toolkit::get_uv_errmsg();
+        return;
+    }
+    // 注册前已到达的帧不会再触发边沿事件，先读一次
+    m_poller->async([]() { drainInterface(); });
+#endif
 }
 
 /**
  * @brief 处理广播数据包
- * @param buf 数据包内容
+ * @param buf 数据包内容，每个目标共享一次
  * @param pktRecvPeer 数据包来源地址
  * @param ttl 生存时间
  * @details 
@@ -72,25 +143,38 @@ void VSwitch::start() {
  * 2. 维护已发送节点列表，避免重复发送
  * 3. 根据节点类型设置不同的TTL
  */
-void VSwitch::sendBroadcast(const toolkit::Buffer::Ptr& buf,const sockaddr_storage& pktRecvPeer,uint8_t ttl) {
+void VSwitch::sendBroadcast(const PacketPtr& buf,const sockaddr_storage& pktRecvPeer,uint8_t ttl) {
     uint64_t sMac = *(uint64_t*)(buf->data()+6);
     sMac = sMac<<16;
     // 获取目标MAC
     uint64_t dMac = *(uint64_t*)buf->data();
     dMac = dMac<<16;
     // 广播流量转发，向子节点转发
-    std::shared_ptr<std::list<sockaddr_storage>> sendPeers = std::make_shared<std::list<sockaddr_storage>>();
-    MacMap::forEach([ buf,sMac,dMac, pktRecvPeer, ttl,sendPeers](uint64_t mac,sockaddr_storage addr){
+    std::vector<sockaddr_storage> sendPeers;
+    auto &federation = Federation::Instance();
+    if (federation.enabled() && !federation.isPeer(pktRecvPeer)) {
+        // 联邦节点全互联，本地收到的广播转发给全部联邦节点，联邦节点发来的只转发给本地节点
+        for (auto &addr : federation.peers()) {
+            Transport::Instance().send(buf.share(),addr, sizeof(sockaddr_storage),true,ttl-1);
+            sendPeers.push_back(addr);
+        }
+    }
+    for (auto &pr : MacMap::peers()) {
+        auto mac = pr.first;
+        auto &addr = pr.second;
+        if (federation.isPeer(addr)) {
+            continue;
+        }
         //去重
-        auto iter = std::find_if(sendPeers->begin(), sendPeers->end(), [addr](const sockaddr_storage& addr2){
+        auto iter = std::find_if(sendPeers.begin(), sendPeers.end(), [&addr](const sockaddr_storage& addr2){
             return compareSockAddr(addr, addr2);
         });
-        if (iter!= sendPeers->end()) {
-            return;
+        if (iter!= sendPeers.end()) {
+            continue;
         }
         // 忽略数据包来源地址
         if (compareSockAddr(pktRecvPeer,addr)) {
-            return;
+            continue;
         }
         if(Config::debug) {
             DebugL << "BROADCAST:" << MacMap::uint64ToMacStr(sMac) << " -> " << MacMap::uint64ToMacStr(dMac) << " - " << MacMap::uint64ToMacStr(mac) << " "
@@ -101,13 +185,13 @@ void VSwitch::sendBroadcast(const toolkit::Buffer::Ptr& buf,const sockaddr_stora
         }
         if( mac != MAC_BROADCAST ){
             // 向P2P节点转发,ttl置为0
-            Transport::Instance().send(buf,addr, sizeof(sockaddr_storage),true,0);
+            Transport::Instance().send(buf.share(),addr, sizeof(sockaddr_storage),true,0);
         }else {
             // 向上级节点转发 TTL - 1
-            Transport::Instance().send(buf,addr, sizeof(sockaddr_storage),true,ttl-1);
+            Transport::Instance().send(buf.share(),addr, sizeof(sockaddr_storage),true,ttl-1);
         }
-        sendPeers->push_back(addr);
-    });
+        sendPeers.push_back(addr);
+    }
 }
 
 /**
@@ -121,8 +205,8 @@ void VSwitch::sendBroadcast(const toolkit::Buffer::Ptr& buf,const sockaddr_stora
  * 4. 更新MAC表
  */
 void VSwitch::setupOnPeerInput(const sockaddr_storage &corePeer, uint64_t macLocal) {
-    Transport::Instance().setOnRead([macLocal, corePeer](const toolkit::Buffer::Ptr &buf,
-        const sockaddr_storage& pktRecvPeer, int addr_len,uint8_t ttl,bool isTvsCmd){
+    Transport::Instance().setOnRead([macLocal, corePeer](const PacketPtr &buf,
+        const sockaddr_storage& pktRecvPeer, int addr_len,uint8_t ttl,bool isTvsCmd,int tos){
 
         // 获取来源MAC
         uint64_t sMac = *(uint64_t*)(buf->data()+6);
@@ -138,6 +222,11 @@ void VSwitch::setupOnPeerInput(const sockaddr_storage &corePeer, uint64_t macLoc
                    << (int)ttl<<" size:"<<buf->size();
         }
 
+        // 外层的拥塞标记合并到内层，内层不支持ECN时按RFC 6040丢弃
+        if (Config::ecn && tos >= 0 && !isTvsCmd && !Ecn::decap(buf->data(), buf->size(), tos)) {
+            return;
+        }
+
         // ARP检查
         ArpMap::checkArp(buf,pktRecvPeer,addr_len,ttl);
 
@@ -151,11 +240,19 @@ void VSwitch::setupOnPeerInput(const sockaddr_storage &corePeer, uint64_t macLoc
                            << toolkit::SockUtil::inet_ntoa(reinterpret_cast<const sockaddr *>(&pktRecvPeer)) << ":"
                            << toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&pktRecvPeer));
                 }
-                TapInterface::Instance().write(buf->data(),buf->size());
+                if (Config::mssClamp && dMac == macLocal) {
+                    // 本节点发出的TCP报文段经隧道回到来源节点，按到来源节点的上限钳制
+                    MssClamp::apply(buf->data(), buf->size(), Transport::pathBudget(pktRecvPeer));
+                }
+                writeInterface(buf.share());
             }
             // 收到合适的MAC地址报文,更新MAC表
             if( sMac != MAC_BROADCAST && sMac != Config::macLocal){
                 MacMap::addMacPeer(sMac, pktRecvPeer,ttl);
+                // 只有MAC头的保活报文，可能是打洞的检查
+                if (buf->size() <= 12) {
+                    HolePunch::Instance().onKeepalive(sMac, pktRecvPeer);
+                }
             }
         }
         // 发给本节点的流量，不转发
@@ -184,7 +281,12 @@ void VSwitch::setupOnPeerInput(const sockaddr_storage &corePeer, uint64_t macLoc
                            << toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&forwardPeer));
                 }
                 // 转发前TTL减一
-                Transport::Instance().send(buf,forwardPeer, sizeof(sockaddr_storage),true,ttl-1);
+                Transport::Instance().send(buf.share(),forwardPeer, sizeof(sockaddr_storage),true,ttl-1);
+            }else if(!isTvsCmd && !(dMac >> 16 & 1)
+                     && !toolkit::SockUtil::inet_port(reinterpret_cast<const sockaddr *>(&corePeer))
+                     && Resolver::Instance().notify(dMac, pktRecvPeer)){
+                // 核心节点不认识目标MAC，告知来源，开启按需解析的来源据此缓存否定结果
+                VSCtrlHelper::Instance().SendMapReply(pktRecvPeer, dMac, false, {});
             }
         }else{
             // 广播流量转发
@@ -200,6 +302,19 @@ void VSwitch::setupOnPeerInput(const sockaddr_storage &corePeer, uint64_t macLoc
 void VSwitch::stop() {
     if (m_running) {
         m_running = false;
+#if defined(HAS_IO_URING)
+        if (UringEngine::Instance().active()) {
+            UringEngine::Instance().stopTapRead();
+        }
+#endif
+        if (m_poller) {
+            m_poller->delEvent(TapInterface::Instance().native_handle());
+            m_poller = nullptr;
+        }
+        if (m_thread) {
+            // 阻塞读取的线程只能等待下一帧到达后退出，不在此等待
+            m_thread = nullptr;
+        }
         Transport::Instance().setOnRead(nullptr);
     }
 }
@@ -207,28 +322,127 @@ void VSwitch::stop() {
 /**
  * @brief 轮询TAP接口数据
  * @param buf 数据缓冲区
- * @details 
- * 1. 从TAP接口读取数据
- * 2. 解析MAC地址
- * 3. 查找目标节点
- * 4. 转发数据包
+ * @return 是否读到了一帧数据
+ * @details 从TAP接口读取一帧数据并交给onInterfaceFrame处理
  */
-void VSwitch::pollInterface(const std::shared_ptr<std::vector<uint8_t>>& buf) {
+bool VSwitch::pollInterface(const std::shared_ptr<std::vector<uint8_t>>& buf) {
     // 从虚拟网卡接收数据
     size_t len = buf->size();
     int size = TapInterface::Instance().read(buf->data(),len);
     if(size <= 0){
+        return false;
+    }
+    onInterfaceFrame(reinterpret_cast<const char *>(buf->data()), size);
+    return true;
+}
+
+/**
+ * @brief 读空TAP接口
+ * @details 
+ * 1. 循环读取直到网卡无数据
+ * 2. 开启忙轮询时，本次唤醒读到过数据则继续空转一个窗口，等待紧随其后的帧，
+ *    窗口内等到数据则窗口加倍(不超过配置值)，空转超时则窗口减半，空闲时不空转
+ */
+void VSwitch::drainInterface() {
+    static auto &wakeups = Statistics::Instance().counter("tap.wakeups");
+    static auto &frames = Statistics::Instance().counter("tap.frames");
+    static auto &busyHits = Statistics::Instance().counter("tap.busy_poll_hits");
+    static auto &backpressure = Statistics::Instance().counter("tap.backpressure");
+    static int window = Config::busyPollUs;
+    ++wakeups;
+
+    bool got = false;
+    while (m_running) {
+        if (Transport::Instance().congested()) {
+            // 下游拥塞，帧留在内核队列中，由内核按队列长度丢弃
+            ++backpressure;
+            return;
+        }
+        if (!pollInterface(m_buf)) {
+            break;
+        }
+        ++frames;
+        got = true;
+    }
+    if (!got || Config::busyPollUs <= 0) {
         return;
     }
-    auto data = std::make_shared<toolkit::BufferLikeString>();
-    data->assign(reinterpret_cast<const char *>(buf->data()),size);
+    auto start = std::chrono::steady_clock::now();
+    while (m_running && window > 0 && !Transport::Instance().congested()) {
+        if (pollInterface(m_buf)) {
+            ++frames;
+            ++busyHits;
+            window = std::min(window * 2, Config::busyPollUs);
+            start = std::chrono::steady_clock::now();
+            continue;
+        }
+        auto spin = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        if (spin >= window) {
+            window = std::max(window / 2, 1);
+            break;
+        }
+    }
+}
+
+/**
+ * @brief 拥塞解除后恢复读取TAP接口
+ */
+void VSwitch::resumeInterface() {
+    if (!m_running) {
+        return;
+    }
+#if defined(HAS_IO_URING)
+    if (UringEngine::Instance().active()) {
+        UringEngine::Instance().resumeTapRead();
+        return;
+    }
+#endif
+    if (m_poller) {
+        // 暂停期间网卡不会再触发边沿事件，需要主动读一次
+        m_poller->async([]() { drainInterface(); }, false);
+    }
+}
+
+/**
+ * @brief 写入TAP接口数据
+ * @param buf 数据包内容
+ */
+void VSwitch::writeInterface(PacketPtr buf) {
+#if defined(HAS_IO_URING)
+    if (UringEngine::Instance().active()) {
+        UringEngine::Instance().writeTap(TapInterface::Instance().native_handle(), std::move(buf));
+        return;
+    }
+#endif
+    if (TapInterface::Instance().write(buf->data(),buf->size()) < 0) {
+        static auto &drops = Statistics::Instance().counter("tap.write_drops");
+        ++drops;
+    }
+}
+
+/**
+ * @brief 处理TAP接口读到的一帧数据
+ * @param frame 帧数据
+ * @param size 帧长度
+ * @details 
+ * 1. 解析MAC地址
+ * 2. 查找目标节点
+ * 3. 转发数据包
+ */
+void VSwitch::onInterfaceFrame(const char *frame, size_t size) {
     // 查询mac表并转发数据
-    uint64_t dMac = *(uint64_t*)data->data();
+    uint64_t dMac = *(uint64_t*)frame;
     dMac = dMac<<16;
-    uint64_t sMac = *(uint64_t*)(data->data()+6);
+    uint64_t sMac = *(uint64_t*)(frame+6);
     sMac = sMac<<16;
+    // 单播帧只会被移动，不跨线程共享，可使用非原子引用计数
+    auto data = Packet::create(frame,size,dMac == MAC_BROADCAST);
     bool got = false;
     auto peer = MacMap::getMacPeer(dMac,got);
+    if(!got && dMac != MAC_BROADCAST){
+        // 未知单播按目标MAC分配到核心节点
+        peer = CoreSet::Instance().pick(dMac);
+    }
 
     if(Config::debug) {
         DebugL << "TP:" << MacMap::uint64ToMacStr(sMac) << " -> " << MacMap::uint64ToMacStr(dMac);
@@ -241,8 +455,15 @@ void VSwitch::pollInterface(const std::shared_ptr<std::vector<uint8_t>>& buf) {
         if(Config::debug) {
             DebugL << "TX:" << MacMap::uint64ToMacStr(sMac) << " -> " << MacMap::uint64ToMacStr(dMac) << " -> " << toolkit::SockUtil::inet_ntoa(reinterpret_cast<const sockaddr *>(&peer));
         }
+        if (Config::mssClamp) {
+            MssClamp::apply(data->data(), data->size(), Transport::pathBudget(peer));
+        }
+        // 开启按需解析时，未知单播先向核心节点查询，应答前暂存
+        if (!got && dMac != MAC_BROADCAST && Resolver::Instance().enabled() && Resolver::Instance().miss(dMac, data)) {
+            return;
+        }
         // 发送数据到远端
-        Transport::Instance().send(data, peer, sizeof(sockaddr_storage),true,Config::sendTtl);
+        Transport::Instance().send(std::move(data), peer, sizeof(sockaddr_storage),true,Config::sendTtl);
         return ;
     }else if( dMac == MAC_BROADCAST ){
         // 远端地址无效，但目标MAC地址是广播地址，转发广播
@@ -5,13 +5,14 @@
  * - 数据包的转发和处理
  * - MAC地址学习
  * - 广播包处理
- * - TAP接口数据轮询
+ * - TAP接口数据读取
  */
 
 #ifndef TALUSVSWITCH_VSWITCH_H
 #define TALUSVSWITCH_VSWITCH_H
 
 #include "Poller/EventPoller.h"
+#include "Packet.h"
 #include <cstdint>
 #include <memory>
 #include <vector>
@@ -35,9 +36,8 @@ public:
     /**
      * @brief 启动虚拟交换机
      * @details 初始化并启动：
-     * - 数据包处理线程
      * - 网络事件回调
-     * - TAP接口轮询
+     * - TAP接口的事件驱动读取
      */
     static void start();
 
@@ -62,12 +62,42 @@ protected:
     /**
      * @brief 轮询TAP接口数据
      * @param buf 数据缓冲区
-     * @details 持续读取TAP接口数据并处理：
+     * @return 是否读到了一帧数据
+     * @details 读取一帧TAP接口数据并处理：
      * - 解析目标MAC地址
      * - 查找目标节点
      * - 转发数据包
      */
-    static void pollInterface(const std::shared_ptr<std::vector<uint8_t>>& buf);
+    static bool pollInterface(const std::shared_ptr<std::vector<uint8_t>>& buf);
+
+    /**
+     * @brief 读空TAP接口
+     * @details 网卡可读时由事件轮询器调用，读取所有待处理的帧，
+     * 按配置在读到数据后进行自适应忙轮询
+     */
+    static void drainInterface();
+
+    /**
+     * @brief 发送路径拥塞解除后恢复读取TAP接口
+     */
+    static void resumeInterface();
+
+    /**
+     * @brief 处理TAP接口读到的一帧数据
+     * @param frame 帧数据，仅在调用期间有效
+     * @param size 帧长度
+     * @details
+     * - 解析目标MAC地址
+     * - 查找目标节点
+     * - 转发数据包
+     */
+    static void onInterfaceFrame(const char *frame, size_t size);
+
+    /**
+     * @brief 写入TAP接口数据
+     * @param buf 数据包内容，所有权移交
+     */
+    static void writeInterface(PacketPtr buf);
 
     /**
      * @brief 处理广播数据包
@@ -76,12 +106,14 @@ protected:
      * @param ttl 生存时间
      * @details 将广播包转发给所有已知节点，除了发送者
      */
-    static void sendBroadcast(const toolkit::Buffer::Ptr& buf,
+    static void sendBroadcast(const PacketPtr& buf,
                             const sockaddr_storage& pktRecvPeer,
                             uint8_t ttl);
 
     static volatile bool m_running;                    ///< 运行状态标志
-    static std::shared_ptr<toolkit::ThreadPool> m_thread;  ///< 数据处理线程池
+    static std::shared_ptr<toolkit::ThreadPool> m_thread;  ///< 数据处理线程池(仅Windows)
+    static std::shared_ptr<std::vector<uint8_t>> m_buf;    ///< TAP接口读缓冲区
+    static toolkit::EventPoller::Ptr m_poller;             ///< TAP接口所在的事件轮询器
 };
 
 #endif //TALUSVSWITCH_VSWITCH_H
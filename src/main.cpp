@@ -1,5 +1,9 @@
+#include "CoreSet.h"
+#include "Crypto.h"
 #include "LinkKeeper.h"
 #include "MacMap.h"
+#include "PacketArena.h"
+#include "Statistics.h"
 #include "TapInterface.h"
 #include "Transport.h"
 #include "Utils.h"
@@ -61,6 +65,13 @@ int main(int argc, char* argv[]) {
     TapInterface::Instance().mtu(Config::mtu);
     InfoL<<"MTU "<<TapInterface::Instance().mtu();
 
+    // 报文内存池，优先使用大页
+    auto arenaSizeStr = parser.getOptionValue("arena_size");
+    if(!arenaSizeStr.empty()){
+        Config::arenaSize = stoi(arenaSizeStr);
+    }
+    PacketArena::Instance().init((size_t)Config::arenaSize << 20, std::max(2048, Config::mtu + 256));
+
     auto autoUpStr= parser.getOptionValue("auto_up");
     bool autoUp = true;
     if(!autoUpStr.empty()){
@@ -72,6 +83,174 @@ int main(int argc, char* argv[]) {
         Config::enableP2p = stoi(enableP2PStr);
     }
 
+    // 收发引擎，io_uring不可用时自动回退到epoll
+    auto ioEngineStr = parser.getOptionValue("io_engine");
+    if(!ioEngineStr.empty()){
+        Config::ioEngine = ioEngineStr;
+    }
+
+    // 网卡忙轮询窗口，超低延迟场景使用
+    auto busyPollStr = parser.getOptionValue("busy_poll");
+    if(!busyPollStr.empty()){
+        Config::busyPollUs = stoi(busyPollStr);
+    }
+
+    // 发送路径队列长度与丢包策略
+    auto queueLenStr = parser.getOptionValue("queue_len");
+    if(!queueLenStr.empty()){
+        Config::queueLen = stoi(queueLenStr);
+    }
+    auto queueDropStr = parser.getOptionValue("queue_drop");
+    if(!queueDropStr.empty()){
+        Config::queueDrop = queueDropStr;
+    }
+
+    // 统计输出间隔
+    auto statsIntervalStr = parser.getOptionValue("stats_interval");
+    if(!statsIntervalStr.empty()){
+        Config::statsInterval = stoi(statsIntervalStr);
+    }
+
+    // 隧道分片与路径MTU探测
+    auto fragStr = parser.getOptionValue("frag");
+    if(!fragStr.empty()){
+        Config::fragSize = stoi(fragStr);
+    }
+    auto pmtudStr = parser.getOptionValue("pmtud");
+    if(!pmtudStr.empty()){
+        Config::pmtud = stoi(pmtudStr);
+    }
+    auto pmtuMaxStr = parser.getOptionValue("pmtu_max");
+    if(!pmtuMaxStr.empty()){
+        Config::pmtuMax = stoi(pmtuMaxStr);
+    }
+    auto mssClampStr = parser.getOptionValue("mss_clamp");
+    if(!mssClampStr.empty()){
+        Config::mssClamp = stoi(mssClampStr);
+    }
+
+    // 前向纠错
+    auto fecStr = parser.getOptionValue("fec");
+    if(!fecStr.empty()){
+        Config::fec = fecStr;
+    }
+    auto fecBlockStr = parser.getOptionValue("fec_block");
+    if(!fecBlockStr.empty()){
+        Config::fecBlock = stoi(fecBlockStr);
+    }
+
+    // 多路径
+    Config::uplinks = parser.getOptionValue("uplinks");
+    auto multipathStr = parser.getOptionValue("multipath");
+    if(!multipathStr.empty()){
+        Config::multipath = multipathStr;
+    }
+
+    // 发送优先级通道
+    auto prioStr = parser.getOptionValue("prio");
+    if(!prioStr.empty()){
+        Config::prio = prioStr;
+    }
+
+    // DSCP与ECN
+    auto dscpStr = parser.getOptionValue("dscp");
+    if(!dscpStr.empty()){
+        Config::dscp = stoi(dscpStr);
+    }
+    auto ecnStr = parser.getOptionValue("ecn");
+    if(!ecnStr.empty()){
+        Config::ecn = stoi(ecnStr);
+    }
+
+    // 发送整形
+    auto paceRateStr = parser.getOptionValue("pace_rate");
+    if(!paceRateStr.empty()){
+        Config::paceRate = stoi(paceRateStr);
+    }
+    auto paceBurstStr = parser.getOptionValue("pace_burst");
+    if(!paceBurstStr.empty()){
+        Config::paceBurst = stoi(paceBurstStr);
+    }
+    auto paceAutoStr = parser.getOptionValue("pace_auto");
+    if(!paceAutoStr.empty()){
+        Config::paceAuto = stoi(paceAutoStr);
+    }
+
+    // 节点路径测量
+    auto probeIntervalStr = parser.getOptionValue("probe_interval");
+    if(!probeIntervalStr.empty()){
+        Config::probeInterval = stoi(probeIntervalStr);
+    }
+
+    auto pathSelectStr = parser.getOptionValue("path_select");
+    if(!pathSelectStr.empty()){
+        Config::pathSelect = stoi(pathSelectStr);
+    }
+    if(Config::pathSelect){
+        // 路径选择依赖路径测量
+        if(Config::probeInterval <= 0){
+            Config::probeInterval = 1000;
+        }
+        MacMap::keepCandidates() = true;
+    }
+
+    // 经中间边缘节点的中继，边缘节点依赖路径测量上报得分
+    auto relayStr = parser.getOptionValue("relay");
+    if(!relayStr.empty()){
+        Config::relay = stoi(relayStr);
+    }
+    if(Config::relay && Config::probeInterval <= 0){
+        Config::probeInterval = 1000;
+    }
+
+    // 数据报序号，对端据此统计投递质量
+    auto seqStr = parser.getOptionValue("seq");
+    if(!seqStr.empty()){
+        Config::seq = stoi(seqStr);
+    }
+
+    // 核心节点联邦
+    Config::federation = parser.getOptionValue("federation");
+
+    // 直连节点失效时快速回退到核心节点
+    auto failoverStr = parser.getOptionValue("failover");
+    if(!failoverStr.empty()){
+        Config::failover = stoi(failoverStr);
+    }
+
+    // 未知单播按需向核心节点解析
+    auto resolveStr = parser.getOptionValue("resolve");
+    if(!resolveStr.empty()){
+        Config::resolve = stoi(resolveStr);
+    }
+
+    // 热点节点的已连接socket
+    auto peerSocksStr = parser.getOptionValue("peer_socks");
+    if(!peerSocksStr.empty()){
+        Config::peerSocks = stoi(peerSocksStr);
+    }
+
+    // 隧道加密
+    auto cryptoBenchStr = parser.getOptionValue("crypto_bench");
+    if(!cryptoBenchStr.empty() && stoi(cryptoBenchStr)){
+        Crypto::benchmark(Config::mtu + 14);
+        return 0;
+    }
+    Config::psk = parser.getOptionValue("psk");
+    auto pskFile = parser.getOptionValue("psk_file");
+    if(!pskFile.empty()){
+        std::ifstream file(pskFile);
+        std::getline(file, Config::psk);
+    }
+    auto cipherStr = parser.getOptionValue("cipher");
+    if(!cipherStr.empty()){
+        Config::cipher = cipherStr;
+    }
+    if(!Config::psk.empty() && !Crypto::Instance().start(Config::psk, Config::cipher)){
+        ErrorL<<"Tunnel encryption requested but not available";
+        return -1;
+    }
+
 
     // ttl
     auto ttlStr = parser.getOptionValue("ttl");
@@ -122,6 +301,24 @@ int main(int argc, char* argv[]) {
 
     // 增加默认广播地址到MAC表
     Config::corePeer = toolkit::SockUtil::make_sockaddr(remoteAddr.c_str(),remotePort);
+    if(remotePort){
+        // 多个核心节点，未知单播与控制命令按MAC分担
+        std::vector<sockaddr_storage> cores{Config::corePeer};
+        Config::cores = parser.getOptionValue("cores");
+        for (auto &item : toolkit::split(Config::cores, ",")) {
+            if (item.empty()) {
+                continue;
+            }
+            auto pos = item.rfind(':');
+            if (pos == std::string::npos) {
+                ErrorL << "Invalid core " << item;
+                return -1;
+            }
+            cores.emplace_back(toolkit::SockUtil::make_sockaddr(item.substr(0, pos).c_str(), stoi(item.substr(pos + 1))));
+        }
+        CoreSet::Instance().init(cores);
+        Config::corePeer = CoreSet::Instance().primary();
+    }
     MacMap::addMacPeer(MAC_BROADCAST, Config::corePeer,Config::sendTtl);
 
     // 启动各个组件
@@ -129,6 +326,7 @@ int main(int argc, char* argv[]) {
     VSwitch::start();                         // 启动虚拟交换机
     LinkKeeper::start();                      // 启动链路保持
     VSCtrlHelper::Instance().Start();         // 启动控制助手
+    Statistics::Instance().start(Transport::Instance().getPoller(), Config::statsInterval); // 启动统计输出
 
     // 设置信号处理，优雅退出
     static semaphore sem;
@@ -138,4 +336,5 @@ int main(int argc, char* argv[]) {
         sem.post();
     });
     sem.wait();
+    VSwitch::stop();
 }